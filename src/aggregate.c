@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tss/tspi.h>
+#include <trousers/trousers.h>
+
+#include "aggregate.h"
+#include "evlog.h"
+#include "tpm.h"
+
+#define AGG_SAMPLES 256
+#define AGG_WINDOW_MIN_NS 100000ULL   /* 100us */
+
+typedef struct agg_item {
+    unsigned char digest[AGG_DIGEST_LEN];
+    uint64_t submitted;
+} agg_item_t;
+
+struct aggregator {
+    tss_pool_t *pool;
+    TPM_PCRINDEX index;
+    FILE *log;
+    evlog_t *evlog;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    agg_item_t *items;
+    size_t count;
+    size_t size;
+    bool closing;
+    int error;
+    uint64_t target_ns;
+    uint64_t samples[AGG_SAMPLES];
+    size_t sample_count;
+    size_t sample_next;
+    agg_stats_t stats;
+};
+
+typedef struct agg_extend_op {
+    TPM_PCRINDEX index;
+    unsigned char *digest;
+} agg_extend_op_t;
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static TSS_RESULT
+agg_extend_op (tss_conn_t *conn, void *arg)
+{
+    agg_extend_op_t *op = arg;
+    UINT32 pcr_len = 0;
+    BYTE *pcr = NULL;
+
+    return Tspi_TPM_PcrExtend (conn->tpm, op->index, AGG_DIGEST_LEN,
+                               op->digest, NULL, &pcr_len, &pcr);
+}
+
+static int
+u64_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*  Called with the lock held after each batch of depth measurements.
+ */
+static void
+agg_adapt (aggregator_t *agg, uint64_t extend_ns, size_t depth)
+{
+    uint64_t sorted[AGG_SAMPLES], floor, ceiling, window;
+
+    if (agg->stats.extend_ns == 0)
+        agg->stats.extend_ns = extend_ns;
+    else
+        agg->stats.extend_ns = (agg->stats.extend_ns * 4 + extend_ns) / 5;
+    memcpy (sorted, agg->samples, agg->sample_count * sizeof (uint64_t));
+    qsort (sorted, agg->sample_count, sizeof (uint64_t), u64_cmp);
+    agg->stats.p99_ns = sorted[(agg->sample_count * 99) / 100];
+
+    floor = agg->stats.extend_ns + agg->stats.extend_ns / 4;
+    if (floor < AGG_WINDOW_MIN_NS)
+        floor = AGG_WINDOW_MIN_NS;
+    ceiling = agg->target_ns > agg->stats.extend_ns ?
+        agg->target_ns - agg->stats.extend_ns : 0;
+    window = agg->stats.window_ns;
+    if (agg->stats.p99_ns > agg->target_ns)
+        window = window * agg->target_ns / agg->stats.p99_ns;
+    else if (depth <= 1)
+        /* nothing joined the batch, the window only delayed it */
+        window -= window / 10;
+    else if (agg->stats.p99_ns < agg->target_ns - agg->target_ns / 10)
+        window += window / 10 + 1;
+    if (window > ceiling)
+        window = ceiling;
+    /* a TPM too slow for the target still mustn't fall behind */
+    if (window < floor)
+        window = floor;
+    agg->stats.window_ns = window;
+}
+
+static int
+agg_flush (aggregator_t *agg, agg_item_t *items, size_t count)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    agg_extend_op_t op = { .index = agg->index, .digest = digest };
+    EVP_MD_CTX *ctx;
+    TSS_RESULT result;
+    static const char hex[] = "0123456789abcdef";
+    char *desc = NULL, *p, line[AGG_DIGEST_LEN * 2 + 1];
+    uint64_t start, done;
+    size_t i, j;
+    int ret = -1;
+
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL || EVP_DigestInit (ctx, EVP_sha1 ()) == 0)
+        goto flush_fail;
+    for (i = 0; i < count; ++i) {
+        if (EVP_DigestUpdate (ctx, items[i].digest, AGG_DIGEST_LEN) == 0)
+            goto flush_fail;
+    }
+    if (EVP_DigestFinal (ctx, digest, NULL) == 0)
+        goto flush_fail;
+    EVP_MD_CTX_destroy (ctx);
+    ctx = NULL;
+
+    if (agg->evlog) {
+        /* the components go in the record so the log can be checked
+         * digest by digest, not only replayed */
+        desc = malloc (32 + count * (AGG_DIGEST_LEN * 2 + 1));
+        if (desc == NULL) {
+            perror ("malloc of aggregate record:\n");
+            return -1;
+        }
+        p = desc + sprintf (desc, "aggregate %zu", count);
+        for (i = 0; i < count; ++i) {
+            *p++ = ' ';
+            for (j = 0; j < AGG_DIGEST_LEN; ++j) {
+                *p++ = hex[items[i].digest[j] >> 4];
+                *p++ = hex[items[i].digest[j] & 0xf];
+            }
+        }
+        *p = '\0';
+        if (evlog_lock (agg->evlog, true))
+            goto flush_out;
+    }
+    start = now_ns ();
+    result = tss_pool_run (agg->pool, agg_extend_op, &op, false);
+    done = now_ns ();
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to extend PCR %d: %s\n", agg->index,
+                 Trspi_Error_String (result));
+        if (agg->evlog)
+            evlog_unlock (agg->evlog);
+        goto flush_out;
+    }
+    if (agg->evlog) {
+        if (evlog_append (agg->evlog, agg->index, digest, AGG_DIGEST_LEN,
+                          desc)) {
+            evlog_unlock (agg->evlog);
+            goto flush_out;
+        }
+        evlog_unlock (agg->evlog);
+    }
+    if (agg->log) {
+        fprintf (agg->log, "batch %llu ",
+                 (unsigned long long)agg->stats.batches);
+        for (j = 0; j < AGG_DIGEST_LEN; ++j)
+            fprintf (agg->log, "%02x", digest[j]);
+        fprintf (agg->log, " %zu\n", count);
+        for (i = 0; i < count; ++i) {
+            for (j = 0; j < AGG_DIGEST_LEN; ++j) {
+                line[j * 2] = hex[items[i].digest[j] >> 4];
+                line[j * 2 + 1] = hex[items[i].digest[j] & 0xf];
+            }
+            line[AGG_DIGEST_LEN * 2] = '\n';
+            fwrite (line, 1, sizeof (line), agg->log);
+        }
+        fflush (agg->log);
+    }
+
+    pthread_mutex_lock (&agg->lock);
+    for (i = 0; i < count; ++i) {
+        agg->samples[agg->sample_next] = done - items[i].submitted;
+        agg->sample_next = (agg->sample_next + 1) % AGG_SAMPLES;
+        if (agg->sample_count < AGG_SAMPLES)
+            ++agg->sample_count;
+    }
+    ++agg->stats.batches;
+    agg->stats.items += count;
+    if (count > agg->stats.max_depth)
+        agg->stats.max_depth = count;
+    agg_adapt (agg, done - start, count);
+    pthread_mutex_unlock (&agg->lock);
+    ret = 0;
+flush_out:
+    free (desc);
+    return ret;
+flush_fail:
+    ERR_print_errors_fp (stderr);
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    return -1;
+}
+
+static void*
+agg_thread (void *arg)
+{
+    aggregator_t *agg = arg;
+    agg_item_t *batch;
+    struct timespec deadline;
+    uint64_t due;
+    size_t count;
+
+    pthread_mutex_lock (&agg->lock);
+    for (;;) {
+        while (agg->count == 0 && !agg->closing)
+            pthread_cond_wait (&agg->cond, &agg->lock);
+        if (agg->count == 0 || agg->error)
+            break;
+        /* the window opens with the oldest queued measurement */
+        due = agg->items[0].submitted + agg->stats.window_ns;
+        deadline.tv_sec = due / 1000000000ULL;
+        deadline.tv_nsec = due % 1000000000ULL;
+        while (!agg->closing &&
+               pthread_cond_timedwait (&agg->cond, &agg->lock,
+                                       &deadline) != ETIMEDOUT)
+            ;
+        batch = agg->items;
+        count = agg->count;
+        agg->items = NULL;
+        agg->count = 0;
+        agg->size = 0;
+        pthread_mutex_unlock (&agg->lock);
+        if (agg_flush (agg, batch, count)) {
+            /* the PCR may no longer match the logs, so nothing more is
+             * extended and what's queued is dropped */
+            pthread_mutex_lock (&agg->lock);
+            agg->error = -1;
+            agg->count = 0;
+            pthread_mutex_unlock (&agg->lock);
+        }
+        free (batch);
+        pthread_mutex_lock (&agg->lock);
+    }
+    pthread_mutex_unlock (&agg->lock);
+    return NULL;
+}
+
+aggregator_t*
+agg_new (tss_pool_t *pool, TPM_PCRINDEX index, uint64_t target_p99_ns,
+         FILE *log, evlog_t *evlog)
+{
+    pthread_condattr_t attr;
+    aggregator_t *agg;
+
+    agg = calloc (1, sizeof (aggregator_t));
+    if (agg == NULL) {
+        perror ("calloc of aggregator:\n");
+        return NULL;
+    }
+    agg->pool = pool;
+    agg->index = index;
+    agg->log = log;
+    agg->evlog = evlog;
+    agg->target_ns = target_p99_ns;
+    agg->stats.window_ns = target_p99_ns / 2;
+    pthread_mutex_init (&agg->lock, NULL);
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&agg->cond, &attr);
+    pthread_condattr_destroy (&attr);
+    if (pthread_create (&agg->thread, NULL, agg_thread, agg)) {
+        fprintf (stderr, "Failed to start aggregation thread.\n");
+        pthread_cond_destroy (&agg->cond);
+        pthread_mutex_destroy (&agg->lock);
+        free (agg);
+        return NULL;
+    }
+    return agg;
+}
+
+int
+agg_submit (aggregator_t *agg, const unsigned char *digest)
+{
+    return agg_submit_many (agg, digest, 1);
+}
+
+int
+agg_submit_many (aggregator_t *agg, const unsigned char *digests,
+                 size_t count)
+{
+    agg_item_t *items;
+    uint64_t now;
+    size_t size, i;
+    int ret = 0;
+
+    if (count == 0)
+        return 0;
+    now = now_ns ();
+    pthread_mutex_lock (&agg->lock);
+    if (agg->error) {
+        ret = agg->error;
+        goto submit_out;
+    }
+    if (agg->count + count > agg->size) {
+        for (size = agg->size ? agg->size : 64; size < agg->count + count;)
+            size *= 2;
+        items = realloc (agg->items, size * sizeof (agg_item_t));
+        if (items == NULL) {
+            perror ("realloc of aggregation queue:\n");
+            ret = -1;
+            goto submit_out;
+        }
+        agg->items = items;
+        agg->size = size;
+    }
+    for (i = 0; i < count; ++i) {
+        memcpy (agg->items[agg->count + i].digest,
+                digests + i * AGG_DIGEST_LEN, AGG_DIGEST_LEN);
+        agg->items[agg->count + i].submitted = now;
+    }
+    if (agg->count == 0)
+        pthread_cond_signal (&agg->cond);
+    agg->count += count;
+submit_out:
+    pthread_mutex_unlock (&agg->lock);
+    return ret;
+}
+
+int
+agg_close (aggregator_t *agg, agg_stats_t *stats)
+{
+    int ret;
+
+    pthread_mutex_lock (&agg->lock);
+    agg->closing = true;
+    pthread_cond_signal (&agg->cond);
+    pthread_mutex_unlock (&agg->lock);
+    pthread_join (agg->thread, NULL);
+    ret = agg->error;
+    if (stats)
+        *stats = agg->stats;
+    free (agg->items);
+    pthread_cond_destroy (&agg->cond);
+    pthread_mutex_destroy (&agg->lock);
+    free (agg);
+    return ret;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <tss/tspi.h>
+
+#include "evlog.h"
+#include "tpm.h"
+
+#define AGG_DIGEST_LEN 20
+
+/*  Aggregate measurements into one extend per window. Digests submitted
+ *  while a window is open are extended as SHA1 (d1 || d2 || ... || dn)
+ *  and each batch is written to the log as
+ *    batch <n> <aggregate> <count>
+ *  followed by one line per component digest, so the PCR can be
+ *  replayed. With an event log each batch is also recorded there, under
+ *  the log's lock with the extend, as
+ *    aggregate <count> <digest 1> ... <digest n>
+ *  so each component can be checked against a golden database.
+ *  Once an extend or its record fails nothing more is extended.
+ *  The window adapts to the TPM: it never drops below 1.25x the
+ *  observed PcrExtend latency (keeping the TPM from falling behind) and
+ *  otherwise moves toward the largest window for which the p99 of
+ *  submit to extend latency still meets the target. It only grows
+ *  while batches hold more than one measurement: a batch of one saved
+ *  no extends, so the window shrinks toward the floor instead.
+ */
+typedef struct aggregator aggregator_t;
+
+typedef struct agg_stats {
+    uint64_t batches;
+    uint64_t items;
+    uint64_t window_ns;      /* current window */
+    uint64_t extend_ns;      /* smoothed PcrExtend latency */
+    uint64_t p99_ns;         /* recent submit to extend latency */
+    uint64_t max_depth;      /* largest batch */
+} agg_stats_t;
+
+aggregator_t*
+agg_new (tss_pool_t *pool, TPM_PCRINDEX index, uint64_t target_p99_ns,
+         FILE *log, evlog_t *evlog);
+int
+agg_submit (aggregator_t *agg, const unsigned char *digest);
+/*  Submit count digests of AGG_DIGEST_LEN bytes at once, taking the
+ *  queue's lock once for all of them. Fails without queueing anything
+ *  once an extend has failed.
+ */
+int
+agg_submit_many (aggregator_t *agg, const unsigned char *digests,
+                 size_t count);
+/*  Flush what's queued and stop. Returns non-zero if any extend failed,
+ *  in which case what was queued after the failure was dropped.
+ */
+int
+agg_close (aggregator_t *agg, agg_stats_t *stats);
+
+#endif /* AGGREGATE_H */
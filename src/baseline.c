@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <openssl/crypto.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "baseline.h"
+#include "util.h"
+
+static const char *bank_names[BASELINE_BANKS] = {
+    [BASELINE_SHA1] = "sha1",
+    [BASELINE_SHA256] = "sha256",
+};
+
+static const size_t bank_lens[BASELINE_BANKS] = {
+    [BASELINE_SHA1] = 20,
+    [BASELINE_SHA256] = 32,
+};
+
+size_t
+baseline_digest_len (baseline_bank_t bank)
+{
+    return bank_lens[bank];
+}
+
+static int
+baseline_add (baseline_values_t *pcr, const unsigned char *value, size_t len)
+{
+    unsigned char (*values)[BASELINE_DIGEST_MAX];
+    size_t i;
+
+    for (i = 0; i < pcr->count; ++i) {
+        if (memcmp (pcr->values[i], value, len) == 0)
+            return 0;
+    }
+    values = realloc (pcr->values, (pcr->count + 1) * sizeof (*values));
+    if (values == NULL) {
+        perror ("realloc of baseline values:\n");
+        return -1;
+    }
+    memset (values[pcr->count], 0, BASELINE_DIGEST_MAX);
+    memcpy (values[pcr->count], value, len);
+    pcr->values = values;
+    ++pcr->count;
+    return 0;
+}
+
+static int
+baseline_parse_line (baseline_t *baseline, char *line, size_t lineno)
+{
+    unsigned char value[BASELINE_DIGEST_MAX];
+    char *pcr_str, *bank_str, *hex, *end, *save;
+    unsigned long pcr;
+    int bank;
+
+    pcr_str = strtok_r (line, " \t\n", &save);
+    if (pcr_str == NULL || *pcr_str == '#')
+        return 0;
+    bank_str = strtok_r (NULL, " \t\n", &save);
+    hex = strtok_r (NULL, " \t\n", &save);
+    if (bank_str == NULL || hex == NULL)
+        goto parse_fail;
+    errno = 0;
+    pcr = strtoul (pcr_str, &end, 10);
+    if (errno || *end != '\0' || pcr >= BASELINE_PCRS)
+        goto parse_fail;
+    for (bank = 0; bank < BASELINE_BANKS; ++bank) {
+        if (strcmp (bank_str, bank_names[bank]) == 0)
+            break;
+    }
+    if (bank == BASELINE_BANKS || strlen (hex) != bank_lens[bank] * 2 ||
+        hex_parse (hex, value, bank_lens[bank]))
+        goto parse_fail;
+    return baseline_add (&baseline->pcrs[bank][pcr], value, bank_lens[bank]);
+parse_fail:
+    fprintf (stderr, "Invalid baseline entry on line %zu\n", lineno);
+    return -1;
+}
+
+baseline_t*
+baseline_load (const char *path)
+{
+    baseline_t *baseline;
+    char *line = NULL;
+    size_t line_size = 0, lineno = 0;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        fprintf (stderr, "Failed to open baseline %s: %s\n", path,
+                 strerror (errno));
+        return NULL;
+    }
+    baseline = calloc (1, sizeof (baseline_t));
+    if (baseline == NULL) {
+        perror ("calloc of baseline:\n");
+        fclose (file);
+        return NULL;
+    }
+    while (getline (&line, &line_size, file) != -1) {
+        if (baseline_parse_line (baseline, line, ++lineno))
+            goto load_fail;
+    }
+    if (ferror (file)) {
+        perror ("getline:\n");
+        goto load_fail;
+    }
+    free (line);
+    fclose (file);
+    return baseline;
+load_fail:
+    free (line);
+    fclose (file);
+    baseline_free (baseline);
+    return NULL;
+}
+
+void
+baseline_free (baseline_t *baseline)
+{
+    int bank, pcr;
+
+    if (baseline == NULL)
+        return;
+    for (bank = 0; bank < BASELINE_BANKS; ++bank) {
+        for (pcr = 0; pcr < BASELINE_PCRS; ++pcr)
+            free (baseline->pcrs[bank][pcr].values);
+    }
+    free (baseline);
+}
+
+uint32_t
+baseline_mask (const baseline_t *baseline, baseline_bank_t bank)
+{
+    uint32_t mask = 0;
+    int pcr;
+
+    for (pcr = 0; pcr < BASELINE_PCRS; ++pcr) {
+        if (baseline->pcrs[bank][pcr].count)
+            mask |= 1U << pcr;
+    }
+    return mask;
+}
+
+bool
+baseline_match (const baseline_t *baseline, baseline_bank_t bank,
+                unsigned int pcr, const unsigned char *value)
+{
+    const baseline_values_t *values = &baseline->pcrs[bank][pcr];
+    size_t i;
+    int match = 0;
+
+    for (i = 0; i < values->count; ++i)
+        match |= CRYPTO_memcmp (values->values[i], value,
+                                bank_lens[bank]) == 0;
+    return match;
+}
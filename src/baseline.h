@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef BASELINE_H
+#define BASELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BASELINE_PCRS 24
+#define BASELINE_DIGEST_MAX 32
+
+typedef enum baseline_bank {
+    BASELINE_SHA1,
+    BASELINE_SHA256,
+    BASELINE_BANKS,
+} baseline_bank_t;
+
+/*  Known-good PCR values, one per line:
+ *    <pcr> <sha1|sha256> <hex value>
+ *  A PCR may have several acceptable values per bank. Blank lines and
+ *  lines starting with '#' are skipped.
+ */
+typedef struct baseline_values {
+    unsigned char (*values)[BASELINE_DIGEST_MAX];
+    size_t count;
+} baseline_values_t;
+
+typedef struct baseline {
+    baseline_values_t pcrs[BASELINE_BANKS][BASELINE_PCRS];
+} baseline_t;
+
+baseline_t*
+baseline_load (const char *path);
+void
+baseline_free (baseline_t *baseline);
+size_t
+baseline_digest_len (baseline_bank_t bank);
+/*  Mask of the PCRs with values in bank.
+ */
+uint32_t
+baseline_mask (const baseline_t *baseline, baseline_bank_t bank);
+/*  Compare value against every acceptable value of the PCR, taking the
+ *  same time whichever (if any) matches.
+ */
+bool
+baseline_match (const baseline_t *baseline, baseline_bank_t bank,
+                unsigned int pcr, const unsigned char *value);
+
+#endif /* BASELINE_H */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <tss/tspi.h>
+#include <unistd.h>
+
+#include "evlog.h"
+
+evlog_t*
+evlog_open (const char *path, bool writable)
+{
+    evlog_t *log;
+
+    log = calloc (1, sizeof (evlog_t));
+    if (log == NULL) {
+        perror ("calloc of event log:\n");
+        return NULL;
+    }
+    log->path = strdup (path);
+    if (log->path == NULL) {
+        perror ("strdup:\n");
+        goto open_fail;
+    }
+    if (writable)
+        log->fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                        0644);
+    else
+        log->fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (log->fd == -1) {
+        fprintf (stderr, "Failed to open event log %s: %s\n", path,
+                 strerror (errno));
+        goto open_fail;
+    }
+    return log;
+open_fail:
+    free (log->path);
+    free (log);
+    return NULL;
+}
+
+void
+evlog_close (evlog_t *log)
+{
+    if (log == NULL)
+        return;
+    close (log->fd);
+    free (log->path);
+    free (log);
+}
+
+int
+evlog_lock (evlog_t *log, bool exclusive)
+{
+    while (flock (log->fd, exclusive ? LOCK_EX : LOCK_SH) == -1) {
+        if (errno != EINTR) {
+            fprintf (stderr, "Failed to lock event log %s: %s\n",
+                     log->path, strerror (errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+evlog_unlock (evlog_t *log)
+{
+    if (flock (log->fd, LOCK_UN) == -1) {
+        fprintf (stderr, "Failed to unlock event log %s: %s\n",
+                 log->path, strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+int
+evlog_append (evlog_t *log, TPM_PCRINDEX index, const void *digest,
+              size_t digest_len, const char *desc)
+{
+    const unsigned char *bytes = digest;
+    char *record = NULL, *p;
+    size_t len, i;
+    ssize_t written;
+    int ret = -1;
+
+    /* one write per record keeps O_APPEND from interleaving records */
+    len = 12 + digest_len * 2 + strlen (desc) * 2 + 2;
+    record = malloc (len);
+    if (record == NULL) {
+        perror ("malloc of event record:\n");
+        return -1;
+    }
+    p = record + sprintf (record, "%u ", index);
+    for (i = 0; i < digest_len; ++i)
+        p += sprintf (p, "%02x", bytes[i]);
+    *p++ = ' ';
+    for (; *desc; ++desc) {
+        if (*desc == '\\') {
+            *p++ = '\\';
+            *p++ = '\\';
+        } else if (*desc == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
+        } else {
+            *p++ = *desc;
+        }
+    }
+    *p++ = '\n';
+    len = p - record;
+    for (p = record; len > 0; p += written, len -= written) {
+        written = write (log->fd, p, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                written = 0;
+                continue;
+            }
+            fprintf (stderr, "Failed to write event log %s: %s\n",
+                     log->path, strerror (errno));
+            goto append_out;
+        }
+    }
+    if (fdatasync (log->fd) == -1) {
+        fprintf (stderr, "Failed to sync event log %s: %s\n",
+                 log->path, strerror (errno));
+        goto append_out;
+    }
+    ret = 0;
+append_out:
+    free (record);
+    return ret;
+}
+
+off_t
+evlog_size (evlog_t *log)
+{
+    struct stat sb;
+
+    if (fstat (log->fd, &sb) == -1) {
+        fprintf (stderr, "Failed to stat event log %s: %s\n", log->path,
+                 strerror (errno));
+        return -1;
+    }
+    return sb.st_size;
+}
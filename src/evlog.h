@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <tss/tspi.h>
+
+/*  Event log of the extends made by pcr-extend, one record per line:
+ *    <pcr> <hex digest> <description>
+ *  with '\' and newlines in the description escaped as in tree
+ *  manifests, so paths in it can't forge records.
+ *  Writers hold an exclusive flock across the extend and the append,
+ *  readers take a shared lock to read PCRs and the log length, so a
+ *  snapshot never sees an extend without its record or the reverse.
+ */
+typedef struct evlog {
+    int fd;
+    char *path;
+} evlog_t;
+
+evlog_t*
+evlog_open (const char *path, bool writable);
+void
+evlog_close (evlog_t *log);
+int
+evlog_lock (evlog_t *log, bool exclusive);
+int
+evlog_unlock (evlog_t *log);
+/*  Append a record, the caller must hold the exclusive lock.
+ */
+int
+evlog_append (evlog_t *log, TPM_PCRINDEX index, const void *digest,
+              size_t digest_len, const char *desc);
+off_t
+evlog_size (evlog_t *log);
+
+#endif /* EVLOG_H */
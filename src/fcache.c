@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <ctype.h>
+#include <openssl/objects.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "util.h"
+
+#define FCACHE_MIN 256
+#define FCACHE_NONE SIZE_MAX
+#define FCACHE_NAME_MAX 16
+
+void
+file_stamp_set (file_stamp_t *stamp, const struct stat *st)
+{
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtim;
+    stamp->ctime = st->st_ctim;
+}
+
+bool
+file_stamp_match (const file_stamp_t *stamp, const struct stat *st)
+{
+    return stamp->dev == st->st_dev && stamp->ino == st->st_ino &&
+           stamp->size == st->st_size &&
+           stamp->mtime.tv_sec == st->st_mtim.tv_sec &&
+           stamp->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           stamp->ctime.tv_sec == st->st_ctim.tv_sec &&
+           stamp->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+typedef struct fcache_entry {
+    file_stamp_t stamp;
+    int nid;
+    unsigned int len;
+    bool used;          /* looked up or added since the cache was loaded */
+    size_t next;        /* bucket chain */
+    unsigned char digest[EVP_MAX_MD_SIZE];
+} fcache_entry_t;
+
+/*  Entries sit in one array, in the order they were added until the
+ *  cache is full. From then on it's a ring and head is the next entry
+ *  to be replaced. There are as many buckets as entries.
+ */
+struct fcache {
+    pthread_mutex_t lock;
+    fcache_entry_t *entries;
+    size_t count;
+    size_t size;
+    size_t limit;
+    size_t head;
+    size_t *buckets;
+};
+
+fcache_t*
+fcache_new (size_t limit)
+{
+    fcache_t *cache;
+
+    cache = calloc (1, sizeof (fcache_t));
+    if (cache == NULL) {
+        perror ("calloc of file digest cache:\n");
+        return NULL;
+    }
+    pthread_mutex_init (&cache->lock, NULL);
+    cache->limit = limit;
+    return cache;
+}
+
+void
+fcache_free (fcache_t *cache)
+{
+    if (cache == NULL)
+        return;
+    pthread_mutex_destroy (&cache->lock);
+    free (cache->entries);
+    free (cache->buckets);
+    free (cache);
+}
+
+static size_t
+fcache_bucket (const fcache_t *cache, dev_t dev, ino_t ino, int nid)
+{
+    uint64_t key = (uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)ino;
+
+    key = (key ^ (uint64_t)nid) * 0xff51afd7ed558ccdULL;
+    return (key ^ key >> 32) % cache->size;
+}
+
+static size_t
+fcache_find (const fcache_t *cache, dev_t dev, ino_t ino, int nid)
+{
+    const fcache_entry_t *entry;
+    size_t i;
+
+    if (cache->size == 0)
+        return FCACHE_NONE;
+    i = cache->buckets[fcache_bucket (cache, dev, ino, nid)];
+    for (; i != FCACHE_NONE; i = entry->next) {
+        entry = &cache->entries[i];
+        if (entry->stamp.dev == dev && entry->stamp.ino == ino &&
+            entry->nid == nid)
+            return i;
+    }
+    return FCACHE_NONE;
+}
+
+static void
+fcache_link (fcache_t *cache, size_t i)
+{
+    fcache_entry_t *entry = &cache->entries[i];
+    size_t bucket;
+
+    bucket = fcache_bucket (cache, entry->stamp.dev, entry->stamp.ino,
+                            entry->nid);
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+}
+
+static void
+fcache_unlink (fcache_t *cache, size_t i)
+{
+    fcache_entry_t *entry = &cache->entries[i];
+    size_t *link;
+
+    link = &cache->buckets[fcache_bucket (cache, entry->stamp.dev,
+                                          entry->stamp.ino, entry->nid)];
+    while (*link != FCACHE_NONE && *link != i)
+        link = &cache->entries[*link].next;
+    if (*link != FCACHE_NONE)
+        *link = entry->next;
+}
+
+/*  Double the entries, but not past the limit, and rehash.
+ */
+static int
+fcache_grow (fcache_t *cache)
+{
+    fcache_entry_t *entries;
+    size_t *buckets, size, i;
+
+    size = cache->size ? cache->size * 2 : FCACHE_MIN;
+    if (cache->limit && size > cache->limit)
+        size = cache->limit;
+    entries = realloc (cache->entries, size * sizeof (fcache_entry_t));
+    if (entries == NULL) {
+        perror ("realloc of file digest cache:\n");
+        return -1;
+    }
+    cache->entries = entries;
+    buckets = realloc (cache->buckets, size * sizeof (size_t));
+    if (buckets == NULL) {
+        perror ("realloc of file digest cache:\n");
+        return -1;
+    }
+    cache->buckets = buckets;
+    cache->size = size;
+    for (i = 0; i < size; ++i)
+        cache->buckets[i] = FCACHE_NONE;
+    for (i = 0; i < cache->count; ++i)
+        fcache_link (cache, i);
+    return 0;
+}
+
+/*  Called with the lock held.
+ */
+static int
+fcache_insert (fcache_t *cache, const file_stamp_t *stamp, int nid,
+               const unsigned char *digest, unsigned int len, bool used)
+{
+    fcache_entry_t *entry;
+    size_t i;
+
+    i = fcache_find (cache, stamp->dev, stamp->ino, nid);
+    if (i == FCACHE_NONE) {
+        if (cache->limit && cache->count == cache->limit) {
+            i = cache->head;
+            cache->head = (cache->head + 1) % cache->limit;
+            fcache_unlink (cache, i);
+        } else {
+            if (cache->count == cache->size && fcache_grow (cache))
+                return -1;
+            i = cache->count++;
+        }
+        cache->entries[i].stamp = *stamp;
+        cache->entries[i].nid = nid;
+        fcache_link (cache, i);
+    }
+    entry = &cache->entries[i];
+    entry->stamp = *stamp;
+    entry->len = len;
+    entry->used = used;
+    memcpy (entry->digest, digest, len);
+    return 0;
+}
+
+bool
+fcache_lookup (fcache_t *cache, const struct stat *st, const EVP_MD *md,
+               unsigned char *digest)
+{
+    fcache_entry_t *entry;
+    bool found = false;
+    size_t i;
+
+    pthread_mutex_lock (&cache->lock);
+    i = fcache_find (cache, st->st_dev, st->st_ino, EVP_MD_type (md));
+    if (i != FCACHE_NONE) {
+        entry = &cache->entries[i];
+        found = file_stamp_match (&entry->stamp, st);
+        if (found) {
+            memcpy (digest, entry->digest, entry->len);
+            entry->used = true;
+        }
+    }
+    pthread_mutex_unlock (&cache->lock);
+    return found;
+}
+
+int
+fcache_add (fcache_t *cache, const struct stat *st, const EVP_MD *md,
+            const unsigned char *digest, time_t since)
+{
+    file_stamp_t stamp;
+    int ret;
+
+    if (st->st_mtime >= since || st->st_ctime >= since)
+        return 0;
+    file_stamp_set (&stamp, st);
+    pthread_mutex_lock (&cache->lock);
+    ret = fcache_insert (cache, &stamp, EVP_MD_type (md), digest,
+                         EVP_MD_size (md), true);
+    pthread_mutex_unlock (&cache->lock);
+    return ret;
+}
+
+static int
+parse_entry (const char *name, int *nid, unsigned char *digest,
+             unsigned int *len)
+{
+    char alg[FCACHE_NAME_MAX];
+    const char *hex;
+    const EVP_MD *md;
+
+    hex = strchr (name, ':');
+    if (hex == NULL || (size_t)(hex - name) >= sizeof (alg))
+        return -1;
+    memcpy (alg, name, hex - name);
+    alg[hex++ - name] = '\0';
+    md = EVP_get_digestbyname (alg);
+    if (md == NULL || strlen (hex) != (size_t)EVP_MD_size (md) * 2)
+        return -1;
+    if (hex_parse (hex, digest, EVP_MD_size (md)))
+        return -1;
+    *nid = EVP_MD_type (md);
+    *len = EVP_MD_size (md);
+    return 0;
+}
+
+int
+fcache_load (fcache_t *cache, const char *path)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned long long dev, ino;
+    long long size, mtime_s, mtime_ns, ctime_s, ctime_ns;
+    char name[FCACHE_NAME_MAX + EVP_MAX_MD_SIZE * 2 + 2];
+    file_stamp_t stamp;
+    unsigned int len;
+    FILE *file;
+    int nid, ret = 0;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf (stderr, "Failed to read digest cache %s: %s\n", path,
+                 strerror (errno));
+        return -1;
+    }
+    pthread_mutex_lock (&cache->lock);
+    while (ret == 0 &&
+           fscanf (file, "%145s %llu %llu %lld %lld %lld %lld %lld", name,
+                   &dev, &ino, &size, &mtime_s, &mtime_ns, &ctime_s,
+                   &ctime_ns) == 8) {
+        /* entries of unknown algorithms are dropped */
+        if (parse_entry (name, &nid, digest, &len))
+            continue;
+        stamp.dev = dev;
+        stamp.ino = ino;
+        stamp.size = size;
+        stamp.mtime.tv_sec = mtime_s;
+        stamp.mtime.tv_nsec = mtime_ns;
+        stamp.ctime.tv_sec = ctime_s;
+        stamp.ctime.tv_nsec = ctime_ns;
+        ret = fcache_insert (cache, &stamp, nid, digest, len, false);
+    }
+    pthread_mutex_unlock (&cache->lock);
+    fclose (file);
+    return ret;
+}
+
+static void
+write_entry (FILE *file, const fcache_entry_t *entry)
+{
+    const char *name = OBJ_nid2sn (entry->nid);
+    unsigned int i;
+
+    for (; *name; ++name)
+        fputc (tolower ((unsigned char)*name), file);
+    fputc (':', file);
+    for (i = 0; i < entry->len; ++i)
+        fprintf (file, "%02x", entry->digest[i]);
+    fprintf (file, " %llu %llu %lld %lld %ld %lld %ld\n",
+             (unsigned long long)entry->stamp.dev,
+             (unsigned long long)entry->stamp.ino,
+             (long long)entry->stamp.size,
+             (long long)entry->stamp.mtime.tv_sec, entry->stamp.mtime.tv_nsec,
+             (long long)entry->stamp.ctime.tv_sec, entry->stamp.ctime.tv_nsec);
+}
+
+int
+fcache_save (fcache_t *cache, const char *path, bool used_only)
+{
+    char tmp[PATH_MAX];
+    size_t i;
+    FILE *file;
+    int fd;
+
+    snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+    fd = mkstemp (tmp);
+    if (fd == -1 || (file = fdopen (fd, "w")) == NULL) {
+        fprintf (stderr, "Failed to write digest cache %s: %s\n", path,
+                 strerror (errno));
+        if (fd != -1) {
+            close (fd);
+            unlink (tmp);
+        }
+        return -1;
+    }
+    pthread_mutex_lock (&cache->lock);
+    for (i = 0; i < cache->count; ++i) {
+        if (cache->entries[i].used || !used_only)
+            write_entry (file, &cache->entries[i]);
+    }
+    pthread_mutex_unlock (&cache->lock);
+    if (fflush (file) || fsync (fd) || fclose (file) || rename (tmp, path)) {
+        fprintf (stderr, "Failed to write digest cache %s: %s\n", path,
+                 strerror (errno));
+        unlink (tmp);
+        return -1;
+    }
+    return 0;
+}
+
+size_t
+fcache_memory (const fcache_t *cache)
+{
+    return sizeof (fcache_t) +
+           cache->size * (sizeof (fcache_entry_t) + sizeof (size_t));
+}
+
+size_t
+fcache_entries_in (size_t bytes)
+{
+    size_t entry = sizeof (fcache_entry_t) + sizeof (size_t);
+
+    if (bytes < sizeof (fcache_t) + entry)
+        return 1;
+    return (bytes - sizeof (fcache_t)) / entry;
+}
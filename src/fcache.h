@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*  What identifies a file and tells it changed: device, inode, size,
+ *  mtime and ctime. The owner can set mtime but not ctime, and any
+ *  write moves ctime.
+ */
+typedef struct file_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+} file_stamp_t;
+
+void
+file_stamp_set (file_stamp_t *stamp, const struct stat *st);
+bool
+file_stamp_match (const file_stamp_t *stamp, const struct stat *st);
+
+/*  Digests of files, each valid while the file's stamp is unchanged,
+ *  shared by the directory walk, OCI blob verification and pcr-hashd.
+ *  Entries are keyed by device, inode and algorithm in a hash table
+ *  that grows by doubling. With a limit, the oldest entries make room
+ *  for new ones. The cache is locked internally so threads can share
+ *  it. It's saved as a text file, one entry per line:
+ *    <algorithm>:<hex> <dev> <ino> <size> <mtime s> <mtime ns>
+ *      <ctime s> <ctime ns>
+ */
+typedef struct fcache fcache_t;
+
+fcache_t*
+fcache_new (size_t limit);
+void
+fcache_free (fcache_t *cache);
+/*  Add the entries of the file at path, a missing file is an empty
+ *  cache.
+ */
+int
+fcache_load (fcache_t *cache, const char *path);
+/*  Replace the file at path with the cache, only the entries looked up
+ *  or added since it was loaded when used_only is set.
+ */
+int
+fcache_save (fcache_t *cache, const char *path, bool used_only);
+bool
+fcache_lookup (fcache_t *cache, const struct stat *st, const EVP_MD *md,
+               unsigned char *digest);
+/*  Remember the digest of the file st describes. A file changed at or
+ *  after since could change again without its stamp moving, it isn't
+ *  cached.
+ */
+int
+fcache_add (fcache_t *cache, const struct stat *st, const EVP_MD *md,
+            const unsigned char *digest, time_t since);
+/*  Bytes held by the cache.
+ */
+size_t
+fcache_memory (const fcache_t *cache);
+/*  Limit on entries that keeps a cache within bytes, at least 1.
+ */
+size_t
+fcache_entries_in (size_t bytes);
+
+#endif /* FCACHE_H */
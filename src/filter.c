@@ -0,0 +1,586 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "filter.h"
+
+#define RULE_NONE -1
+#define TYPE_SLOTS 16
+#define TYPE_SLOT(mode) (((mode) & S_IFMT) >> 12)
+
+/*  Rules are classified when they're added so that the common cases can
+ *  be matched with a handful of hash table lookups instead of running
+ *  every pattern against every path. Only patterns that don't fit one
+ *  of the literal forms fall through to glob_match.
+ */
+typedef enum rule_kind {
+    RULE_NAME,     /* literal last path component: 'core' */
+    RULE_SUFFIX,   /* '*' and a literal, last path component: '*.pyc' */
+    RULE_PATH,     /* literal path from the tree root: '/etc/mtab' */
+    RULE_SUBTREE,  /* literal directory and a trailing globstar */
+    RULE_GLOB,     /* anything else */
+    RULE_TYPE,     /* file type: 'socket' */
+} rule_kind_t;
+
+typedef struct rule {
+    filter_action_t action;
+    rule_kind_t kind;
+    char *pattern;   /* anchored patterns always start with '/' */
+    size_t len;
+    bool anchored;
+    bool dir_only;
+    bool subtree;    /* RULE_GLOB ending in a globstar */
+    char *base;      /* a subtree's pattern without the globstar */
+    mode_t type;
+} rule_t;
+
+/*  Open addressing table mapping a literal to the first rule that uses
+ *  it. Rules are inserted in order so the first one wins.
+ */
+typedef struct strtab_entry {
+    const char *key;
+    size_t len;
+    int any;   /* first rule matching any file type */
+    int dir;   /* first rule restricted to directories */
+} strtab_entry_t;
+
+typedef struct strtab {
+    strtab_entry_t *entries;
+    size_t size;
+} strtab_t;
+
+struct filter {
+    rule_t *rules;
+    size_t rule_count;
+    size_t rule_size;
+    bool compiled;
+    strtab_t names;
+    strtab_t suffixes;
+    strtab_t paths;
+    strtab_t subtrees;
+    size_t *suffix_lens;   /* distinct suffix lengths, ascending */
+    size_t suffix_len_count;
+    int *globs;            /* RULE_GLOB rule indexes, ascending */
+    size_t glob_count;
+    int types[TYPE_SLOTS];
+};
+
+static const struct {
+    const char *name;
+    mode_t type;
+} type_names[] = {
+    { "file",    S_IFREG },
+    { "dir",     S_IFDIR },
+    { "symlink", S_IFLNK },
+    { "fifo",    S_IFIFO },
+    { "socket",  S_IFSOCK },
+    { "char",    S_IFCHR },
+    { "block",   S_IFBLK },
+};
+
+static inline int
+rule_min (int a, int b)
+{
+    if (a == RULE_NONE)
+        return b;
+    if (b == RULE_NONE)
+        return a;
+    return a < b ? a : b;
+}
+
+/*  FNV-1a */
+static uint64_t
+str_hash (const char *str, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int
+strtab_init (strtab_t *tab, size_t count)
+{
+    size_t size = 8;
+
+    if (count == 0)
+        return 0;
+    while (size < count * 2)
+        size <<= 1;
+    tab->entries = calloc (size, sizeof (strtab_entry_t));
+    if (tab->entries == NULL) {
+        perror ("calloc of filter table:\n");
+        return -1;
+    }
+    tab->size = size;
+    return 0;
+}
+
+static strtab_entry_t*
+strtab_slot (const strtab_t *tab, const char *key, size_t len)
+{
+    size_t i = str_hash (key, len) & (tab->size - 1);
+
+    while (tab->entries[i].key != NULL) {
+        if (tab->entries[i].len == len &&
+            memcmp (tab->entries[i].key, key, len) == 0)
+            break;
+        i = (i + 1) & (tab->size - 1);
+    }
+    return &tab->entries[i];
+}
+
+static void
+strtab_insert (strtab_t *tab, const char *key, size_t len, int rule,
+               bool dir_only)
+{
+    strtab_entry_t *entry = strtab_slot (tab, key, len);
+
+    if (entry->key == NULL) {
+        entry->key = key;
+        entry->len = len;
+        entry->any = RULE_NONE;
+        entry->dir = RULE_NONE;
+    }
+    if (dir_only && entry->dir == RULE_NONE)
+        entry->dir = rule;
+    else if (!dir_only && entry->any == RULE_NONE)
+        entry->any = rule;
+}
+
+static int
+strtab_lookup (const strtab_t *tab, const char *key, size_t len, bool is_dir)
+{
+    strtab_entry_t *entry;
+
+    if (tab->size == 0)
+        return RULE_NONE;
+    entry = strtab_slot (tab, key, len);
+    if (entry->key == NULL)
+        return RULE_NONE;
+    return is_dir ? rule_min (entry->any, entry->dir) : entry->any;
+}
+
+static bool
+is_literal (const char *pattern, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        switch (pattern[i]) {
+            case '*':
+            case '?':
+            case '[':
+            case '\\':
+                return false;
+        }
+    }
+    return true;
+}
+
+/*  Match a bracket expression starting just past the '['. On success the
+ *  position of the closing ']' is stored in end. Returns -1 if the
+ *  expression isn't terminated, in which case '[' is taken literally.
+ */
+static int
+bracket_match (const char *p, char c, const char **end)
+{
+    bool negate = false, match = false;
+    const char *start;
+
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        ++p;
+    }
+    start = p;
+    for (; *p != '\0' && (*p != ']' || p == start); ++p) {
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+            if ((unsigned char)c >= (unsigned char)p[0] &&
+                (unsigned char)c <= (unsigned char)p[2])
+                match = true;
+            p += 2;
+        } else if (*p == c) {
+            match = true;
+        }
+    }
+    if (*p != ']')
+        return -1;
+    *end = p;
+    return match != negate;
+}
+
+static bool
+glob_match (const char *p, const char *s)
+{
+    const char *end;
+    int ret;
+
+    for (; *p != '\0'; ++p, ++s) {
+        switch (*p) {
+            case '*':
+                if (p[1] == '*') {
+                    while (*p == '*')
+                        ++p;
+                    /* a globstar and '/' may match zero directories */
+                    if (*p == '/' && glob_match (p + 1, s))
+                        return true;
+                    for (;; ++s) {
+                        if (glob_match (p, s))
+                            return true;
+                        if (*s == '\0')
+                            return false;
+                    }
+                }
+                for (;; ++s) {
+                    if (glob_match (p + 1, s))
+                        return true;
+                    if (*s == '\0' || *s == '/')
+                        return false;
+                }
+            case '?':
+                if (*s == '\0' || *s == '/')
+                    return false;
+                break;
+            case '[':
+                if (*s == '\0' || *s == '/')
+                    return false;
+                ret = bracket_match (p + 1, *s, &end);
+                if (ret == 0)
+                    return false;
+                if (ret == 1) {
+                    p = end;
+                    break;
+                }
+                if (*p != *s)
+                    return false;
+                break;
+            case '\\':
+                if (p[1] != '\0')
+                    ++p;
+                /* fall through */
+            default:
+                if (*p != *s)
+                    return false;
+        }
+    }
+    return *s == '\0';
+}
+
+filter_t*
+filter_new (void)
+{
+    filter_t *filter;
+    int i;
+
+    filter = calloc (1, sizeof (filter_t));
+    if (filter == NULL) {
+        perror ("calloc of filter:\n");
+        return NULL;
+    }
+    for (i = 0; i < TYPE_SLOTS; ++i)
+        filter->types[i] = RULE_NONE;
+    return filter;
+}
+
+void
+filter_free (filter_t *filter)
+{
+    size_t i;
+
+    if (filter == NULL)
+        return;
+    for (i = 0; i < filter->rule_count; ++i) {
+        free (filter->rules[i].pattern);
+        free (filter->rules[i].base);
+    }
+    free (filter->rules);
+    free (filter->names.entries);
+    free (filter->suffixes.entries);
+    free (filter->paths.entries);
+    free (filter->subtrees.entries);
+    free (filter->suffix_lens);
+    free (filter->globs);
+    free (filter);
+}
+
+static rule_t*
+filter_rule_new (filter_t *filter, filter_action_t action)
+{
+    rule_t *rules;
+    size_t size;
+
+    if (filter->compiled) {
+        fprintf (stderr, "Filter rules added after compilation.\n");
+        return NULL;
+    }
+    if (filter->rule_count == filter->rule_size) {
+        size = filter->rule_size ? filter->rule_size * 2 : 16;
+        rules = realloc (filter->rules, size * sizeof (rule_t));
+        if (rules == NULL) {
+            perror ("realloc of filter rules:\n");
+            return NULL;
+        }
+        filter->rules = rules;
+        filter->rule_size = size;
+    }
+    memset (&filter->rules[filter->rule_count], 0, sizeof (rule_t));
+    filter->rules[filter->rule_count].action = action;
+    return &filter->rules[filter->rule_count++];
+}
+
+int
+filter_add_pattern (filter_t *filter, filter_action_t action,
+                    const char *pattern)
+{
+    rule_t *rule;
+    size_t len = strlen (pattern);
+    bool dir_only = false, anchored;
+
+    while (len > 0 && pattern[len - 1] == '/') {
+        dir_only = true;
+        --len;
+    }
+    if (len == 0) {
+        fprintf (stderr, "Empty filter pattern: \"%s\"\n", pattern);
+        return -1;
+    }
+    anchored = memchr (pattern, '/', len) != NULL;
+    rule = filter_rule_new (filter, action);
+    if (rule == NULL)
+        return -1;
+    rule->pattern = malloc (len + 2);
+    if (rule->pattern == NULL) {
+        perror ("malloc of filter pattern:\n");
+        --filter->rule_count;
+        return -1;
+    }
+    rule->len = 0;
+    if (anchored && pattern[0] != '/')
+        rule->pattern[rule->len++] = '/';
+    memcpy (rule->pattern + rule->len, pattern, len);
+    rule->len += len;
+    rule->pattern[rule->len] = '\0';
+    rule->anchored = anchored;
+    rule->dir_only = dir_only;
+
+    if (!anchored && is_literal (rule->pattern, rule->len)) {
+        rule->kind = RULE_NAME;
+    } else if (!anchored && rule->len > 1 && rule->pattern[0] == '*' &&
+               is_literal (rule->pattern + 1, rule->len - 1)) {
+        rule->kind = RULE_SUFFIX;
+    } else if (anchored && is_literal (rule->pattern, rule->len)) {
+        rule->kind = RULE_PATH;
+    } else if (anchored && rule->len > 4 &&
+               strcmp (rule->pattern + rule->len - 3, "/**") == 0 &&
+               is_literal (rule->pattern, rule->len - 3)) {
+        rule->kind = RULE_SUBTREE;
+    } else {
+        rule->kind = RULE_GLOB;
+        rule->subtree = rule->len > 3 &&
+            strcmp (rule->pattern + rule->len - 3, "/**") == 0;
+    }
+    return 0;
+}
+
+int
+filter_add_type (filter_t *filter, filter_action_t action, const char *type)
+{
+    rule_t *rule;
+    size_t i;
+
+    for (i = 0; i < sizeof (type_names) / sizeof (type_names[0]); ++i) {
+        if (strcmp (type, type_names[i].name) == 0)
+            break;
+    }
+    if (i == sizeof (type_names) / sizeof (type_names[0])) {
+        fprintf (stderr, "Unknown file type for filter: \"%s\"\n", type);
+        return -1;
+    }
+    rule = filter_rule_new (filter, action);
+    if (rule == NULL)
+        return -1;
+    rule->kind = RULE_TYPE;
+    rule->type = type_names[i].type;
+    return 0;
+}
+
+static int
+size_cmp (const void *a, const void *b)
+{
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*  Build the lookup tables. Must be called once, after the last rule has
+ *  been added and before the first call to filter_match.
+ */
+int
+filter_compile (filter_t *filter)
+{
+    size_t counts[RULE_TYPE + 1] = { 0 };
+    size_t i, j;
+    rule_t *rule;
+
+    if (filter->compiled)
+        return 0;
+    for (i = 0; i < filter->rule_count; ++i)
+        ++counts[filter->rules[i].kind];
+    if (strtab_init (&filter->names, counts[RULE_NAME]) ||
+        strtab_init (&filter->suffixes, counts[RULE_SUFFIX]) ||
+        strtab_init (&filter->paths, counts[RULE_PATH]) ||
+        strtab_init (&filter->subtrees, counts[RULE_SUBTREE]))
+        return -1;
+    if (counts[RULE_SUFFIX]) {
+        filter->suffix_lens = calloc (counts[RULE_SUFFIX], sizeof (size_t));
+        if (filter->suffix_lens == NULL) {
+            perror ("calloc of filter suffix lengths:\n");
+            return -1;
+        }
+    }
+    if (counts[RULE_GLOB]) {
+        filter->globs = calloc (counts[RULE_GLOB], sizeof (int));
+        if (filter->globs == NULL) {
+            perror ("calloc of filter globs:\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < filter->rule_count; ++i) {
+        rule = &filter->rules[i];
+        switch (rule->kind) {
+            case RULE_NAME:
+                strtab_insert (&filter->names, rule->pattern, rule->len,
+                               i, rule->dir_only);
+                break;
+            case RULE_SUFFIX:
+                strtab_insert (&filter->suffixes, rule->pattern + 1,
+                               rule->len - 1, i, rule->dir_only);
+                filter->suffix_lens[filter->suffix_len_count++] =
+                    rule->len - 1;
+                break;
+            case RULE_PATH:
+                strtab_insert (&filter->paths, rule->pattern, rule->len,
+                               i, rule->dir_only);
+                break;
+            case RULE_SUBTREE:
+                strtab_insert (&filter->subtrees, rule->pattern,
+                               rule->len - 3, i, rule->dir_only);
+                break;
+            case RULE_GLOB:
+                filter->globs[filter->glob_count++] = i;
+                if (rule->subtree) {
+                    rule->base = strndup (rule->pattern, rule->len - 3);
+                    if (rule->base == NULL) {
+                        perror ("strndup of filter pattern:\n");
+                        return -1;
+                    }
+                }
+                break;
+            case RULE_TYPE:
+                if (filter->types[TYPE_SLOT (rule->type)] == RULE_NONE)
+                    filter->types[TYPE_SLOT (rule->type)] = i;
+                break;
+        }
+    }
+    /* keep only the distinct suffix lengths */
+    qsort (filter->suffix_lens, filter->suffix_len_count, sizeof (size_t),
+           size_cmp);
+    for (i = 0, j = 0; i < filter->suffix_len_count; ++i) {
+        if (j == 0 || filter->suffix_lens[j - 1] != filter->suffix_lens[i])
+            filter->suffix_lens[j++] = filter->suffix_lens[i];
+    }
+    filter->suffix_len_count = j;
+    filter->compiled = true;
+    return 0;
+}
+
+static bool
+glob_rule_match (const rule_t *rule, const char *path, const char *name)
+{
+    const char *subject = rule->anchored ? path : name;
+
+    if (glob_match (rule->pattern, subject))
+        return true;
+    /* a trailing globstar also matches the directory itself */
+    return rule->subtree && glob_match (rule->base, subject);
+}
+
+/*  Decide whether the path (relative to the tree root, with a leading
+ *  '/') is included in the measurement.
+ */
+filter_action_t
+filter_match (const filter_t *filter, const char *path, mode_t mode)
+{
+    const char *name;
+    const rule_t *rule;
+    size_t path_len, name_len, i;
+    bool is_dir = S_ISDIR (mode);
+    int best = RULE_NONE;
+
+    if (filter == NULL || filter->rule_count == 0)
+        return FILTER_INCLUDE;
+    name = strrchr (path, '/');
+    name = name ? name + 1 : path;
+    path_len = strlen (path);
+    name_len = strlen (name);
+
+    best = rule_min (best, filter->types[TYPE_SLOT (mode)]);
+    best = rule_min (best, strtab_lookup (&filter->names, name, name_len,
+                                          is_dir));
+    for (i = 0; i < filter->suffix_len_count; ++i) {
+        if (filter->suffix_lens[i] > name_len)
+            break;
+        best = rule_min (best,
+                         strtab_lookup (&filter->suffixes,
+                                        name + name_len - filter->suffix_lens[i],
+                                        filter->suffix_lens[i], is_dir));
+    }
+    best = rule_min (best, strtab_lookup (&filter->paths, path, path_len,
+                                          is_dir));
+    if (filter->subtrees.size) {
+        for (i = 1; i <= path_len; ++i) {
+            if (i == path_len || path[i] == '/')
+                best = rule_min (best, strtab_lookup (&filter->subtrees, path,
+                                                      i, is_dir));
+        }
+    }
+    for (i = 0; i < filter->glob_count; ++i) {
+        if (best != RULE_NONE && filter->globs[i] > best)
+            break;
+        rule = &filter->rules[filter->globs[i]];
+        if (rule->dir_only && !is_dir)
+            continue;
+        if (glob_rule_match (rule, path, name)) {
+            best = filter->globs[i];
+            break;
+        }
+    }
+    if (best == RULE_NONE)
+        return FILTER_INCLUDE;
+    return filter->rules[best].action;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <sys/types.h>
+
+/*  Include / exclude rules applied to paths during tree measurement.
+ *  Rules are evaluated in the order they were added and the first rule
+ *  that matches a path decides its fate. Paths that no rule matches are
+ *  included. Patterns follow gitignore conventions:
+ *    - a pattern containing a '/' (other than a trailing one) is matched
+ *      against the whole path relative to the tree root, otherwise it is
+ *      matched against the last path component only
+ *    - a trailing '/' restricts the pattern to directories
+ *    - '*' and '?' do not match '/', '**' matches anything including '/'
+ *  Excluding a directory excludes everything beneath it: excluded
+ *  subtrees are never descended into.
+ */
+typedef enum filter_action {
+    FILTER_INCLUDE = 0,
+    FILTER_EXCLUDE,
+} filter_action_t;
+
+typedef struct filter filter_t;
+
+filter_t*
+filter_new (void);
+void
+filter_free (filter_t *filter);
+int
+filter_add_pattern (filter_t *filter, filter_action_t action,
+                    const char *pattern);
+int
+filter_add_type (filter_t *filter, filter_action_t action, const char *type);
+int
+filter_compile (filter_t *filter);
+filter_action_t
+filter_match (const filter_t *filter, const char *path, mode_t mode);
+
+#endif /* FILTER_H */
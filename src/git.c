@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "git.h"
+#include "hash.h"
+
+#define GIT_OID_LEN 20
+#define GIT_ENTRY_LEN 62
+#define GIT_MODE_TREE 040000
+#define GIT_MODE_LINK 0120000
+#define GIT_MODE_GITLINK 0160000
+#define GIT_FLAG_EXTENDED 0x4000
+#define GIT_FLAG_STAGE 0x3000
+#define GIT_FLAG_NAME 0x0fff
+#define GIT_XFLAG_SKIP_WORKTREE 0x4000
+#define GIT_XFLAG_INTENT_TO_ADD 0x2000
+
+typedef struct git_entry {
+    char *path;
+    size_t path_len;
+    uint32_t mode;
+    uint16_t xflags;
+    bool omit;          /* deleted or intent-to-add, not in the tree */
+    const unsigned char *raw;
+    unsigned char oid[GIT_OID_LEN];
+} git_entry_t;
+
+typedef struct git_index {
+    int worktree_fd;
+    struct stat st;
+    unsigned char *map;
+    size_t size;
+    uint32_t version;
+    git_entry_t *entries;
+    size_t count;
+    git_stats_t *stats;
+} git_index_t;
+
+typedef struct git_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} git_buf_t;
+
+static inline uint32_t
+be32 (const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint16_t
+be16 (const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static int
+git_buf_add (git_buf_t *buf, const void *data, size_t len)
+{
+    unsigned char *tmp;
+    size_t size;
+
+    if (buf->len + len > buf->size) {
+        size = buf->size ? buf->size : 256;
+        while (size < buf->len + len)
+            size *= 2;
+        tmp = realloc (buf->data, size);
+        if (tmp == NULL) {
+            perror ("realloc of git buffer:\n");
+            return -1;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+    memcpy (buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+/*  Hash a git object: "<type> <len>\0" followed by data.
+ */
+static int
+git_hash_object (const char *type, const void *data, size_t len,
+                 unsigned char *oid)
+{
+    EVP_MD_CTX *ctx;
+    char hdr[64];
+    int hdr_len, ret = -1;
+
+    hdr_len = snprintf (hdr, sizeof (hdr), "%s %zu", type, len) + 1;
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL ||
+        EVP_DigestInit (ctx, EVP_sha1 ()) == 0 ||
+        EVP_DigestUpdate (ctx, hdr, hdr_len) == 0 ||
+        EVP_DigestUpdate (ctx, data, len) == 0 ||
+        EVP_DigestFinal (ctx, oid, NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto hash_out;
+    }
+    ret = 0;
+hash_out:
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    return ret;
+}
+
+/*  The same test 'git status' applies before trusting an entry, plus
+ *  nanoseconds where git only compares them when built with USE_NSEC.
+ *  Entries modified in the same second the index was written are racy
+ *  and always rehashed.
+ */
+static bool
+git_stat_clean (const git_index_t *index, const unsigned char *raw,
+                const struct stat *st, uint32_t mode)
+{
+    uint32_t mtime_s = be32 (raw + 8), mtime_ns = be32 (raw + 12);
+
+    if (be32 (raw) != (uint32_t)st->st_ctim.tv_sec ||
+        be32 (raw + 4) != (uint32_t)st->st_ctim.tv_nsec ||
+        mtime_s != (uint32_t)st->st_mtim.tv_sec ||
+        mtime_ns != (uint32_t)st->st_mtim.tv_nsec ||
+        be32 (raw + 20) != (uint32_t)st->st_ino ||
+        be32 (raw + 28) != (uint32_t)st->st_uid ||
+        be32 (raw + 32) != (uint32_t)st->st_gid ||
+        be32 (raw + 36) != (uint32_t)st->st_size)
+        return false;
+    if ((mode & S_IFMT) != (st->st_mode & S_IFMT))
+        return false;
+    if (S_ISREG (mode) && (mode & 0100) != (st->st_mode & 0100))
+        return false;
+    if ((uint32_t)index->st.st_mtim.tv_sec < mtime_s ||
+        ((uint32_t)index->st.st_mtim.tv_sec == mtime_s &&
+         (uint32_t)index->st.st_mtim.tv_nsec <= mtime_ns))
+        return false;
+    return true;
+}
+
+static int
+git_hash_file (git_index_t *index, git_entry_t *entry)
+{
+    unsigned char *hash = NULL;
+    unsigned int hash_len = 0;
+    char prefix[64];
+    struct stat st;
+    FILE *file = NULL;
+    int fd, prefix_len, ret = -1;
+
+    fd = openat (index->worktree_fd, entry->path,
+                 O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", entry->path,
+                 strerror (errno));
+        return -1;
+    }
+    file = fdopen (fd, "r");
+    if (file == NULL) {
+        perror ("fdopen:\n");
+        close (fd);
+        return -1;
+    }
+    if (fstat (fd, &st)) {
+        perror ("fstat:\n");
+        goto file_out;
+    }
+    prefix_len = snprintf (prefix, sizeof (prefix), "blob %jd",
+                           (intmax_t)st.st_size) + 1;
+    hash = digest_file (file, EVP_sha1 (), prefix, prefix_len, &hash_len);
+    if (hash == NULL)
+        goto file_out;
+    if (ftello (file) != st.st_size) {
+        fprintf (stderr, "%s changed while it was hashed\n", entry->path);
+        goto file_out;
+    }
+    memcpy (entry->oid, hash, GIT_OID_LEN);
+    entry->mode = (st.st_mode & 0100) ? 0100755 : 0100644;
+    ret = 0;
+file_out:
+    fclose (file);
+    free (hash);
+    return ret;
+}
+
+static int
+git_hash_link (git_index_t *index, git_entry_t *entry)
+{
+    char target[PATH_MAX];
+    ssize_t len;
+
+    len = readlinkat (index->worktree_fd, entry->path, target,
+                      sizeof (target));
+    if (len == -1 || (size_t)len == sizeof (target)) {
+        fprintf (stderr, "Failed to read link %s\n", entry->path);
+        return -1;
+    }
+    entry->mode = GIT_MODE_LINK;
+    return git_hash_object ("blob", target, len, entry->oid);
+}
+
+/*  Check one index entry against the working tree, hashing it again
+ *  if its stat data can't be trusted.
+ */
+static int
+git_check_entry (git_index_t *index, git_entry_t *entry)
+{
+    struct stat st;
+
+    if (entry->mode == GIT_MODE_GITLINK || entry->mode == GIT_MODE_TREE ||
+        (entry->xflags & GIT_XFLAG_SKIP_WORKTREE))
+        return 0;
+    /* git leaves intent-to-add entries out of the trees it writes */
+    if (entry->xflags & GIT_XFLAG_INTENT_TO_ADD) {
+        entry->omit = true;
+        return 0;
+    }
+    if (fstatat (index->worktree_fd, entry->path, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            entry->omit = true;
+            ++index->stats->missing;
+            return 0;
+        }
+        fprintf (stderr, "Failed to stat %s: %s\n", entry->path,
+                 strerror (errno));
+        return -1;
+    }
+    if (git_stat_clean (index, entry->raw, &st, entry->mode))
+        return 0;
+    ++index->stats->hashed;
+    if (S_ISREG (st.st_mode))
+        return git_hash_file (index, entry);
+    if (S_ISLNK (st.st_mode))
+        return git_hash_link (index, entry);
+    fprintf (stderr, "%s is no longer a file or symlink\n", entry->path);
+    return -1;
+}
+
+/*  Decode the offset varint used by index v4 path compression.
+ */
+static int
+git_varint (const unsigned char **p, const unsigned char *end, size_t *value)
+{
+    unsigned char c;
+
+    if (*p >= end)
+        return -1;
+    c = *(*p)++;
+    *value = c & 0x7f;
+    while (c & 0x80) {
+        if (*p >= end)
+            return -1;
+        c = *(*p)++;
+        *value = ((*value + 1) << 7) | (c & 0x7f);
+    }
+    return 0;
+}
+
+/*  A split index holds only the changes to a shared index named by its
+ *  "link" extension, its entries alone don't make the tree.
+ */
+static int
+git_check_extensions (const unsigned char *p, const unsigned char *end)
+{
+    uint32_t size;
+
+    while (end - p >= 8) {
+        if (memcmp (p, "link", 4) == 0) {
+            fprintf (stderr, "Split git indexes are not supported.\n");
+            return -1;
+        }
+        size = be32 (p + 4);
+        if ((size_t)(end - p) - 8 < size) {
+            fprintf (stderr, "Git index extension is corrupt.\n");
+            return -1;
+        }
+        p += 8 + size;
+    }
+    return 0;
+}
+
+static int
+git_parse_entries (git_index_t *index)
+{
+    const unsigned char *p = index->map + 12;
+    const unsigned char *end = index->map + index->size - GIT_OID_LEN;
+    const unsigned char *raw, *name, *nul;
+    git_entry_t *entry;
+    char *prev = NULL;
+    size_t prev_len = 0, strip, name_len, hdr_len, i;
+    uint16_t flags, xflags;
+
+    index->entries = calloc (index->count, sizeof (git_entry_t));
+    if (index->entries == NULL && index->count) {
+        perror ("calloc of git entries:\n");
+        return -1;
+    }
+    for (i = 0; i < index->count; ++i) {
+        raw = p;
+        if (end - p < GIT_ENTRY_LEN)
+            goto parse_corrupt;
+        flags = be16 (p + 60);
+        xflags = 0;
+        hdr_len = GIT_ENTRY_LEN;
+        if ((flags & GIT_FLAG_EXTENDED) && index->version >= 3) {
+            if (end - p < GIT_ENTRY_LEN + 2)
+                goto parse_corrupt;
+            xflags = be16 (p + 62);
+            hdr_len += 2;
+        }
+        if (flags & GIT_FLAG_STAGE) {
+            fprintf (stderr, "Git index has unmerged entries.\n");
+            return -1;
+        }
+        entry = &index->entries[i];
+        entry->raw = raw;
+        entry->xflags = xflags;
+        entry->mode = be32 (p + 24);
+        memcpy (entry->oid, p + 40, GIT_OID_LEN);
+        p += hdr_len;
+        if (index->version == 4) {
+            if (git_varint (&p, end, &strip) || strip > prev_len)
+                goto parse_corrupt;
+            nul = memchr (p, '\0', end - p);
+            if (nul == NULL)
+                goto parse_corrupt;
+            name_len = nul - p;
+            entry->path_len = prev_len - strip + name_len;
+            entry->path = malloc (entry->path_len + 1);
+            if (entry->path == NULL) {
+                perror ("malloc of git path:\n");
+                return -1;
+            }
+            memcpy (entry->path, prev, prev_len - strip);
+            memcpy (entry->path + prev_len - strip, p, name_len + 1);
+            p = nul + 1;
+        } else {
+            name = p;
+            nul = memchr (name, '\0', end - name);
+            if (nul == NULL)
+                goto parse_corrupt;
+            name_len = nul - name;
+            if ((flags & GIT_FLAG_NAME) != GIT_FLAG_NAME &&
+                name_len != (flags & GIT_FLAG_NAME))
+                goto parse_corrupt;
+            entry->path = strndup ((const char*)name, name_len);
+            if (entry->path == NULL) {
+                perror ("strndup:\n");
+                return -1;
+            }
+            entry->path_len = name_len;
+            /* entries are NUL padded to a multiple of 8 bytes */
+            p = raw + ((hdr_len + name_len + 8) & ~7);
+            if (p > end)
+                goto parse_corrupt;
+        }
+        prev = entry->path;
+        prev_len = entry->path_len;
+    }
+    if (git_check_extensions (p, end))
+        return -1;
+    for (i = 0; i < index->count; ++i) {
+        if (git_check_entry (index, &index->entries[i]))
+            return -1;
+    }
+    index->stats->entries = index->count;
+    return 0;
+parse_corrupt:
+    fprintf (stderr, "Git index is corrupt at entry %zu.\n", i);
+    return -1;
+}
+
+/*  Build the tree object for all entries below prefix, starting at *i.
+ *  Sets empty when every entry below prefix has been deleted, in which
+ *  case git has no tree for it either.
+ */
+static int
+git_build_tree (git_index_t *index, size_t *i, const char *prefix,
+                size_t prefix_len, unsigned char *oid, bool *empty)
+{
+    git_buf_t buf = { 0 };
+    git_entry_t *entry;
+    unsigned char sub_oid[GIT_OID_LEN];
+    const char *rest, *slash;
+    size_t rest_len, name_len;
+    char mode[16];
+    bool sub_empty;
+    int ret = -1;
+
+    while (*i < index->count) {
+        entry = &index->entries[*i];
+        if (entry->path_len <= prefix_len ||
+            memcmp (entry->path, prefix, prefix_len) != 0)
+            break;
+        if (entry->omit) {
+            ++*i;
+            continue;
+        }
+        rest = entry->path + prefix_len;
+        rest_len = entry->path_len - prefix_len;
+        slash = memchr (rest, '/', rest_len);
+        if (slash && !(entry->mode == GIT_MODE_TREE &&
+                       slash == rest + rest_len - 1)) {
+            name_len = slash - rest;
+            if (git_build_tree (index, i, entry->path,
+                                prefix_len + name_len + 1, sub_oid,
+                                &sub_empty))
+                goto tree_out;
+            if (sub_empty)
+                continue;
+            if (git_buf_add (&buf, "40000 ", 6) ||
+                git_buf_add (&buf, rest, name_len) ||
+                git_buf_add (&buf, "", 1) ||
+                git_buf_add (&buf, sub_oid, GIT_OID_LEN))
+                goto tree_out;
+            continue;
+        }
+        /* sparse index directory entries carry a trailing '/' */
+        name_len = slash ? rest_len - 1 : rest_len;
+        snprintf (mode, sizeof (mode), "%o ", entry->mode);
+        if (git_buf_add (&buf, mode, strlen (mode)) ||
+            git_buf_add (&buf, rest, name_len) ||
+            git_buf_add (&buf, "", 1) ||
+            git_buf_add (&buf, entry->oid, GIT_OID_LEN))
+            goto tree_out;
+        ++*i;
+    }
+    *empty = buf.len == 0;
+    ret = git_hash_object ("tree", buf.data, buf.len, oid);
+tree_out:
+    free (buf.data);
+    return ret;
+}
+
+/*  Find the index of the checkout, following a '.git' file to the real
+ *  git dir for worktrees and submodules.
+ */
+static int
+git_index_path (const char *worktree, char *path, size_t size)
+{
+    char gitdir[PATH_MAX], *nl;
+    struct stat st;
+    FILE *file;
+
+    snprintf (path, size, "%s/.git", worktree);
+    if (stat (path, &st)) {
+        fprintf (stderr, "Failed to stat %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    if (S_ISDIR (st.st_mode)) {
+        snprintf (path, size, "%s/.git/index", worktree);
+        return 0;
+    }
+    file = fopen (path, "r");
+    if (file == NULL) {
+        perror ("fopen of .git:\n");
+        return -1;
+    }
+    if (fgets (gitdir, sizeof (gitdir), file) == NULL ||
+        strncmp (gitdir, "gitdir: ", 8) != 0) {
+        fprintf (stderr, "Malformed %s\n", path);
+        fclose (file);
+        return -1;
+    }
+    fclose (file);
+    nl = strchr (gitdir, '\n');
+    if (nl)
+        *nl = '\0';
+    if (gitdir[8] == '/')
+        snprintf (path, size, "%s/index", gitdir + 8);
+    else
+        snprintf (path, size, "%s/%s/index", worktree, gitdir + 8);
+    return 0;
+}
+
+static int
+git_index_open (git_index_t *index, const char *worktree)
+{
+    unsigned char sum[GIT_OID_LEN];
+    char path[PATH_MAX];
+    int fd;
+
+    if (git_index_path (worktree, path, sizeof (path)))
+        return -1;
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    if (fstat (fd, &index->st)) {
+        perror ("fstat:\n");
+        close (fd);
+        return -1;
+    }
+    index->size = index->st.st_size;
+    if (index->size < 12 + GIT_OID_LEN) {
+        fprintf (stderr, "Git index %s is truncated.\n", path);
+        close (fd);
+        return -1;
+    }
+    index->map = mmap (NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        perror ("mmap of git index:\n");
+        return -1;
+    }
+    if (memcmp (index->map, "DIRC", 4) != 0) {
+        fprintf (stderr, "%s is not a git index.\n", path);
+        return -1;
+    }
+    index->version = be32 (index->map + 4);
+    index->count = be32 (index->map + 8);
+    if (index->version < 2 || index->version > 4) {
+        fprintf (stderr, "Unsupported git index version %u.\n",
+                 index->version);
+        return -1;
+    }
+    if (EVP_Digest (index->map, index->size - GIT_OID_LEN, sum, NULL,
+                    EVP_sha1 (), NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        return -1;
+    }
+    if (memcmp (sum, index->map + index->size - GIT_OID_LEN,
+                GIT_OID_LEN) != 0) {
+        fprintf (stderr, "Git index checksum mismatch.\n");
+        return -1;
+    }
+    return 0;
+}
+
+unsigned char*
+sha1_git_tree (const char *worktree, git_stats_t *stats,
+               unsigned int *hash_len)
+{
+    git_index_t index = { .worktree_fd = -1, .stats = stats };
+    unsigned char *hash = NULL;
+    size_t i = 0;
+    bool empty;
+
+    memset (stats, 0, sizeof (git_stats_t));
+    index.worktree_fd = open (worktree, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (index.worktree_fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", worktree,
+                 strerror (errno));
+        goto git_out;
+    }
+    if (git_index_open (&index, worktree) || git_parse_entries (&index))
+        goto git_out;
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        goto git_out;
+    }
+    if (git_build_tree (&index, &i, "", 0, hash, &empty)) {
+        free (hash);
+        hash = NULL;
+        goto git_out;
+    }
+    *hash_len = GIT_OID_LEN;
+git_out:
+    for (i = 0; index.entries && i < index.count; ++i)
+        free (index.entries[i].path);
+    free (index.entries);
+    if (index.map)
+        munmap (index.map, index.size);
+    if (index.worktree_fd != -1)
+        close (index.worktree_fd);
+    return hash;
+}
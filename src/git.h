@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef GIT_H
+#define GIT_H
+
+#include <stddef.h>
+
+typedef struct git_stats {
+    size_t entries;
+    size_t hashed;    /* stat-dirty entries hashed from the working tree */
+    size_t missing;   /* entries deleted from the working tree */
+} git_stats_t;
+
+/*  Compute the git tree id of the working tree of a checkout using the
+ *  stat cache in its index: entries whose stat data still matches the
+ *  index reuse the recorded blob id, only the others are read and hashed.
+ *  With a clean checkout the result is what 'git write-tree' reports.
+ *  Untracked files are not part of the measurement and clean / smudge
+ *  filters are not applied. Only SHA1 repositories are supported.
+ */
+unsigned char*
+sha1_git_tree (const char *worktree, git_stats_t *stats,
+               unsigned int *hash_len);
+
+#endif /* GIT_H */
@@ -0,0 +1,496 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "golden.h"
+#include "workers.h"
+
+/*  Keys per bucket. With every slot filled the last buckets placed find
+ *  few free slots, and a bucket of k keys then needs about (n / free)^k
+ *  pilots, so buckets are kept small: pilots cost 4 / LAMBDA bytes a key.
+ */
+#define LAMBDA 3
+#define PILOT_MAX (1U << 24)
+#define PARTITION_KEYS 4096     /* target partition size */
+#define SEED_ATTEMPTS 4
+#define SEED2 0x9e3779b97f4a7c15ULL
+
+static uint64_t
+mix64 (uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*  Map x onto [0, n) without a division.
+ */
+static uint64_t
+fastrange (uint64_t x, uint64_t n)
+{
+    return (unsigned __int128)x * n >> 64;
+}
+
+/*  Digests are already uniform, but every byte goes into the hash so two
+ *  digests that share most of their bytes still part ways.
+ */
+static uint64_t
+digest_hash (const unsigned char *digest, size_t len, uint64_t seed)
+{
+    uint64_t h = seed, word;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy (&word, digest + i, 8);
+        h = mix64 (h ^ word);
+    }
+    if (i < len) {
+        word = 0;
+        memcpy (&word, digest + i, len - i);
+        h = mix64 (h ^ word);
+    }
+    return h;
+}
+
+static uint64_t
+pilot_slot (uint64_t h2, uint32_t pilot, uint64_t n)
+{
+    return fastrange (mix64 (h2 ^ (pilot * SEED2)), n);
+}
+
+static uint64_t
+partition_of (const unsigned char *digest, uint32_t bits)
+{
+    return bits ? (uint32_t)(digest[0] << 8 | digest[1]) >> (16 - bits) : 0;
+}
+
+static size_t
+pad8 (size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+/*  Lay the file out, checking each term against limit so a header read
+ *  from disk can't wrap the offsets around.
+ */
+static int
+golden_layout (uint32_t bits, uint64_t bucket_count, uint64_t count,
+               size_t digest_len, size_t limit, size_t *pilots_at,
+               size_t *digests_at, size_t *size)
+{
+    size_t tables = ((size_t)1 << bits) + 1, pilots;
+
+    *pilots_at = sizeof (golden_header_t) + tables * 2 * sizeof (uint64_t);
+    if (*pilots_at > limit ||
+        bucket_count > (limit - *pilots_at) / sizeof (uint32_t))
+        return -1;
+    pilots = pad8 (bucket_count * sizeof (uint32_t));
+    if (pilots > limit - *pilots_at)
+        return -1;
+    *digests_at = *pilots_at + pilots;
+    if (count > (limit - *digests_at) / digest_len)
+        return -1;
+    *size = *digests_at + count * digest_len;
+    return 0;
+}
+
+golden_t*
+golden_open (const char *path)
+{
+    const golden_header_t *header;
+    size_t pilots_at, digests_at, size, partitions, i;
+    golden_t *golden;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return NULL;
+    }
+    if (fstat (fd, &sb) == -1) {
+        perror ("fstat:\n");
+        close (fd);
+        return NULL;
+    }
+    if ((size_t)sb.st_size < sizeof (golden_header_t)) {
+        fprintf (stderr, "%s isn't a golden digest database.\n", path);
+        close (fd);
+        return NULL;
+    }
+    map = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        perror ("mmap:\n");
+        return NULL;
+    }
+    golden = calloc (1, sizeof (golden_t));
+    if (golden == NULL) {
+        perror ("calloc of golden_t:\n");
+        munmap (map, sb.st_size);
+        return NULL;
+    }
+    golden->map = map;
+    golden->size = sb.st_size;
+    header = golden->header = map;
+    if (memcmp (header->magic, GOLDEN_MAGIC, sizeof (GOLDEN_MAGIC)) != 0 ||
+        header->version != GOLDEN_VERSION ||
+        header->byte_order != GOLDEN_BYTE_ORDER ||
+        header->digest_len < GOLDEN_DIGEST_MIN ||
+        header->digest_len > GOLDEN_DIGEST_MAX ||
+        header->partition_bits > GOLDEN_PARTITION_BITS_MAX ||
+        golden_layout (header->partition_bits, header->bucket_count,
+                       header->count, header->digest_len, golden->size,
+                       &pilots_at, &digests_at, &size) ||
+        size != golden->size)
+        goto open_invalid;
+    partitions = (size_t)1 << header->partition_bits;
+    golden->key_offsets = (const uint64_t*)(golden->map +
+                                            sizeof (golden_header_t));
+    golden->bucket_offsets = golden->key_offsets + partitions + 1;
+    golden->pilots = (const uint32_t*)(golden->map + pilots_at);
+    golden->digests = golden->map + digests_at;
+    /* lookups index with these unchecked */
+    if (golden->key_offsets[0] != 0 || golden->bucket_offsets[0] != 0 ||
+        golden->key_offsets[partitions] != header->count ||
+        golden->bucket_offsets[partitions] != header->bucket_count)
+        goto open_invalid;
+    for (i = 0; i < partitions; ++i) {
+        if (golden->key_offsets[i] > golden->key_offsets[i + 1] ||
+            golden->bucket_offsets[i] > golden->bucket_offsets[i + 1] ||
+            (golden->key_offsets[i] != golden->key_offsets[i + 1] &&
+             golden->bucket_offsets[i] == golden->bucket_offsets[i + 1]))
+            goto open_invalid;
+    }
+    madvise ((void*)golden->map, golden->size, MADV_RANDOM);
+    return golden;
+open_invalid:
+    fprintf (stderr, "%s isn't a golden digest database.\n", path);
+    golden_close (golden);
+    return NULL;
+}
+
+void
+golden_close (golden_t *golden)
+{
+    if (golden == NULL)
+        return;
+    munmap ((void*)golden->map, golden->size);
+    free (golden);
+}
+
+size_t
+golden_digest_len (const golden_t *golden)
+{
+    return golden->header->digest_len;
+}
+
+bool
+golden_contains (const golden_t *golden, const unsigned char *digest)
+{
+    const golden_header_t *header = golden->header;
+    uint64_t p, n, m, slot;
+    uint32_t pilot;
+
+    p = partition_of (digest, header->partition_bits);
+    n = golden->key_offsets[p + 1] - golden->key_offsets[p];
+    if (n == 0)
+        return false;
+    m = golden->bucket_offsets[p + 1] - golden->bucket_offsets[p];
+    pilot = golden->pilots[golden->bucket_offsets[p] +
+                           fastrange (digest_hash (digest, header->digest_len,
+                                                   header->seed), m)];
+    slot = golden->key_offsets[p] +
+           pilot_slot (digest_hash (digest, header->digest_len,
+                                    header->seed ^ SEED2), pilot, n);
+    return memcmp (golden->digests + slot * header->digest_len, digest,
+                   header->digest_len) == 0;
+}
+
+typedef struct build {
+    const unsigned char *digests;
+    size_t digest_len;
+    uint64_t seed;
+    uint64_t *key_offsets;
+    uint64_t *bucket_offsets;
+    uint32_t *pilots;
+    unsigned char *slots;
+    size_t partitions;
+    atomic_size_t next;
+    atomic_bool failed;
+} build_t;
+
+/*  Place the keys of partition p: buckets, largest first, each take the
+ *  first pilot that sends all their keys to free slots.
+ */
+static int
+build_partition (build_t *build, size_t p)
+{
+    const unsigned char *keys;
+    uint64_t n, m, *h2 = NULL, *taken = NULL, slot[64];
+    size_t *count = NULL, *start = NULL, *order = NULL, *by_size = NULL;
+    size_t len = build->digest_len, i, j, k, b, size, max_size = 0;
+    uint32_t *bucket = NULL, pilot;
+    int ret = -1;
+
+    n = build->key_offsets[p + 1] - build->key_offsets[p];
+    m = build->bucket_offsets[p + 1] - build->bucket_offsets[p];
+    if (n == 0)
+        return 0;
+    keys = build->digests + build->key_offsets[p] * len;
+    h2 = malloc (n * sizeof (uint64_t));
+    bucket = malloc (n * sizeof (uint32_t));
+    count = calloc (m + 1, sizeof (size_t));
+    start = calloc (m + 1, sizeof (size_t));
+    order = malloc (n * sizeof (size_t));
+    by_size = malloc (m * sizeof (size_t));
+    taken = calloc ((n + 63) / 64, sizeof (uint64_t));
+    if (h2 == NULL || bucket == NULL || count == NULL || start == NULL ||
+        order == NULL || by_size == NULL || taken == NULL) {
+        perror ("allocation for perfect hash:\n");
+        goto partition_out;
+    }
+    for (i = 0; i < n; ++i) {
+        bucket[i] = fastrange (digest_hash (keys + i * len, len, build->seed),
+                               m);
+        h2[i] = digest_hash (keys + i * len, len, build->seed ^ SEED2);
+        ++count[bucket[i]];
+    }
+    /* keys grouped by bucket */
+    for (b = 0; b < m; ++b) {
+        start[b + 1] = start[b] + count[b];
+        if (count[b] > max_size)
+            max_size = count[b];
+    }
+    if (max_size > sizeof (slot) / sizeof (slot[0]))
+        goto partition_out;
+    memset (count, 0, (m + 1) * sizeof (size_t));
+    for (i = 0; i < n; ++i)
+        order[start[bucket[i]] + count[bucket[i]]++] = i;
+    /* buckets by size, largest first */
+    for (size = max_size, k = 0; size > 0; --size) {
+        for (b = 0; b < m; ++b) {
+            if (count[b] == size)
+                by_size[k++] = b;
+        }
+    }
+    for (i = 0; i < k; ++i) {
+        b = by_size[i];
+        for (pilot = 0; pilot < PILOT_MAX; ++pilot) {
+            for (j = 0; j < count[b]; ++j) {
+                slot[j] = pilot_slot (h2[order[start[b] + j]], pilot, n);
+                if (taken[slot[j] / 64] & (1ULL << slot[j] % 64))
+                    break;
+                /* two keys of one bucket can't share a slot either */
+                for (size = 0; size < j && slot[size] != slot[j]; ++size)
+                    ;
+                if (size < j)
+                    break;
+            }
+            if (j == count[b])
+                break;
+        }
+        if (pilot == PILOT_MAX)
+            goto partition_out;
+        build->pilots[build->bucket_offsets[p] + b] = pilot;
+        for (j = 0; j < count[b]; ++j) {
+            taken[slot[j] / 64] |= 1ULL << slot[j] % 64;
+            memcpy (build->slots + (build->key_offsets[p] + slot[j]) * len,
+                    keys + order[start[b] + j] * len, len);
+        }
+    }
+    ret = 0;
+partition_out:
+    free (h2);
+    free (bucket);
+    free (count);
+    free (start);
+    free (order);
+    free (by_size);
+    free (taken);
+    return ret;
+}
+
+static void
+build_worker (void *arg)
+{
+    build_t *build = arg;
+    size_t p;
+
+    while (!atomic_load (&build->failed) &&
+           (p = atomic_fetch_add (&build->next, 1)) < build->partitions) {
+        if (build_partition (build, p))
+            atomic_store (&build->failed, true);
+    }
+}
+
+static int
+build_run (build_t *build, unsigned int threads)
+{
+    atomic_init (&build->next, 0);
+    atomic_init (&build->failed, false);
+    if (workers_run (build_worker, build, threads))
+        return -1;
+    return atomic_load (&build->failed) ? -1 : 0;
+}
+
+static uint64_t
+random_seed (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return mix64 (((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+                  (uint64_t)getpid () << 32);
+}
+
+int
+golden_write (const char *path, const unsigned char *digests, size_t count,
+              size_t digest_len, unsigned int threads,
+              golden_build_stats_t *stats)
+{
+    build_t build = { .digests = digests, .digest_len = digest_len };
+    golden_header_t *header;
+    unsigned char *map = MAP_FAILED;
+    size_t pilots_at, digests_at, size = 0, p, i;
+    uint32_t bits = 0;
+    char *tmp = NULL;
+    int fd = -1, ret = -1;
+
+    if (digest_len < GOLDEN_DIGEST_MIN || digest_len > GOLDEN_DIGEST_MAX) {
+        fprintf (stderr, "Unsupported digest length %zu\n", digest_len);
+        return -1;
+    }
+    while (bits < GOLDEN_PARTITION_BITS_MAX &&
+           count >> (bits + 1) >= PARTITION_KEYS)
+        ++bits;
+    build.partitions = (size_t)1 << bits;
+
+    /* the partition tables only depend on the keys */
+    build.key_offsets = calloc (build.partitions + 1, sizeof (uint64_t));
+    build.bucket_offsets = calloc (build.partitions + 1, sizeof (uint64_t));
+    if (build.key_offsets == NULL || build.bucket_offsets == NULL) {
+        perror ("calloc of partition tables:\n");
+        goto write_out;
+    }
+    for (i = 0; i < count; ++i)
+        ++build.key_offsets[partition_of (digests + i * digest_len, bits) + 1];
+    for (p = 0; p < build.partitions; ++p) {
+        build.bucket_offsets[p + 1] = build.bucket_offsets[p] +
+            (build.key_offsets[p + 1] + LAMBDA - 1) / LAMBDA;
+        build.key_offsets[p + 1] += build.key_offsets[p];
+    }
+
+    if (asprintf (&tmp, "%s.XXXXXX", path) == -1) {
+        perror ("asprintf:\n");
+        tmp = NULL;
+        goto write_out;
+    }
+    fd = mkstemp (tmp);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to create %s: %s\n", tmp, strerror (errno));
+        goto write_out;
+    }
+    if (fchmod (fd, 0644) == -1) {
+        fprintf (stderr, "Failed to chmod %s: %s\n", tmp, strerror (errno));
+        goto write_out;
+    }
+    if (golden_layout (bits, build.bucket_offsets[build.partitions], count,
+                       digest_len, SIZE_MAX, &pilots_at, &digests_at, &size)) {
+        fprintf (stderr, "Too many digests for %s\n", path);
+        goto write_out;
+    }
+    if (ftruncate (fd, size) == -1) {
+        fprintf (stderr, "Failed to size %s: %s\n", tmp, strerror (errno));
+        goto write_out;
+    }
+    /* built in place, so the file is the image lookups will map */
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap:\n");
+        goto write_out;
+    }
+    header = (golden_header_t*)map;
+    memcpy ((uint64_t*)(map + sizeof (golden_header_t)), build.key_offsets,
+            (build.partitions + 1) * sizeof (uint64_t));
+    memcpy ((uint64_t*)(map + sizeof (golden_header_t)) + build.partitions + 1,
+            build.bucket_offsets, (build.partitions + 1) * sizeof (uint64_t));
+    build.pilots = (uint32_t*)(map + pilots_at);
+    build.slots = map + digests_at;
+    for (i = 1; i <= SEED_ATTEMPTS; ++i) {
+        build.seed = random_seed ();
+        if (build_run (&build, threads ? threads : 1) == 0)
+            break;
+    }
+    if (i > SEED_ATTEMPTS) {
+        fprintf (stderr, "Failed to build a perfect hash in %d attempts.\n",
+                 SEED_ATTEMPTS);
+        goto write_out;
+    }
+    memcpy (header->magic, GOLDEN_MAGIC, sizeof (GOLDEN_MAGIC));
+    header->version = GOLDEN_VERSION;
+    header->byte_order = GOLDEN_BYTE_ORDER;
+    header->digest_len = digest_len;
+    header->partition_bits = bits;
+    header->count = count;
+    header->bucket_count = build.bucket_offsets[build.partitions];
+    header->seed = build.seed;
+    if (msync (map, size, MS_SYNC) == -1 || fsync (fd) == -1 ||
+        rename (tmp, path) == -1) {
+        fprintf (stderr, "Failed to write %s: %s\n", path, strerror (errno));
+        goto write_out;
+    }
+    if (stats) {
+        stats->partition_bits = bits;
+        stats->bucket_count = header->bucket_count;
+        stats->seed = build.seed;
+        stats->attempts = i;
+    }
+    free (tmp);
+    tmp = NULL;
+    ret = 0;
+write_out:
+    if (map != MAP_FAILED)
+        munmap (map, size);
+    if (fd != -1)
+        close (fd);
+    if (tmp) {
+        unlink (tmp);
+        free (tmp);
+    }
+    free (build.key_offsets);
+    free (build.bucket_offsets);
+    return ret;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef GOLDEN_H
+#define GOLDEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GOLDEN_MAGIC "PCRGOLD"
+#define GOLDEN_VERSION 1
+#define GOLDEN_DIGEST_MIN 20
+#define GOLDEN_DIGEST_MAX 64
+#define GOLDEN_PARTITION_BITS_MAX 16
+
+/*  A database of known-good digests laid out to be used straight from
+ *  mmap. Digests are split into partitions by their leading bits, and
+ *  each partition has a minimal perfect hash (hash and displace): a
+ *  digest selects a bucket, the bucket's pilot displaces it to a slot,
+ *  and the slot holds the only digest that can be there. Looking one up
+ *  reads a pilot and compares a single slot.
+ *  The file is, in host byte order:
+ *    golden_header_t
+ *    uint64_t key_offsets[partitions + 1]     first slot of partition
+ *    uint64_t bucket_offsets[partitions + 1]  first pilot of partition
+ *    uint32_t pilots[bucket_count], padded to 8 bytes
+ *    digests[count], digest_len bytes each, in slot order
+ */
+typedef struct golden_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        /* GOLDEN_BYTE_ORDER as written */
+    uint32_t digest_len;
+    uint32_t partition_bits;
+    uint64_t count;
+    uint64_t bucket_count;
+    uint64_t seed;
+    uint64_t reserved[2];
+} golden_header_t;
+
+#define GOLDEN_BYTE_ORDER 0x01020304
+
+typedef struct golden {
+    const unsigned char *map;
+    size_t size;
+    const golden_header_t *header;
+    const uint64_t *key_offsets;
+    const uint64_t *bucket_offsets;
+    const uint32_t *pilots;
+    const unsigned char *digests;
+} golden_t;
+
+golden_t*
+golden_open (const char *path);
+void
+golden_close (golden_t *golden);
+size_t
+golden_digest_len (const golden_t *golden);
+bool
+golden_contains (const golden_t *golden, const unsigned char *digest);
+
+typedef struct golden_build_stats {
+    uint32_t partition_bits;
+    uint64_t bucket_count;
+    uint64_t seed;
+    unsigned int attempts;      /* seeds tried */
+} golden_build_stats_t;
+
+/*  Build the database of count distinct digests, sorted byte-wise, and
+ *  write it to path. Partitions are built on threads threads.
+ */
+int
+golden_write (const char *path, const unsigned char *digests, size_t count,
+              size_t digest_len, unsigned int threads,
+              golden_build_stats_t *stats);
+
+#endif /* GOLDEN_H */
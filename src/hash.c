@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "hash.h"
+#include "prefetch.h"
+#include "profile.h"
+
+#define BUF_SIZE 1024
+#define READ_SIZE (64 << 10)
+/* with TBB each update is split over the cores, so give it more to split */
+#ifdef HAVE_BLAKE3_TBB
+#define BLAKE3_BUF_SIZE (8 << 20)
+#else
+#define BLAKE3_BUF_SIZE (1 << 16)
+#endif
+
+unsigned char*
+sha1_file (FILE *file, unsigned int *hash_len)
+{
+    return digest_file (file, EVP_sha1 (), NULL, 0, hash_len);
+}
+
+unsigned char*
+sha1_buf (const void *data, size_t len, unsigned int *hash_len)
+{
+    unsigned char *hash;
+
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        return NULL;
+    }
+    if (EVP_Digest (data, len, hash, hash_len, EVP_sha1 (), NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        free (hash);
+        return NULL;
+    }
+    return hash;
+}
+
+/*  Feed the rest of the file on fd through concurrent reads.
+ */
+static int
+digest_prefetch (EVP_MD_CTX *ctx, int fd, off_t pos)
+{
+    const unsigned char *data;
+    prefetch_t *pf;
+    ssize_t len;
+    int ret = -1;
+
+    pf = prefetch_new (fd, pos);
+    if (pf == NULL)
+        return -1;
+    while ((len = prefetch_next (pf, &data)) > 0) {
+        if (EVP_DigestUpdate (ctx, data, len) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto prefetch_out;
+        }
+    }
+    ret = len == 0 ? 0 : -1;
+prefetch_out:
+    prefetch_free (pf);
+    return ret;
+}
+
+unsigned char*
+digest_file (FILE *file, const EVP_MD *md, const void *prefix,
+             size_t prefix_len, unsigned int *hash_len)
+{
+    EVP_MD_CTX *ctx = NULL;
+    unsigned char *buf = NULL, *hash = NULL;
+    size_t num_read = 0;
+    off_t pos;
+
+    profile_note_fd (fileno (file));
+    buf = malloc (BUF_SIZE);
+    if (buf == NULL) {
+        perror ("malloc:\n");
+        goto digest_fail;
+    }
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL) {
+        ERR_print_errors_fp (stderr);
+        goto digest_fail;
+    }
+    if (EVP_DigestInit (ctx, md) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto digest_fail;
+    }
+    if (prefix && EVP_DigestUpdate (ctx, prefix, prefix_len) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto digest_fail;
+    }
+    /* only when nothing is buffered in the stream */
+    if (prefetch_wanted (fileno (file)) &&
+        (pos = lseek (fileno (file), 0, SEEK_CUR)) != -1 &&
+        ftello (file) == pos) {
+        if (digest_prefetch (ctx, fileno (file), pos))
+            goto digest_fail;
+        goto digest_final;
+    }
+    do {
+        num_read = fread (buf, 1, BUF_SIZE, file);
+        if (num_read <= 0)
+            break;
+        if (EVP_DigestUpdate (ctx, buf, num_read) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto digest_fail;
+        }
+    } while (!feof (file) && !ferror (file));
+    if (ferror (file)) {
+        perror ("fread:\n");
+        goto digest_fail;
+    }
+digest_final:
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        goto digest_fail;
+    }
+    if (EVP_DigestFinal (ctx, hash, hash_len) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto digest_fail;
+    }
+    EVP_MD_CTX_destroy (ctx);
+    if (buf)
+        free (buf);
+    return hash;
+digest_fail:
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    if (buf)
+        free (buf);
+    if (hash)
+        free (hash);
+    return NULL;
+}
+
+static int
+digests_update (EVP_MD_CTX **ctxs, size_t count, const void *data,
+                size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (EVP_DigestUpdate (ctxs[i], data, len) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*  Read fd to its end from offset, with pread until the file turns out
+ *  not to be seekable.
+ */
+static int
+digests_read (EVP_MD_CTX **ctxs, size_t count, int fd, off_t offset)
+{
+    unsigned char *buf;
+    bool seekable = true;
+    ssize_t got;
+    int ret = -1;
+
+    buf = malloc (READ_SIZE);
+    if (buf == NULL)
+        return -1;
+    for (;;) {
+        if (seekable)
+            got = pread (fd, buf, READ_SIZE, offset);
+        else
+            got = read (fd, buf, READ_SIZE);
+        if (got == -1 && errno == ESPIPE && seekable) {
+            seekable = false;
+            continue;
+        }
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+            goto read_out;
+        if (got == 0)
+            break;
+        offset += got;
+        if (digests_update (ctxs, count, buf, got)) {
+            ERR_print_errors_fp (stderr);
+            errno = EIO;
+            goto read_out;
+        }
+    }
+    ret = 0;
+read_out:
+    free (buf);
+    return ret;
+}
+
+int
+digest_fd (int fd, off_t offset, const EVP_MD *const *mds, size_t count,
+           unsigned char digests[][EVP_MAX_MD_SIZE], unsigned int *lens)
+{
+    EVP_MD_CTX *ctxs[DIGEST_FD_MAX] = { 0 };
+    const unsigned char *data;
+    prefetch_t *pf = NULL;
+    ssize_t len;
+    size_t i;
+    int ret = -1, err = EIO;
+
+    if (count > DIGEST_FD_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    profile_note_fd (fd);
+    for (i = 0; i < count; ++i) {
+        ctxs[i] = EVP_MD_CTX_create ();
+        if (ctxs[i] == NULL || EVP_DigestInit (ctxs[i], mds[i]) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto fd_out;
+        }
+    }
+    if (prefetch_wanted (fd)) {
+        pf = prefetch_new (fd, offset);
+        if (pf == NULL)
+            goto fd_out;
+        while ((len = prefetch_next (pf, &data)) > 0) {
+            if (digests_update (ctxs, count, data, len)) {
+                ERR_print_errors_fp (stderr);
+                goto fd_out;
+            }
+        }
+        if (len == -1)
+            goto fd_out;
+    } else if (digests_read (ctxs, count, fd, offset)) {
+        err = errno;
+        goto fd_out;
+    }
+    for (i = 0; i < count; ++i) {
+        if (EVP_DigestFinal (ctxs[i], digests[i], &lens[i]) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto fd_out;
+        }
+    }
+    ret = 0;
+fd_out:
+    prefetch_free (pf);
+    for (i = 0; i < count; ++i) {
+        if (ctxs[i])
+            EVP_MD_CTX_destroy (ctxs[i]);
+    }
+    if (ret)
+        errno = err;
+    return ret;
+}
+
+static int
+digest_u32 (EVP_MD_CTX *ctx, uint32_t value)
+{
+    unsigned char be[4] = {
+        value >> 24, value >> 16, value >> 8, value
+    };
+
+    return EVP_DigestUpdate (ctx, be, sizeof (be));
+}
+
+unsigned char*
+sha1_strings (const char *tag, char *const *strings, size_t count,
+              unsigned int *hash_len)
+{
+    EVP_MD_CTX *ctx = NULL;
+    unsigned char *hash = NULL;
+    size_t i, len;
+
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        return NULL;
+    }
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL)
+        goto strings_fail;
+    if (EVP_DigestInit (ctx, EVP_sha1 ()) == 0 ||
+        EVP_DigestUpdate (ctx, tag, strlen (tag) + 1) == 0 ||
+        digest_u32 (ctx, count) == 0)
+        goto strings_fail;
+    for (i = 0; i < count; ++i) {
+        len = strlen (strings[i]);
+        if (digest_u32 (ctx, len) == 0 ||
+            EVP_DigestUpdate (ctx, strings[i], len) == 0)
+            goto strings_fail;
+    }
+    if (EVP_DigestFinal (ctx, hash, hash_len) == 0)
+        goto strings_fail;
+    EVP_MD_CTX_destroy (ctx);
+    return hash;
+strings_fail:
+    ERR_print_errors_fp (stderr);
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    free (hash);
+    return NULL;
+}
+
+#ifdef HAVE_BLAKE3
+static void
+blake3_update (blake3_hasher *hasher, const void *data, size_t len)
+{
+#ifdef HAVE_BLAKE3_TBB
+    blake3_hasher_update_tbb (hasher, data, len);
+#else
+    blake3_hasher_update (hasher, data, len);
+#endif
+}
+
+unsigned char*
+blake3_file (FILE *file, unsigned int *hash_len)
+{
+    blake3_hasher hasher;
+    unsigned char *buf = NULL, *hash = NULL;
+    size_t num_read;
+
+    profile_note_fd (fileno (file));
+    buf = malloc (BLAKE3_BUF_SIZE);
+    if (buf == NULL) {
+        perror ("malloc:\n");
+        return NULL;
+    }
+    blake3_hasher_init (&hasher);
+    while ((num_read = fread (buf, 1, BLAKE3_BUF_SIZE, file)) > 0)
+        blake3_update (&hasher, buf, num_read);
+    if (ferror (file)) {
+        perror ("fread:\n");
+        free (buf);
+        return NULL;
+    }
+    free (buf);
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        return NULL;
+    }
+    blake3_hasher_finalize (&hasher, hash, BLAKE3_FILE_LEN);
+    *hash_len = BLAKE3_FILE_LEN;
+    return hash;
+}
+#endif
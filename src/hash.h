@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+unsigned char*
+sha1_file (FILE *file, unsigned int *hash_len);
+unsigned char*
+sha1_buf (const void *data, size_t len, unsigned int *hash_len);
+/*  Hash a list of strings in a canonical, unambiguous encoding: tag and
+ *  its NUL, then the count and each string as a big-endian 32 bit length
+ *  followed by its bytes.
+ */
+unsigned char*
+sha1_strings (const char *tag, char *const *strings, size_t count,
+              unsigned int *hash_len);
+/*  Hash prefix followed by the contents of file with md. The prefix may
+ *  be NULL.
+ */
+unsigned char*
+digest_file (FILE *file, const EVP_MD *md, const void *prefix,
+             size_t prefix_len, unsigned int *hash_len);
+
+#define DIGEST_FD_MAX 4
+/*  Hash what fd holds from offset to its end with each of the count
+ *  (up to DIGEST_FD_MAX) digests in mds, in one pass. Seekable files
+ *  are read with pread, so the file offset doesn't move and a file cut
+ *  short while it's read only ends the data early, anything else is
+ *  read to its end. Files are read until EOF whatever their size says.
+ *  Returns -1 with errno set on failure.
+ */
+int
+digest_fd (int fd, off_t offset, const EVP_MD *const *mds, size_t count,
+           unsigned char digests[][EVP_MAX_MD_SIZE], unsigned int *lens);
+
+#ifdef HAVE_BLAKE3
+#define BLAKE3_FILE_LEN 32
+/*  BLAKE3 of the contents of file, read through a buffer. When libblake3
+ *  was built with TBB (HAVE_BLAKE3_TBB) the buffer is large and each
+ *  update spreads over every core.
+ */
+unsigned char*
+blake3_file (FILE *file, unsigned int *hash_len);
+#endif
+
+#endif /* HASH_H */
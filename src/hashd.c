@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "hashd.h"
+#include "util.h"
+
+/*  The digests are extended as they come, only a service run by root
+ *  or by ourselves is trusted to provide them.
+ */
+static int
+hashd_trusted (int sock, const char *socket_path)
+{
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+
+    if (getsockopt (sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        perror ("getsockopt SO_PEERCRED:\n");
+        return -1;
+    }
+    if (cred.uid != 0 && cred.uid != geteuid ()) {
+        fprintf (stderr, "Hash service %s is run by untrusted uid %u\n",
+                 socket_path, (unsigned int)cred.uid);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+hashd_send (int sock, int fd)
+{
+    union {
+        char buf[CMSG_SPACE (sizeof (int))];
+        struct cmsghdr align;
+    } control = { 0 };
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof (control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    return sendmsg (sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int
+hashd_digest (const char *socket_path, int fd, unsigned char *sha1,
+              unsigned char *sha256)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char line[HASHD_LINE_MAX];
+    size_t len = 0;
+    ssize_t ret;
+    int sock;
+
+    if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+        fprintf (stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy (addr.sun_path, socket_path);
+    sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror ("socket:\n");
+        return -1;
+    }
+    if (connect (sock, (struct sockaddr*)&addr, sizeof (addr)) == -1) {
+        fprintf (stderr, "Failed to reach hash service %s: %s\n",
+                 socket_path, strerror (errno));
+        goto digest_fail;
+    }
+    if (hashd_trusted (sock, socket_path))
+        goto digest_fail;
+    if (hashd_send (sock, fd)) {
+        fprintf (stderr, "Failed to reach hash service %s: %s\n",
+                 socket_path, strerror (errno));
+        goto digest_fail;
+    }
+    while (len < sizeof (line) - 1) {
+        ret = read (sock, line + len, sizeof (line) - 1 - len);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len += ret;
+        if (memchr (line, '\n', len))
+            break;
+    }
+    line[len] = '\0';
+    if (len == 0 || line[len - 1] != '\n') {
+        fprintf (stderr, "Truncated reply from hash service %s\n",
+                 socket_path);
+        goto digest_fail;
+    }
+    if (strncmp (line, "error ", 6) == 0) {
+        fprintf (stderr, "Hash service: %s", line + 6);
+        goto digest_fail;
+    }
+    if (len != HASHD_SHA1_LEN * 2 + 1 + HASHD_SHA256_LEN * 2 + 1 ||
+        hex_parse (line, sha1, HASHD_SHA1_LEN) ||
+        hex_parse (line + HASHD_SHA1_LEN * 2 + 1, sha256, HASHD_SHA256_LEN)) {
+        fprintf (stderr, "Malformed reply from hash service %s\n",
+                 socket_path);
+        goto digest_fail;
+    }
+    close (sock);
+    return 0;
+digest_fail:
+    close (sock);
+    return -1;
+}
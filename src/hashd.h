@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef HASHD_H
+#define HASHD_H
+
+#define HASHD_SHA1_LEN 20
+#define HASHD_SHA256_LEN 32
+#define HASHD_LINE_MAX 160
+
+/*  Protocol of the pcr-hashd service: a client connects to its Unix
+ *  socket and, per request, sends one byte carrying an open file
+ *  descriptor as SCM_RIGHTS ancillary data. The service replies with
+ *  one line:
+ *    <sha1 hex> <sha256 hex>\n
+ *  of the whole contents whatever the descriptor's offset, or
+ *    error <reason>\n
+ *  The descriptor must be open for reading, O_PATH ones are refused.
+ *  Clients only trust a service whose peer credentials are root's or
+ *  their own effective uid's.
+ */
+
+/*  Ask the service listening on socket for the digests of fd.
+ */
+int
+hashd_digest (const char *socket, int fd, unsigned char *sha1,
+              unsigned char *sha256);
+
+#endif /* HASHD_H */
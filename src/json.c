@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+#define JSON_MAX_DEPTH 64
+
+typedef struct json_parser {
+    const char *p;
+    const char *end;
+    unsigned int depth;
+} json_parser_t;
+
+static int
+json_value (json_parser_t *parser, json_value_t *value);
+
+static void
+json_release (json_value_t *value)
+{
+    size_t i;
+
+    free (value->string);
+    for (i = 0; i < value->count; ++i) {
+        json_release (&value->items[i]);
+        if (value->keys)
+            free (value->keys[i]);
+    }
+    free (value->items);
+    free (value->keys);
+}
+
+void
+json_free (json_value_t *value)
+{
+    if (value == NULL)
+        return;
+    json_release (value);
+    free (value);
+}
+
+static void
+json_skip (json_parser_t *parser)
+{
+    while (parser->p < parser->end &&
+           (*parser->p == ' ' || *parser->p == '\t' ||
+            *parser->p == '\n' || *parser->p == '\r'))
+        ++parser->p;
+}
+
+static int
+json_literal (json_parser_t *parser, const char *literal)
+{
+    size_t len = strlen (literal);
+
+    if ((size_t)(parser->end - parser->p) < len ||
+        memcmp (parser->p, literal, len) != 0)
+        return -1;
+    parser->p += len;
+    return 0;
+}
+
+static int
+json_hex4 (json_parser_t *parser, uint32_t *code)
+{
+    int i;
+
+    *code = 0;
+    if (parser->end - parser->p < 4)
+        return -1;
+    for (i = 0; i < 4; ++i, ++parser->p) {
+        *code <<= 4;
+        if (*parser->p >= '0' && *parser->p <= '9')
+            *code |= *parser->p - '0';
+        else if (*parser->p >= 'a' && *parser->p <= 'f')
+            *code |= *parser->p - 'a' + 10;
+        else if (*parser->p >= 'A' && *parser->p <= 'F')
+            *code |= *parser->p - 'A' + 10;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+static size_t
+json_utf8 (uint32_t code, char *out)
+{
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = 0xc0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3f);
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = 0xe0 | (code >> 12);
+        out[1] = 0x80 | ((code >> 6) & 0x3f);
+        out[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3f);
+    out[2] = 0x80 | ((code >> 6) & 0x3f);
+    out[3] = 0x80 | (code & 0x3f);
+    return 4;
+}
+
+/*  Parse a string starting at the opening quote. The decoded string is
+ *  never longer than its encoding.
+ */
+static int
+json_string (json_parser_t *parser, char **str, size_t *str_len)
+{
+    const char *start = ++parser->p;
+    uint32_t code, low;
+    size_t len = 0;
+    char *out;
+
+    while (parser->p < parser->end && *parser->p != '"') {
+        if (*parser->p == '\\')
+            ++parser->p;
+        ++parser->p;
+    }
+    if (parser->p >= parser->end)
+        return -1;
+    out = malloc (parser->p - start + 1);
+    if (out == NULL) {
+        perror ("malloc of json string:\n");
+        return -1;
+    }
+    parser->p = start;
+    while (*parser->p != '"') {
+        if ((unsigned char)*parser->p < 0x20)
+            goto string_fail;
+        if (*parser->p != '\\') {
+            out[len++] = *parser->p++;
+            continue;
+        }
+        ++parser->p;
+        switch (*parser->p++) {
+            case '"':  out[len++] = '"';  break;
+            case '\\': out[len++] = '\\'; break;
+            case '/':  out[len++] = '/';  break;
+            case 'b':  out[len++] = '\b'; break;
+            case 'f':  out[len++] = '\f'; break;
+            case 'n':  out[len++] = '\n'; break;
+            case 'r':  out[len++] = '\r'; break;
+            case 't':  out[len++] = '\t'; break;
+            case 'u':
+                if (json_hex4 (parser, &code))
+                    goto string_fail;
+                if (code >= 0xd800 && code < 0xdc00) {
+                    if (json_literal (parser, "\\u") ||
+                        json_hex4 (parser, &low) ||
+                        low < 0xdc00 || low >= 0xe000)
+                        goto string_fail;
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                len += json_utf8 (code, out + len);
+                break;
+            default:
+                goto string_fail;
+        }
+    }
+    ++parser->p;
+    out[len] = '\0';
+    *str = out;
+    *str_len = len;
+    return 0;
+string_fail:
+    free (out);
+    return -1;
+}
+
+static int
+json_push (json_value_t *value, char *key)
+{
+    json_value_t *items;
+    char **keys;
+
+    items = realloc (value->items, (value->count + 1) * sizeof (json_value_t));
+    if (items == NULL) {
+        perror ("realloc of json items:\n");
+        return -1;
+    }
+    value->items = items;
+    memset (&items[value->count], 0, sizeof (json_value_t));
+    if (value->type == JSON_OBJECT) {
+        keys = realloc (value->keys, (value->count + 1) * sizeof (char*));
+        if (keys == NULL) {
+            perror ("realloc of json keys:\n");
+            return -1;
+        }
+        value->keys = keys;
+        keys[value->count] = key;
+    }
+    ++value->count;
+    return 0;
+}
+
+/*  Readers of the same document mustn't disagree on which of two
+ *  members of the same name counts, so objects with duplicate names
+ *  are malformed.
+ */
+static bool
+json_duplicate (const json_value_t *object, const char *key)
+{
+    size_t i;
+
+    for (i = 0; i < object->count; ++i) {
+        if (strcmp (object->keys[i], key) == 0)
+            return true;
+    }
+    return false;
+}
+
+static int
+json_container (json_parser_t *parser, json_value_t *value, char close)
+{
+    char *key = NULL;
+    size_t key_len;
+
+    if (++parser->depth > JSON_MAX_DEPTH)
+        return -1;
+    ++parser->p;
+    json_skip (parser);
+    if (parser->p < parser->end && *parser->p == close) {
+        ++parser->p;
+        --parser->depth;
+        return 0;
+    }
+    for (;;) {
+        json_skip (parser);
+        if (value->type == JSON_OBJECT) {
+            if (parser->p >= parser->end || *parser->p != '"' ||
+                json_string (parser, &key, &key_len))
+                return -1;
+            json_skip (parser);
+            if (parser->p >= parser->end || *parser->p++ != ':' ||
+                json_duplicate (value, key)) {
+                free (key);
+                return -1;
+            }
+        }
+        if (json_push (value, key)) {
+            free (key);
+            return -1;
+        }
+        key = NULL;
+        if (json_value (parser, &value->items[value->count - 1]))
+            return -1;
+        json_skip (parser);
+        if (parser->p >= parser->end)
+            return -1;
+        if (*parser->p == close)
+            break;
+        if (*parser->p++ != ',')
+            return -1;
+    }
+    ++parser->p;
+    --parser->depth;
+    return 0;
+}
+
+static int
+json_value (json_parser_t *parser, json_value_t *value)
+{
+    char *end;
+
+    json_skip (parser);
+    if (parser->p >= parser->end)
+        return -1;
+    switch (*parser->p) {
+        case '{':
+            value->type = JSON_OBJECT;
+            return json_container (parser, value, '}');
+        case '[':
+            value->type = JSON_ARRAY;
+            return json_container (parser, value, ']');
+        case '"':
+            value->type = JSON_STRING;
+            return json_string (parser, &value->string, &value->string_len);
+        case 't':
+            value->type = JSON_BOOL;
+            value->boolean = true;
+            return json_literal (parser, "true");
+        case 'f':
+            value->type = JSON_BOOL;
+            return json_literal (parser, "false");
+        case 'n':
+            value->type = JSON_NULL;
+            return json_literal (parser, "null");
+        default:
+            /* the document is NUL terminated by json_parse */
+            value->type = JSON_NUMBER;
+            value->number = strtod (parser->p, &end);
+            if (end == parser->p || end > parser->end)
+                return -1;
+            parser->p = end;
+            return 0;
+    }
+}
+
+json_value_t*
+json_parse (const char *data, size_t len)
+{
+    json_parser_t parser = { 0 };
+    json_value_t *value;
+    char *copy;
+
+    copy = malloc (len + 1);
+    value = calloc (1, sizeof (json_value_t));
+    if (copy == NULL || value == NULL) {
+        perror ("malloc of json document:\n");
+        goto parse_fail;
+    }
+    memcpy (copy, data, len);
+    copy[len] = '\0';
+    parser.p = copy;
+    parser.end = copy + len;
+    if (json_value (&parser, value))
+        goto parse_fail;
+    json_skip (&parser);
+    if (parser.p != parser.end)
+        goto parse_fail;
+    free (copy);
+    return value;
+parse_fail:
+    fprintf (stderr, "Malformed JSON document.\n");
+    free (copy);
+    json_free (value);
+    return NULL;
+}
+
+const json_value_t*
+json_get (const json_value_t *object, const char *key)
+{
+    size_t i;
+
+    if (object == NULL || object->type != JSON_OBJECT)
+        return NULL;
+    for (i = 0; i < object->count; ++i) {
+        if (strcmp (object->keys[i], key) == 0)
+            return &object->items[i];
+    }
+    return NULL;
+}
+
+const char*
+json_get_string (const json_value_t *object, const char *key)
+{
+    const json_value_t *value = json_get (object, key);
+
+    if (value == NULL || value->type != JSON_STRING)
+        return NULL;
+    return value->string;
+}
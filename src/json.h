@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*  Just enough JSON to read image layout metadata. Documents are parsed
+ *  into a tree of values, strings are decoded to UTF-8.
+ */
+typedef enum json_type {
+    JSON_NULL = 0,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+} json_type_t;
+
+typedef struct json_value {
+    json_type_t type;
+    bool boolean;
+    double number;
+    char *string;
+    size_t string_len;
+    struct json_value *items;   /* array elements or object members */
+    char **keys;                /* object member names */
+    size_t count;
+} json_value_t;
+
+json_value_t*
+json_parse (const char *data, size_t len);
+void
+json_free (json_value_t *value);
+const json_value_t*
+json_get (const json_value_t *object, const char *key);
+const char*
+json_get_string (const json_value_t *object, const char *key);
+
+#endif /* JSON_H */
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merkle.h"
+
+typedef unsigned char merkle_hash_t[MERKLE_HASH_LEN];
+
+struct merkle {
+    merkle_hash_t **levels;   /* levels[0] are the leaf hashes */
+    size_t *counts;
+    size_t depth;             /* number of levels above the leaves */
+};
+
+static void
+merkle_hash (unsigned char prefix, const unsigned char *a,
+             const unsigned char *b, unsigned char *out)
+{
+    unsigned char buf[1 + 2 * MERKLE_HASH_LEN];
+    size_t len = 1 + MERKLE_HASH_LEN;
+
+    buf[0] = prefix;
+    memcpy (buf + 1, a, MERKLE_HASH_LEN);
+    if (b) {
+        memcpy (buf + 1 + MERKLE_HASH_LEN, b, MERKLE_HASH_LEN);
+        len += MERKLE_HASH_LEN;
+    }
+    EVP_Digest (buf, len, out, NULL, EVP_sha1 (), NULL);
+}
+
+merkle_t*
+merkle_build (const unsigned char (*leaves)[MERKLE_HASH_LEN], size_t count)
+{
+    merkle_t *tree;
+    size_t levels, n, i;
+
+    if (count == 0)
+        return NULL;
+    for (levels = 1, n = count; n > 1; n = (n + 1) / 2)
+        ++levels;
+    tree = calloc (1, sizeof (merkle_t));
+    if (tree == NULL)
+        goto build_fail;
+    tree->levels = calloc (levels, sizeof (merkle_hash_t*));
+    tree->counts = calloc (levels, sizeof (size_t));
+    if (tree->levels == NULL || tree->counts == NULL)
+        goto build_fail;
+    tree->depth = levels - 1;
+    for (i = 0, n = count; i < levels; ++i, n = (n + 1) / 2) {
+        tree->levels[i] = calloc (n, sizeof (merkle_hash_t));
+        if (tree->levels[i] == NULL)
+            goto build_fail;
+        tree->counts[i] = n;
+    }
+    for (i = 0; i < count; ++i)
+        merkle_hash (0x00, leaves[i], NULL, tree->levels[0][i]);
+    for (levels = 1; levels <= tree->depth; ++levels) {
+        merkle_hash_t *below = tree->levels[levels - 1];
+
+        for (i = 0; i < tree->counts[levels]; ++i) {
+            if (2 * i + 1 < tree->counts[levels - 1])
+                merkle_hash (0x01, below[2 * i], below[2 * i + 1],
+                             tree->levels[levels][i]);
+            else
+                memcpy (tree->levels[levels][i], below[2 * i],
+                        MERKLE_HASH_LEN);
+        }
+    }
+    return tree;
+build_fail:
+    perror ("calloc of merkle tree:\n");
+    merkle_free (tree);
+    return NULL;
+}
+
+void
+merkle_free (merkle_t *tree)
+{
+    size_t i;
+
+    if (tree == NULL)
+        return;
+    if (tree->levels) {
+        for (i = 0; i <= tree->depth; ++i)
+            free (tree->levels[i]);
+    }
+    free (tree->levels);
+    free (tree->counts);
+    free (tree);
+}
+
+const unsigned char*
+merkle_root (const merkle_t *tree)
+{
+    return tree->levels[tree->depth][0];
+}
+
+size_t
+merkle_depth (const merkle_t *tree)
+{
+    return tree->depth;
+}
+
+size_t
+merkle_path (const merkle_t *tree, size_t index, merkle_step_t *steps)
+{
+    size_t level, sibling, count = 0;
+
+    for (level = 0; level < tree->depth; ++level, index /= 2) {
+        sibling = index ^ 1;
+        if (sibling >= tree->counts[level])
+            continue;
+        steps[count].left = sibling < index;
+        memcpy (steps[count].sibling, tree->levels[level][sibling],
+                MERKLE_HASH_LEN);
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MERKLE_HASH_LEN 20
+
+/*  SHA1 Merkle tree over a list of leaves. Leaves are hashed as
+ *  SHA1 (0x00 || leaf) and interior nodes as SHA1 (0x01 || left ||
+ *  right), a node without a sibling moves up a level unchanged.
+ */
+typedef struct merkle merkle_t;
+
+typedef struct merkle_step {
+    bool left;     /* sibling is the left input of the parent */
+    unsigned char sibling[MERKLE_HASH_LEN];
+} merkle_step_t;
+
+merkle_t*
+merkle_build (const unsigned char (*leaves)[MERKLE_HASH_LEN], size_t count);
+void
+merkle_free (merkle_t *tree);
+const unsigned char*
+merkle_root (const merkle_t *tree);
+/*  Fill steps (at most merkle_depth (tree) of them) with the inclusion
+ *  path of leaf index, returning the number of steps.
+ */
+size_t
+merkle_path (const merkle_t *tree, size_t index, merkle_step_t *steps);
+size_t
+merkle_depth (const merkle_t *tree);
+
+#endif /* MERKLE_H */
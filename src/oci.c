@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "hash.h"
+#include "json.h"
+#include "oci.h"
+
+#define OCI_MAX_DOCUMENT (16 << 20)
+#define OCI_MAX_DEPTH 8
+
+typedef struct oci_blob {
+    char *digest;
+    int64_t size;
+    bool ok;
+    bool cached;
+    struct stat st;
+} oci_blob_t;
+
+typedef struct oci_walk {
+    int layout_fd;
+    oci_image_t *image;
+    oci_blob_t *blobs;      /* sorted by digest once the walk is done */
+    size_t blob_count;
+    size_t blob_size;
+    fcache_t *cache;
+    time_t start;
+    atomic_size_t next;
+    atomic_int failed;
+} oci_walk_t;
+
+/*  Split "<algorithm>:<hex>" and check it names a blob in the layout.
+ *  The hex part is used as a file name so anything else is rejected.
+ */
+static const EVP_MD*
+oci_digest_md (const char *digest, const char **hex)
+{
+    const EVP_MD *md;
+    size_t len, i;
+
+    if (strncmp (digest, "sha256:", 7) == 0) {
+        md = EVP_sha256 ();
+        *hex = digest + 7;
+    } else if (strncmp (digest, "sha512:", 7) == 0) {
+        md = EVP_sha512 ();
+        *hex = digest + 7;
+    } else {
+        fprintf (stderr, "Unsupported digest: %s\n", digest);
+        return NULL;
+    }
+    len = strlen (*hex);
+    if (len != (size_t)EVP_MD_size (md) * 2)
+        goto digest_bad;
+    for (i = 0; i < len; ++i) {
+        if (!((*hex)[i] >= '0' && (*hex)[i] <= '9') &&
+            !((*hex)[i] >= 'a' && (*hex)[i] <= 'f'))
+            goto digest_bad;
+    }
+    return md;
+digest_bad:
+    fprintf (stderr, "Malformed digest: %s\n", digest);
+    return NULL;
+}
+
+static bool
+oci_digest_match (const EVP_MD *md, const unsigned char *hash,
+                  unsigned int hash_len, const char *hex)
+{
+    char buf[2 * EVP_MAX_MD_SIZE + 1];
+    unsigned int i;
+
+    if (hash_len != (unsigned int)EVP_MD_size (md))
+        return false;
+    for (i = 0; i < hash_len; ++i)
+        sprintf (buf + 2 * i, "%02x", hash[i]);
+    return CRYPTO_memcmp (buf, hex, 2 * hash_len) == 0;
+}
+
+static int
+oci_blob_open (oci_walk_t *walk, const char *digest, const EVP_MD **md)
+{
+    char path[PATH_MAX];
+    const char *hex;
+    int fd;
+
+    *md = oci_digest_md (digest, &hex);
+    if (*md == NULL)
+        return -1;
+    snprintf (path, sizeof (path), "blobs/%.*s/%s",
+              (int)(hex - digest - 1), digest, hex);
+    fd = openat (walk->layout_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        fprintf (stderr, "Failed to open blob %s: %s\n", digest,
+                 strerror (errno));
+    return fd;
+}
+
+static char*
+oci_read_fd (int fd, size_t *len)
+{
+    struct stat st;
+    ssize_t ret;
+    char *buf;
+
+    if (fstat (fd, &st)) {
+        perror ("fstat:\n");
+        return NULL;
+    }
+    if (st.st_size > OCI_MAX_DOCUMENT) {
+        fprintf (stderr, "Image document too large.\n");
+        return NULL;
+    }
+    buf = malloc (st.st_size + 1);
+    if (buf == NULL) {
+        perror ("malloc of image document:\n");
+        return NULL;
+    }
+    for (*len = 0; *len < (size_t)st.st_size; *len += ret) {
+        ret = read (fd, buf + *len, st.st_size - *len);
+        if (ret == -1 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) {
+            perror ("read of image document:\n");
+            free (buf);
+            return NULL;
+        }
+    }
+    return buf;
+}
+
+/*  Read a small document blob (index or manifest), verify it and parse.
+ */
+static json_value_t*
+oci_read_document (oci_walk_t *walk, const json_value_t *desc)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = 0;
+    const json_value_t *size;
+    const char *digest, *hex;
+    const EVP_MD *md;
+    json_value_t *doc = NULL;
+    size_t len = 0;
+    char *buf;
+    int fd;
+
+    digest = json_get_string (desc, "digest");
+    size = json_get (desc, "size");
+    if (digest == NULL || size == NULL || size->type != JSON_NUMBER) {
+        fprintf (stderr, "Malformed descriptor.\n");
+        return NULL;
+    }
+    fd = oci_blob_open (walk, digest, &md);
+    if (fd == -1)
+        return NULL;
+    buf = oci_read_fd (fd, &len);
+    close (fd);
+    if (buf == NULL)
+        return NULL;
+    oci_digest_md (digest, &hex);
+    if (EVP_Digest (buf, len, hash, &hash_len, md, NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto document_out;
+    }
+    if ((int64_t)len != (int64_t)size->number ||
+        !oci_digest_match (md, hash, hash_len, hex)) {
+        fprintf (stderr, "Blob %s failed verification.\n", digest);
+        goto document_out;
+    }
+    doc = json_parse (buf, len);
+document_out:
+    free (buf);
+    return doc;
+}
+
+static int
+oci_add_blob (oci_walk_t *walk, const json_value_t *desc, char **digest_out)
+{
+    const json_value_t *size;
+    const char *digest;
+    oci_blob_t *blobs;
+    size_t size_new;
+
+    digest = json_get_string (desc, "digest");
+    size = json_get (desc, "size");
+    if (digest == NULL || size == NULL || size->type != JSON_NUMBER) {
+        fprintf (stderr, "Malformed descriptor.\n");
+        return -1;
+    }
+    *digest_out = strdup (digest);
+    if (*digest_out == NULL) {
+        perror ("strdup:\n");
+        return -1;
+    }
+    /* blobs shared between images are only dropped by oci_dedup_blobs */
+    if (walk->blob_count == walk->blob_size) {
+        size_new = walk->blob_size ? walk->blob_size * 2 : 16;
+        blobs = realloc (walk->blobs, size_new * sizeof (oci_blob_t));
+        if (blobs == NULL) {
+            perror ("realloc of blob list:\n");
+            return -1;
+        }
+        walk->blobs = blobs;
+        walk->blob_size = size_new;
+    }
+    blobs = walk->blobs;
+    memset (&blobs[walk->blob_count], 0, sizeof (oci_blob_t));
+    blobs[walk->blob_count].digest = strdup (digest);
+    blobs[walk->blob_count].size = size->number;
+    if (blobs[walk->blob_count].digest == NULL) {
+        perror ("strdup:\n");
+        return -1;
+    }
+    ++walk->blob_count;
+    return 0;
+}
+
+static int
+oci_blob_cmp (const void *a, const void *b)
+{
+    return strcmp (((const oci_blob_t*)a)->digest,
+                   ((const oci_blob_t*)b)->digest);
+}
+
+/*  Sort the blobs and keep one of each digest. Descriptors that give
+ *  one digest different sizes can't both be right.
+ */
+static int
+oci_dedup_blobs (oci_walk_t *walk)
+{
+    size_t i, j;
+
+    qsort (walk->blobs, walk->blob_count, sizeof (oci_blob_t), oci_blob_cmp);
+    for (i = 0, j = 0; i < walk->blob_count; ++i) {
+        if (j > 0 && oci_blob_cmp (&walk->blobs[j - 1], &walk->blobs[i]) == 0) {
+            if (walk->blobs[j - 1].size != walk->blobs[i].size) {
+                fprintf (stderr, "Blob %s is given different sizes.\n",
+                         walk->blobs[i].digest);
+                for (; i < walk->blob_count; ++i)
+                    free (walk->blobs[i].digest);
+                walk->blob_count = j;
+                return -1;
+            }
+            free (walk->blobs[i].digest);
+            continue;
+        }
+        walk->blobs[j++] = walk->blobs[i];
+    }
+    walk->blob_count = j;
+    return 0;
+}
+
+static int
+oci_add_manifest (oci_walk_t *walk, const json_value_t *desc,
+                  const json_value_t *doc)
+{
+    const json_value_t *layers;
+    oci_manifest_t *manifests, *manifest;
+    size_t i;
+
+    manifests = realloc (walk->image->manifests,
+                         (walk->image->count + 1) * sizeof (oci_manifest_t));
+    if (manifests == NULL) {
+        perror ("realloc of manifest list:\n");
+        return -1;
+    }
+    walk->image->manifests = manifests;
+    manifest = &manifests[walk->image->count++];
+    memset (manifest, 0, sizeof (oci_manifest_t));
+    manifest->digest = strdup (json_get_string (desc, "digest"));
+    if (manifest->digest == NULL) {
+        perror ("strdup:\n");
+        return -1;
+    }
+    layers = json_get (doc, "layers");
+    if (json_get (doc, "config") == NULL || layers == NULL ||
+        layers->type != JSON_ARRAY) {
+        fprintf (stderr, "Malformed image manifest %s\n", manifest->digest);
+        return -1;
+    }
+    if (oci_add_blob (walk, json_get (doc, "config"), &manifest->config))
+        return -1;
+    manifest->layers = calloc (layers->count + 1, sizeof (char*));
+    if (manifest->layers == NULL) {
+        perror ("calloc of layer list:\n");
+        return -1;
+    }
+    manifest->layer_count = layers->count;
+    for (i = 0; i < layers->count; ++i) {
+        if (oci_add_blob (walk, &layers->items[i], &manifest->layers[i]))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+oci_walk_index (oci_walk_t *walk, const json_value_t *index,
+                unsigned int depth)
+{
+    const json_value_t *manifests, *desc;
+    json_value_t *doc;
+    size_t i;
+    int ret = 0;
+
+    manifests = json_get (index, "manifests");
+    if (manifests == NULL || manifests->type != JSON_ARRAY) {
+        fprintf (stderr, "Image index has no manifests.\n");
+        return -1;
+    }
+    if (depth > OCI_MAX_DEPTH) {
+        fprintf (stderr, "Image indexes nested too deeply.\n");
+        return -1;
+    }
+    for (i = 0; i < manifests->count && ret == 0; ++i) {
+        desc = &manifests->items[i];
+        doc = oci_read_document (walk, desc);
+        if (doc == NULL)
+            return -1;
+        if (json_get (doc, "manifests"))
+            ret = oci_walk_index (walk, doc, depth + 1);
+        else
+            ret = oci_add_manifest (walk, desc, doc);
+        json_free (doc);
+    }
+    return ret;
+}
+
+static int
+oci_verify_blob (oci_walk_t *walk, oci_blob_t *blob)
+{
+    unsigned char cached[EVP_MAX_MD_SIZE], *hash = NULL;
+    unsigned int hash_len = 0;
+    const EVP_MD *md;
+    const char *hex;
+    FILE *file;
+    int fd, ret = -1;
+
+    fd = oci_blob_open (walk, blob->digest, &md);
+    if (fd == -1)
+        return -1;
+    if (fstat (fd, &blob->st)) {
+        perror ("fstat:\n");
+        close (fd);
+        return -1;
+    }
+    if (blob->st.st_size != blob->size) {
+        fprintf (stderr, "Blob %s has the wrong size.\n", blob->digest);
+        close (fd);
+        return -1;
+    }
+    oci_digest_md (blob->digest, &hex);
+    if (walk->cache && fcache_lookup (walk->cache, &blob->st, md, cached) &&
+        oci_digest_match (md, cached, EVP_MD_size (md), hex)) {
+        close (fd);
+        blob->cached = true;
+        return 0;
+    }
+    file = fdopen (fd, "r");
+    if (file == NULL) {
+        perror ("fdopen:\n");
+        close (fd);
+        return -1;
+    }
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    hash = digest_file (file, md, NULL, 0, &hash_len);
+    if (hash == NULL)
+        goto verify_out;
+    if (!oci_digest_match (md, hash, hash_len, hex)) {
+        fprintf (stderr, "Blob %s failed verification.\n", blob->digest);
+        goto verify_out;
+    }
+    if (walk->cache &&
+        fcache_add (walk->cache, &blob->st, md, hash, walk->start))
+        goto verify_out;
+    ret = 0;
+verify_out:
+    fclose (file);
+    free (hash);
+    return ret;
+}
+
+static void*
+oci_verify_worker (void *arg)
+{
+    oci_walk_t *walk = arg;
+    size_t i;
+
+    while (!atomic_load (&walk->failed)) {
+        i = atomic_fetch_add (&walk->next, 1);
+        if (i >= walk->blob_count)
+            break;
+        if (oci_verify_blob (walk, &walk->blobs[i]))
+            atomic_store (&walk->failed, 1);
+        else
+            walk->blobs[i].ok = true;
+    }
+    return NULL;
+}
+
+static int
+oci_verify_blobs (oci_walk_t *walk, unsigned int jobs)
+{
+    pthread_t *threads;
+    unsigned int i, started = 0;
+
+    if (jobs == 0)
+        jobs = 1;
+    if (jobs > walk->blob_count)
+        jobs = walk->blob_count ? walk->blob_count : 1;
+    threads = calloc (jobs, sizeof (pthread_t));
+    if (threads == NULL) {
+        perror ("calloc of verify threads:\n");
+        return -1;
+    }
+    for (i = 0; i < jobs; ++i) {
+        if (pthread_create (&threads[i], NULL, oci_verify_worker, walk)) {
+            atomic_store (&walk->failed, 1);
+            break;
+        }
+        ++started;
+    }
+    for (i = 0; i < started; ++i)
+        pthread_join (threads[i], NULL);
+    free (threads);
+    if (started == 0)
+        fprintf (stderr, "Failed to start verify threads.\n");
+    return atomic_load (&walk->failed) ? -1 : 0;
+}
+
+int
+oci_measure (const char *layout, const oci_opts_t *opts, oci_image_t *image)
+{
+    oci_walk_t walk = { .layout_fd = -1, .image = image };
+    json_value_t *index = NULL;
+    size_t len, i;
+    char *buf = NULL;
+    int fd, ret = -1;
+
+    memset (image, 0, sizeof (oci_image_t));
+    atomic_init (&walk.next, 0);
+    atomic_init (&walk.failed, 0);
+    walk.layout_fd = open (layout, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walk.layout_fd == -1) {
+        fprintf (stderr, "Failed to open image layout %s: %s\n", layout,
+                 strerror (errno));
+        goto oci_out;
+    }
+    fd = openat (walk.layout_fd, "index.json", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open index.json: %s\n", strerror (errno));
+        goto oci_out;
+    }
+    buf = oci_read_fd (fd, &len);
+    close (fd);
+    if (buf == NULL)
+        goto oci_out;
+    index = json_parse (buf, len);
+    if (index == NULL)
+        goto oci_out;
+    if (oci_walk_index (&walk, index, 0) || oci_dedup_blobs (&walk))
+        goto oci_out;
+    if (opts->cache) {
+        walk.start = time (NULL);
+        walk.cache = fcache_new (0);
+        if (walk.cache == NULL || fcache_load (walk.cache, opts->cache))
+            goto oci_out;
+    }
+    if (oci_verify_blobs (&walk, opts->jobs))
+        goto oci_out;
+    image->blobs = walk.blob_count;
+    for (i = 0; i < walk.blob_count; ++i) {
+        if (walk.blobs[i].cached)
+            ++image->cached;
+        else
+            ++image->verified;
+    }
+    /* blobs of other images stay cached */
+    if (opts->cache && fcache_save (walk.cache, opts->cache, false))
+        goto oci_out;
+    ret = 0;
+oci_out:
+    for (i = 0; i < walk.blob_count; ++i)
+        free (walk.blobs[i].digest);
+    free (walk.blobs);
+    fcache_free (walk.cache);
+    json_free (index);
+    free (buf);
+    if (walk.layout_fd != -1)
+        close (walk.layout_fd);
+    if (ret)
+        oci_image_free (image);
+    return ret;
+}
+
+void
+oci_image_free (oci_image_t *image)
+{
+    size_t i, j;
+
+    for (i = 0; i < image->count; ++i) {
+        free (image->manifests[i].digest);
+        free (image->manifests[i].config);
+        for (j = 0; j < image->manifests[i].layer_count; ++j)
+            free (image->manifests[i].layers[j]);
+        free (image->manifests[i].layers);
+    }
+    free (image->manifests);
+    memset (image, 0, sizeof (oci_image_t));
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef OCI_H
+#define OCI_H
+
+#include <stddef.h>
+
+typedef struct oci_opts {
+    const char *cache;   /* verified blob cache file, NULL for none */
+    unsigned int jobs;   /* blobs verified concurrently */
+} oci_opts_t;
+
+typedef struct oci_manifest {
+    char *digest;        /* "<algorithm>:<hex>" */
+    char *config;
+    char **layers;
+    size_t layer_count;
+} oci_manifest_t;
+
+typedef struct oci_image {
+    oci_manifest_t *manifests;
+    size_t count;
+    size_t blobs;        /* distinct config and layer blobs */
+    size_t verified;     /* blobs read and hashed */
+    size_t cached;       /* blobs trusted from the cache */
+} oci_image_t;
+
+/*  Walk index.json of an OCI image layout and every image manifest it
+ *  references, directly or through nested indexes, verifying the
+ *  content digest and size of each blob. Manifests are collected in
+ *  the order they're found. Config and layer blobs are streamed through
+ *  the hash by opts->jobs threads and, when a cache is given, blobs
+ *  whose digest was already verified for the same inode, size, mtime
+ *  and ctime aren't read again. The cache must only be writable by
+ *  whoever may vouch for the image contents.
+ */
+int
+oci_measure (const char *layout, const oci_opts_t *opts, oci_image_t *image);
+void
+oci_image_free (oci_image_t *image);
+
+#endif /* OCI_H */
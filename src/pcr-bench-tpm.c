@@ -0,0 +1,510 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tss/tspi.h>
+#include <trousers/trousers.h>
+
+#include "tpm.h"
+
+#define PCR_COUNT 24
+#define PCR_LEN 20
+#define DEBUG_PCR 16
+#define APP_PCR 23
+#define COUNT 1000
+#define CONNECTS 100
+#define WARMUP 10
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state);
+
+typedef struct bench_args {
+    TPM_PCRINDEX pcr_index;
+    bool force;
+    unsigned long count;
+    unsigned long connects;
+    unsigned long warmup;
+    unsigned int threads;
+    bool read_only;
+    bool json;
+    bool verbose;
+} bench_args_t;
+
+const struct argp_option bench_opts[] = {
+    {
+        .name  = "pcr",
+        .key   = 'p',
+        .arg   = "0-PCR_MAX",
+        .flags = 0,
+        .doc   = "PCR to extend (default 16, the debug PCR).",
+        .group = 0,
+    },
+    {
+        .name  = "force",
+        .key   = 'F',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Extend a PCR other than 16 or 23, only for a simulator "
+                 "or a TPM whose measurements don't matter: PCRs can't be "
+                 "reset without a reboot.",
+        .group = 0,
+    },
+    {
+        .name  = "count",
+        .key   = 'n',
+        .arg   = "ops",
+        .flags = 0,
+        .doc   = "Operations per test (default 1000).",
+        .group = 0,
+    },
+    {
+        .name  = "connects",
+        .key   = 'c',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Context setups and teardowns to time (default 100).",
+        .group = 0,
+    },
+    {
+        .name  = "warmup",
+        .key   = 'w',
+        .arg   = "ops",
+        .flags = 0,
+        .doc   = "Untimed operations before each test (default 10).",
+        .group = 0,
+    },
+    {
+        .name  = "threads",
+        .key   = 't',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Threads issuing commands back to back in the load tests, "
+                 "each with a context of its own (default 4).",
+        .group = 0,
+    },
+    {
+        .name  = "read-only",
+        .key   = 'r',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Skip the PcrExtend tests.",
+        .group = 0,
+    },
+    {
+        .name  = "json",
+        .key   = 'j',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Report each test as a line of JSON.",
+        .group = 0,
+    },
+    {
+        .name = "verbose",
+        .key = 'v',
+        .arg = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc = "verbose",
+        .group = 0,
+    },
+    { 0 }
+};
+
+const struct argp bench_argp = {
+    .options  = bench_opts,
+    .parser   = parse_opts,
+    .args_doc = NULL,
+    .doc      = "Measure TPM command latency: context setup and teardown, "
+                "PcrRead and PcrExtend one at a time, then both under "
+                "back to back load from several threads. Latencies are "
+                "in microseconds."
+};
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state)
+{
+    bench_args_t *args = state->input;
+    long index;
+
+    switch (key) {
+        case 'p':
+            index = strtol (arg, NULL, 10);
+            if (index < 0 || index >= PCR_COUNT) {
+                fprintf (stderr, "Invalid PCR: %s\n", arg);
+                return EINVAL;
+            }
+            args->pcr_index = index;
+            break;
+        case 'F':
+            args->force = true;
+            break;
+        case 'n':
+            args->count = strtoul (arg, NULL, 10);
+            break;
+        case 'c':
+            args->connects = strtoul (arg, NULL, 10);
+            break;
+        case 'w':
+            args->warmup = strtoul (arg, NULL, 10);
+            break;
+        case 't':
+            args->threads = strtoul (arg, NULL, 10);
+            if (args->threads == 0 || args->threads > TSS_POOL_MAX) {
+                fprintf (stderr, "Threads must be 1-%d.\n", TSS_POOL_MAX);
+                return EINVAL;
+            }
+            break;
+        case 'r':
+            args->read_only = true;
+            break;
+        case 'j':
+            args->json = true;
+            break;
+        case 'v':
+            args->verbose = true;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void
+bench_args_dump (bench_args_t *args)
+{
+    printf ("User provided options:\n");
+    printf ("  pcr: %d\n", args->pcr_index);
+    printf ("  force: %s\n", args->force ? "true" : "false");
+    printf ("  count: %lu\n", args->count);
+    printf ("  connects: %lu\n", args->connects);
+    printf ("  warmup: %lu\n", args->warmup);
+    printf ("  threads: %u\n", args->threads);
+    printf ("  read-only: %s\n", args->read_only ? "true" : "false");
+    printf ("  json: %s\n", args->json ? "true" : "false");
+    printf ("  verbose: %s\n", args->verbose ? "true" : "false");
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+u64_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile (const uint64_t *sorted, size_t count, double p)
+{
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+
+    return sorted[i] / 1000.0;
+}
+
+/*  Print the latency distribution of samples, and the throughput when
+ *  elapsed_ns covers them all.
+ */
+static void
+report (bench_args_t *args, const char *test, unsigned int threads,
+        uint64_t *samples, size_t count, uint64_t elapsed_ns)
+{
+    double sum = 0, ops = 0;
+    size_t i;
+
+    if (count == 0)
+        return;
+    qsort (samples, count, sizeof (uint64_t), u64_cmp);
+    for (i = 0; i < count; ++i)
+        sum += samples[i];
+    if (elapsed_ns)
+        ops = count * 1e9 / elapsed_ns;
+    if (args->json) {
+        printf ("{\"test\":\"%s\",\"threads\":%u,\"count\":%zu,"
+                "\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+                "\"max\":%.1f,\"mean\":%.1f", test, threads, count,
+                samples[0] / 1000.0, percentile (samples, count, 0.5),
+                percentile (samples, count, 0.9),
+                percentile (samples, count, 0.99),
+                samples[count - 1] / 1000.0, sum / count / 1000.0);
+        if (elapsed_ns)
+            printf (",\"ops\":%.1f", ops);
+        printf ("}\n");
+    } else {
+        printf ("%-9s x%-2u n %-6zu min %9.1f p50 %9.1f p90 %9.1f "
+                "p99 %9.1f max %9.1f mean %9.1f", test, threads, count,
+                samples[0] / 1000.0, percentile (samples, count, 0.5),
+                percentile (samples, count, 0.9),
+                percentile (samples, count, 0.99),
+                samples[count - 1] / 1000.0, sum / count / 1000.0);
+        if (elapsed_ns)
+            printf ("  %.1f ops/s", ops);
+        printf ("\n");
+    }
+    fflush (stdout);
+}
+
+static TSS_RESULT
+noop_op (tss_conn_t *conn, void *arg)
+{
+    (void)conn;
+    (void)arg;
+    return TSS_SUCCESS;
+}
+
+static TSS_RESULT
+read_op (tss_conn_t *conn, void *arg)
+{
+    TPM_PCRINDEX *index = arg;
+    TSS_RESULT result;
+    UINT32 len;
+    BYTE *value;
+
+    result = Tspi_TPM_PcrRead (conn->tpm, *index, &len, &value);
+    if (result != TSS_SUCCESS)
+        fprintf (stderr, "Failed to read PCR %d: %s\n", *index,
+                 Trspi_Error_String (result));
+    return result;
+}
+
+static TSS_RESULT
+extend_op (tss_conn_t *conn, void *arg)
+{
+    TPM_PCRINDEX *index = arg;
+    BYTE digest[PCR_LEN] = { 0 };
+    TSS_RESULT result;
+    UINT32 len;
+    BYTE *value;
+
+    result = Tspi_TPM_PcrExtend (conn->tpm, *index, PCR_LEN, digest, NULL,
+                                 &len, &value);
+    if (result != TSS_SUCCESS)
+        fprintf (stderr, "Failed to extend PCR %d: %s\n", *index,
+                 Trspi_Error_String (result));
+    return result;
+}
+
+/*  Set up a context and connect it, then tear it down, as every run of
+ *  pcr-extend and pcr-dump does.
+ */
+static int
+bench_connect (bench_args_t *args)
+{
+    uint64_t *setup, *teardown, start, connected;
+    tss_pool_t *pool;
+    unsigned long i;
+    int ret = -1;
+
+    setup = calloc (args->connects, sizeof (uint64_t));
+    teardown = calloc (args->connects, sizeof (uint64_t));
+    if (setup == NULL || teardown == NULL) {
+        perror ("calloc of samples:\n");
+        goto connect_out;
+    }
+    for (i = 0; i < args->connects; ++i) {
+        start = now_ns ();
+        pool = tss_pool_new (1);
+        if (pool == NULL)
+            goto connect_out;
+        if (tss_pool_run (pool, noop_op, NULL, false) != TSS_SUCCESS) {
+            tss_pool_free (pool);
+            goto connect_out;
+        }
+        connected = now_ns ();
+        tss_pool_free (pool);
+        setup[i] = connected - start;
+        teardown[i] = now_ns () - connected;
+    }
+    report (args, "connect", 1, setup, args->connects, 0);
+    report (args, "teardown", 1, teardown, args->connects, 0);
+    ret = 0;
+connect_out:
+    free (setup);
+    free (teardown);
+    return ret;
+}
+
+typedef struct load {
+    tss_pool_t *pool;
+    tss_op_t op;
+    TPM_PCRINDEX index;
+    unsigned long warmup;
+    pthread_barrier_t start;
+    atomic_bool failed;
+} load_t;
+
+typedef struct load_thread {
+    load_t *load;
+    uint64_t *samples;
+    size_t count;
+    uint64_t started;
+    uint64_t finished;
+    pthread_t thread;
+} load_thread_t;
+
+static void*
+load_worker (void *arg)
+{
+    load_thread_t *self = arg;
+    load_t *load = self->load;
+    uint64_t start;
+    size_t i;
+
+    /* connect and warm up before the clock starts */
+    for (i = 0; i < load->warmup; ++i) {
+        if (tss_pool_run (load->pool, load->op, &load->index, false))
+            atomic_store (&load->failed, true);
+    }
+    pthread_barrier_wait (&load->start);
+    self->started = now_ns ();
+    for (i = 0; i < self->count && !atomic_load (&load->failed); ++i) {
+        start = now_ns ();
+        if (tss_pool_run (load->pool, load->op, &load->index, false)) {
+            atomic_store (&load->failed, true);
+            break;
+        }
+        self->samples[i] = now_ns () - start;
+    }
+    self->finished = now_ns ();
+    self->count = i;
+    return NULL;
+}
+
+/*  Run count operations split over threads, each issuing its next
+ *  command as soon as the last one returns.
+ */
+static int
+bench_load (bench_args_t *args, const char *test, tss_op_t op,
+            unsigned int threads)
+{
+    load_t load = {
+        .op = op,
+        .index = args->pcr_index,
+        .warmup = args->warmup ? args->warmup : 1,
+    };
+    load_thread_t *workers;
+    uint64_t *samples, start = UINT64_MAX, finish = 0;
+    size_t i, n = 0;
+    unsigned int started;
+    int ret = -1;
+
+    load.pool = tss_pool_new (threads);
+    workers = calloc (threads, sizeof (load_thread_t));
+    samples = calloc (args->count ? args->count : 1, sizeof (uint64_t));
+    if (load.pool == NULL || workers == NULL || samples == NULL) {
+        perror ("allocation for load test:\n");
+        goto load_out;
+    }
+    atomic_init (&load.failed, false);
+    pthread_barrier_init (&load.start, NULL, threads + 1);
+    for (started = 0; started < threads; ++started) {
+        workers[started].load = &load;
+        workers[started].samples = samples + n;
+        workers[started].count = args->count / threads +
+                                 (started < args->count % threads);
+        n += workers[started].count;
+        if (pthread_create (&workers[started].thread, NULL, load_worker,
+                            &workers[started])) {
+            perror ("pthread_create:\n");
+            /* those started would wait at the barrier forever */
+            exit (EXIT_FAILURE);
+        }
+    }
+    pthread_barrier_wait (&load.start);
+    /* timed by the workers: this thread may not run again until they
+     * are done */
+    for (i = 0; i < threads; ++i) {
+        pthread_join (workers[i].thread, NULL);
+        if (workers[i].started < start)
+            start = workers[i].started;
+        if (workers[i].finished > finish)
+            finish = workers[i].finished;
+    }
+    pthread_barrier_destroy (&load.start);
+    if (atomic_load (&load.failed))
+        goto load_out;
+    report (args, test, threads, samples, n, finish - start);
+    ret = 0;
+load_out:
+    tss_pool_free (load.pool);
+    free (workers);
+    free (samples);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    bench_args_t bench_args = {
+        .pcr_index = DEBUG_PCR,
+        .count = COUNT,
+        .connects = CONNECTS,
+        .warmup = WARMUP,
+        .threads = 4,
+    };
+    int ret = -1;
+
+    if (argp_parse (&bench_argp, argc, argv, 0, NULL, &bench_args)) {
+        perror ("argp_parse: \n");
+        goto main_out;
+    }
+    if (bench_args.verbose)
+        bench_args_dump (&bench_args);
+    if (!bench_args.read_only && !bench_args.force &&
+        bench_args.pcr_index != DEBUG_PCR && bench_args.pcr_index != APP_PCR) {
+        fprintf (stderr, "Refusing to extend PCR %d without --force.\n",
+                 bench_args.pcr_index);
+        goto main_out;
+    }
+    if (bench_args.connects && bench_connect (&bench_args))
+        goto main_out;
+    if (bench_load (&bench_args, "read", read_op, 1))
+        goto main_out;
+    if (!bench_args.read_only &&
+        bench_load (&bench_args, "extend", extend_op, 1))
+        goto main_out;
+    if (bench_args.threads > 1) {
+        if (bench_load (&bench_args, "read", read_op, bench_args.threads))
+            goto main_out;
+        if (!bench_args.read_only &&
+            bench_load (&bench_args, "extend", extend_op,
+                        bench_args.threads))
+            goto main_out;
+    }
+    ret = 0;
+main_out:
+    if (ret == 0)
+        exit (EXIT_SUCCESS);
+    else
+        exit (EXIT_FAILURE);
+}
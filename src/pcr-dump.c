@@ -17,21 +17,48 @@
  */
 
 #include <argp.h>
+#include <errno.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <time.h>
 #include <tss/tspi.h>
 #include <trousers/trousers.h>
+#include <unistd.h>
+
+#include "baseline.h"
+#include "evlog.h"
+#include "golden.h"
+#include "tpm.h"
+#include "util.h"
 
 #define BUF_SIZE 1024
+#define PCR_COUNT 24
+#define PCR_LEN 20
+#define WATCH_MIN_MS 100
+#define WATCH_MAX_MS 5000
+#define EXIT_MISMATCH 2
 
 error_t
 parse_opts (int key, char *arg, struct argp_state *state);
 
 typedef struct dump_args {
     TPM_PCRINDEX pcr_index;
+    uint32_t pcr_mask;
+    char *log;
+    bool watch;
+    char *expect;
+    char *golden;
+    unsigned long interval_ms;
     bool pcr_set;
     bool verbose;
 } dump_args_t;
@@ -42,7 +69,60 @@ const struct argp_option dump_opts[] = {
         .key = 'p',
         .arg = "0-PCR_MAX",
         .flags = 0,
-        .doc = "The PCR to dump.",
+        .doc = "The PCR to dump, may be given several times.",
+        .group = 0,
+    },
+    {
+        .name  = "log",
+        .key   = 'l',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Event log written by 'pcr-extend --log'. The PCRs are "
+                 "read together with the log length, no extend through the "
+                 "log can fall between them.",
+        .group = 0,
+    },
+    {
+        .name  = "watch",
+        .key   = 'W',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Keep watching the PCRs, printing each change as a line of "
+                 "JSON. The TPM is polled quickly after a change and less "
+                 "often while idle, appends to the event log wake the "
+                 "watch straight away.",
+        .group = 0,
+    },
+    {
+        .name  = "expect",
+        .key   = 'e',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Compare the PCRs with the known-good values in file "
+                 "(lines of '<pcr> <sha1|sha256> <hex>') and print the "
+                 "result as JSON. Exits with 2 when a PCR doesn't match. "
+                 "A TPM 1.2 only has the sha1 bank, other banks are "
+                 "ignored.",
+        .group = 0,
+    },
+    {
+        .name  = "golden",
+        .key   = 'g',
+        .arg   = "db",
+        .flags = 0,
+        .doc   = "Check every record of the event log (--log) against the "
+                 "golden digest database db built by pcr-golden-build, "
+                 "only the PCRs given with --pcr if any. The records not "
+                 "in the database are printed as JSON, exits with 2 when "
+                 "there are any.",
+        .group = 0,
+    },
+    {
+        .name  = "interval",
+        .key   = 'i',
+        .arg   = "ms",
+        .flags = 0,
+        .doc   = "Longest interval between polls while idle (default 5000).",
         .group = 0,
     },
     {
@@ -71,8 +151,33 @@ parse_opts (int key, char *arg, struct argp_state *state)
     switch (key) {
         case 'p':
             args->pcr_index = strtol (arg, NULL, 10);
+            if (args->pcr_index >= PCR_COUNT) {
+                fprintf (stderr, "Invalid PCR: %s\n", arg);
+                return EINVAL;
+            }
+            args->pcr_mask |= 1U << args->pcr_index;
             args->pcr_set = true;
             break;
+        case 'l':
+            args->log = arg;
+            break;
+        case 'W':
+            args->watch = true;
+            break;
+        case 'e':
+            args->expect = arg;
+            break;
+        case 'g':
+            args->golden = arg;
+            break;
+        case 'i':
+            args->interval_ms = strtoul (arg, NULL, 10);
+            if (args->interval_ms < WATCH_MIN_MS) {
+                fprintf (stderr, "Interval must be at least %d ms.\n",
+                         WATCH_MIN_MS);
+                return EINVAL;
+            }
+            break;
         case 'v':
             args->verbose = true;
             break;
@@ -87,6 +192,12 @@ dump_args_dump (dump_args_t *args)
 {
     printf ("User provided options:\n");
     printf ("  pcr:  %d\n", args->pcr_index);
+    printf ("  pcr_mask: 0x%06x\n", args->pcr_mask);
+    printf ("  log: %s\n", args->log);
+    printf ("  watch: %s\n", args->watch ? "true" : "false");
+    printf ("  expect: %s\n", args->expect);
+    printf ("  golden: %s\n", args->golden);
+    printf ("  interval: %lu\n", args->interval_ms);
     printf ("  pcr_set: %s\n", args->pcr_set ? "true" : "false");
     printf ("  verbose: %s\n", args->verbose ? "true" : "false");
 }
@@ -102,17 +213,22 @@ dump_buf (FILE *file, char *buf, size_t length)
     fprintf (file, "\n");
 }
 
-/*  Read data from file object and dump into PCR till EOF or error.
+/*  Dump the PCRs in mask. With an event log the PCRs are read under
+ *  the log's shared lock and the log length is printed with them, so
+ *  replaying that much of the log reproduces the values.
  */
 static int
-dump_pcr (TPM_PCRINDEX index)
+dump_pcr (uint32_t mask, evlog_t *log)
 {
     TSS_RESULT result, out;
-    TSS_HCONTEXT context;
+    TSS_HCONTEXT context = 0;
     TSS_HTPM tpm;
     TSS_UNICODE *host = NULL; /* no remote connections */
     UINT32 pcr_before_len = 0;
     BYTE *pcr_before = NULL;
+    TPM_PCRINDEX index;
+    bool locked = false;
+    off_t length;
 
     result = Tspi_Context_Create (&context);
     if (result != TSS_SUCCESS) {
@@ -129,14 +245,36 @@ dump_pcr (TPM_PCRINDEX index)
         fprintf (stderr, "Failed to get TPM object.\n");
         goto dump_out;
     }
-    result = Tspi_TPM_PcrRead (tpm, index, &pcr_before_len, &pcr_before);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to read PCR %d: %s\n",
-                 index, Trspi_Error_String (result));
-        goto dump_out;
+    if (log) {
+        if (evlog_lock (log, false)) {
+            result = TSS_E_FAIL;
+            goto dump_out;
+        }
+        locked = true;
+        length = evlog_size (log);
+        if (length == -1) {
+            result = TSS_E_FAIL;
+            goto dump_out;
+        }
+        printf ("log: %s %lld\n", log->path, (long long)length);
+    }
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(mask & (1U << index)))
+            continue;
+        result = Tspi_TPM_PcrRead (tpm, index, &pcr_before_len, &pcr_before);
+        if (result != TSS_SUCCESS) {
+            fprintf (stderr, "Failed to read PCR %d: %s\n",
+                     index, Trspi_Error_String (result));
+            goto dump_out;
+        }
+        /* a single PCR without a log keeps the bare output */
+        if (log || (mask & (mask - 1)))
+            printf ("PCR %d: ", index);
+        dump_buf (stdout, pcr_before, pcr_before_len);
     }
-    dump_buf (stdout, pcr_before, pcr_before_len);
 dump_out:
+    if (locked)
+        evlog_unlock (log);
     out = result;
     /* shortcut to free all memory bound to the context */
     result = Tspi_Context_FreeMemory (context, NULL);
@@ -150,10 +288,369 @@ dump_out:
     return out;
 }
 
+typedef struct pcr_values {
+    BYTE value[PCR_COUNT][PCR_LEN];
+} pcr_values_t;
+
+typedef struct read_op {
+    uint32_t mask;
+    pcr_values_t *values;
+} read_op_t;
+
+static volatile sig_atomic_t watch_stop;
+
+static void
+watch_signal (int sig)
+{
+    (void)sig;
+    watch_stop = 1;
+}
+
+static TSS_RESULT
+read_pcrs_op (tss_conn_t *conn, void *arg)
+{
+    read_op_t *op = arg;
+    TSS_RESULT result;
+    TPM_PCRINDEX index;
+    UINT32 len;
+    BYTE *value;
+
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(op->mask & (1U << index)))
+            continue;
+        result = Tspi_TPM_PcrRead (conn->tpm, index, &len, &value);
+        if (result != TSS_SUCCESS) {
+            fprintf (stderr, "Failed to read PCR %d: %s\n",
+                     index, Trspi_Error_String (result));
+            return result;
+        }
+        if (len != PCR_LEN) {
+            fprintf (stderr, "Unexpected length %u of PCR %d\n", len, index);
+            return TSS_E_FAIL;
+        }
+        memcpy (op->values->value[index], value, PCR_LEN);
+    }
+    return TSS_SUCCESS;
+}
+
+/*  Read the PCRs and, with a log, its length under the shared lock.
+ */
+static int
+watch_read (tss_pool_t *pool, evlog_t *log, uint32_t mask,
+            pcr_values_t *values, off_t *length)
+{
+    read_op_t op = { .mask = mask, .values = values };
+    TSS_RESULT result;
+
+    if (log) {
+        if (evlog_lock (log, false))
+            return -1;
+        *length = evlog_size (log);
+    }
+    result = tss_pool_run (pool, read_pcrs_op, &op, true);
+    if (log)
+        evlog_unlock (log);
+    return result == TSS_SUCCESS && (!log || *length != -1) ? 0 : -1;
+}
+
+static void
+print_hex (FILE *file, const BYTE *buf, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i)
+        fprintf (file, "%02x", buf[i]);
+}
+
+/*  Watch the PCRs in mask until interrupted. The poll interval starts
+ *  at WATCH_MIN_MS after every change and doubles up to max_ms while
+ *  nothing changes. The event log is watched with inotify so extends
+ *  made through it are seen without waiting for the next poll, the
+ *  polls still catch extends made by anything else.
+ */
+static int
+watch_pcrs (uint32_t mask, evlog_t *log, unsigned long max_ms)
+{
+    struct sigaction action = { .sa_handler = watch_signal };
+    struct pollfd pfd = { .fd = -1, .events = POLLIN };
+    char events[4096];
+    pcr_values_t old, new;
+    struct timespec now;
+    tss_pool_t *pool;
+    TPM_PCRINDEX index;
+    unsigned long interval = WATCH_MIN_MS;
+    off_t length = 0;
+    bool changed;
+    int ret = -1;
+
+    pool = tss_pool_new (1);
+    if (pool == NULL)
+        return -1;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+    if (log) {
+        pfd.fd = inotify_init1 (IN_CLOEXEC | IN_NONBLOCK);
+        if (pfd.fd == -1 ||
+            inotify_add_watch (pfd.fd, log->path, IN_MODIFY) == -1) {
+            perror ("inotify:\n");
+            goto watch_out;
+        }
+    }
+    if (watch_read (pool, log, mask, &old, &length))
+        goto watch_out;
+    while (!watch_stop) {
+        if (poll (&pfd, pfd.fd == -1 ? 0 : 1, interval) > 0) {
+            while (read (pfd.fd, events, sizeof (events)) > 0)
+                ;
+        }
+        if (watch_stop)
+            break;
+        if (watch_read (pool, log, mask, &new, &length))
+            goto watch_out;
+        clock_gettime (CLOCK_REALTIME, &now);
+        changed = false;
+        for (index = 0; index < PCR_COUNT; ++index) {
+            if (!(mask & (1U << index)) ||
+                memcmp (old.value[index], new.value[index], PCR_LEN) == 0)
+                continue;
+            printf ("{\"time\":%lld.%03ld,\"pcr\":%d,\"old\":\"",
+                    (long long)now.tv_sec, now.tv_nsec / 1000000, index);
+            print_hex (stdout, old.value[index], PCR_LEN);
+            printf ("\",\"new\":\"");
+            print_hex (stdout, new.value[index], PCR_LEN);
+            if (log)
+                printf ("\",\"log\":%lld}\n", (long long)length);
+            else
+                printf ("\"}\n");
+            changed = true;
+        }
+        if (changed) {
+            fflush (stdout);
+            old = new;
+            interval = WATCH_MIN_MS;
+        } else if (interval < max_ms) {
+            interval = interval * 2 < max_ms ? interval * 2 : max_ms;
+        }
+    }
+    ret = 0;
+watch_out:
+    if (pfd.fd != -1)
+        close (pfd.fd);
+    tss_pool_free (pool);
+    return ret;
+}
+
+/*  Compare the PCRs in mask, or every PCR with a baseline value if mask
+ *  is empty, with the baseline. Returns EXIT_MISMATCH if any differ.
+ */
+static int
+expect_pcrs (uint32_t mask, evlog_t *log, const char *path)
+{
+    baseline_t *baseline;
+    pcr_values_t values;
+    tss_pool_t *pool = NULL;
+    TPM_PCRINDEX index;
+    off_t length = 0;
+    bool match, all = true, first = true;
+    int ret = -1;
+
+    baseline = baseline_load (path);
+    if (baseline == NULL)
+        return -1;
+    if (mask == 0)
+        mask = baseline_mask (baseline, BASELINE_SHA1);
+    if (mask == 0) {
+        fprintf (stderr, "Baseline %s has no sha1 values.\n", path);
+        goto expect_out;
+    }
+    pool = tss_pool_new (1);
+    if (pool == NULL)
+        goto expect_out;
+    if (watch_read (pool, log, mask, &values, &length))
+        goto expect_out;
+    printf ("{\"pcrs\":[");
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(mask & (1U << index)))
+            continue;
+        match = baseline_match (baseline, BASELINE_SHA1, index,
+                                values.value[index]);
+        all = all && match;
+        printf ("%s{\"pcr\":%d,\"value\":\"", first ? "" : ",", index);
+        print_hex (stdout, values.value[index], PCR_LEN);
+        printf ("\",\"match\":%s}", match ? "true" : "false");
+        first = false;
+    }
+    printf ("]");
+    if (log)
+        printf (",\"log\":%lld", (long long)length);
+    printf (",\"result\":\"%s\"}\n", all ? "match" : "mismatch");
+    ret = all ? 0 : EXIT_MISMATCH;
+expect_out:
+    tss_pool_free (pool);
+    baseline_free (baseline);
+    return ret;
+}
+
+static void
+print_json_string (FILE *file, const char *str, size_t len)
+{
+    size_t i;
+
+    fputc ('"', file);
+    for (i = 0; i < len; ++i) {
+        if (str[i] == '"' || str[i] == '\\')
+            fprintf (file, "\\%c", str[i]);
+        else if ((unsigned char)str[i] < 0x20)
+            fprintf (file, "\\u%04x", (unsigned char)str[i]);
+        else
+            fputc (str[i], file);
+    }
+    fputc ('"', file);
+}
+
+static int
+parse_digest (const char *hex, size_t hex_len, unsigned char *buf,
+              size_t len)
+{
+    if (hex_len != len * 2)
+        return -1;
+    return hex_parse (hex, buf, len);
+}
+
+#define AGGREGATE_DESC "aggregate "
+
+/*  A record of pcr-extend --aggregate lists in its description the
+ *  digests whose SHA1 was extended. It's known if they hash to the
+ *  record's digest and each of them is in the golden database.
+ */
+static bool
+golden_aggregate (const golden_t *golden, const unsigned char *digest,
+                  size_t digest_len, const char *desc, const char *eol)
+{
+    unsigned char component[PCR_LEN], sum[EVP_MAX_MD_SIZE];
+    const char *p = desc + strlen (AGGREGATE_DESC);
+    unsigned long count = 0, i;
+    EVP_MD_CTX *ctx;
+    bool known = false;
+
+    if (digest_len != PCR_LEN || golden_digest_len (golden) != PCR_LEN ||
+        (size_t)(eol - desc) <= strlen (AGGREGATE_DESC) ||
+        memcmp (desc, AGGREGATE_DESC, strlen (AGGREGATE_DESC)))
+        return false;
+    for (; p < eol && *p >= '0' && *p <= '9'; ++p) {
+        count = count * 10 + (*p - '0');
+        if (count > (size_t)(eol - desc))
+            return false;
+    }
+    if (count == 0 || (size_t)(eol - p) != count * (PCR_LEN * 2 + 1))
+        return false;
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL || EVP_DigestInit (ctx, EVP_sha1 ()) == 0)
+        goto aggregate_fail;
+    for (i = 0; i < count; ++i, p += PCR_LEN * 2 + 1) {
+        if (*p != ' ' || hex_parse (p + 1, component, PCR_LEN) ||
+            !golden_contains (golden, component))
+            goto aggregate_out;
+        if (EVP_DigestUpdate (ctx, component, PCR_LEN) == 0)
+            goto aggregate_fail;
+    }
+    if (EVP_DigestFinal (ctx, sum, NULL) == 0)
+        goto aggregate_fail;
+    known = memcmp (sum, digest, PCR_LEN) == 0;
+    goto aggregate_out;
+aggregate_fail:
+    ERR_print_errors_fp (stderr);
+aggregate_out:
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    return known;
+}
+
+/*  Look up the digest of every record of the log, for the PCRs in mask
+ *  or all of them if it's empty, in the golden database at path, or
+ *  for aggregated records the digests they list. The log is append
+ *  only, so once its length is taken under the shared lock that much
+ *  of it can be read without holding the lock. Returns EXIT_MISMATCH
+ *  if any digest isn't in the database.
+ */
+static int
+golden_check (uint32_t mask, evlog_t *log, const char *path)
+{
+    unsigned char digest[GOLDEN_DIGEST_MAX];
+    const char *line, *eol, *hex, *hex_end, *desc;
+    char *map = MAP_FAILED, *end;
+    golden_t *golden;
+    size_t records = 0, unknown = 0, lineno = 0, digest_len;
+    unsigned long index;
+    off_t length;
+    int ret = -1;
+
+    golden = golden_open (path);
+    if (golden == NULL)
+        return -1;
+    digest_len = golden_digest_len (golden);
+    if (evlog_lock (log, false))
+        goto golden_out;
+    length = evlog_size (log);
+    if (length > 0)
+        map = mmap (NULL, length, PROT_READ, MAP_SHARED, log->fd, 0);
+    evlog_unlock (log);
+    if (length == -1)
+        goto golden_out;
+    if (length > 0 && map == MAP_FAILED) {
+        perror ("mmap:\n");
+        goto golden_out;
+    }
+    printf ("{\"unknown\":[");
+    for (line = map; length > 0 && line < map + length; line = eol + 1) {
+        eol = memchr (line, '\n', map + length - line);
+        if (eol == NULL)
+            eol = map + length;
+        ++lineno;
+        index = strtoul (line, &end, 10);
+        if (end == line || end >= eol || *end != ' ' || index >= PCR_COUNT) {
+            fprintf (stderr, "Malformed record at line %zu of %s\n",
+                     lineno, log->path);
+            printf ("]}\n");
+            goto golden_out;
+        }
+        if (mask && !(mask & (1U << index)))
+            continue;
+        hex = end + 1;
+        desc = memchr (hex, ' ', eol - hex);
+        if (desc == NULL)
+            desc = eol;
+        ++records;
+        hex_end = desc;
+        if (desc < eol)
+            ++desc;
+        if (parse_digest (hex, hex_end - hex, digest, digest_len) == 0 &&
+            (golden_contains (golden, digest) ||
+             golden_aggregate (golden, digest, digest_len, desc, eol)))
+            continue;
+        printf ("%s{\"line\":%zu,\"pcr\":%lu,\"digest\":",
+                unknown ? "," : "", lineno, index);
+        print_json_string (stdout, hex, hex_end - hex);
+        printf (",\"desc\":");
+        print_json_string (stdout, desc, eol - desc);
+        printf ("}");
+        ++unknown;
+    }
+    printf ("],\"records\":%zu,\"log\":%lld,\"result\":\"%s\"}\n",
+            records, (long long)length, unknown ? "mismatch" : "match");
+    ret = unknown ? EXIT_MISMATCH : 0;
+golden_out:
+    if (map != MAP_FAILED)
+        munmap (map, length);
+    golden_close (golden);
+    return ret;
+}
+
 int
 main (int argc, char *argv[])
 {
     dump_args_t dump_args = { 0 };
+    evlog_t *log = NULL;
     int ret = 0;
 
     if (ret = argp_parse (&dump_argp, argc, argv, 0, NULL, &dump_args)) {
@@ -162,14 +659,44 @@ main (int argc, char *argv[])
     }
     if (dump_args.verbose)
         dump_args_dump (&dump_args);
-    if (dump_args.pcr_set == false) {
+    if (dump_args.pcr_set == false && !dump_args.expect &&
+        !dump_args.golden) {
         ret = 1;
         fprintf (stderr, "No PCR provided.\n");
         goto main_out;
     }
-    if (ret = dump_pcr (dump_args.pcr_index) != 0)
+    if (dump_args.log) {
+        log = evlog_open (dump_args.log, false);
+        if (log == NULL) {
+            ret = 1;
+            goto main_out;
+        }
+    }
+    if (dump_args.golden) {
+        if (log == NULL) {
+            ret = 1;
+            fprintf (stderr, "--golden checks the event log, --log is "
+                     "required.\n");
+            goto main_out;
+        }
+        ret = golden_check (dump_args.pcr_mask, log, dump_args.golden);
+        goto main_out;
+    }
+    if (dump_args.expect) {
+        ret = expect_pcrs (dump_args.pcr_mask, log, dump_args.expect);
+        goto main_out;
+    }
+    if (dump_args.watch) {
+        ret = watch_pcrs (dump_args.pcr_mask, log, dump_args.interval_ms ?
+                          dump_args.interval_ms : WATCH_MAX_MS);
+        goto main_out;
+    }
+    if (ret = dump_pcr (dump_args.pcr_mask, log) != 0)
         goto main_out;
 main_out:
+    evlog_close (log);
+    if (ret == EXIT_MISMATCH)
+        exit (EXIT_MISMATCH);
     if (ret)
         exit (EXIT_FAILURE);
     exit (EXIT_SUCCESS);
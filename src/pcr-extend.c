@@ -17,21 +17,108 @@
  */
 
 #include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
 #include <tss/tspi.h>
 #include <trousers/trousers.h>
+#include <unistd.h>
 
-#define BUF_SIZE 1024
+#include "aggregate.h"
+#include "evlog.h"
+#include "filter.h"
+#include "git.h"
+#include "golden.h"
+#include "hashd.h"
+#include "hash.h"
+#include "oci.h"
+#include "pe.h"
+#include "pkgdb.h"
+#include "proc.h"
+#include "record.h"
+#include "sweep.h"
+#include "profile.h"
+#include "tpm.h"
+#include "tree.h"
+#include "verity.h"
 
 error_t
 parse_opts (int key, char *arg, struct argp_state *state);
 
+#define KEY_ARGV 0x100
+#define KEY_VERITY_SAMPLE 0x101
+#define KEY_SWEEP_STATE 0x102
+#define KEY_BUDGET 0x103
+
+extern char **environ;
+
+/*  Digests to extend into the PCR, in order.
+ */
+typedef struct measurements {
+    char **hashes;
+    unsigned int *hash_lens;
+    size_t count;
+} measurements_t;
+
+/*  Measurements taken from memory rather than a file.
+ */
+typedef enum inline_kind {
+    INLINE_DATA,
+    INLINE_ENV,
+    INLINE_ARGV,
+} inline_kind_t;
+
+typedef struct inline_item {
+    inline_kind_t kind;
+    char *arg;
+} inline_item_t;
+
 typedef struct extend_args {
     char *file;
+    bool blake3;
+    bool stream;
+    record_format_t stream_format;
+    char *hashd;
+    char *directory;
+    char *git;
+    char *oci;
+    bool oci_layers;
+    char *pe;
+    char *verity;
+    unsigned int verity_samples;
+    char *sweep;
+    char *sweep_state;
+    unsigned long budget_s;
+    uint64_t sweep_number;
+    char *cache;
+    unsigned int jobs;
+    pid_t *pids;
+    size_t pid_count;
+    inline_item_t *inlines;
+    size_t inline_count;
+    char **cmd;
+    size_t cmd_count;
+    bool rodata;
+    bool dry_run;
+    unsigned long aggregate_ms;
+    char *log;
+    char *golden;
+    golden_t *golden_db;    /* opened from golden */
+    char *record_profile;
+    char *readahead;
+    filter_t *filter;
+    char *manifest;
+    size_t mem_limit;
+    char *packages;
+    unsigned int sample_percent;
     TPM_PCRINDEX pcr_index;
     bool pcr_set;
     bool verbose;
@@ -46,6 +133,253 @@ const struct argp_option extend_opts[] = {
         .doc   = "File containing data to extend into the PCR.",
         .group = 0,
     },
+    {
+        .name  = "blake3",
+        .key   = 'B',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Hash the file (or stdin) with BLAKE3 and extend the SHA1 "
+                 "of the record 'blake3:<hex digest>'.",
+        .group = 0,
+    },
+    {
+        .name  = "stream",
+        .key   = 's',
+        .arg   = "line|nul|length",
+        .flags = 0,
+        .doc   = "Split the file (or stdin) into newline or NUL terminated "
+                 "records, or records preceded by a 32 bit big-endian "
+                 "length, and extend the SHA1 of each as it's read. With "
+                 "--aggregate records are batched and each digest is "
+                 "listed with its batch.",
+        .group = 0,
+    },
+    {
+        .name  = "hashd",
+        .key   = 'H',
+        .arg   = "socket",
+        .flags = 0,
+        .doc   = "Have the pcr-hashd service listening on socket hash the "
+                 "file (or stdin).",
+        .group = 0,
+    },
+    {
+        .name  = "directory",
+        .key   = 'd',
+        .arg   = "dir",
+        .flags = 0,
+        .doc   = "Directory tree to measure and extend into the PCR.",
+        .group = 0,
+    },
+    {
+        .name  = "git",
+        .key   = 'g',
+        .arg   = "dir",
+        .flags = 0,
+        .doc   = "Git checkout to measure by the tree id of its working "
+                 "tree, trusting the index stat cache for unchanged files.",
+        .group = 0,
+    },
+    {
+        .name  = "oci",
+        .key   = 'I',
+        .arg   = "dir",
+        .flags = 0,
+        .doc   = "OCI image layout to verify, extending the digest of each "
+                 "image manifest.",
+        .group = 0,
+    },
+    {
+        .name  = "oci-layers",
+        .key   = 'L',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Also extend the digest of every layer of each OCI image.",
+        .group = 0,
+    },
+    {
+        .name  = "pe",
+        .key   = 'e',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "PE/COFF image (EFI application or UKI) to measure by its "
+                 "SHA1 Authenticode digest, as firmware does into PCR 4.",
+        .group = 0,
+    },
+    {
+        .name  = "verity",
+        .key   = 'V',
+        .arg   = "device",
+        .flags = 0,
+        .doc   = "dm-verity device (node or mapping name) to measure by "
+                 "its active table: root hash, salt and hash tree "
+                 "parameters, without reading the device.",
+        .group = 0,
+    },
+    {
+        .name  = "verity-sample",
+        .key   = KEY_VERITY_SAMPLE,
+        .arg   = "blocks",
+        .flags = 0,
+        .doc   = "Check this many random data blocks of the verity device "
+                 "against its hash tree first.",
+        .group = 0,
+    },
+    {
+        .name  = "sweep",
+        .key   = 'W',
+        .arg   = "list",
+        .flags = 0,
+        .doc   = "Measure the files of list (lines of '<priority> <path>') "
+                 "over as many runs as the budget requires, extending the "
+                 "sweep's digest once every file is done.",
+        .group = 0,
+    },
+    {
+        .name  = "sweep-state",
+        .key   = KEY_SWEEP_STATE,
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Checkpoint of the sweep between runs.",
+        .group = 0,
+    },
+    {
+        .name  = "budget",
+        .key   = KEY_BUDGET,
+        .arg   = "seconds",
+        .flags = 0,
+        .doc   = "How long this run of the sweep may hash for, the rest "
+                 "is left for the next one (default no limit).",
+        .group = 0,
+    },
+    {
+        .name  = "cache",
+        .key   = 'C',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Cache of verified OCI blobs or of the file digests of a "
+                 "directory measurement, files unchanged since they were "
+                 "hashed aren't read again.",
+        .group = 0,
+    },
+    {
+        .name  = "jobs",
+        .key   = 'j',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Number of blobs to verify concurrently, defaults to the "
+                 "number of CPUs.",
+        .group = 0,
+    },
+    {
+        .name  = "pid",
+        .key   = 'r',
+        .arg   = "pid",
+        .flags = 0,
+        .doc   = "Running process whose executable mappings are measured. "
+                 "May be given several times, each process is extended "
+                 "separately.",
+        .group = 0,
+    },
+    {
+        .name  = "data",
+        .key   = 'D',
+        .arg   = "string",
+        .flags = 0,
+        .doc   = "Measure string itself. --data, --env and --argv may be "
+                 "given several times, each is extended separately.",
+        .group = 0,
+    },
+    {
+        .name  = "env",
+        .key   = 'E',
+        .arg   = "names",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Measure the environment, or only the comma separated "
+                 "names, as sorted NAME=VALUE strings (an unset name is "
+                 "measured as NAME).",
+        .group = 0,
+    },
+    {
+        .name  = "argv",
+        .key   = KEY_ARGV,
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Measure the command line given after '--'.",
+        .group = 0,
+    },
+    {
+        .name  = "rodata",
+        .key   = 'R',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Also measure the read-only data following each text "
+                 "mapping of a process.",
+        .group = 0,
+    },
+    {
+        .name  = "exclude",
+        .key   = 'x',
+        .arg   = "pattern",
+        .flags = 0,
+        .doc   = "Exclude paths matching pattern from the directory "
+                 "measurement. Rules apply in order, first match wins.",
+        .group = 0,
+    },
+    {
+        .name  = "include",
+        .key   = 'i',
+        .arg   = "pattern",
+        .flags = 0,
+        .doc   = "Include paths matching pattern in the directory "
+                 "measurement.",
+        .group = 0,
+    },
+    {
+        .name  = "exclude-type",
+        .key   = 't',
+        .arg   = "type",
+        .flags = 0,
+        .doc   = "Exclude files of type (file, dir, symlink, fifo, socket, "
+                 "char or block) from the directory measurement.",
+        .group = 0,
+    },
+    {
+        .name  = "manifest",
+        .key   = 'o',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Write the manifest of the directory measurement to file.",
+        .group = 0,
+    },
+    {
+        .name  = "memory-limit",
+        .key   = 'm',
+        .arg   = "bytes[KMG]",
+        .flags = 0,
+        .doc   = "Bound the memory used to hold directory entries, spilling "
+                 "to TMPDIR beyond it.",
+        .group = 0,
+    },
+    {
+        .name  = "packages",
+        .key   = 'P',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Reuse the SHA-256 file digests in file ('rpm -qa --dump' "
+                 "output) for the directory measurement. Files are then "
+                 "hashed with SHA-256.",
+        .group = 0,
+    },
+    {
+        .name  = "sample",
+        .key   = 'S',
+        .arg   = "percent",
+        .flags = 0,
+        .doc   = "Percentage of reused package digests to check by hashing "
+                 "the file anyway (default 1).",
+        .group = 0,
+    },
     {
         .name = "pcr",
         .key = 'p',
@@ -54,6 +388,62 @@ const struct argp_option extend_opts[] = {
         .doc = "The PCR to extend.",
         .group = 0,
     },
+    {
+        .name  = "record-profile",
+        .key   = 'w',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Record the files read by this measurement to a readahead "
+                 "profile.",
+        .group = 0,
+    },
+    {
+        .name  = "readahead",
+        .key   = 'a',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Read ahead the files in profile, in on-disk order, while "
+                 "measuring. A missing profile is ignored.",
+        .group = 0,
+    },
+    {
+        .name  = "aggregate",
+        .key   = 'A',
+        .arg   = "ms",
+        .flags = 0,
+        .doc   = "Extend measurements in batches, one extend per batch, "
+                 "adapting the batch window to the TPM so that the p99 "
+                 "latency of a measurement stays within ms.",
+        .group = 0,
+    },
+    {
+        .name  = "log",
+        .key   = 'l',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Append a record of each extend to the event log file, "
+                 "atomically with the extend as seen by 'pcr-dump --log'.",
+        .group = 0,
+    },
+    {
+        .name  = "golden",
+        .key   = 'G',
+        .arg   = "db",
+        .flags = 0,
+        .doc   = "Only extend digests found in the golden digest database "
+                 "db built by pcr-golden-build. If any measurement isn't "
+                 "there none are extended and the run fails, a stream "
+                 "stops before the batch holding the unknown record.",
+        .group = 0,
+    },
+    {
+        .name  = "dry-run",
+        .key   = 'n',
+        .arg   = NULL,
+        .flags = 0,
+        .doc   = "Print the measurements without extending them.",
+        .group = 0,
+    },
     {
         .name = "verbose",
         .key = 'v',
@@ -68,19 +458,191 @@ const struct argp_option extend_opts[] = {
 const struct argp extend_argp = {
     .options  = extend_opts,
     .parser   = parse_opts,
-    .args_doc = NULL,
+    .args_doc = "[-- ARGV...]",
     .doc      = "Arguments for the PCR extend utility."
 };
 
+static int
+parse_size (const char *arg, size_t *size)
+{
+    char *end = NULL;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull (arg, &end, 10);
+    if (errno || end == arg)
+        return -1;
+    switch (*end) {
+        case 'G': case 'g':
+            value <<= 10;
+            /* fall through */
+        case 'M': case 'm':
+            value <<= 10;
+            /* fall through */
+        case 'K': case 'k':
+            value <<= 10;
+            ++end;
+            break;
+    }
+    if (*end != '\0')
+        return -1;
+    *size = value;
+    return 0;
+}
+
+static int
+inline_add (extend_args_t *args, inline_kind_t kind, char *arg)
+{
+    inline_item_t *items;
+
+    items = realloc (args->inlines,
+                     (args->inline_count + 1) * sizeof (inline_item_t));
+    if (items == NULL) {
+        perror ("realloc of inline measurements:\n");
+        return ENOMEM;
+    }
+    items[args->inline_count].kind = kind;
+    items[args->inline_count].arg = arg;
+    args->inlines = items;
+    ++args->inline_count;
+    return 0;
+}
+
 error_t
 parse_opts (int key, char *arg, struct argp_state *state)
 {
     extend_args_t *args = state->input;
+    pid_t *pids;
 
     switch (key) {
         case 'f':
             args->file = arg;
             break;
+        case 'B':
+#ifdef HAVE_BLAKE3
+            args->blake3 = true;
+            break;
+#else
+            fprintf (stderr, "Built without BLAKE3 support.\n");
+            return EINVAL;
+#endif
+        case 's':
+            if (record_format_parse (arg, &args->stream_format)) {
+                fprintf (stderr, "Invalid record format: %s\n", arg);
+                return EINVAL;
+            }
+            args->stream = true;
+            break;
+        case 'H':
+            args->hashd = arg;
+            break;
+        case 'd':
+            args->directory = arg;
+            break;
+        case 'g':
+            args->git = arg;
+            break;
+        case 'I':
+            args->oci = arg;
+            break;
+        case 'L':
+            args->oci_layers = true;
+            break;
+        case 'e':
+            args->pe = arg;
+            break;
+        case 'V':
+            args->verity = arg;
+            break;
+        case KEY_VERITY_SAMPLE:
+            args->verity_samples = strtoul (arg, NULL, 10);
+            break;
+        case 'W':
+            args->sweep = arg;
+            break;
+        case KEY_SWEEP_STATE:
+            args->sweep_state = arg;
+            break;
+        case KEY_BUDGET:
+            args->budget_s = strtoul (arg, NULL, 10);
+            break;
+        case 'C':
+            args->cache = arg;
+            break;
+        case 'j':
+            args->jobs = strtoul (arg, NULL, 10);
+            break;
+        case 'r':
+            pids = realloc (args->pids, (args->pid_count + 1) * sizeof (pid_t));
+            if (pids == NULL) {
+                perror ("realloc of pid list:\n");
+                return ENOMEM;
+            }
+            args->pids = pids;
+            args->pids[args->pid_count++] = strtol (arg, NULL, 10);
+            break;
+        case 'D':
+            return inline_add (args, INLINE_DATA, arg);
+        case 'E':
+            return inline_add (args, INLINE_ENV, arg);
+        case KEY_ARGV:
+            return inline_add (args, INLINE_ARGV, NULL);
+        case ARGP_KEY_ARGS:
+            args->cmd = state->argv + state->next;
+            args->cmd_count = state->argc - state->next;
+            break;
+        case 'R':
+            args->rodata = true;
+            break;
+        case 'A':
+            args->aggregate_ms = strtoul (arg, NULL, 10);
+            if (args->aggregate_ms == 0) {
+                fprintf (stderr, "Invalid aggregation target: %s\n", arg);
+                return EINVAL;
+            }
+            break;
+        case 'l':
+            args->log = arg;
+            break;
+        case 'G':
+            args->golden = arg;
+            break;
+        case 'n':
+            args->dry_run = true;
+            break;
+        case 'w':
+            args->record_profile = arg;
+            break;
+        case 'a':
+            args->readahead = arg;
+            break;
+        case 'x':
+            if (filter_add_pattern (args->filter, FILTER_EXCLUDE, arg))
+                return EINVAL;
+            break;
+        case 'i':
+            if (filter_add_pattern (args->filter, FILTER_INCLUDE, arg))
+                return EINVAL;
+            break;
+        case 't':
+            if (filter_add_type (args->filter, FILTER_EXCLUDE, arg))
+                return EINVAL;
+            break;
+        case 'o':
+            args->manifest = arg;
+            break;
+        case 'P':
+            args->packages = arg;
+            break;
+        case 'S':
+            args->sample_percent = strtoul (arg, NULL, 10);
+            break;
+        case 'm':
+            if (parse_size (arg, &args->mem_limit)) {
+                fprintf (stderr, "Invalid memory limit: %s\n", arg);
+                return EINVAL;
+            }
+            break;
         case 'p':
             args->pcr_index = strtol (arg, NULL, 10);
             args->pcr_set = true;
@@ -99,6 +661,35 @@ extend_args_dump (extend_args_t *args)
 {
     printf ("User provided options:\n");
     printf ("  file: %s\n", args->file);
+    printf ("  blake3: %s\n", args->blake3 ? "true" : "false");
+    printf ("  hashd: %s\n", args->hashd);
+    printf ("  stream: %s\n", args->stream ? "true" : "false");
+    printf ("  directory: %s\n", args->directory);
+    printf ("  git: %s\n", args->git);
+    printf ("  oci: %s\n", args->oci);
+    printf ("  oci-layers: %s\n", args->oci_layers ? "true" : "false");
+    printf ("  pe: %s\n", args->pe);
+    printf ("  verity: %s\n", args->verity);
+    printf ("  verity-sample: %u\n", args->verity_samples);
+    printf ("  sweep: %s\n", args->sweep);
+    printf ("  sweep-state: %s\n", args->sweep_state);
+    printf ("  budget: %lu\n", args->budget_s);
+    printf ("  cache: %s\n", args->cache);
+    printf ("  jobs: %u\n", args->jobs);
+    printf ("  pids: %zu\n", args->pid_count);
+    printf ("  inline: %zu\n", args->inline_count);
+    printf ("  argv: %zu\n", args->cmd_count);
+    printf ("  rodata: %s\n", args->rodata ? "true" : "false");
+    printf ("  dry-run: %s\n", args->dry_run ? "true" : "false");
+    printf ("  aggregate: %lu\n", args->aggregate_ms);
+    printf ("  log: %s\n", args->log);
+    printf ("  golden: %s\n", args->golden);
+    printf ("  record-profile: %s\n", args->record_profile);
+    printf ("  readahead: %s\n", args->readahead);
+    printf ("  manifest: %s\n", args->manifest);
+    printf ("  memory-limit: %zu\n", args->mem_limit);
+    printf ("  packages: %s\n", args->packages);
+    printf ("  sample: %u\n", args->sample_percent);
     printf ("  pcr:  %d\n", args->pcr_index);
     printf ("  pcr_set: %s\n", args->pcr_set ? "true" : "false");
     printf ("  verbose: %s\n", args->verbose ? "true" : "false");
@@ -115,114 +706,754 @@ dump_buf (FILE *file, char *buf, size_t length)
     fprintf (file, "\n");
 }
 
-static unsigned char*
-sha1_file (FILE *file, unsigned int *hash_len)
+typedef struct extend_op {
+    TPM_PCRINDEX index;
+    char *hash;
+    size_t hash_len;
+} extend_op_t;
+
+static TSS_RESULT
+extend_pcr_op (tss_conn_t *conn, void *arg)
+{
+    extend_op_t *op = arg;
+    TSS_RESULT result;
+    UINT32 pcr_before_len = 0, pcr_after_len = 0;
+    BYTE *pcr_before = NULL, *pcr_after = NULL;
+
+    result = Tspi_TPM_PcrRead (conn->tpm, op->index, &pcr_before_len,
+                               &pcr_before);
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to read PCR %d: %s\n",
+                 op->index, Trspi_Error_String (result));
+        return result;
+    }
+    fprintf (stdout, "Current value for PCR %d:\n  ", op->index);
+    dump_buf (stdout, pcr_before, pcr_before_len);
+    fprintf (stdout, "Extending PCR %d with data:\n  ", op->index);
+    dump_buf (stdout, op->hash, op->hash_len);
+    /* extend the PCR ... finally */
+    result = Tspi_TPM_PcrExtend (conn->tpm, op->index, op->hash_len, op->hash,
+                                 NULL, &pcr_after_len, &pcr_after);
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to extend PCR %d: %s\n",
+                 op->index, Trspi_Error_String (result));
+        return result;
+    }
+    fprintf (stdout, "New state for PCR %d:\n  ", op->index);
+    dump_buf (stdout, pcr_after, pcr_after_len);
+    return result;
+}
+
+/*  Extend a hash into the PCR through a pooled TSS context. With an
+ *  event log the extend and its record happen under the log's lock.
+ */
+static int
+extend_pcr (tss_pool_t *pool, evlog_t *log, TPM_PCRINDEX index, char *hash,
+            size_t hash_len, const char *desc)
+{
+    extend_op_t op = {
+        .index = index,
+        .hash = hash,
+        .hash_len = hash_len,
+    };
+    int ret = -1;
+
+    if (log && evlog_lock (log, true))
+        return -1;
+    if (tss_pool_run (pool, extend_pcr_op, &op, false) != TSS_SUCCESS)
+        goto extend_out;
+    if (log && evlog_append (log, index, hash, hash_len, desc))
+        goto extend_out;
+    ret = 0;
+extend_out:
+    if (log)
+        evlog_unlock (log);
+    return ret;
+}
+
+/*  Describe measurement i of this run for the event log.
+ */
+static void
+extend_desc (extend_args_t *args, size_t i, char *desc, size_t size)
+{
+    if (args->directory)
+        snprintf (desc, size, "directory %s", args->directory);
+    else if (args->git)
+        snprintf (desc, size, "git %s", args->git);
+    else if (args->oci)
+        snprintf (desc, size, "oci %s %zu", args->oci, i);
+    else if (args->pe)
+        snprintf (desc, size, "pe %s", args->pe);
+    else if (args->verity)
+        snprintf (desc, size, "verity %s", args->verity);
+    else if (args->sweep)
+        snprintf (desc, size, "sweep %s %llu", args->sweep,
+                  (unsigned long long)args->sweep_number);
+    else if (args->pid_count)
+        snprintf (desc, size, "pid %d", (int)args->pids[i]);
+    else if (args->inline_count && args->inlines[i].kind == INLINE_DATA)
+        snprintf (desc, size, "data");
+    else if (args->inline_count && args->inlines[i].kind == INLINE_ENV)
+        snprintf (desc, size, "env %s",
+                  args->inlines[i].arg ? args->inlines[i].arg : "*");
+    else if (args->inline_count)
+        snprintf (desc, size, "argv");
+    else if (args->file)
+        snprintf (desc, size, "file %s", args->file);
+    else
+        snprintf (desc, size, "stdin");
+}
+
+/*  Look a measurement up in the golden database, if there is one, and
+ *  report it when it isn't there.
+ */
+static bool
+golden_known (extend_args_t *args, const char *hash, unsigned int hash_len,
+              const char *desc)
+{
+    unsigned int i;
+
+    if (args->golden_db == NULL)
+        return true;
+    if (hash_len == golden_digest_len (args->golden_db) &&
+        golden_contains (args->golden_db, (const unsigned char*)hash))
+        return true;
+    fprintf (stderr, "Not in golden database %s: ", args->golden);
+    for (i = 0; i < hash_len; ++i)
+        fprintf (stderr, "%02x", (unsigned char)hash[i]);
+    fprintf (stderr, " %s\n", desc);
+    return false;
+}
+
+/*  Extend the list in adaptive batches. The batch log goes to stdout.
+ */
+static int
+extend_aggregate (extend_args_t *args, tss_pool_t *pool, evlog_t *log,
+                  measurements_t *list)
+{
+    aggregator_t *agg;
+    agg_stats_t stats;
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < list->count; ++i) {
+        if (list->hash_lens[i] != AGG_DIGEST_LEN) {
+            fprintf (stderr, "Measurement %zu isn't a SHA1 digest.\n", i);
+            return -1;
+        }
+    }
+    agg = agg_new (pool, args->pcr_index,
+                   (uint64_t)args->aggregate_ms * 1000000ULL, stdout, log);
+    if (agg == NULL)
+        return -1;
+    for (i = 0; i < list->count && ret == 0; ++i)
+        ret = agg_submit (agg, (unsigned char*)list->hashes[i]);
+    if (agg_close (agg, &stats))
+        ret = -1;
+    if (args->verbose) {
+        printf ("Aggregated %llu measurements in %llu extends, largest %llu, "
+                "window %lluus, extend %lluus, p99 %lluus\n",
+                (unsigned long long)stats.items,
+                (unsigned long long)stats.batches,
+                (unsigned long long)stats.max_depth,
+                (unsigned long long)stats.window_ns / 1000,
+                (unsigned long long)stats.extend_ns / 1000,
+                (unsigned long long)stats.p99_ns / 1000);
+    }
+    return ret;
+}
+
+#define STREAM_BATCH 4096
+
+/*  Hand the digests of a stream's records to the aggregator, or extend
+ *  them one at a time, or print them for a dry run.
+ */
+static int
+stream_flush (extend_args_t *args, tss_pool_t *pool, evlog_t *log,
+              aggregator_t *agg, unsigned char *digests, size_t count,
+              uint64_t first)
 {
-    EVP_MD_CTX ctx = { 0 };
-    unsigned char *buf = NULL, *hash = NULL;
-    size_t num_read = 0;
+    char desc[64];
+    size_t i;
+    bool known = true;
 
-    buf = malloc (BUF_SIZE);
-    if (buf == NULL) {
-        perror ("malloc:\n");
-        goto sha1_fail;
+    for (i = 0; args->golden_db && i < count; ++i) {
+        snprintf (desc, sizeof (desc), "record %llu",
+                  (unsigned long long)(first + i));
+        known = golden_known (args, (char*)digests + i * AGG_DIGEST_LEN,
+                              AGG_DIGEST_LEN, desc) && known;
     }
-    if (EVP_DigestInit (&ctx, EVP_sha1 ()) == 0) {
-        ERR_print_errors_fp (stderr);
-        goto sha1_fail;
+    if (!known)
+        return -1;
+    if (agg)
+        return agg_submit_many (agg, digests, count);
+    for (i = 0; i < count; ++i) {
+        if (args->dry_run) {
+            fprintf (stdout, "Record %llu:\n  ",
+                     (unsigned long long)(first + i));
+            dump_buf (stdout, (char*)digests + i * AGG_DIGEST_LEN,
+                      AGG_DIGEST_LEN);
+            continue;
+        }
+        snprintf (desc, sizeof (desc), "record %llu",
+                  (unsigned long long)(first + i));
+        if (extend_pcr (pool, log, args->pcr_index,
+                        (char*)digests + i * AGG_DIGEST_LEN, AGG_DIGEST_LEN,
+                        desc))
+            return -1;
     }
-    do {
-        num_read = fread (buf, 1, BUF_SIZE, file);
-        if (num_read <= 0)
+    return 0;
+}
+
+/*  Measure file record by record as it's read. Digests are passed on
+ *  STREAM_BATCH at a time, or as soon as reading more would block so a
+ *  slow stream isn't held back waiting for a full batch.
+ */
+static int
+extend_stream (extend_args_t *args, tss_pool_t *pool, evlog_t *log,
+               FILE *file)
+{
+    unsigned char *digests = NULL;
+    const unsigned char *data;
+    record_reader_t *reader;
+    aggregator_t *agg = NULL;
+    agg_stats_t stats;
+    EVP_MD_CTX *ctx;
+    uint64_t records = 0;
+    size_t count = 0, len;
+    int status, ret = -1;
+
+    ctx = EVP_MD_CTX_create ();
+    reader = record_reader_new (fileno (file), args->stream_format);
+    digests = malloc (STREAM_BATCH * AGG_DIGEST_LEN);
+    if (ctx == NULL || reader == NULL || digests == NULL) {
+        perror ("allocation for record stream:\n");
+        goto stream_out;
+    }
+    if (args->aggregate_ms && !args->dry_run) {
+        agg = agg_new (pool, args->pcr_index,
+                       (uint64_t)args->aggregate_ms * 1000000ULL, stdout,
+                       log);
+        if (agg == NULL)
+            goto stream_out;
+    }
+    for (;;) {
+        status = record_next (reader, false, &data, &len);
+        if (status == RECORD_AGAIN) {
+            if (stream_flush (args, pool, log, agg, digests, count,
+                              records - count))
+                goto stream_out;
+            count = 0;
+            status = record_next (reader, true, &data, &len);
+        }
+        if (status == RECORD_ERROR)
+            goto stream_out;
+        if (status == RECORD_EOF)
             break;
-        if (EVP_DigestUpdate (&ctx, buf, num_read) == 0) {
+        if (EVP_DigestInit_ex (ctx, EVP_sha1 (), NULL) == 0 ||
+            EVP_DigestUpdate (ctx, data, len) == 0 ||
+            EVP_DigestFinal_ex (ctx, digests + count * AGG_DIGEST_LEN,
+                                NULL) == 0) {
             ERR_print_errors_fp (stderr);
-            goto sha1_fail;
+            goto stream_out;
+        }
+        ++records;
+        if (++count == STREAM_BATCH) {
+            if (stream_flush (args, pool, log, agg, digests, count,
+                              records - count))
+                goto stream_out;
+            count = 0;
         }
-    } while (!feof (file) && !ferror (file));
-    if (ferror (file)) {
-        perror ("fread:\n");
-        goto sha1_fail;
     }
-    hash = calloc (1, EVP_MAX_MD_SIZE);
-    if (hash == NULL) {
-        perror ("calloc of hash buffer:\n");
-        goto sha1_fail;
+    if (stream_flush (args, pool, log, agg, digests, count, records - count))
+        goto stream_out;
+    ret = 0;
+stream_out:
+    if (agg) {
+        if (agg_close (agg, &stats))
+            ret = -1;
+        if (args->verbose)
+            printf ("Aggregated %llu records in %llu extends, largest %llu, "
+                    "window %lluus, extend %lluus, p99 %lluus\n",
+                    (unsigned long long)stats.items,
+                    (unsigned long long)stats.batches,
+                    (unsigned long long)stats.max_depth,
+                    (unsigned long long)stats.window_ns / 1000,
+                    (unsigned long long)stats.extend_ns / 1000,
+                    (unsigned long long)stats.p99_ns / 1000);
+    }
+    if (args->verbose)
+        fprintf (stdout, "Measured %llu records\n",
+                 (unsigned long long)records);
+    free (digests);
+    record_reader_free (reader);
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    return ret;
+}
+
+static int
+measurements_add (measurements_t *list, char *hash, unsigned int hash_len)
+{
+    unsigned int *lens;
+    char **hashes;
+
+    hashes = realloc (list->hashes, (list->count + 1) * sizeof (char*));
+    if (hashes)
+        list->hashes = hashes;
+    lens = realloc (list->hash_lens, (list->count + 1) * sizeof (unsigned int));
+    if (lens)
+        list->hash_lens = lens;
+    if (hashes == NULL || lens == NULL) {
+        perror ("realloc of measurements:\n");
+        free (hash);
+        return -1;
+    }
+    list->hashes[list->count] = hash;
+    list->hash_lens[list->count++] = hash_len;
+    return 0;
+}
+
+static void
+measurements_free (measurements_t *list)
+{
+    size_t i;
+
+    for (i = 0; i < list->count; ++i)
+        free (list->hashes[i]);
+    free (list->hashes);
+    free (list->hash_lens);
+}
+
+/*  Add the SHA1 of a textual record, e.g. a digest in "<alg>:<hex>" form.
+ */
+static int
+measurements_add_record (measurements_t *list, const char *record)
+{
+    unsigned int hash_len = 0;
+    char *hash;
+
+    hash = sha1_buf (record, strlen (record), &hash_len);
+    if (hash == NULL)
+        return -1;
+    return measurements_add (list, hash, hash_len);
+}
+
+static char*
+measure_tree (extend_args_t *args, unsigned int *hash_len)
+{
+    tree_opts_t opts = {
+        .filter = args->filter,
+        .mem_limit = args->mem_limit,
+        .sample_percent = args->sample_percent,
+        .cache = args->cache,
+    };
+    tree_stats_t stats = { 0 };
+    pkgdb_t *pkgdb = NULL;
+    char *hash;
+
+    if (args->packages) {
+        pkgdb = pkgdb_load (args->packages);
+        if (pkgdb == NULL)
+            return NULL;
+        opts.pkgdb = pkgdb;
+    }
+    if (args->manifest) {
+        opts.manifest = fopen (args->manifest, "w");
+        if (opts.manifest == NULL) {
+            perror ("fopen of manifest:\n");
+            pkgdb_free (pkgdb);
+            return NULL;
+        }
     }
-    if (EVP_DigestFinal (&ctx, hash, hash_len) == 0) {
-        ERR_print_errors_fp (stderr);
-        goto sha1_fail;
+    hash = sha1_tree (args->directory, &opts, &stats, hash_len);
+    pkgdb_free (pkgdb);
+    if (opts.manifest && fclose (opts.manifest)) {
+        perror ("fclose of manifest:\n");
+        free (hash);
+        return NULL;
     }
-    if (buf)
-        free (buf);
+    if (hash == NULL)
+        return NULL;
+    fprintf (stdout, "Measured %zu entries, %zu spill runs, %zu merges, "
+             "peak entry memory %zu bytes\n", stats.entries, stats.spill_runs,
+             stats.spill_merges, stats.mem_peak);
+    if (args->packages)
+        fprintf (stdout, "Reused %zu package digests, spot-checked %zu\n",
+                 stats.pkg_reused, stats.pkg_checked);
+    if (args->cache)
+        fprintf (stdout, "Reused %zu cached file digests\n",
+                 stats.cache_hits);
     return hash;
-sha1_fail:
-    if (buf)
-        free (buf);
+}
+
+static char*
+measure_git (extend_args_t *args, unsigned int *hash_len)
+{
+    git_stats_t stats = { 0 };
+    char *hash;
+
+    hash = sha1_git_tree (args->git, &stats, hash_len);
     if (hash)
-        free (hash);
-    return NULL;
+        fprintf (stdout, "Measured %zu git index entries, %zu hashed, %zu "
+                 "missing\n", stats.entries, stats.hashed, stats.missing);
+    return hash;
+}
+
+static int
+measure_oci (extend_args_t *args, measurements_t *list)
+{
+    oci_opts_t opts = {
+        .cache = args->cache,
+        .jobs = args->jobs,
+    };
+    oci_image_t image;
+    size_t i, j;
+    int ret = -1;
+
+    if (opts.jobs == 0)
+        opts.jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    if (oci_measure (args->oci, &opts, &image))
+        return -1;
+    for (i = 0; i < image.count; ++i) {
+        fprintf (stdout, "Verified image manifest %s\n",
+                 image.manifests[i].digest);
+        if (measurements_add_record (list, image.manifests[i].digest))
+            goto oci_out;
+        for (j = 0; args->oci_layers && j < image.manifests[i].layer_count;
+             ++j) {
+            if (measurements_add_record (list, image.manifests[i].layers[j]))
+                goto oci_out;
+        }
+    }
+    fprintf (stdout, "Verified %zu blobs, %zu read, %zu from cache\n",
+             image.blobs, image.verified, image.cached);
+    ret = 0;
+oci_out:
+    oci_image_free (&image);
+    return ret;
 }
 
-/*  Read data from file object and extend into PCR till EOF or error.
+static int
+measure_procs (extend_args_t *args, measurements_t *list)
+{
+    proc_result_t *results;
+    char *hash;
+    size_t i;
+    int ret = -1;
+
+    results = calloc (args->pid_count, sizeof (proc_result_t));
+    if (results == NULL) {
+        perror ("calloc of process results:\n");
+        return -1;
+    }
+    if (proc_measure (args->pids, args->pid_count, args->rodata,
+                      args->jobs ? args->jobs : sysconf (_SC_NPROCESSORS_ONLN),
+                      results))
+        goto procs_out;
+    for (i = 0; i < args->pid_count; ++i) {
+        fprintf (stdout, "Process %d: %zu mappings, %zu bytes\n  ",
+                 results[i].pid, results[i].mappings, results[i].bytes);
+        dump_buf (stdout, (char*)results[i].hash, results[i].hash_len);
+        hash = malloc (results[i].hash_len);
+        if (hash == NULL) {
+            perror ("malloc of hash buffer:\n");
+            goto procs_out;
+        }
+        memcpy (hash, results[i].hash, results[i].hash_len);
+        if (measurements_add (list, hash, results[i].hash_len))
+            goto procs_out;
+    }
+    ret = 0;
+procs_out:
+    free (results);
+    return ret;
+}
+
+static int
+str_cmp (const void *a, const void *b)
+{
+    return strcmp (*(char* const*)a, *(char* const*)b);
+}
+
+/*  The environment, or only the comma separated names, as sorted
+ *  NAME=VALUE strings.
+ */
+static unsigned char*
+measure_env (const char *names, unsigned int *hash_len)
+{
+    unsigned char *hash = NULL;
+    char **strings = NULL, **tmp, *copy = NULL, *name, *save, *value;
+    size_t count = 0, size = 0, i;
+
+    if (names) {
+        copy = strdup (names);
+        if (copy == NULL) {
+            perror ("strdup:\n");
+            return NULL;
+        }
+    }
+    name = copy ? strtok_r (copy, ",", &save) : environ[0];
+    for (i = 1; name; ++i) {
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            tmp = realloc (strings, size * sizeof (char*));
+            if (tmp == NULL) {
+                perror ("realloc of environment:\n");
+                goto env_out;
+            }
+            strings = tmp;
+        }
+        value = copy ? getenv (name) : NULL;
+        if (value) {
+            strings[count] = malloc (strlen (name) + strlen (value) + 2);
+            if (strings[count])
+                sprintf (strings[count], "%s=%s", name, value);
+        } else {
+            strings[count] = strdup (name);
+        }
+        if (strings[count] == NULL) {
+            perror ("copy of environment:\n");
+            goto env_out;
+        }
+        ++count;
+        name = copy ? strtok_r (NULL, ",", &save) : environ[i];
+    }
+    qsort (strings, count, sizeof (char*), str_cmp);
+    hash = sha1_strings ("env", strings, count, hash_len);
+env_out:
+    for (i = 0; i < count; ++i)
+        free (strings[i]);
+    free (strings);
+    free (copy);
+    return hash;
+}
+
+/*  Measure --data, --env and --argv in the order given, straight from
+ *  memory.
  */
 static int
-extend_pcr (TPM_PCRINDEX index, char *hash, size_t hash_len)
+measure_inline (extend_args_t *args, measurements_t *list)
 {
-    TSS_RESULT result, out;
-    TSS_HCONTEXT context;
-    TSS_HTPM tpm;
-    TSS_UNICODE *host = NULL; /* no remote connections */
-    UINT32 pcr_before_len = 0, pcr_after_len = 0;
-    BYTE *pcr_before = NULL, *pcr_after = NULL;
+    unsigned char *hash = NULL;
+    unsigned int hash_len = 0;
+    size_t i;
 
-    result = Tspi_Context_Create (&context);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to create Tspi Context.\n");
-        goto extend_out;
+    for (i = 0; i < args->inline_count; ++i) {
+        switch (args->inlines[i].kind) {
+            case INLINE_DATA:
+                hash = sha1_strings ("data", &args->inlines[i].arg, 1,
+                                     &hash_len);
+                break;
+            case INLINE_ENV:
+                hash = measure_env (args->inlines[i].arg, &hash_len);
+                break;
+            case INLINE_ARGV:
+                hash = sha1_strings ("argv", args->cmd, args->cmd_count,
+                                     &hash_len);
+                break;
+        }
+        if (hash == NULL)
+            return -1;
+        if (measurements_add (list, (char*)hash, hash_len))
+            return -1;
     }
-    result = Tspi_Context_Connect (context, host);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to connect Tspi Context.\n");
-        goto extend_out;
+    return 0;
+}
+
+/*  The SHA1 Authenticode digest of a PE/COFF image, the value firmware
+ *  extends for it. The SHA256 one is computed in the same pass and
+ *  printed for the other bank.
+ */
+static char*
+measure_pe (extend_args_t *args, unsigned int *hash_len)
+{
+    const EVP_MD *mds[] = { EVP_sha1 (), EVP_sha256 () };
+    const char *names[] = { "sha1", "sha256" };
+    unsigned char digests[2][EVP_MAX_MD_SIZE];
+    unsigned int lens[2], i, j;
+    pe_image_t *image;
+    char *hash;
+    int ret;
+
+    image = pe_open (args->pe);
+    if (image == NULL)
+        return NULL;
+    ret = pe_digest (image, mds, 2, digests, lens);
+    pe_close (image);
+    if (ret)
+        return NULL;
+    for (i = 0; i < 2; ++i) {
+        fprintf (stdout, "authenticode %s: ", names[i]);
+        for (j = 0; j < lens[i]; ++j)
+            fprintf (stdout, "%02x", digests[i][j]);
+        fprintf (stdout, "\n");
     }
-    result = Tspi_Context_GetTpmObject (context, &tpm);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to get TPM object.\n");
-        goto extend_out;
+    hash = malloc (lens[0]);
+    if (hash == NULL) {
+        perror ("malloc of digest:\n");
+        return NULL;
     }
-    result = Tspi_TPM_PcrRead (tpm, index, &pcr_before_len, &pcr_before);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to read PCR %d: %s\n",
-                 index, Trspi_Error_String (result));
-        goto extend_out;
+    memcpy (hash, digests[0], lens[0]);
+    *hash_len = lens[0];
+    return hash;
+}
+
+/*  Continue the sweep for at most the budget. The digest is only set
+ *  once the sweep is complete.
+ */
+static sweep_t*
+measure_sweep (extend_args_t *args, char **hash, unsigned int *hash_len)
+{
+    sweep_stats_t stats;
+    sweep_t *sweep;
+    size_t i;
+
+    *hash = NULL;
+    sweep = sweep_open (args->sweep, args->sweep_state);
+    if (sweep == NULL)
+        return NULL;
+    if (sweep_run (sweep, args->budget_s ?
+                   (uint64_t)args->budget_s * 1000000000ULL : UINT64_MAX,
+                   &stats)) {
+        sweep_free (sweep);
+        return NULL;
     }
-    fprintf (stdout, "Current value for PCR %d:\n  ", index);
-    dump_buf (stdout, pcr_before, pcr_before_len);
-    fprintf (stdout, "Extending PCR %d with data:\n  ", index);
-    dump_buf (stdout, hash, hash_len);
-    /* extend the PCR ... finally */
-    result = Tspi_TPM_PcrExtend (tpm, index, hash_len, hash,
-                                 NULL, &pcr_after_len, &pcr_after);
-    if (result != TSS_SUCCESS) {
-        fprintf (stderr, "Failed to extend PCR %d: %s\n",
-                 index, Trspi_Error_String (result));
-        goto extend_out;
+    args->sweep_number = stats.number;
+    fprintf (stdout, "Sweep %llu: measured %zu of %zu files (%llu bytes), "
+             "%zu remaining\n", (unsigned long long)stats.number,
+             stats.measured, stats.files, (unsigned long long)stats.bytes,
+             stats.remaining);
+    if (!stats.complete)
+        return sweep;
+    *hash = malloc (SWEEP_DIGEST_LEN);
+    if (*hash == NULL) {
+        perror ("malloc of digest:\n");
+        sweep_free (sweep);
+        return NULL;
     }
-    fprintf (stdout, "New state for PCR %d:\n  ", index);
-    dump_buf (stdout, pcr_after, pcr_after_len);
-extend_out:
-    out = result;
-    /* shortcut to free all memory bound to the context */
-    result = Tspi_Context_FreeMemory (context, NULL);
-    if (result != TSS_SUCCESS)
-        fprintf (stderr, "Failed to FreeMemory: %s\n", Trspi_Error_String (result));
-    if (context) {
-        result = Tspi_Context_Close (context);
-        if (result != TSS_SUCCESS)
-            fprintf (stderr, "Failed to close context: %s\n", Trspi_Error_String (result));
-    }
-    return out;
+    memcpy (*hash, stats.digest, SWEEP_DIGEST_LEN);
+    *hash_len = SWEEP_DIGEST_LEN;
+    fprintf (stdout, "Sweep %llu complete: ", (unsigned long long)stats.number);
+    for (i = 0; i < SWEEP_DIGEST_LEN; ++i)
+        fprintf (stdout, "%02x", stats.digest[i]);
+    fprintf (stdout, "\n");
+    return sweep;
+}
+
+static int
+open_block (dev_t dev)
+{
+    char path[64];
+    int fd;
+
+    snprintf (path, sizeof (path), "/dev/block/%u:%u", major (dev),
+              minor (dev));
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+    return fd;
+}
+
+/*  The SHA1 of the canonical record of a dm-verity table, after
+ *  spot-checking the hash tree when asked to.
+ */
+static char*
+measure_verity (extend_args_t *args, unsigned int *hash_len)
+{
+    verity_table_t table;
+    char *record = NULL, *hash = NULL;
+    int data_fd = -1, hash_fd = -1;
+
+    if (verity_query (args->verity, &table))
+        return NULL;
+    if (table.corrupted) {
+        fprintf (stderr, "%s has seen corrupted blocks.\n", args->verity);
+        return NULL;
+    }
+    if (args->verity_samples) {
+        data_fd = open_block (table.data_dev);
+        hash_fd = open_block (table.hash_dev);
+        if (data_fd == -1 || hash_fd == -1 ||
+            verity_sample (&table, data_fd, hash_fd, args->verity_samples))
+            goto verity_out;
+        fprintf (stdout, "Checked %u data blocks against the hash tree\n",
+                 args->verity_samples);
+    }
+    record = verity_record (&table);
+    if (record == NULL)
+        goto verity_out;
+    fprintf (stdout, "%s\n", record);
+    hash = (char*)sha1_buf (record, strlen (record), hash_len);
+verity_out:
+    if (data_fd != -1)
+        close (data_fd);
+    if (hash_fd != -1)
+        close (hash_fd);
+    free (record);
+    return hash;
+}
+
+#ifdef HAVE_BLAKE3
+/*  The SHA1 of the record "blake3:<hex>" for the contents of file.
+ */
+static char*
+measure_blake3 (FILE *file, unsigned int *hash_len)
+{
+    char record[sizeof ("blake3:") + BLAKE3_FILE_LEN * 2];
+    unsigned char *digest;
+    unsigned int digest_len = 0, i;
+    char *hash;
+
+    digest = blake3_file (file, &digest_len);
+    if (digest == NULL)
+        return NULL;
+    strcpy (record, "blake3:");
+    for (i = 0; i < digest_len; ++i)
+        sprintf (record + 7 + i * 2, "%02x", digest[i]);
+    free (digest);
+    fprintf (stdout, "%s\n", record);
+    hash = (char*)sha1_buf (record, strlen (record), hash_len);
+    return hash;
+}
+#endif
+
+/*  The SHA1 of file from the hash service. Only the descriptor is
+ *  passed, the service hashes the whole file so nothing may have been
+ *  read from it yet.
+ */
+static char*
+measure_hashd (extend_args_t *args, FILE *file, unsigned int *hash_len)
+{
+    unsigned char sha256[HASHD_SHA256_LEN];
+    char *hash;
+
+    hash = malloc (HASHD_SHA1_LEN);
+    if (hash == NULL) {
+        perror ("malloc of digest:\n");
+        return NULL;
+    }
+    if (hashd_digest (args->hashd, fileno (file), (unsigned char*)hash,
+                      sha256)) {
+        free (hash);
+        return NULL;
+    }
+    *hash_len = HASHD_SHA1_LEN;
+    return hash;
+}
+
+/*  Hash file with the selected content digest.
+ */
+static char*
+measure_file (extend_args_t *args, FILE *file, unsigned int *hash_len)
+{
+    if (args->hashd)
+        return measure_hashd (args, file, hash_len);
+#ifdef HAVE_BLAKE3
+    if (args->blake3)
+        return measure_blake3 (file, hash_len);
+#endif
+    return (char*)sha1_file (file, hash_len);
 }
 
 int
@@ -230,41 +1461,199 @@ main (int argc, char *argv[])
 {
     FILE *file = stdin;
     extend_args_t extend_args = { 0 };
+    measurements_t list = { 0 };
+    tss_pool_t *pool = NULL;
+    evlog_t *log = NULL;
+    sweep_t *sweep = NULL;
+    char desc[PATH_MAX + 32];
     char *buf = NULL;
     unsigned int buf_len = 0;
+    size_t i;
+    bool known = true;
     int ret = -1;
 
+    extend_args.sample_percent = 1;
+    extend_args.filter = filter_new ();
+    if (extend_args.filter == NULL)
+        goto main_out;
     if (argp_parse (&extend_argp, argc, argv, 0, NULL, &extend_args)) {
         perror ("argp_parse: \n");
         goto main_out;
     }
     if (extend_args.verbose)
         extend_args_dump (&extend_args);
-    if (extend_args.pcr_set == false) {
+    if (extend_args.pcr_set == false && !extend_args.dry_run) {
         fprintf (stderr, "No PCR provided.\n");
         goto main_out;
     }
-    if (extend_args.file) {
+    if (!!extend_args.file + !!extend_args.directory + !!extend_args.git +
+        !!extend_args.oci + !!extend_args.pe + !!extend_args.verity +
+        !!extend_args.sweep + !!extend_args.pid_count +
+        !!extend_args.inline_count > 1) {
+        fprintf (stderr, "Only one of file, directory, git, oci, pe, verity, "
+                 "sweep, pid or inline data (data, env, argv) may be "
+                 "provided.\n");
+        goto main_out;
+    }
+    if (extend_args.sweep && extend_args.sweep_state == NULL) {
+        fprintf (stderr, "A sweep needs a state file.\n");
+        goto main_out;
+    }
+    if (extend_args.blake3 && (extend_args.directory || extend_args.git ||
+                               extend_args.oci || extend_args.pe ||
+                               extend_args.verity || extend_args.sweep ||
+                               extend_args.pid_count ||
+                               extend_args.inline_count)) {
+        fprintf (stderr, "BLAKE3 only applies to a file or stdin.\n");
+        goto main_out;
+    }
+    if (extend_args.stream && (extend_args.blake3 || extend_args.hashd ||
+                               extend_args.directory || extend_args.git ||
+                               extend_args.oci || extend_args.pe ||
+                               extend_args.verity || extend_args.sweep ||
+                               extend_args.pid_count ||
+                               extend_args.inline_count)) {
+        fprintf (stderr, "Streams are read from a file or stdin.\n");
+        goto main_out;
+    }
+    if (extend_args.hashd && (extend_args.blake3 || extend_args.directory ||
+                              extend_args.git || extend_args.oci ||
+                              extend_args.pe || extend_args.verity ||
+                              extend_args.sweep || extend_args.pid_count ||
+                              extend_args.inline_count)) {
+        fprintf (stderr, "The hash service only hashes a file or stdin "
+                 "with SHA1.\n");
+        goto main_out;
+    }
+    for (i = 0; i < extend_args.inline_count; ++i) {
+        if (extend_args.inlines[i].kind == INLINE_ARGV)
+            break;
+    }
+    if (extend_args.cmd_count && i == extend_args.inline_count) {
+        fprintf (stderr, "Arguments given without --argv.\n");
+        goto main_out;
+    }
+    if (filter_compile (extend_args.filter))
+        goto main_out;
+    if (extend_args.readahead &&
+        profile_readahead_start (extend_args.readahead))
+        goto main_out;
+    if (extend_args.record_profile && profile_record_start ())
+        goto main_out;
+    if (extend_args.directory) {
+        buf = measure_tree (&extend_args, &buf_len);
+    } else if (extend_args.git) {
+        buf = measure_git (&extend_args, &buf_len);
+    } else if (extend_args.oci) {
+        if (measure_oci (&extend_args, &list))
+            goto main_out;
+    } else if (extend_args.pe) {
+        buf = measure_pe (&extend_args, &buf_len);
+    } else if (extend_args.verity) {
+        buf = measure_verity (&extend_args, &buf_len);
+    } else if (extend_args.sweep) {
+        sweep = measure_sweep (&extend_args, &buf, &buf_len);
+        if (sweep == NULL)
+            goto main_out;
+        /* nothing is extended until the sweep is complete */
+        if (buf == NULL) {
+            ret = 0;
+            goto main_out;
+        }
+    } else if (extend_args.pid_count) {
+        if (measure_procs (&extend_args, &list))
+            goto main_out;
+    } else if (extend_args.inline_count) {
+        if (measure_inline (&extend_args, &list))
+            goto main_out;
+    } else if (extend_args.file) {
         file = fopen (extend_args.file, "r");
         if (file == NULL) {
             perror ("fopen:\n");
             goto main_out;
         }
-    } else {
-        file = stdin;
+        if (!extend_args.stream)
+            buf = measure_file (&extend_args, file, &buf_len);
+    } else if (!extend_args.stream) {
+        buf = measure_file (&extend_args, file, &buf_len);
     }
-
-    buf = sha1_file (file, &buf_len);
-    if (buf == NULL)
+    /* records of a stream are extended as they're read */
+    if (!extend_args.oci && !extend_args.pid_count &&
+        !extend_args.inline_count && !extend_args.stream) {
+        if (buf == NULL)
+            goto main_out;
+        if (measurements_add (&list, buf, buf_len))
+            goto main_out;
+    }
+    profile_readahead_wait ();
+    if (extend_args.record_profile &&
+        profile_record_save (extend_args.record_profile))
+        goto main_out;
+    if (extend_args.golden) {
+        extend_args.golden_db = golden_open (extend_args.golden);
+        if (extend_args.golden_db == NULL)
+            goto main_out;
+    }
+    /* an appraisal gate: all of the measurements are known or none count */
+    for (i = 0; extend_args.golden_db && i < list.count; ++i) {
+        extend_desc (&extend_args, i, desc, sizeof (desc));
+        known = golden_known (&extend_args, list.hashes[i],
+                              list.hash_lens[i], desc) && known;
+    }
+    if (!known)
+        goto main_out;
+    if (extend_args.dry_run && extend_args.stream) {
+        ret = extend_stream (&extend_args, NULL, NULL, file);
         goto main_out;
-    if (extend_pcr (extend_args.pcr_index, buf, buf_len) != 0)
+    }
+    if (extend_args.dry_run) {
+        for (i = 0; i < list.count; ++i) {
+            fprintf (stdout, "Measurement %zu:\n  ", i);
+            dump_buf (stdout, list.hashes[i], list.hash_lens[i]);
+        }
+        ret = 0;
+        goto main_out;
+    }
+    /* one context serves every extend of this run */
+    pool = tss_pool_new (1);
+    if (pool == NULL)
+        goto main_out;
+    if (extend_args.log) {
+        log = evlog_open (extend_args.log, true);
+        if (log == NULL)
+            goto main_out;
+    }
+    if (extend_args.stream) {
+        ret = extend_stream (&extend_args, pool, log, file);
+        goto main_out;
+    }
+    if (extend_args.aggregate_ms) {
+        ret = extend_aggregate (&extend_args, pool, log, &list);
+        if (ret == 0 && sweep)
+            ret = sweep_commit (sweep);
+        goto main_out;
+    }
+    for (i = 0; i < list.count; ++i) {
+        extend_desc (&extend_args, i, desc, sizeof (desc));
+        if (extend_pcr (pool, log, extend_args.pcr_index, list.hashes[i],
+                        list.hash_lens[i], desc) != 0)
+            goto main_out;
+    }
+    if (sweep && sweep_commit (sweep))
         goto main_out;
     ret = 0;
 main_out:
-    if (file != stdin)
+    profile_readahead_wait ();
+    if (file && file != stdin)
         fclose (file);
-    if (buf)
-        free (buf);
+    measurements_free (&list);
+    tss_pool_free (pool);
+    evlog_close (log);
+    sweep_free (sweep);
+    golden_close (extend_args.golden_db);
+    free (extend_args.pids);
+    free (extend_args.inlines);
+    filter_free (extend_args.filter);
     if (ret == 0)
         exit (EXIT_SUCCESS);
     else
@@ -0,0 +1,620 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "golden.h"
+#include "workers.h"
+
+#define CHUNK_SIZE (16 << 20)   /* bytes of input parsed per job */
+#define RADIX_BINS (1 << 16)    /* the sort's first pass is on 16 bits */
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state);
+
+typedef struct golden_args {
+    char *output;
+    char *algorithm;
+    char **paths;
+    size_t path_count;
+    unsigned int jobs;
+    bool verbose;
+} golden_args_t;
+
+const struct argp_option golden_opts[] = {
+    {
+        .name  = "output",
+        .key   = 'o',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Database to write, replaced atomically.",
+        .group = 0,
+    },
+    {
+        .name  = "algorithm",
+        .key   = 'a',
+        .arg   = "sha1|sha256",
+        .flags = 0,
+        .doc   = "Algorithm of the digests, by default taken from the "
+                 "length of the first one.",
+        .group = 0,
+    },
+    {
+        .name  = "jobs",
+        .key   = 'j',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Number of threads, defaults to the number of CPUs.",
+        .group = 0,
+    },
+    {
+        .name = "verbose",
+        .key = 'v',
+        .arg = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc = "verbose",
+        .group = 0,
+    },
+    { 0 }
+};
+
+const struct argp golden_argp = {
+    .options  = golden_opts,
+    .parser   = parse_opts,
+    .args_doc = "LIST...",
+    .doc      = "Build a golden digest database for pcr-dump and "
+                "pcr-extend. Each line of a list starts with a hex digest, "
+                "optionally prefixed by '<algorithm>:', anything after it "
+                "is ignored, as are blank lines and lines starting with "
+                "'#'. Duplicates are dropped."
+};
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state)
+{
+    golden_args_t *args = state->input;
+
+    switch (key) {
+        case 'o':
+            args->output = arg;
+            break;
+        case 'a':
+            if (strcmp (arg, "sha1") != 0 && strcmp (arg, "sha256") != 0) {
+                fprintf (stderr, "Unsupported algorithm: %s\n", arg);
+                return EINVAL;
+            }
+            args->algorithm = arg;
+            break;
+        case 'j':
+            args->jobs = strtoul (arg, NULL, 10);
+            break;
+        case 'v':
+            args->verbose = true;
+            break;
+        case ARGP_KEY_ARGS:
+            args->paths = state->argv + state->next;
+            args->path_count = state->argc - state->next;
+            break;
+        case ARGP_KEY_NO_ARGS:
+            argp_usage (state);
+            break;
+        case ARGP_KEY_END:
+            if (args->output == NULL) {
+                argp_error (state, "An output file is required.");
+                return EINVAL;
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void
+golden_args_dump (golden_args_t *args)
+{
+    printf ("User provided options:\n");
+    printf ("  output: %s\n", args->output);
+    printf ("  algorithm: %s\n", args->algorithm ? args->algorithm : "auto");
+    printf ("  lists: %zu\n", args->path_count);
+    printf ("  jobs: %u\n", args->jobs);
+    printf ("  verbose: %s\n", args->verbose ? "true" : "false");
+}
+
+typedef struct list_chunk {
+    const char *path;
+    const char *start;
+    const char *end;
+    unsigned char *digests;
+    size_t count;
+    size_t alloc;
+    int error;
+} list_chunk_t;
+
+typedef struct parse_work {
+    list_chunk_t *chunks;
+    size_t chunk_count;
+    size_t digest_len;
+    atomic_size_t next;
+} parse_work_t;
+
+static int
+nibble (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool
+is_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*  Find the digest on the line [line, end): the first word, less any
+ *  '<algorithm>:' prefix. Returns its length in hex digits, 0 when the
+ *  line has none.
+ */
+static size_t
+line_digest (const char *line, const char *end, const char **hex)
+{
+    const char *word;
+
+    while (line < end && is_space (*line))
+        ++line;
+    if (line == end || *line == '#')
+        return 0;
+    for (word = line; line < end && !is_space (*line); ++line) {
+        if (*line == ':')
+            word = line + 1;
+    }
+    *hex = word;
+    return line - word;
+}
+
+static int
+chunk_add (list_chunk_t *chunk, const char *hex, size_t len)
+{
+    unsigned char *digest;
+    size_t i;
+    int hi, lo;
+
+    if (chunk->count == chunk->alloc) {
+        size_t alloc = chunk->alloc ? chunk->alloc * 2 : 4096;
+        unsigned char *digests;
+
+        digests = realloc (chunk->digests, alloc * len);
+        if (digests == NULL) {
+            perror ("realloc of digests:\n");
+            return -1;
+        }
+        chunk->digests = digests;
+        chunk->alloc = alloc;
+    }
+    digest = chunk->digests + chunk->count * len;
+    for (i = 0; i < len; ++i) {
+        hi = nibble (hex[i * 2]);
+        lo = nibble (hex[i * 2 + 1]);
+        if (hi < 0 || lo < 0)
+            return 1;
+        digest[i] = hi << 4 | lo;
+    }
+    ++chunk->count;
+    return 0;
+}
+
+static void
+parse_chunk (parse_work_t *work, list_chunk_t *chunk)
+{
+    const char *line, *eol, *hex;
+    size_t len;
+
+    for (line = chunk->start; line < chunk->end; line = eol + 1) {
+        eol = memchr (line, '\n', chunk->end - line);
+        if (eol == NULL)
+            eol = chunk->end;
+        len = line_digest (line, eol, &hex);
+        if (len == 0)
+            continue;
+        chunk->error = len == work->digest_len * 2 ?
+                       chunk_add (chunk, hex, work->digest_len) : 1;
+        if (chunk->error > 0)
+            fprintf (stderr, "%s: invalid digest \"%.*s\"\n", chunk->path,
+                     (int)len, hex);
+        if (chunk->error)
+            return;
+    }
+}
+
+static void
+parse_worker (void *arg, unsigned int index)
+{
+    parse_work_t *work = arg;
+    size_t i;
+
+    (void)index;
+    while ((i = atomic_fetch_add (&work->next, 1)) < work->chunk_count)
+        parse_chunk (work, &work->chunks[i]);
+}
+
+typedef struct list_map {
+    void *map;
+    size_t size;
+} list_map_t;
+
+/*  Map the list at path and cut it into chunks of about CHUNK_SIZE bytes
+ *  ending on line boundaries.
+ */
+static int
+list_split (const char *path, list_map_t *map, list_chunk_t **chunks,
+            size_t *chunk_count)
+{
+    const char *start, *end, *cut;
+    list_chunk_t *grown;
+    struct stat sb;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    if (fstat (fd, &sb) == -1) {
+        perror ("fstat:\n");
+        close (fd);
+        return -1;
+    }
+    map->size = sb.st_size;
+    map->map = NULL;
+    if (map->size == 0) {
+        close (fd);
+        return 0;
+    }
+    map->map = mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map->map == MAP_FAILED) {
+        fprintf (stderr, "Failed to map %s: %s\n", path, strerror (errno));
+        map->map = NULL;
+        return -1;
+    }
+    madvise (map->map, map->size, MADV_SEQUENTIAL);
+    start = map->map;
+    end = start + map->size;
+    while (start < end) {
+        cut = end;
+        if ((size_t)(end - start) > CHUNK_SIZE) {
+            cut = memchr (start + CHUNK_SIZE, '\n',
+                          end - start - CHUNK_SIZE);
+            cut = cut ? cut + 1 : end;
+        }
+        grown = realloc (*chunks, (*chunk_count + 1) * sizeof (list_chunk_t));
+        if (grown == NULL) {
+            perror ("realloc of chunks:\n");
+            return -1;
+        }
+        *chunks = grown;
+        (*chunks)[(*chunk_count)++] = (list_chunk_t){
+            .path = path, .start = start, .end = cut
+        };
+        start = cut;
+    }
+    return 0;
+}
+
+/*  Without -a the first digest of the lists decides the algorithm.
+ */
+static size_t
+guess_digest_len (const list_chunk_t *chunks, size_t chunk_count)
+{
+    const char *line, *eol, *hex;
+    size_t i, len;
+
+    for (i = 0; i < chunk_count; ++i) {
+        for (line = chunks[i].start; line < chunks[i].end; line = eol + 1) {
+            eol = memchr (line, '\n', chunks[i].end - line);
+            if (eol == NULL)
+                eol = chunks[i].end;
+            len = line_digest (line, eol, &hex);
+            if (len)
+                return len / 2;
+        }
+    }
+    return 0;
+}
+
+/*  Parallel sort: the first pass scatters the digests into bins by their
+ *  first 16 bits, each thread counting and then moving its own slice of
+ *  the input, and the bins are then sorted independently. Digests are
+ *  uniform so the bins come out even.
+ */
+typedef struct sort_work {
+    const unsigned char *in;
+    unsigned char *out;
+    size_t count;
+    size_t digest_len;
+    unsigned int threads;
+    size_t *histograms;         /* RADIX_BINS per thread */
+    size_t bin_start[RADIX_BINS + 1];
+    atomic_size_t next;
+} sort_work_t;
+
+static size_t
+radix_bin (const unsigned char *digest)
+{
+    return digest[0] << 8 | digest[1];
+}
+
+static void
+slice_of (const sort_work_t *work, unsigned int index, size_t *first,
+          size_t *last)
+{
+    *first = work->count * index / work->threads;
+    *last = work->count * (index + 1) / work->threads;
+}
+
+static void
+sort_count (void *arg, unsigned int index)
+{
+    sort_work_t *work = arg;
+    size_t *histogram = work->histograms + (size_t)index * RADIX_BINS;
+    size_t i, first, last;
+
+    slice_of (work, index, &first, &last);
+    for (i = first; i < last; ++i)
+        ++histogram[radix_bin (work->in + i * work->digest_len)];
+}
+
+static void
+sort_scatter (void *arg, unsigned int index)
+{
+    sort_work_t *work = arg;
+    size_t *next = work->histograms + (size_t)index * RADIX_BINS;
+    const unsigned char *digest;
+    size_t i, first, last;
+
+    slice_of (work, index, &first, &last);
+    for (i = first; i < last; ++i) {
+        digest = work->in + i * work->digest_len;
+        memcpy (work->out + next[radix_bin (digest)]++ * work->digest_len,
+                digest, work->digest_len);
+    }
+}
+
+static _Thread_local size_t sort_digest_len;
+
+static int
+digest_cmp (const void *a, const void *b)
+{
+    return memcmp (a, b, sort_digest_len);
+}
+
+static void
+sort_bins (void *arg, unsigned int index)
+{
+    sort_work_t *work = arg;
+    size_t bin;
+
+    (void)index;
+    sort_digest_len = work->digest_len;
+    while ((bin = atomic_fetch_add (&work->next, 1)) < RADIX_BINS) {
+        qsort (work->out + work->bin_start[bin] * work->digest_len,
+               work->bin_start[bin + 1] - work->bin_start[bin],
+               work->digest_len, digest_cmp);
+    }
+}
+
+/*  Sort count digests from in into out, byte-wise.
+ */
+static int
+digests_sort (const unsigned char *in, unsigned char *out, size_t count,
+              size_t digest_len, unsigned int threads)
+{
+    sort_work_t *work;
+    size_t bin, total = 0, *slot;
+    unsigned int t;
+    int ret = -1;
+
+    work = calloc (1, sizeof (sort_work_t));
+    if (work == NULL) {
+        perror ("calloc of sort_work_t:\n");
+        return -1;
+    }
+    *work = (sort_work_t){
+        .in = in, .out = out, .count = count, .digest_len = digest_len,
+        .threads = threads,
+    };
+    work->histograms = calloc ((size_t)threads * RADIX_BINS, sizeof (size_t));
+    if (work->histograms == NULL) {
+        perror ("calloc of histograms:\n");
+        goto sort_out;
+    }
+    if (phase_run (sort_count, work, threads))
+        goto sort_out;
+    /* each thread's histogram becomes where its next digest of a bin goes */
+    for (bin = 0; bin < RADIX_BINS; ++bin) {
+        work->bin_start[bin] = total;
+        for (t = 0; t < threads; ++t) {
+            slot = &work->histograms[(size_t)t * RADIX_BINS + bin];
+            total += *slot;
+            *slot = total - *slot;
+        }
+    }
+    work->bin_start[RADIX_BINS] = total;
+    if (phase_run (sort_scatter, work, threads))
+        goto sort_out;
+    atomic_init (&work->next, 0);
+    if (phase_run (sort_bins, work, threads))
+        goto sort_out;
+    ret = 0;
+sort_out:
+    free (work->histograms);
+    free (work);
+    return ret;
+}
+
+static size_t
+digests_dedup (unsigned char *digests, size_t count, size_t digest_len)
+{
+    size_t i, unique;
+
+    for (i = 1, unique = count ? 1 : 0; i < count; ++i) {
+        if (memcmp (digests + i * digest_len,
+                    digests + (unique - 1) * digest_len, digest_len) == 0)
+            continue;
+        if (i != unique)
+            memcpy (digests + unique * digest_len, digests + i * digest_len,
+                    digest_len);
+        ++unique;
+    }
+    return unique;
+}
+
+static double
+elapsed (const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) +
+           (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+int
+main (int argc, char *argv[])
+{
+    golden_args_t golden_args = { 0 };
+    golden_build_stats_t stats = { 0 };
+    parse_work_t work = { 0 };
+    list_map_t *maps = NULL;
+    unsigned char *digests = NULL, *sorted = NULL;
+    size_t i, count = 0, unique;
+    struct timespec start;
+    double parse_time, sort_time;
+    int ret = -1;
+
+    if (argp_parse (&golden_argp, argc, argv, 0, NULL, &golden_args)) {
+        perror ("argp_parse: \n");
+        goto main_out;
+    }
+    if (golden_args.verbose)
+        golden_args_dump (&golden_args);
+    if (golden_args.jobs == 0)
+        golden_args.jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    maps = calloc (golden_args.path_count, sizeof (list_map_t));
+    if (maps == NULL) {
+        perror ("calloc of maps:\n");
+        goto main_out;
+    }
+    for (i = 0; i < golden_args.path_count; ++i) {
+        if (list_split (golden_args.paths[i], &maps[i], &work.chunks,
+                        &work.chunk_count))
+            goto main_out;
+    }
+    if (golden_args.algorithm)
+        work.digest_len = strcmp (golden_args.algorithm, "sha1") == 0 ?
+                          20 : 32;
+    else
+        work.digest_len = guess_digest_len (work.chunks, work.chunk_count);
+    if (work.digest_len < GOLDEN_DIGEST_MIN ||
+        work.digest_len > GOLDEN_DIGEST_MAX) {
+        fprintf (stderr, "No digests of a supported length found.\n");
+        goto main_out;
+    }
+    atomic_init (&work.next, 0);
+    if (phase_run (parse_worker, &work, golden_args.jobs))
+        goto main_out;
+    for (i = 0; i < work.chunk_count; ++i) {
+        if (work.chunks[i].error)
+            goto main_out;
+        count += work.chunks[i].count;
+    }
+    digests = malloc (count * work.digest_len + 1);
+    sorted = malloc (count * work.digest_len + 1);
+    if (digests == NULL || sorted == NULL) {
+        perror ("malloc of digests:\n");
+        goto main_out;
+    }
+    for (i = 0, count = 0; i < work.chunk_count; ++i) {
+        memcpy (digests + count * work.digest_len, work.chunks[i].digests,
+                work.chunks[i].count * work.digest_len);
+        count += work.chunks[i].count;
+        free (work.chunks[i].digests);
+        work.chunks[i].digests = NULL;
+    }
+    parse_time = elapsed (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (digests_sort (digests, sorted, count, work.digest_len,
+                      golden_args.jobs))
+        goto main_out;
+    unique = digests_dedup (sorted, count, work.digest_len);
+    free (digests);
+    digests = NULL;
+    sort_time = elapsed (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (golden_write (golden_args.output, sorted, unique, work.digest_len,
+                      golden_args.jobs, &stats))
+        goto main_out;
+    fprintf (stdout, "%s: %zu digests (%zu duplicates) of %zu bytes\n",
+             golden_args.output, unique, count - unique, work.digest_len);
+    if (golden_args.verbose) {
+        fprintf (stdout, "  partitions: %u, buckets: %" PRIu64
+                 ", seeds tried: %u\n", 1U << stats.partition_bits,
+                 stats.bucket_count, stats.attempts);
+        fprintf (stdout, "  parse: %.3fs, sort: %.3fs, build: %.3fs\n",
+                 parse_time, sort_time, elapsed (&start));
+    }
+    ret = 0;
+main_out:
+    for (i = 0; i < work.chunk_count; ++i)
+        free (work.chunks[i].digests);
+    free (work.chunks);
+    for (i = 0; maps && i < golden_args.path_count; ++i) {
+        if (maps[i].map)
+            munmap (maps[i].map, maps[i].size);
+    }
+    free (maps);
+    free (digests);
+    free (sorted);
+    if (ret == 0)
+        exit (EXIT_SUCCESS);
+    else
+        exit (EXIT_FAILURE);
+}
@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "hash.h"
+#include "hashd.h"
+#include "util.h"
+
+#define CACHE_ENTRIES 65536
+#define CLIENTS_MAX 1024
+#define CLIENT_TIMEOUT_S 5
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state);
+
+typedef struct hashd_args {
+    char *socket;
+    unsigned int jobs;
+    size_t cache_entries;
+    bool verbose;
+} hashd_args_t;
+
+const struct argp_option hashd_opts[] = {
+    {
+        .name  = "socket",
+        .key   = 's',
+        .arg   = "path",
+        .flags = 0,
+        .doc   = "Unix socket to serve digests on.",
+        .group = 0,
+    },
+    {
+        .name  = "jobs",
+        .key   = 'j',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Number of requests to serve concurrently, defaults to "
+                 "the number of CPUs.",
+        .group = 0,
+    },
+    {
+        .name  = "cache",
+        .key   = 'c',
+        .arg   = "entries",
+        .flags = 0,
+        .doc   = "Number of file digests to remember (default 65536), 0 "
+                 "disables the cache.",
+        .group = 0,
+    },
+    {
+        .name = "verbose",
+        .key = 'v',
+        .arg = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc = "verbose",
+        .group = 0,
+    },
+    { 0 }
+};
+
+const struct argp hashd_argp = {
+    .options  = hashd_opts,
+    .parser   = parse_opts,
+    .args_doc = NULL,
+    .doc      = "Serve SHA1 and SHA256 file digests. Clients pass open "
+                "descriptors over the socket so they need no access to "
+                "the paths, and files unchanged since a client last asked "
+                "aren't read again."
+};
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state)
+{
+    hashd_args_t *args = state->input;
+
+    switch (key) {
+        case 's':
+            args->socket = arg;
+            break;
+        case 'j':
+            args->jobs = strtoul (arg, NULL, 10);
+            break;
+        case 'c':
+            args->cache_entries = strtoul (arg, NULL, 10);
+            break;
+        case 'v':
+            args->verbose = true;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void
+hashd_args_dump (hashd_args_t *args)
+{
+    printf ("User provided options:\n");
+    printf ("  socket: %s\n", args->socket);
+    printf ("  jobs: %u\n", args->jobs);
+    printf ("  cache: %zu\n", args->cache_entries);
+    printf ("  verbose: %s\n", args->verbose ? "true" : "false");
+}
+
+/*  A file a worker is hashing. Others asking for the same file wait
+ *  for its digests to land in the cache instead of reading it again.
+ */
+typedef struct hashing {
+    file_stamp_t stamp;
+    bool busy;
+} hashing_t;
+
+/*  A connected client. Between requests it's polled by the accepting
+ *  thread, only a request ready to be read is handed to a worker, so
+ *  idle clients hold no worker.
+ */
+typedef struct client {
+    int fd;                     /* -1 when the slot is free */
+    bool busy;                  /* handed to a worker */
+    time_t seen;                /* last request, monotonic seconds */
+} client_t;
+
+typedef struct hashd {
+    fcache_t *cache;            /* NULL when caching is off */
+    pthread_mutex_t hash_lock;
+    pthread_cond_t hashed;
+    hashing_t *hashing;         /* one per worker */
+    size_t workers;
+    size_t hits;
+    size_t misses;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    client_t clients[CLIENTS_MAX];
+    size_t queue[CLIENTS_MAX];  /* clients with a request to serve */
+    size_t queue_head;
+    size_t queue_count;
+    int wake[2];                /* workers hand clients back through it */
+    bool stopping;
+} hashd_t;
+
+static volatile sig_atomic_t hashd_stop;
+
+static void
+hashd_signal (int sig)
+{
+    (void)sig;
+    hashd_stop = 1;
+}
+
+/*  Both digests of what fd refers to, in one pass through hash.c. The
+ *  descriptor belongs to a client that may truncate or replace the file
+ *  while it's read, so it's read with pread rather than mapped, and read
+ *  to its end since procfs and sysfs files report a size of 0.
+ */
+static int
+hash_fd (int fd, unsigned char *sha1, unsigned char *sha256)
+{
+    const EVP_MD *mds[2] = { EVP_sha1 (), EVP_sha256 () };
+    unsigned char digests[2][EVP_MAX_MD_SIZE];
+    unsigned int lens[2];
+
+    if (digest_fd (fd, 0, mds, 2, digests, lens))
+        return -1;
+    memcpy (sha1, digests[0], HASHD_SHA1_LEN);
+    memcpy (sha256, digests[1], HASHD_SHA256_LEN);
+    return 0;
+}
+
+static bool
+cache_lookup (hashd_t *hashd, const struct stat *sb, unsigned char *sha1,
+              unsigned char *sha256)
+{
+    return fcache_lookup (hashd->cache, sb, EVP_sha1 (), sha1) &&
+           fcache_lookup (hashd->cache, sb, EVP_sha256 (), sha256);
+}
+
+/*  Digests of a regular file, from the cache when it's unchanged. A
+ *  file changed within the second before it's hashed could change again
+ *  without its stamp moving, it isn't cached.
+ */
+static int
+cached_digests (hashd_t *hashd, int fd, const struct stat *sb,
+                unsigned char *sha1, unsigned char *sha256)
+{
+    size_t slot;
+    int ret, err;
+
+    if (hashd->cache == NULL)
+        return hash_fd (fd, sha1, sha256);
+    pthread_mutex_lock (&hashd->hash_lock);
+    for (;;) {
+        if (cache_lookup (hashd, sb, sha1, sha256)) {
+            ++hashd->hits;
+            pthread_mutex_unlock (&hashd->hash_lock);
+            return 0;
+        }
+        for (slot = 0; slot < hashd->workers; ++slot) {
+            if (hashd->hashing[slot].busy &&
+                file_stamp_match (&hashd->hashing[slot].stamp, sb))
+                break;
+        }
+        if (slot == hashd->workers)
+            break;
+        pthread_cond_wait (&hashd->hashed, &hashd->hash_lock);
+    }
+    ++hashd->misses;
+    /* a worker hashes one file at a time, so there's a free slot */
+    for (slot = 0; hashd->hashing[slot].busy; ++slot)
+        ;
+    hashd->hashing[slot].busy = true;
+    file_stamp_set (&hashd->hashing[slot].stamp, sb);
+    pthread_mutex_unlock (&hashd->hash_lock);
+
+    ret = hash_fd (fd, sha1, sha256);
+    err = errno;
+    if (ret == 0) {
+        fcache_add (hashd->cache, sb, EVP_sha1 (), sha1, time (NULL) - 1);
+        fcache_add (hashd->cache, sb, EVP_sha256 (), sha256,
+                    time (NULL) - 1);
+    }
+    pthread_mutex_lock (&hashd->hash_lock);
+    hashd->hashing[slot].busy = false;
+    pthread_cond_broadcast (&hashd->hashed);
+    pthread_mutex_unlock (&hashd->hash_lock);
+    errno = err;
+    return ret;
+}
+
+/*  Receive a request the client has sent. Returns the descriptor, -2
+ *  for a request that didn't carry one, or -1 once the client is gone.
+ */
+static int
+recv_fd (int conn)
+{
+    union {
+        char buf[CMSG_SPACE (sizeof (int))];
+        struct cmsghdr align;
+    } control;
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof (control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int fd = -2;
+
+    do {
+        ret = recvmsg (conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+    if (ret <= 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+            memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+    }
+    return fd;
+}
+
+/*  A client that doesn't read its replies is dropped rather than left
+ *  to block a worker.
+ */
+static int
+reply (int conn, const unsigned char *sha1, const unsigned char *sha256,
+       const char *error)
+{
+    char line[HASHD_LINE_MAX];
+    size_t i, len = 0;
+
+    if (error) {
+        len = snprintf (line, sizeof (line), "error %s\n", error);
+    } else {
+        for (i = 0; i < HASHD_SHA1_LEN; ++i)
+            len += sprintf (line + len, "%02x", sha1[i]);
+        line[len++] = ' ';
+        for (i = 0; i < HASHD_SHA256_LEN; ++i)
+            len += sprintf (line + len, "%02x", sha256[i]);
+        line[len++] = '\n';
+    }
+    if (send (conn, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+    return 0;
+}
+
+/*  Serve the request waiting on conn. Returns -1 once the client is
+ *  gone or has to be dropped.
+ */
+static int
+serve_request (hashd_t *hashd, int conn)
+{
+    unsigned char sha1[HASHD_SHA1_LEN], sha256[HASHD_SHA256_LEN];
+    struct stat sb;
+    int fd, flags, ret;
+
+    fd = recv_fd (conn);
+    if (fd == -1)
+        return -1;
+    if (fd == -2)
+        return reply (conn, NULL, NULL, "no descriptor");
+    flags = fcntl (fd, F_GETFL);
+    if (flags == -1 || (flags & O_PATH) ||
+        (flags & O_ACCMODE) == O_WRONLY) {
+        ret = reply (conn, NULL, NULL, "descriptor not open for reading");
+    } else if (fstat (fd, &sb) == -1 || S_ISDIR (sb.st_mode)) {
+        ret = reply (conn, NULL, NULL, "not a file");
+    } else {
+        if (S_ISREG (sb.st_mode))
+            ret = cached_digests (hashd, fd, &sb, sha1, sha256);
+        else
+            ret = hash_fd (fd, sha1, sha256);
+        ret = reply (conn, sha1, sha256, ret ? strerror (errno) : NULL);
+    }
+    close (fd);
+    return ret;
+}
+
+static time_t
+monotonic_s (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void*
+hashd_worker (void *arg)
+{
+    hashd_t *hashd = arg;
+    client_t *client;
+    int conn, ret;
+
+    for (;;) {
+        pthread_mutex_lock (&hashd->lock);
+        while (hashd->queue_count == 0 && !hashd->stopping)
+            pthread_cond_wait (&hashd->ready, &hashd->lock);
+        if (hashd->queue_count == 0) {
+            pthread_mutex_unlock (&hashd->lock);
+            return NULL;
+        }
+        client = &hashd->clients[hashd->queue[hashd->queue_head]];
+        hashd->queue_head = (hashd->queue_head + 1) % CLIENTS_MAX;
+        --hashd->queue_count;
+        conn = client->fd;
+        pthread_mutex_unlock (&hashd->lock);
+        ret = serve_request (hashd, conn);
+        pthread_mutex_lock (&hashd->lock);
+        if (ret) {
+            close (conn);
+            client->fd = -1;
+        }
+        client->busy = false;
+        client->seen = monotonic_s ();
+        pthread_mutex_unlock (&hashd->lock);
+        /* back to the poll, a full pipe already has it waking up */
+        if (write (hashd->wake[1], "", 1) == -1)
+            continue;
+    }
+}
+
+/*  Poll the idle clients and, once the next request is ready, queue it
+ *  for the workers. Clients idle for CLIENT_TIMEOUT_S are dropped.
+ *  Called with the lock held, returns the number of descriptors to
+ *  poll, which start after the listening socket and the wake pipe.
+ */
+static size_t
+hashd_idle (hashd_t *hashd, struct pollfd *pfds, size_t *slots)
+{
+    time_t now = monotonic_s ();
+    client_t *client;
+    size_t i, count = 2;
+
+    for (i = 0; i < CLIENTS_MAX; ++i) {
+        client = &hashd->clients[i];
+        if (client->fd == -1 || client->busy)
+            continue;
+        if (now - client->seen >= CLIENT_TIMEOUT_S) {
+            close (client->fd);
+            client->fd = -1;
+            continue;
+        }
+        pfds[count].fd = client->fd;
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        slots[count++] = i;
+    }
+    return count;
+}
+
+static void
+hashd_accept (hashd_t *hashd, int listen_fd)
+{
+    client_t *client;
+    size_t i;
+    int conn;
+
+    conn = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1)
+        return;
+    pthread_mutex_lock (&hashd->lock);
+    for (i = 0; i < CLIENTS_MAX && hashd->clients[i].fd != -1; ++i)
+        ;
+    if (i == CLIENTS_MAX) {
+        pthread_mutex_unlock (&hashd->lock);
+        close (conn);
+        return;
+    }
+    client = &hashd->clients[i];
+    client->fd = conn;
+    client->busy = false;
+    client->seen = monotonic_s ();
+    pthread_mutex_unlock (&hashd->lock);
+}
+
+/*  Accept clients until interrupted and queue their requests for the
+ *  workers.
+ */
+static int
+hashd_serve (hashd_args_t *args, hashd_t *hashd)
+{
+    static struct pollfd pfds[CLIENTS_MAX + 2];
+    static size_t slots[CLIENTS_MAX + 2];
+    struct sigaction action = { .sa_handler = hashd_signal };
+    sigset_t mask, old_mask;
+    pthread_t *threads;
+    char drain[64];
+    size_t started, count, i;
+    int listen_fd, ret = -1;
+
+    threads = calloc (args->jobs, sizeof (pthread_t));
+    if (threads == NULL) {
+        perror ("calloc of workers:\n");
+        return -1;
+    }
+    for (i = 0; i < CLIENTS_MAX; ++i)
+        hashd->clients[i].fd = -1;
+    if (pipe2 (hashd->wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror ("pipe2:\n");
+        free (threads);
+        return -1;
+    }
+    listen_fd = unix_listen (args->socket);
+    if (listen_fd == -1) {
+        close (hashd->wake[0]);
+        close (hashd->wake[1]);
+        free (threads);
+        return -1;
+    }
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+    signal (SIGPIPE, SIG_IGN);
+    /* signals go to this thread so they interrupt its poll */
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGINT);
+    sigaddset (&mask, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &mask, &old_mask);
+    for (started = 0; started < args->jobs; ++started) {
+        if (pthread_create (&threads[started], NULL, hashd_worker, hashd))
+            break;
+    }
+    pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+    if (started < args->jobs) {
+        perror ("pthread_create:\n");
+        goto serve_out;
+    }
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = hashd->wake[0];
+    pfds[1].events = POLLIN;
+    while (!hashd_stop) {
+        pthread_mutex_lock (&hashd->lock);
+        count = hashd_idle (hashd, pfds, slots);
+        pthread_mutex_unlock (&hashd->lock);
+        /* wake up every second to drop idle clients */
+        if (poll (pfds, count, 1000) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror ("poll:\n");
+            goto serve_out;
+        }
+        if (pfds[1].revents)
+            while (read (hashd->wake[0], drain, sizeof (drain)) > 0)
+                ;
+        pthread_mutex_lock (&hashd->lock);
+        for (i = 2; i < count; ++i) {
+            if (pfds[i].revents == 0)
+                continue;
+            hashd->clients[slots[i]].busy = true;
+            hashd->queue[(hashd->queue_head + hashd->queue_count) %
+                         CLIENTS_MAX] = slots[i];
+            ++hashd->queue_count;
+            pthread_cond_signal (&hashd->ready);
+        }
+        pthread_mutex_unlock (&hashd->lock);
+        if (pfds[0].revents & POLLIN)
+            hashd_accept (hashd, listen_fd);
+    }
+    ret = 0;
+serve_out:
+    pthread_mutex_lock (&hashd->lock);
+    hashd->stopping = true;
+    pthread_cond_broadcast (&hashd->ready);
+    pthread_mutex_unlock (&hashd->lock);
+    for (i = 0; i < started; ++i)
+        pthread_join (threads[i], NULL);
+    /* with no worker left to serve them */
+    for (i = 0; i < CLIENTS_MAX; ++i) {
+        if (hashd->clients[i].fd != -1)
+            close (hashd->clients[i].fd);
+    }
+    close (listen_fd);
+    close (hashd->wake[0]);
+    close (hashd->wake[1]);
+    unlink (args->socket);
+    free (threads);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    hashd_args_t hashd_args = { .cache_entries = CACHE_ENTRIES };
+    hashd_t hashd = {
+        .hash_lock = PTHREAD_MUTEX_INITIALIZER,
+        .hashed = PTHREAD_COND_INITIALIZER,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .ready = PTHREAD_COND_INITIALIZER,
+    };
+    int ret = -1;
+
+    if (argp_parse (&hashd_argp, argc, argv, 0, NULL, &hashd_args)) {
+        perror ("argp_parse: \n");
+        goto main_out;
+    }
+    if (hashd_args.verbose)
+        hashd_args_dump (&hashd_args);
+    if (hashd_args.socket == NULL) {
+        fprintf (stderr, "No socket provided.\n");
+        goto main_out;
+    }
+    if (hashd_args.jobs == 0)
+        hashd_args.jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    hashd.workers = hashd_args.jobs;
+    hashd.hashing = calloc (hashd.workers, sizeof (hashing_t));
+    if (hashd.hashing == NULL) {
+        perror ("calloc of workers:\n");
+        goto main_out;
+    }
+    /* each file takes an entry per digest */
+    if (hashd_args.cache_entries) {
+        hashd.cache = fcache_new (hashd_args.cache_entries * 2);
+        if (hashd.cache == NULL)
+            goto main_out;
+    }
+    ret = hashd_serve (&hashd_args, &hashd);
+    if (hashd_args.verbose)
+        fprintf (stdout, "cache hits: %zu misses: %zu\n", hashd.hits,
+                 hashd.misses);
+main_out:
+    fcache_free (hashd.cache);
+    free (hashd.hashing);
+    if (ret == 0)
+        exit (EXIT_SUCCESS);
+    else
+        exit (EXIT_FAILURE);
+}
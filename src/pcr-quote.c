@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <tss/tspi.h>
+#include <trousers/trousers.h>
+#include <unistd.h>
+
+#include "merkle.h"
+#include "tpm.h"
+#include "util.h"
+
+#define PCR_COUNT 24
+#define PCR_LEN 20
+#define NONCE_LEN MERKLE_HASH_LEN
+#define LINE_MAX_LEN 128
+#define CLIENTS_MAX 1024
+#define WINDOW_MS 50
+#define CLIENT_TIMEOUT_MS 5000
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state);
+
+typedef struct quote_args {
+    char *socket;
+    char *aik;
+    uint32_t pcr_mask;
+    unsigned long window_ms;
+    bool verbose;
+} quote_args_t;
+
+const struct argp_option quote_opts[] = {
+    {
+        .name  = "socket",
+        .key   = 's',
+        .arg   = "path",
+        .flags = 0,
+        .doc   = "Unix socket to serve quotes on. Each client writes a "
+                 "nonce as a line of 40 hex digits and reads back one "
+                 "line of JSON.",
+        .group = 0,
+    },
+    {
+        .name  = "aik",
+        .key   = 'k',
+        .arg   = "file",
+        .flags = 0,
+        .doc   = "Blob of the attestation identity key to quote with, "
+                 "wrapped by the SRK (well known secret).",
+        .group = 0,
+    },
+    {
+        .name  = "pcr",
+        .key   = 'p',
+        .arg   = "0-PCR_MAX",
+        .flags = 0,
+        .doc   = "A PCR to quote, may be given several times.",
+        .group = 0,
+    },
+    {
+        .name  = "window",
+        .key   = 'w',
+        .arg   = "ms",
+        .flags = 0,
+        .doc   = "How long to collect nonces for one quote (default 50).",
+        .group = 0,
+    },
+    {
+        .name = "verbose",
+        .key = 'v',
+        .arg = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc = "verbose",
+        .group = 0,
+    },
+    { 0 }
+};
+
+const struct argp quote_argp = {
+    .options  = quote_opts,
+    .parser   = parse_opts,
+    .args_doc = NULL,
+    .doc      = "Serve TPM quotes, one quote per window of challenges. "
+                "The nonces of a window are the leaves of a SHA1 Merkle "
+                "tree whose root is quoted, each client gets the quote "
+                "and the inclusion path of its nonce."
+};
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state)
+{
+    quote_args_t *args = state->input;
+    long index;
+
+    switch (key) {
+        case 's':
+            args->socket = arg;
+            break;
+        case 'k':
+            args->aik = arg;
+            break;
+        case 'p':
+            index = strtol (arg, NULL, 10);
+            if (index < 0 || index >= PCR_COUNT) {
+                fprintf (stderr, "Invalid PCR: %s\n", arg);
+                return EINVAL;
+            }
+            args->pcr_mask |= 1U << index;
+            break;
+        case 'w':
+            args->window_ms = strtoul (arg, NULL, 10);
+            break;
+        case 'v':
+            args->verbose = true;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void
+quote_args_dump (quote_args_t *args)
+{
+    printf ("User provided options:\n");
+    printf ("  socket: %s\n", args->socket);
+    printf ("  aik: %s\n", args->aik);
+    printf ("  pcr_mask: 0x%06x\n", args->pcr_mask);
+    printf ("  window: %lu\n", args->window_ms);
+    printf ("  verbose: %s\n", args->verbose ? "true" : "false");
+}
+
+/*  A quote copied out of the TSS before its memory is released.
+ */
+typedef struct quote {
+    BYTE *data;
+    UINT32 data_len;
+    BYTE *signature;
+    UINT32 signature_len;
+    BYTE pcrs[PCR_COUNT][PCR_LEN];
+} quote_t;
+
+typedef struct quote_op {
+    BYTE *aik;
+    UINT32 aik_len;
+    uint32_t pcr_mask;
+    BYTE *nonce;
+    quote_t *quote;
+} quote_op_t;
+
+typedef struct client {
+    int fd;
+    uint64_t accepted;      /* dropped if no nonce CLIENT_TIMEOUT_MS later */
+    size_t len;
+    char line[LINE_MAX_LEN];
+    bool ready;
+    unsigned char nonce[NONCE_LEN];
+} client_t;
+
+static volatile sig_atomic_t quote_stop;
+
+static void
+quote_signal (int sig)
+{
+    (void)sig;
+    quote_stop = 1;
+}
+
+static BYTE*
+copy_buf (const BYTE *buf, UINT32 len)
+{
+    BYTE *copy;
+
+    copy = malloc (len ? len : 1);
+    if (copy == NULL) {
+        perror ("malloc of quote buffer:\n");
+        return NULL;
+    }
+    memcpy (copy, buf, len);
+    return copy;
+}
+
+static void
+quote_close (TSS_HCONTEXT context, TSS_HOBJECT object)
+{
+    TSS_RESULT result;
+
+    if (object == 0)
+        return;
+    result = Tspi_Context_CloseObject (context, object);
+    if (result != TSS_SUCCESS)
+        fprintf (stderr, "Failed to close object: %s\n",
+                 Trspi_Error_String (result));
+}
+
+/*  The SRK, the AIK and the PCR composite are closed once the quote is
+ *  taken, the pooled context outlives the quote and every AIK left
+ *  loaded would hold one of the TPM's few key slots.
+ */
+static TSS_RESULT
+quote_pcrs_op (tss_conn_t *conn, void *arg)
+{
+    quote_op_t *op = arg;
+    BYTE secret[] = TSS_WELL_KNOWN_SECRET;
+    TSS_VALIDATION validation = { 0 };
+    TSS_HKEY srk = 0, aik = 0;
+    TSS_HPOLICY policy;
+    TSS_HPCRS pcrs = 0;
+    TSS_RESULT result;
+    UINT32 index, len;
+    BYTE *value;
+
+    result = Tspi_Context_LoadKeyByUUID (conn->context, TSS_PS_TYPE_SYSTEM,
+                                         TSS_UUID_SRK, &srk);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    result = Tspi_GetPolicyObject (srk, TSS_POLICY_USAGE, &policy);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    result = Tspi_Policy_SetSecret (policy, TSS_SECRET_MODE_SHA1,
+                                    sizeof (secret), secret);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    result = Tspi_Context_LoadKeyByBlob (conn->context, srk, op->aik_len,
+                                         op->aik, &aik);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    result = Tspi_Context_CreateObject (conn->context, TSS_OBJECT_TYPE_PCRS,
+                                        0, &pcrs);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(op->pcr_mask & (1U << index)))
+            continue;
+        result = Tspi_PcrComposite_SelectPcrIndex (pcrs, index);
+        if (result != TSS_SUCCESS)
+            goto op_fail;
+    }
+    validation.ulExternalDataLength = NONCE_LEN;
+    validation.rgbExternalData = op->nonce;
+    result = Tspi_TPM_Quote (conn->tpm, aik, pcrs, &validation);
+    if (result != TSS_SUCCESS)
+        goto op_fail;
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(op->pcr_mask & (1U << index)))
+            continue;
+        result = Tspi_PcrComposite_GetPcrValue (pcrs, index, &len, &value);
+        if (result != TSS_SUCCESS)
+            goto op_fail;
+        if (len != PCR_LEN) {
+            result = TSS_E_FAIL;
+            goto op_fail;
+        }
+        memcpy (op->quote->pcrs[index], value, PCR_LEN);
+    }
+    op->quote->data = copy_buf (validation.rgbData, validation.ulDataLength);
+    op->quote->signature = copy_buf (validation.rgbValidationData,
+                                     validation.ulValidationDataLength);
+    if (op->quote->data == NULL || op->quote->signature == NULL) {
+        result = TSS_E_FAIL;
+        goto op_out;
+    }
+    op->quote->data_len = validation.ulDataLength;
+    op->quote->signature_len = validation.ulValidationDataLength;
+    goto op_out;
+op_fail:
+    fprintf (stderr, "Failed to quote: %s\n", Trspi_Error_String (result));
+op_out:
+    quote_close (conn->context, pcrs);
+    quote_close (conn->context, aik);
+    quote_close (conn->context, srk);
+    return result;
+}
+
+static int
+read_file (const char *path, BYTE **buf, UINT32 *len)
+{
+    struct stat sb;
+    FILE *file;
+    int ret = -1;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    if (fstat (fileno (file), &sb) == -1) {
+        perror ("fstat:\n");
+        goto read_out;
+    }
+    *buf = malloc (sb.st_size ? sb.st_size : 1);
+    if (*buf == NULL) {
+        perror ("malloc of key blob:\n");
+        goto read_out;
+    }
+    if (fread (*buf, 1, sb.st_size, file) != (size_t)sb.st_size) {
+        fprintf (stderr, "Failed to read %s\n", path);
+        free (*buf);
+        *buf = NULL;
+        goto read_out;
+    }
+    *len = sb.st_size;
+    ret = 0;
+read_out:
+    fclose (file);
+    return ret;
+}
+
+static void
+print_hex (FILE *file, const unsigned char *buf, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i)
+        fprintf (file, "%02x", buf[i]);
+}
+
+/*  Write the response for the leaf'th nonce of a batch and close.
+ */
+static void
+client_respond (client_t *client, const quote_t *quote, uint32_t mask,
+                const merkle_t *tree, size_t leaf, merkle_step_t *steps)
+{
+    FILE *out;
+    size_t count, i;
+    int index;
+    bool first = true;
+
+    out = fdopen (client->fd, "w");
+    if (out == NULL) {
+        close (client->fd);
+        return;
+    }
+    fprintf (out, "{\"quote\":\"");
+    print_hex (out, quote->data, quote->data_len);
+    fprintf (out, "\",\"signature\":\"");
+    print_hex (out, quote->signature, quote->signature_len);
+    fprintf (out, "\",\"pcrs\":[");
+    for (index = 0; index < PCR_COUNT; ++index) {
+        if (!(mask & (1U << index)))
+            continue;
+        fprintf (out, "%s{\"pcr\":%d,\"value\":\"", first ? "" : ",",
+                 index);
+        print_hex (out, quote->pcrs[index], PCR_LEN);
+        fprintf (out, "\"}");
+        first = false;
+    }
+    fprintf (out, "],\"root\":\"");
+    print_hex (out, merkle_root (tree), MERKLE_HASH_LEN);
+    fprintf (out, "\",\"leaf\":%zu,\"path\":[", leaf);
+    count = merkle_path (tree, leaf, steps);
+    for (i = 0; i < count; ++i) {
+        fprintf (out, "%s\"%c:", i ? "," : "", steps[i].left ? 'L' : 'R');
+        print_hex (out, steps[i].sibling, MERKLE_HASH_LEN);
+        fputc ('"', out);
+    }
+    fprintf (out, "]}\n");
+    fclose (out);
+}
+
+static void
+client_error (client_t *client, const char *error)
+{
+    dprintf (client->fd, "{\"error\":\"%s\"}\n", error);
+    close (client->fd);
+}
+
+/*  Quote once for every client with a nonce and answer them all.
+ */
+static int
+quote_batch (tss_pool_t *pool, quote_args_t *args, BYTE *aik,
+             UINT32 aik_len, client_t *clients, size_t count)
+{
+    unsigned char (*leaves)[MERKLE_HASH_LEN] = NULL;
+    merkle_step_t *steps = NULL;
+    merkle_t *tree = NULL;
+    quote_t quote = { 0 };
+    quote_op_t op = {
+        .aik = aik,
+        .aik_len = aik_len,
+        .pcr_mask = args->pcr_mask,
+        .quote = &quote,
+    };
+    size_t i, leaf;
+    int ret = -1;
+
+    leaves = calloc (count, MERKLE_HASH_LEN);
+    if (leaves == NULL) {
+        perror ("calloc of nonces:\n");
+        goto batch_out;
+    }
+    for (i = 0, leaf = 0; i < count; ++i) {
+        if (clients[i].ready)
+            memcpy (leaves[leaf++], clients[i].nonce, NONCE_LEN);
+    }
+    tree = merkle_build ((const unsigned char (*)[MERKLE_HASH_LEN])leaves,
+                         leaf);
+    if (tree == NULL)
+        goto batch_out;
+    steps = calloc (merkle_depth (tree) + 1, sizeof (merkle_step_t));
+    if (steps == NULL) {
+        perror ("calloc of merkle path:\n");
+        goto batch_out;
+    }
+    op.nonce = (BYTE*)merkle_root (tree);
+    if (tss_pool_run (pool, quote_pcrs_op, &op, true) != TSS_SUCCESS)
+        goto batch_out;
+    if (args->verbose)
+        printf ("Quoted %zu nonces\n", leaf);
+    for (i = 0, leaf = 0; i < count; ++i) {
+        if (!clients[i].ready)
+            continue;
+        client_respond (&clients[i], &quote, args->pcr_mask, tree, leaf++,
+                        steps);
+        clients[i].fd = -1;
+    }
+    ret = 0;
+batch_out:
+    for (i = 0; i < count; ++i) {
+        if (clients[i].ready && clients[i].fd != -1) {
+            client_error (&clients[i], "quote failed");
+            clients[i].fd = -1;
+        }
+    }
+    free (quote.data);
+    free (quote.signature);
+    free (steps);
+    merkle_free (tree);
+    free (leaves);
+    return ret;
+}
+
+/*  How long poll may wait: until the batch deadline once a nonce is
+ *  ready, and no longer than until the first client without a nonce
+ *  times out.
+ */
+static int
+quote_timeout (const client_t *clients, size_t count, size_t ready,
+               uint64_t deadline, uint64_t now)
+{
+    uint64_t next = ready ? deadline : UINT64_MAX;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (!clients[i].ready &&
+            clients[i].accepted + CLIENT_TIMEOUT_MS < next)
+            next = clients[i].accepted + CLIENT_TIMEOUT_MS;
+    }
+    if (next == UINT64_MAX)
+        return -1;
+    return next > now ? (int)(next - now) : 0;
+}
+
+/*  Read what a client sent, marking it ready once it has a whole nonce.
+ *  Returns -1 if the client should be dropped.
+ */
+static int
+client_read (client_t *client)
+{
+    ssize_t got;
+
+    got = read (client->fd, client->line + client->len,
+                LINE_MAX_LEN - client->len);
+    if (got <= 0)
+        return -1;
+    client->len += got;
+    if (memchr (client->line, '\n', client->len) == NULL)
+        return client->len < LINE_MAX_LEN ? 0 : -1;
+    if (hex_parse (client->line, client->nonce, NONCE_LEN))
+        return -1;
+    if (client->line[NONCE_LEN * 2] != '\n' &&
+        client->line[NONCE_LEN * 2] != '\r')
+        return -1;
+    client->ready = true;
+    return 0;
+}
+
+static uint64_t
+now_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*  Serve until interrupted. The first nonce of a batch opens a window
+ *  of window_ms, everything that arrives within it shares one quote.
+ */
+static int
+quote_serve (quote_args_t *args, BYTE *aik, UINT32 aik_len)
+{
+    struct sigaction action = { .sa_handler = quote_signal };
+    struct pollfd *pfds = NULL;
+    client_t *clients = NULL;
+    tss_pool_t *pool = NULL;
+    uint64_t deadline = 0, now;
+    size_t count = 0, ready = 0, i, j;
+    int listen_fd, fd, timeout, ret = -1;
+
+    listen_fd = unix_listen (args->socket);
+    if (listen_fd == -1)
+        return -1;
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+    signal (SIGPIPE, SIG_IGN);
+    pfds = calloc (CLIENTS_MAX + 1, sizeof (struct pollfd));
+    clients = calloc (CLIENTS_MAX, sizeof (client_t));
+    if (pfds == NULL || clients == NULL) {
+        perror ("calloc of clients:\n");
+        goto serve_out;
+    }
+    pool = tss_pool_new (1);
+    if (pool == NULL)
+        goto serve_out;
+    while (!quote_stop) {
+        pfds[0].fd = count < CLIENTS_MAX ? listen_fd : -1;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < count; ++i) {
+            pfds[i + 1].fd = clients[i].ready ? -1 : clients[i].fd;
+            pfds[i + 1].events = POLLIN;
+        }
+        timeout = quote_timeout (clients, count, ready, deadline, now_ms ());
+        if (poll (pfds, count + 1, timeout) == -1) {
+            /* revents are stale, poll again */
+            if (errno == EINTR)
+                continue;
+            perror ("poll:\n");
+            goto serve_out;
+        }
+        now = now_ms ();
+        for (i = 0; i < count; ++i) {
+            if (clients[i].ready ||
+                !(pfds[i + 1].revents & (POLLIN | POLLHUP)))
+                continue;
+            if (client_read (&clients[i])) {
+                close (clients[i].fd);
+                clients[i].fd = -1;
+            } else if (clients[i].ready && ready++ == 0) {
+                deadline = now_ms () + args->window_ms;
+            }
+        }
+        /* an idle client mustn't hold its slot */
+        for (i = 0; i < count; ++i) {
+            if (!clients[i].ready && clients[i].fd != -1 &&
+                now >= clients[i].accepted + CLIENT_TIMEOUT_MS) {
+                close (clients[i].fd);
+                clients[i].fd = -1;
+            }
+        }
+        if (ready && now_ms () >= deadline) {
+            if (quote_batch (pool, args, aik, aik_len, clients, count))
+                fprintf (stderr, "Failed to answer %zu nonces\n", ready);
+            ready = 0;
+        }
+        /* drop closed clients, pfds are rebuilt from clients */
+        for (i = 0, j = 0; i < count; ++i) {
+            if (clients[i].fd != -1)
+                clients[j++] = clients[i];
+        }
+        count = j;
+        /* after the loops over pfds, the new client has no entry yet */
+        if (pfds[0].revents & POLLIN) {
+            fd = accept (listen_fd, NULL, NULL);
+            if (fd != -1) {
+                memset (&clients[count], 0, sizeof (client_t));
+                clients[count].accepted = now;
+                clients[count++].fd = fd;
+            }
+        }
+    }
+    ret = 0;
+serve_out:
+    for (i = 0; i < count; ++i)
+        close (clients[i].fd);
+    tss_pool_free (pool);
+    free (clients);
+    free (pfds);
+    close (listen_fd);
+    unlink (args->socket);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    quote_args_t quote_args = { .window_ms = WINDOW_MS };
+    BYTE *aik = NULL;
+    UINT32 aik_len = 0;
+    int ret = -1;
+
+    if (argp_parse (&quote_argp, argc, argv, 0, NULL, &quote_args)) {
+        perror ("argp_parse: \n");
+        goto main_out;
+    }
+    if (quote_args.verbose)
+        quote_args_dump (&quote_args);
+    if (quote_args.socket == NULL || quote_args.aik == NULL ||
+        quote_args.pcr_mask == 0) {
+        fprintf (stderr, "A socket, an AIK and at least one PCR are "
+                 "required.\n");
+        goto main_out;
+    }
+    if (read_file (quote_args.aik, &aik, &aik_len))
+        goto main_out;
+    ret = quote_serve (&quote_args, aik, aik_len);
+main_out:
+    free (aik);
+    if (ret == 0)
+        exit (EXIT_SUCCESS);
+    else
+        exit (EXIT_FAILURE);
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "uki.h"
+
+#define UKI_BANKS 2
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state);
+
+typedef struct uki_args {
+    char **paths;
+    size_t path_count;
+    unsigned int jobs;
+    bool verbose;
+} uki_args_t;
+
+const struct argp_option uki_opts[] = {
+    {
+        .name  = "jobs",
+        .key   = 'j',
+        .arg   = "count",
+        .flags = 0,
+        .doc   = "Number of images to process concurrently, defaults to "
+                 "the number of CPUs.",
+        .group = 0,
+    },
+    {
+        .name = "verbose",
+        .key = 'v',
+        .arg = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc = "verbose, also print the digest of every measured section",
+        .group = 0,
+    },
+    { 0 }
+};
+
+const struct argp uki_argp = {
+    .options  = uki_opts,
+    .parser   = parse_opts,
+    .args_doc = "IMAGE|DIR...",
+    .doc      = "Predict PCR 11 for unified kernel images as systemd-stub "
+                "measures them, in the SHA1 and SHA256 banks. Directories "
+                "are searched for *.efi images."
+};
+
+error_t
+parse_opts (int key, char *arg, struct argp_state *state)
+{
+    uki_args_t *args = state->input;
+
+    switch (key) {
+        case 'j':
+            args->jobs = strtoul (arg, NULL, 10);
+            break;
+        case 'v':
+            args->verbose = true;
+            break;
+        case ARGP_KEY_ARGS:
+            args->paths = state->argv + state->next;
+            args->path_count = state->argc - state->next;
+            break;
+        case ARGP_KEY_NO_ARGS:
+            argp_usage (state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void
+uki_args_dump (uki_args_t *args)
+{
+    printf ("User provided options:\n");
+    printf ("  paths: %zu\n", args->path_count);
+    printf ("  jobs: %u\n", args->jobs);
+    printf ("  verbose: %s\n", args->verbose ? "true" : "false");
+}
+
+typedef struct image_list {
+    char **paths;
+    size_t count;
+} image_list_t;
+
+static int
+image_add (image_list_t *list, char *path)
+{
+    char **paths;
+
+    paths = realloc (list->paths, (list->count + 1) * sizeof (char*));
+    if (paths == NULL) {
+        perror ("realloc of image list:\n");
+        free (path);
+        return -1;
+    }
+    list->paths = paths;
+    list->paths[list->count++] = path;
+    return 0;
+}
+
+static int
+name_cmp (const struct dirent **a, const struct dirent **b)
+{
+    return strcmp ((*a)->d_name, (*b)->d_name);
+}
+
+static int
+efi_filter (const struct dirent *entry)
+{
+    size_t len = strlen (entry->d_name);
+
+    return len > 4 && strcmp (entry->d_name + len - 4, ".efi") == 0;
+}
+
+/*  Add path, or the *.efi images in it when it's a directory, in name
+ *  order so the output is stable.
+ */
+static int
+image_scan (image_list_t *list, const char *path)
+{
+    struct dirent **entries;
+    struct stat sb;
+    char *image;
+    int count, i, ret = 0;
+
+    if (stat (path, &sb) == -1) {
+        fprintf (stderr, "Failed to stat %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    if (!S_ISDIR (sb.st_mode)) {
+        image = strdup (path);
+        if (image == NULL) {
+            perror ("strdup:\n");
+            return -1;
+        }
+        return image_add (list, image);
+    }
+    count = scandir (path, &entries, efi_filter, name_cmp);
+    if (count == -1) {
+        fprintf (stderr, "Failed to read %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        if (ret == 0 && asprintf (&image, "%s/%s", path,
+                                  entries[i]->d_name) == -1) {
+            perror ("asprintf:\n");
+            ret = -1;
+        } else if (ret == 0) {
+            ret = image_add (list, image);
+        }
+        free (entries[i]);
+    }
+    free (entries);
+    return ret;
+}
+
+typedef struct uki_work {
+    const image_list_t *list;
+    const EVP_MD *const *mds;
+    uki_prediction_t *predictions;
+    int *results;
+    atomic_size_t next;
+} uki_work_t;
+
+static void*
+uki_worker (void *arg)
+{
+    uki_work_t *work = arg;
+    size_t i;
+
+    while ((i = atomic_fetch_add (&work->next, 1)) < work->list->count) {
+        work->results[i] = uki_predict (work->list->paths[i], work->mds,
+                                        UKI_BANKS, &work->predictions[i]);
+    }
+    return NULL;
+}
+
+static void
+print_digests (const char *const *names,
+               unsigned char digests[][EVP_MAX_MD_SIZE],
+               const unsigned int *lens)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < UKI_BANKS; ++i) {
+        fprintf (stdout, " %s:", names[i]);
+        for (j = 0; j < lens[i]; ++j)
+            fprintf (stdout, "%02x", digests[i][j]);
+    }
+    fprintf (stdout, "\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    const EVP_MD *mds[UKI_BANKS] = { EVP_sha1 (), EVP_sha256 () };
+    const char *names[UKI_BANKS] = { "sha1", "sha256" };
+    uki_args_t uki_args = { 0 };
+    image_list_t list = { 0 };
+    uki_work_t work = { .mds = mds };
+    pthread_t *threads = NULL;
+    size_t i, j, started = 0;
+    int ret = -1;
+
+    if (argp_parse (&uki_argp, argc, argv, 0, NULL, &uki_args)) {
+        perror ("argp_parse: \n");
+        goto main_out;
+    }
+    if (uki_args.verbose)
+        uki_args_dump (&uki_args);
+    if (uki_args.jobs == 0)
+        uki_args.jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < uki_args.path_count; ++i) {
+        if (image_scan (&list, uki_args.paths[i]))
+            goto main_out;
+    }
+    if (list.count == 0) {
+        fprintf (stderr, "No images found.\n");
+        goto main_out;
+    }
+    if (uki_args.jobs > list.count)
+        uki_args.jobs = list.count;
+    work.list = &list;
+    work.predictions = calloc (list.count, sizeof (uki_prediction_t));
+    work.results = calloc (list.count, sizeof (int));
+    threads = calloc (uki_args.jobs, sizeof (pthread_t));
+    if (work.predictions == NULL || work.results == NULL || threads == NULL) {
+        perror ("calloc:\n");
+        goto main_out;
+    }
+    atomic_init (&work.next, 0);
+    for (started = 0; started + 1 < uki_args.jobs; ++started) {
+        if (pthread_create (&threads[started], NULL, uki_worker, &work)) {
+            perror ("pthread_create:\n");
+            break;
+        }
+    }
+    /* the calling thread is the last worker, so one always runs */
+    uki_worker (&work);
+    for (i = 0; i < started; ++i)
+        pthread_join (threads[i], NULL);
+
+    ret = 0;
+    for (i = 0; i < list.count; ++i) {
+        uki_prediction_t *prediction = &work.predictions[i];
+
+        if (work.results[i]) {
+            ret = -1;
+            continue;
+        }
+        fprintf (stdout, "%s", list.paths[i]);
+        print_digests (names, prediction->pcr, prediction->pcr_len);
+        if (uki_args.verbose) {
+            for (j = 0; j < prediction->section_count; ++j) {
+                unsigned int lens[UKI_BANKS] = {
+                    prediction->pcr_len[0], prediction->pcr_len[1]
+                };
+
+                fprintf (stdout, "  %s", prediction->sections[j].name);
+                print_digests (names, prediction->sections[j].digest, lens);
+            }
+        }
+    }
+main_out:
+    for (i = 0; i < list.count; ++i)
+        free (list.paths[i]);
+    free (list.paths);
+    free (work.predictions);
+    free (work.results);
+    free (threads);
+    if (ret == 0)
+        exit (EXIT_SUCCESS);
+    else
+        exit (EXIT_FAILURE);
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pe.h"
+#include "profile.h"
+
+#define DOS_MAGIC 0x5a4d           /* MZ */
+#define DOS_LFANEW 0x3c
+#define PE_SIGNATURE 0x00004550    /* PE\0\0 */
+#define COFF_HEADER_SIZE 20
+#define OPT_MAGIC_PE32 0x10b
+#define OPT_MAGIC_PE32_PLUS 0x20b
+#define OPT_CHECKSUM 64
+#define OPT_SIZE_OF_HEADERS 60
+#define SECTION_HEADER_SIZE 40
+#define DIRECTORY_SECURITY 4
+
+static uint16_t
+le16 (const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32 (const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*  Check the headers of the mapped image and fill in the offsets the
+ *  digests need.
+ */
+static int
+pe_parse (pe_image_t *image)
+{
+    const unsigned char *map = image->map, *coff, *opt, *dirs, *shdr;
+    size_t size = image->size, i;
+    uint32_t pe_offset, dir_count, cert_offset;
+    uint16_t opt_size;
+    pe_section_t *section;
+
+    if (size < DOS_LFANEW + 4 || le16 (map) != DOS_MAGIC)
+        return -1;
+    pe_offset = le32 (map + DOS_LFANEW);
+    if ((uint64_t)pe_offset + 4 + COFF_HEADER_SIZE > size ||
+        le32 (map + pe_offset) != PE_SIGNATURE)
+        return -1;
+    coff = map + pe_offset + 4;
+    image->section_count = le16 (coff + 2);
+    opt_size = le16 (coff + 16);
+    opt = coff + COFF_HEADER_SIZE;
+    if ((size_t)(opt - map) + opt_size > size || opt_size < 2)
+        return -1;
+    /* the data directories follow the fixed part of the optional header */
+    switch (le16 (opt)) {
+        case OPT_MAGIC_PE32:
+            dirs = opt + 96;
+            break;
+        case OPT_MAGIC_PE32_PLUS:
+            dirs = opt + 112;
+            break;
+        default:
+            return -1;
+    }
+    if (dirs > opt + opt_size)
+        return -1;
+    dir_count = le32 (dirs - 4);
+    image->headers = le32 (opt + OPT_SIZE_OF_HEADERS);
+    image->checksum = opt + OPT_CHECKSUM - map;
+    if (image->checksum + 4 > image->headers || image->headers > size)
+        return -1;
+    if (dir_count > DIRECTORY_SECURITY &&
+        dirs + (DIRECTORY_SECURITY + 1) * 8 <= opt + opt_size) {
+        image->cert_dir = dirs + DIRECTORY_SECURITY * 8 - map;
+        cert_offset = le32 (map + image->cert_dir);
+        image->cert_size = le32 (map + image->cert_dir + 4);
+        if (image->cert_dir + 8 > image->headers ||
+            (uint64_t)cert_offset + image->cert_size > size)
+            return -1;
+    }
+
+    shdr = opt + opt_size;
+    if ((size_t)(shdr - map) + image->section_count * SECTION_HEADER_SIZE >
+        size)
+        return -1;
+    image->sections = calloc (image->section_count ? image->section_count : 1,
+                              sizeof (pe_section_t));
+    if (image->sections == NULL) {
+        perror ("calloc of sections:\n");
+        return -1;
+    }
+    for (i = 0; i < image->section_count; ++i) {
+        section = &image->sections[i];
+        memcpy (section->name, shdr, PE_SECTION_NAME_LEN);
+        section->virtual_size = le32 (shdr + 8);
+        section->raw_size = le32 (shdr + 16);
+        section->offset = le32 (shdr + 20);
+        if (section->raw_size &&
+            (uint64_t)section->offset + section->raw_size > size)
+            return -1;
+        shdr += SECTION_HEADER_SIZE;
+    }
+    return 0;
+}
+
+pe_image_t*
+pe_open (const char *path)
+{
+    pe_image_t *image;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return NULL;
+    }
+    profile_note_fd (fd);
+    if (fstat (fd, &sb) == -1) {
+        perror ("fstat:\n");
+        close (fd);
+        return NULL;
+    }
+    image = calloc (1, sizeof (pe_image_t));
+    if (image == NULL) {
+        perror ("calloc of pe_image_t:\n");
+        close (fd);
+        return NULL;
+    }
+    if (sb.st_size == 0)
+        goto open_invalid;
+    map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    fd = -1;
+    if (map == MAP_FAILED) {
+        perror ("mmap:\n");
+        goto open_fail;
+    }
+    image->map = map;
+    image->size = sb.st_size;
+    if (pe_parse (image) == 0)
+        return image;
+open_invalid:
+    fprintf (stderr, "%s isn't a valid PE/COFF image.\n", path);
+open_fail:
+    if (fd != -1)
+        close (fd);
+    pe_close (image);
+    return NULL;
+}
+
+void
+pe_close (pe_image_t *image)
+{
+    if (image == NULL)
+        return;
+    if (image->map)
+        munmap ((void*)image->map, image->size);
+    free (image->sections);
+    free (image);
+}
+
+static int
+section_cmp (const void *a, const void *b)
+{
+    const pe_section_t *x = *(const pe_section_t *const *)a;
+    const pe_section_t *y = *(const pe_section_t *const *)b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+typedef struct pe_hash {
+    EVP_MD_CTX *ctxs[PE_DIGESTS_MAX];
+    size_t count;
+} pe_hash_t;
+
+static int
+pe_update (pe_hash_t *hash, const unsigned char *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < hash->count; ++i) {
+        if (EVP_DigestUpdate (hash->ctxs[i], data, len) == 0) {
+            ERR_print_errors_fp (stderr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+pe_hash_image (pe_hash_t *hash, const pe_image_t *image)
+{
+    const unsigned char *map = image->map;
+    const pe_section_t **sections;
+    size_t checksum = image->checksum, cert_dir = image->cert_dir;
+    size_t headers = image->headers, i, n, sum, end;
+    int ret = -1;
+
+    madvise ((void*)map, image->size, MADV_SEQUENTIAL);
+    /* headers, skipping the checksum and the certificate table entry */
+    if (pe_update (hash, map, checksum))
+        return -1;
+    if (cert_dir) {
+        if (pe_update (hash, map + checksum + 4, cert_dir - checksum - 4) ||
+            pe_update (hash, map + cert_dir + 8, headers - cert_dir - 8))
+            return -1;
+    } else if (pe_update (hash, map + checksum + 4,
+                          headers - checksum - 4)) {
+        return -1;
+    }
+
+    /* sections in file order */
+    sections = calloc (image->section_count ? image->section_count : 1,
+                       sizeof (pe_section_t*));
+    if (sections == NULL) {
+        perror ("calloc of sections:\n");
+        return -1;
+    }
+    for (i = 0, n = 0; i < image->section_count; ++i) {
+        if (image->sections[i].raw_size)
+            sections[n++] = &image->sections[i];
+    }
+    qsort (sections, n, sizeof (pe_section_t*), section_cmp);
+    sum = headers;
+    for (i = 0; i < n; ++i) {
+        if (pe_update (hash, map + sections[i]->offset, sections[i]->raw_size))
+            goto hash_out;
+        sum += sections[i]->raw_size;
+    }
+
+    /* anything past the sections but before the certificate table */
+    end = image->size - image->cert_size;
+    if (end > sum && pe_update (hash, map + sum, end - sum))
+        goto hash_out;
+    ret = 0;
+hash_out:
+    free (sections);
+    return ret;
+}
+
+int
+pe_digest (const pe_image_t *image, const EVP_MD *const *mds, size_t count,
+           unsigned char digests[][EVP_MAX_MD_SIZE], unsigned int *lens)
+{
+    pe_hash_t hash = { .count = count };
+    size_t i;
+    int ret = -1;
+
+    if (count > PE_DIGESTS_MAX)
+        return -1;
+    for (i = 0; i < count; ++i) {
+        hash.ctxs[i] = EVP_MD_CTX_create ();
+        if (hash.ctxs[i] == NULL ||
+            EVP_DigestInit (hash.ctxs[i], mds[i]) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto digest_out;
+        }
+    }
+    if (pe_hash_image (&hash, image))
+        goto digest_out;
+    for (i = 0; i < count; ++i) {
+        if (EVP_DigestFinal (hash.ctxs[i], digests[i], &lens[i]) == 0) {
+            ERR_print_errors_fp (stderr);
+            goto digest_out;
+        }
+    }
+    ret = 0;
+digest_out:
+    for (i = 0; i < count; ++i) {
+        if (hash.ctxs[i])
+            EVP_MD_CTX_destroy (hash.ctxs[i]);
+    }
+    return ret;
+}
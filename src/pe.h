@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PE_H
+#define PE_H
+
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PE_DIGESTS_MAX 4
+#define PE_SECTION_NAME_LEN 8
+
+typedef struct pe_section {
+    char name[PE_SECTION_NAME_LEN + 1];
+    uint32_t virtual_size;  /* size once loaded, zero filled past raw_size */
+    uint32_t raw_size;
+    uint32_t offset;
+} pe_section_t;
+
+/*  A PE/COFF image mapped read-only with its headers checked: every
+ *  offset below, and every section's raw data, lies within the file.
+ */
+typedef struct pe_image {
+    const unsigned char *map;
+    size_t size;
+    size_t checksum;    /* offset of the checksum field */
+    size_t cert_dir;    /* offset of the certificate table entry, or 0 */
+    uint32_t cert_size;
+    uint32_t headers;   /* SizeOfHeaders */
+    pe_section_t *sections;     /* in section table order */
+    size_t section_count;
+} pe_image_t;
+
+pe_image_t*
+pe_open (const char *path);
+void
+pe_close (pe_image_t *image);
+
+/*  Authenticode digests of the image, as firmware measures EFI
+ *  applications into PCR 4: the headers without the checksum and the
+ *  certificate table entry, the sections in file order, then any data
+ *  after them up to the certificate table. Every md in mds is computed
+ *  in the same pass.
+ */
+int
+pe_digest (const pe_image_t *image, const EVP_MD *const *mds, size_t count,
+           unsigned char digests[][EVP_MAX_MD_SIZE], unsigned int *lens);
+
+#endif /* PE_H */
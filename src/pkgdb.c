@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkgdb.h"
+#include "util.h"
+
+#define PKGDB_MAX_FIELDS 64
+
+struct pkgdb {
+    pkgdb_entry_t *entries;
+    size_t count;
+    size_t size;
+};
+
+static bool
+is_number (const char *str)
+{
+    if (*str == '\0')
+        return false;
+    for (; *str; ++str) {
+        if (!isdigit ((unsigned char)*str))
+            return false;
+    }
+    return true;
+}
+
+static int
+parse_digest (const char *hex, unsigned char *digest)
+{
+    if (strlen (hex) != 2 * PKGDB_DIGEST_LEN)
+        return -1;
+    return hex_parse (hex, digest, PKGDB_DIGEST_LEN);
+}
+
+/*  Paths aren't quoted in the dump, so the path is everything up to the
+ *  first 'size mtime digest' triple.
+ */
+static int
+pkgdb_parse_line (pkgdb_t *pkgdb, char *line)
+{
+    char *fields[PKGDB_MAX_FIELDS], *save = NULL, *tok;
+    pkgdb_entry_t *entries, *entry;
+    size_t count = 0, i, j;
+
+    for (tok = strtok_r (line, " \n", &save); tok && count < PKGDB_MAX_FIELDS;
+         tok = strtok_r (NULL, " \n", &save))
+        fields[count++] = tok;
+    for (i = 1; i + 2 < count; ++i) {
+        if (is_number (fields[i]) && is_number (fields[i + 1]))
+            break;
+    }
+    if (i + 2 >= count || fields[0][0] != '/')
+        return 0;
+    if (pkgdb->count == pkgdb->size) {
+        pkgdb->size = pkgdb->size ? pkgdb->size * 2 : 1024;
+        entries = realloc (pkgdb->entries,
+                           pkgdb->size * sizeof (pkgdb_entry_t));
+        if (entries == NULL) {
+            perror ("realloc of package entries:\n");
+            return -1;
+        }
+        pkgdb->entries = entries;
+    }
+    entry = &pkgdb->entries[pkgdb->count];
+    if (parse_digest (fields[i + 2], entry->digest))
+        return 0;
+    /* rejoin a path that contained spaces */
+    for (j = 1; j < i; ++j)
+        fields[j][-1] = ' ';
+    entry->path = strdup (fields[0]);
+    if (entry->path == NULL) {
+        perror ("strdup:\n");
+        return -1;
+    }
+    entry->size = strtoll (fields[i], NULL, 10);
+    entry->mtime = strtoll (fields[i + 1], NULL, 10);
+    ++pkgdb->count;
+    return 0;
+}
+
+static int
+entry_cmp (const void *a, const void *b)
+{
+    return strcmp (((const pkgdb_entry_t*)a)->path,
+                   ((const pkgdb_entry_t*)b)->path);
+}
+
+pkgdb_t*
+pkgdb_load (const char *path)
+{
+    pkgdb_t *pkgdb;
+    char *line = NULL;
+    size_t line_size = 0, i, j;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        fprintf (stderr, "Failed to open package manifest %s: %s\n", path,
+                 strerror (errno));
+        return NULL;
+    }
+    pkgdb = calloc (1, sizeof (pkgdb_t));
+    if (pkgdb == NULL) {
+        perror ("calloc of package manifest:\n");
+        fclose (file);
+        return NULL;
+    }
+    while (getline (&line, &line_size, file) != -1) {
+        if (pkgdb_parse_line (pkgdb, line))
+            goto load_fail;
+    }
+    if (ferror (file)) {
+        perror ("getline:\n");
+        goto load_fail;
+    }
+    qsort (pkgdb->entries, pkgdb->count, sizeof (pkgdb_entry_t), entry_cmp);
+    /* files shared between packages appear once per package, packages
+     * that disagree about a file leave it to be hashed
+     */
+    for (i = 0, j = 0; i < pkgdb->count; ++i) {
+        if (j > 0 && strcmp (pkgdb->entries[j - 1].path,
+                             pkgdb->entries[i].path) == 0) {
+            if (memcmp (pkgdb->entries[j - 1].digest,
+                        pkgdb->entries[i].digest, PKGDB_DIGEST_LEN) != 0)
+                pkgdb->entries[j - 1].size = -1;
+            free (pkgdb->entries[i].path);
+            continue;
+        }
+        pkgdb->entries[j++] = pkgdb->entries[i];
+    }
+    pkgdb->count = j;
+    free (line);
+    fclose (file);
+    return pkgdb;
+load_fail:
+    free (line);
+    fclose (file);
+    pkgdb_free (pkgdb);
+    return NULL;
+}
+
+const pkgdb_entry_t*
+pkgdb_lookup (const pkgdb_t *pkgdb, const char *path)
+{
+    pkgdb_entry_t key = { .path = (char*)path };
+
+    return bsearch (&key, pkgdb->entries, pkgdb->count,
+                    sizeof (pkgdb_entry_t), entry_cmp);
+}
+
+size_t
+pkgdb_count (const pkgdb_t *pkgdb)
+{
+    return pkgdb->count;
+}
+
+void
+pkgdb_free (pkgdb_t *pkgdb)
+{
+    size_t i;
+
+    if (pkgdb == NULL)
+        return;
+    for (i = 0; i < pkgdb->count; ++i)
+        free (pkgdb->entries[i].path);
+    free (pkgdb->entries);
+    free (pkgdb);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PKGDB_H
+#define PKGDB_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define PKGDB_DIGEST_LEN 32
+
+/*  Per-file SHA-256 digests recorded by the package manager, read from
+ *  the output of 'rpm -qa --dump' (one file per line: path size mtime
+ *  digest mode owner group isconfig isdoc rdev symlink). Entries with
+ *  anything other than a SHA-256 digest are ignored.
+ */
+typedef struct pkgdb_entry {
+    char *path;
+    off_t size;
+    time_t mtime;
+    unsigned char digest[PKGDB_DIGEST_LEN];
+} pkgdb_entry_t;
+
+typedef struct pkgdb pkgdb_t;
+
+pkgdb_t*
+pkgdb_load (const char *path);
+const pkgdb_entry_t*
+pkgdb_lookup (const pkgdb_t *pkgdb, const char *path);
+size_t
+pkgdb_count (const pkgdb_t *pkgdb);
+void
+pkgdb_free (pkgdb_t *pkgdb);
+
+#endif /* PKGDB_H */
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+#define PREFETCH_CHUNK (128 * 1024)
+#define PREFETCH_SLOTS 32
+#define PREFETCH_WORKERS 16
+#define PREFETCH_WINDOW_MIN 2
+#define PREFETCH_MIN_SIZE (2 * PREFETCH_CHUNK)
+
+/* filesystem magics from linux/magic.h and the filesystems themselves */
+#define FUSE_SUPER_MAGIC 0x65735546
+#define NFS_SUPER_MAGIC 0x6969
+#define SMB_SUPER_MAGIC 0x517b
+#define CIFS_SUPER_MAGIC 0xff534d42
+#define SMB2_SUPER_MAGIC 0xfe534d42
+#define CEPH_SUPER_MAGIC 0x00c36400
+#define V9FS_MAGIC 0x01021997
+#define AFS_FS_MAGIC 0x6b414653
+
+typedef enum slot_state {
+    SLOT_FREE,
+    SLOT_QUEUED,
+    SLOT_BUSY,
+    SLOT_READY,
+} slot_state_t;
+
+typedef struct slot {
+    slot_state_t state;
+    off_t offset;
+    ssize_t len;
+    int error;
+    unsigned char *buf;
+} slot_t;
+
+/*  Chunks are numbered in file order. Those from consumed to issued are
+ *  queued, being read or ready, slot seq % PREFETCH_SLOTS holds chunk
+ *  seq. The chunk handed to the caller stays held until the next call.
+ */
+struct prefetch {
+    int fd;
+    off_t end;          /* size when opened, read past it synchronously */
+    off_t issue;        /* offset of the next chunk to queue */
+    off_t pos;          /* end of the data handed out so far */
+    uint64_t issued;
+    uint64_t consumed;
+    bool holding;
+    unsigned int window;
+    slot_t slots[PREFETCH_SLOTS];
+    pthread_t workers[PREFETCH_WORKERS];
+    unsigned int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    bool stop;
+    uint64_t read_ns;   /* smoothed pread latency */
+    uint64_t hash_ns;   /* smoothed time the caller spends per chunk */
+    uint64_t handed_ns;
+    unsigned char *tail;
+};
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+ewma (uint64_t avg, uint64_t sample)
+{
+    return avg ? (avg * 7 + sample) / 8 : sample;
+}
+
+static ssize_t
+pread_chunk (int fd, unsigned char *buf, off_t offset)
+{
+    ssize_t got;
+    size_t done = 0;
+
+    while (done < PREFETCH_CHUNK) {
+        got = pread (fd, buf + done, PREFETCH_CHUNK - done, offset + done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+            return -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+bool
+prefetch_wanted (int fd)
+{
+    struct statfs fs;
+    struct stat sb;
+
+    if (fstat (fd, &sb) || !S_ISREG (sb.st_mode) ||
+        sb.st_size < PREFETCH_MIN_SIZE || fstatfs (fd, &fs))
+        return false;
+    switch ((unsigned long)fs.f_type) {
+        case FUSE_SUPER_MAGIC:
+        case NFS_SUPER_MAGIC:
+        case SMB_SUPER_MAGIC:
+        case CIFS_SUPER_MAGIC:
+        case SMB2_SUPER_MAGIC:
+        case CEPH_SUPER_MAGIC:
+        case V9FS_MAGIC:
+        case AFS_FS_MAGIC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void*
+prefetch_worker (void *arg)
+{
+    prefetch_t *pf = arg;
+    slot_t *slot = NULL;
+    uint64_t seq, start;
+    ssize_t len;
+    int error;
+
+    pthread_mutex_lock (&pf->lock);
+    while (!pf->stop) {
+        /* the lowest queued chunk is the one the caller waits on first */
+        for (seq = pf->consumed; seq < pf->issued; ++seq) {
+            slot = &pf->slots[seq % PREFETCH_SLOTS];
+            if (slot->state == SLOT_QUEUED)
+                break;
+        }
+        if (seq == pf->issued) {
+            pthread_cond_wait (&pf->work, &pf->lock);
+            continue;
+        }
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock (&pf->lock);
+        start = now_ns ();
+        len = pread_chunk (pf->fd, slot->buf, slot->offset);
+        error = errno;
+        pthread_mutex_lock (&pf->lock);
+        pf->read_ns = ewma (pf->read_ns, now_ns () - start);
+        slot->len = len;
+        slot->error = error;
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast (&pf->done);
+    }
+    pthread_mutex_unlock (&pf->lock);
+    return NULL;
+}
+
+prefetch_t*
+prefetch_new (int fd, off_t offset)
+{
+    prefetch_t *pf;
+    struct stat sb;
+
+    if (fstat (fd, &sb)) {
+        perror ("fstat:\n");
+        return NULL;
+    }
+    pf = calloc (1, sizeof (prefetch_t));
+    if (pf == NULL) {
+        perror ("calloc of prefetch:\n");
+        return NULL;
+    }
+    pf->fd = fd;
+    pf->end = sb.st_size;
+    pf->issue = offset;
+    pf->pos = offset;
+    pf->window = PREFETCH_WINDOW_MIN;
+    pthread_mutex_init (&pf->lock, NULL);
+    pthread_cond_init (&pf->work, NULL);
+    pthread_cond_init (&pf->done, NULL);
+    return pf;
+}
+
+/*  Enough chunks in flight to cover a read's latency with the time
+ *  spent hashing the chunks ahead of it.
+ */
+static void
+prefetch_adapt (prefetch_t *pf)
+{
+    uint64_t window;
+
+    if (pf->read_ns == 0 || pf->hash_ns == 0)
+        return;
+    window = pf->read_ns / pf->hash_ns + 2;
+    if (window > PREFETCH_SLOTS)
+        window = PREFETCH_SLOTS;
+    pf->window = window;
+}
+
+/*  Queue chunks up to the window, called with the lock held.
+ */
+static int
+prefetch_fill (prefetch_t *pf)
+{
+    slot_t *slot;
+
+    while (pf->issued - pf->consumed < pf->window && pf->issue < pf->end) {
+        slot = &pf->slots[pf->issued % PREFETCH_SLOTS];
+        if (slot->buf == NULL) {
+            slot->buf = malloc (PREFETCH_CHUNK);
+            if (slot->buf == NULL) {
+                perror ("malloc of prefetch chunk:\n");
+                return -1;
+            }
+        }
+        slot->state = SLOT_QUEUED;
+        slot->offset = pf->issue;
+        pf->issue += PREFETCH_CHUNK;
+        ++pf->issued;
+        pthread_cond_signal (&pf->work);
+    }
+    while (pf->worker_count < PREFETCH_WORKERS &&
+           pf->worker_count < pf->issued - pf->consumed) {
+        if (pthread_create (&pf->workers[pf->worker_count], NULL,
+                            prefetch_worker, pf)) {
+            if (pf->worker_count == 0) {
+                fprintf (stderr, "Failed to start prefetch thread.\n");
+                return -1;
+            }
+            break;
+        }
+        ++pf->worker_count;
+    }
+    return 0;
+}
+
+ssize_t
+prefetch_next (prefetch_t *pf, const unsigned char **data)
+{
+    uint64_t now = now_ns ();
+    slot_t *slot;
+    ssize_t len;
+
+    pthread_mutex_lock (&pf->lock);
+    if (pf->holding) {
+        pf->slots[(pf->consumed - 1) % PREFETCH_SLOTS].state = SLOT_FREE;
+        pf->holding = false;
+        pf->hash_ns = ewma (pf->hash_ns, now - pf->handed_ns);
+    }
+    prefetch_adapt (pf);
+    if (prefetch_fill (pf)) {
+        pthread_mutex_unlock (&pf->lock);
+        return -1;
+    }
+    if (pf->consumed == pf->issued) {
+        pthread_mutex_unlock (&pf->lock);
+        /* anything appended since the file was opened */
+        if (pf->tail == NULL) {
+            pf->tail = malloc (PREFETCH_CHUNK);
+            if (pf->tail == NULL) {
+                perror ("malloc of prefetch chunk:\n");
+                return -1;
+            }
+        }
+        len = pread_chunk (pf->fd, pf->tail, pf->pos);
+        if (len == -1) {
+            perror ("pread:\n");
+            return -1;
+        }
+        pf->pos += len;
+        *data = pf->tail;
+        return len;
+    }
+    slot = &pf->slots[pf->consumed % PREFETCH_SLOTS];
+    while (slot->state != SLOT_READY)
+        pthread_cond_wait (&pf->done, &pf->lock);
+    ++pf->consumed;
+    pf->holding = true;
+    len = slot->len;
+    pthread_mutex_unlock (&pf->lock);
+    if (len == -1) {
+        fprintf (stderr, "pread: %s\n", strerror (slot->error));
+        return -1;
+    }
+    pf->pos = slot->offset + len;
+    pf->handed_ns = now_ns ();
+    *data = slot->buf;
+    return len;
+}
+
+void
+prefetch_free (prefetch_t *pf)
+{
+    unsigned int i;
+
+    if (pf == NULL)
+        return;
+    pthread_mutex_lock (&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast (&pf->work);
+    pthread_mutex_unlock (&pf->lock);
+    for (i = 0; i < pf->worker_count; ++i)
+        pthread_join (pf->workers[i], NULL);
+    for (i = 0; i < PREFETCH_SLOTS; ++i)
+        free (pf->slots[i].buf);
+    free (pf->tail);
+    pthread_cond_destroy (&pf->done);
+    pthread_cond_destroy (&pf->work);
+    pthread_mutex_destroy (&pf->lock);
+    free (pf);
+}
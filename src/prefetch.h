@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*  Reads a file through many concurrent preads ahead of the position
+ *  being hashed and hands the chunks back in order, so a filesystem
+ *  with a long round trip (FUSE, network mounts) serves the window in
+ *  parallel instead of one request at a time. The window grows to
+ *  cover the observed read latency with the time spent hashing each
+ *  chunk.
+ */
+typedef struct prefetch prefetch_t;
+
+/*  True for files on filesystems where a read waits on a round trip and
+ *  that are large enough to benefit.
+ */
+bool
+prefetch_wanted (int fd);
+prefetch_t*
+prefetch_new (int fd, off_t offset);
+/*  Point data at the next chunk, valid until the next call. Returns its
+ *  length, 0 at end of file or -1 on error.
+ */
+ssize_t
+prefetch_next (prefetch_t *pf, const unsigned char **data);
+void
+prefetch_free (prefetch_t *pf);
+
+#endif /* PREFETCH_H */
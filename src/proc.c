@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "proc.h"
+
+#define PROC_BUF_SIZE (4 << 20)
+#define PROC_IOV_MAX 64
+
+typedef struct proc_map {
+    uintptr_t start;
+    uintptr_t end;
+    char perms[5];
+    unsigned long long offset;
+    dev_t dev;
+    ino_t ino;
+    char path[PATH_MAX];
+} proc_map_t;
+
+typedef struct proc_pool {
+    const pid_t *pids;
+    size_t count;
+    bool rodata;
+    proc_result_t *results;
+    atomic_size_t next;
+} proc_pool_t;
+
+/*  Read the mappings to measure from /proc/PID/maps.
+ */
+static int
+proc_maps (pid_t pid, bool rodata, proc_map_t **maps, size_t *count)
+{
+    char path[64], *line = NULL;
+    size_t line_size = 0, size = 0;
+    unsigned int major, minor;
+    unsigned long long ino;
+    proc_map_t map, *tmp;
+    bool after_text = false;
+    dev_t text_dev = 0;
+    ino_t text_ino = 0;
+    FILE *file;
+    int name;
+
+    *maps = NULL;
+    *count = 0;
+    snprintf (path, sizeof (path), "/proc/%d/maps", pid);
+    file = fopen (path, "r");
+    if (file == NULL) {
+        fprintf (stderr, "Failed to open %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    while (getline (&line, &line_size, file) != -1) {
+        memset (&map, 0, sizeof (map));
+        name = 0;
+        if (sscanf (line, "%" SCNxPTR "-%" SCNxPTR " %4s %llx %x:%x %llu %n",
+                    &map.start, &map.end, map.perms, &map.offset, &major,
+                    &minor, &ino, &name) < 7)
+            continue;
+        map.dev = makedev (major, minor);
+        map.ino = ino;
+        if (name)
+            snprintf (map.path, sizeof (map.path), "%s", line + name);
+        map.path[strcspn (map.path, "\n")] = '\0';
+        if (map.perms[2] == 'x') {
+            after_text = true;
+            text_dev = map.dev;
+            text_ino = map.ino;
+        } else if (rodata && after_text && map.ino != 0 &&
+                   map.dev == text_dev && map.ino == text_ino &&
+                   strcmp (map.perms, "r--p") == 0) {
+            after_text = false;
+        } else {
+            after_text = false;
+            continue;
+        }
+        /* the vsyscall page can't be read with process_vm_readv */
+        if (strcmp (map.path, "[vsyscall]") == 0)
+            continue;
+        if (*count == size) {
+            size = size ? size * 2 : 32;
+            tmp = realloc (*maps, size * sizeof (proc_map_t));
+            if (tmp == NULL) {
+                perror ("realloc of process maps:\n");
+                goto maps_fail;
+            }
+            *maps = tmp;
+        }
+        (*maps)[(*count)++] = map;
+    }
+    free (line);
+    fclose (file);
+    return 0;
+maps_fail:
+    free (line);
+    fclose (file);
+    free (*maps);
+    *maps = NULL;
+    return -1;
+}
+
+static int
+proc_update (EVP_MD_CTX *ctx, const void *data, size_t len)
+{
+    if (EVP_DigestUpdate (ctx, data, len) == 0) {
+        ERR_print_errors_fp (stderr);
+        return -1;
+    }
+    return 0;
+}
+
+/*  Copy the mappings out of the target a buffer at a time. Each
+ *  process_vm_readv fills the buffer from as many mappings (or parts of
+ *  one) as fit, the records are then hashed in order.
+ */
+static int
+proc_read_maps (pid_t pid, proc_map_t *maps, size_t count, EVP_MD_CTX *ctx,
+                unsigned char *buf, proc_result_t *result)
+{
+    struct iovec local, remote[PROC_IOV_MAX];
+    size_t map = 0, done = 0, fill, len, riov, i;
+    size_t owner[PROC_IOV_MAX];
+    char hdr[PATH_MAX + 96];
+    ssize_t ret;
+    int hdr_len;
+
+    while (map < count) {
+        fill = 0;
+        riov = 0;
+        /* gather up to a buffer full of ranges */
+        for (i = map, len = done; i < count && riov < PROC_IOV_MAX &&
+                                  fill < PROC_BUF_SIZE; ++i, len = 0) {
+            size_t want = (maps[i].end - maps[i].start) - len;
+
+            if (want > PROC_BUF_SIZE - fill)
+                want = PROC_BUF_SIZE - fill;
+            remote[riov].iov_base = (void*)(maps[i].start + len);
+            remote[riov].iov_len = want;
+            owner[riov++] = i;
+            fill += want;
+        }
+        local.iov_base = buf;
+        local.iov_len = fill;
+        ret = process_vm_readv (pid, &local, 1, remote, riov, 0);
+        if (ret != (ssize_t)fill) {
+            fprintf (stderr, "Failed to read memory of process %d: %s\n",
+                     pid, ret == -1 ? strerror (errno) : "short read");
+            return -1;
+        }
+        /* hash what was read, emitting each record header first */
+        for (i = 0, len = 0; i < riov; ++i) {
+            proc_map_t *m = &maps[owner[i]];
+
+            if (remote[i].iov_base == (void*)m->start) {
+                hdr_len = snprintf (hdr, sizeof (hdr), "%s %llx %zx %s\n",
+                                    m->perms, m->offset,
+                                    (size_t)(m->end - m->start), m->path);
+                if (proc_update (ctx, hdr, hdr_len))
+                    return -1;
+                ++result->mappings;
+            }
+            if (proc_update (ctx, buf + len, remote[i].iov_len))
+                return -1;
+            len += remote[i].iov_len;
+            done = (uintptr_t)remote[i].iov_base + remote[i].iov_len - m->start;
+            map = owner[i];
+            if (done == m->end - m->start) {
+                map = owner[i] + 1;
+                done = 0;
+            }
+        }
+        result->bytes += fill;
+    }
+    return 0;
+}
+
+static int
+proc_measure_one (pid_t pid, bool rodata, unsigned char *buf,
+                  proc_result_t *result)
+{
+    proc_map_t *maps = NULL;
+    EVP_MD_CTX *ctx = NULL;
+    size_t count = 0;
+    int ret = -1;
+
+    result->pid = pid;
+    if (proc_maps (pid, rodata, &maps, &count))
+        return -1;
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL || EVP_DigestInit (ctx, EVP_sha1 ()) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto one_out;
+    }
+    if (proc_read_maps (pid, maps, count, ctx, buf, result))
+        goto one_out;
+    if (EVP_DigestFinal (ctx, result->hash, &result->hash_len) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto one_out;
+    }
+    result->ok = true;
+    ret = 0;
+one_out:
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    free (maps);
+    return ret;
+}
+
+static void*
+proc_worker (void *arg)
+{
+    proc_pool_t *pool = arg;
+    unsigned char *buf;
+    size_t i;
+
+    buf = malloc (PROC_BUF_SIZE);
+    if (buf == NULL) {
+        perror ("malloc of process buffer:\n");
+        return NULL;
+    }
+    while ((i = atomic_fetch_add (&pool->next, 1)) < pool->count)
+        proc_measure_one (pool->pids[i], pool->rodata, buf,
+                          &pool->results[i]);
+    free (buf);
+    return NULL;
+}
+
+int
+proc_measure (const pid_t *pids, size_t count, bool rodata,
+              unsigned int jobs, proc_result_t *results)
+{
+    proc_pool_t pool = {
+        .pids = pids,
+        .count = count,
+        .rodata = rodata,
+        .results = results,
+    };
+    pthread_t *threads;
+    unsigned int i, started = 0;
+    size_t j;
+
+    memset (results, 0, count * sizeof (proc_result_t));
+    atomic_init (&pool.next, 0);
+    if (jobs == 0)
+        jobs = 1;
+    if (jobs > count)
+        jobs = count ? count : 1;
+    threads = calloc (jobs, sizeof (pthread_t));
+    if (threads == NULL) {
+        perror ("calloc of process threads:\n");
+        return -1;
+    }
+    for (i = 0; i < jobs; ++i) {
+        if (pthread_create (&threads[i], NULL, proc_worker, &pool))
+            break;
+        ++started;
+    }
+    /* whatever the threads didn't get to is done here */
+    if (started == 0)
+        proc_worker (&pool);
+    for (i = 0; i < started; ++i)
+        pthread_join (threads[i], NULL);
+    free (threads);
+    for (j = 0; j < count; ++j) {
+        if (!results[j].ok)
+            return -1;
+    }
+    return 0;
+}
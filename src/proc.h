@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PROC_H
+#define PROC_H
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct proc_result {
+    pid_t pid;
+    bool ok;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len;
+    size_t mappings;
+    size_t bytes;
+} proc_result_t;
+
+/*  Measure the executable mappings of running processes. For each
+ *  process the mappings are visited in address order and every one is
+ *  hashed as a record
+ *    <perms> <file offset> <length> <path>\n<contents>
+ *  so the digest doesn't depend on where ASLR put things. With rodata
+ *  the read-only mapping that follows the text of the same file is
+ *  measured too. Memory is copied out with batched process_vm_readv
+ *  calls, which needs ptrace access to the target. At most jobs
+ *  processes are measured at a time; results[i] is for pids[i].
+ */
+int
+proc_measure (const pid_t *pids, size_t count, bool rodata,
+              unsigned int jobs, proc_result_t *results);
+
+#endif /* PROC_H */
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+#define PROFILE_NAME "pcr-extend-profile "
+#define PROFILE_MAGIC PROFILE_NAME "2\n"
+
+typedef struct profile_entry {
+    uint64_t physical;   /* first extent on disk, 0 when unknown */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    char *path;
+} profile_entry_t;
+
+typedef struct profile {
+    pthread_mutex_t lock;
+    bool recording;
+    profile_entry_t *entries;
+    size_t count;
+    size_t size;
+    pthread_t thread;
+    bool thread_started;
+} profile_t;
+
+static profile_t profile = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t
+profile_physical (int fd)
+{
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } req;
+
+    memset (&req, 0, sizeof (req));
+    req.map.fm_length = FIEMAP_MAX_OFFSET;
+    req.map.fm_extent_count = 1;
+    if (ioctl (fd, FS_IOC_FIEMAP, &req.map) || req.map.fm_mapped_extents == 0)
+        return 0;
+    return req.extent.fe_physical;
+}
+
+static int
+profile_entry_cmp (const void *a, const void *b)
+{
+    const profile_entry_t *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->physical != y->physical)
+        return x->physical < y->physical ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int
+profile_inode_cmp (const void *a, const void *b)
+{
+    const profile_entry_t *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static int
+profile_add (profile_entry_t *entry)
+{
+    profile_entry_t *entries;
+
+    if (profile.count == profile.size) {
+        profile.size = profile.size ? profile.size * 2 : 256;
+        entries = realloc (profile.entries,
+                           profile.size * sizeof (profile_entry_t));
+        if (entries == NULL)
+            return -1;
+        profile.entries = entries;
+    }
+    profile.entries[profile.count++] = *entry;
+    return 0;
+}
+
+int
+profile_record_start (void)
+{
+    pthread_mutex_lock (&profile.lock);
+    profile.recording = true;
+    pthread_mutex_unlock (&profile.lock);
+    return 0;
+}
+
+/*  Note a file about to be hashed. Anything that isn't a regular file
+ *  with a path (stdin, pipes) is ignored, as are failures: the profile
+ *  is only ever a hint.
+ */
+void
+profile_note_fd (int fd)
+{
+    profile_entry_t entry = { 0 };
+    char link[64], path[PATH_MAX];
+    struct stat st;
+    ssize_t len;
+
+    pthread_mutex_lock (&profile.lock);
+    if (!profile.recording) {
+        pthread_mutex_unlock (&profile.lock);
+        return;
+    }
+    pthread_mutex_unlock (&profile.lock);
+    if (fstat (fd, &st) || !S_ISREG (st.st_mode))
+        return;
+    snprintf (link, sizeof (link), "/proc/self/fd/%d", fd);
+    len = readlink (link, path, sizeof (path) - 1);
+    if (len <= 0 || path[0] != '/')
+        return;
+    path[len] = '\0';
+    entry.physical = profile_physical (fd);
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.path = strdup (path);
+    if (entry.path == NULL)
+        return;
+    pthread_mutex_lock (&profile.lock);
+    if (profile_add (&entry))
+        free (entry.path);
+    pthread_mutex_unlock (&profile.lock);
+}
+
+/*  Paths are written with '\' and newlines escaped as in tree
+ *  manifests, one per line.
+ */
+static void
+profile_put_path (FILE *file, const char *path)
+{
+    for (; *path; ++path) {
+        if (*path == '\\')
+            fputs ("\\\\", file);
+        else if (*path == '\n')
+            fputs ("\\n", file);
+        else
+            fputc (*path, file);
+    }
+    fputc ('\n', file);
+}
+
+/*  Undo profile_put_path in place, -1 for a malformed escape.
+ */
+static int
+profile_get_path (char *path)
+{
+    char *out = path;
+
+    for (; *path; ++path) {
+        if (*path != '\\') {
+            *out++ = *path;
+            continue;
+        }
+        if (path[1] == '\\')
+            *out++ = '\\';
+        else if (path[1] == 'n')
+            *out++ = '\n';
+        else
+            return -1;
+        ++path;
+    }
+    *out = '\0';
+    return 0;
+}
+
+/*  One file per line: <physical> <dev> <ino> <size> <path>, sorted so
+ *  replaying it walks each device front to back.
+ */
+int
+profile_record_save (const char *path)
+{
+    char tmp[PATH_MAX];
+    FILE *file;
+    size_t i, j;
+    int fd;
+
+    pthread_mutex_lock (&profile.lock);
+    profile.recording = false;
+    pthread_mutex_unlock (&profile.lock);
+    /* files hashed more than once (hard links, shared blobs) appear once */
+    qsort (profile.entries, profile.count, sizeof (profile_entry_t),
+           profile_inode_cmp);
+    for (i = 0, j = 0; i < profile.count; ++i) {
+        if (j > 0 && profile_inode_cmp (&profile.entries[j - 1],
+                                        &profile.entries[i]) == 0) {
+            free (profile.entries[i].path);
+            continue;
+        }
+        profile.entries[j++] = profile.entries[i];
+    }
+    profile.count = j;
+    qsort (profile.entries, profile.count, sizeof (profile_entry_t),
+           profile_entry_cmp);
+    snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+    fd = mkstemp (tmp);
+    if (fd == -1 || (file = fdopen (fd, "w")) == NULL) {
+        fprintf (stderr, "Failed to write profile %s: %s\n", path,
+                 strerror (errno));
+        if (fd != -1) {
+            close (fd);
+            unlink (tmp);
+        }
+        return -1;
+    }
+    fputs (PROFILE_MAGIC, file);
+    for (i = 0; i < profile.count; ++i) {
+        fprintf (file, "%llu %llu %llu %lld ",
+                 (unsigned long long)profile.entries[i].physical,
+                 (unsigned long long)profile.entries[i].dev,
+                 (unsigned long long)profile.entries[i].ino,
+                 (long long)profile.entries[i].size);
+        profile_put_path (file, profile.entries[i].path);
+        free (profile.entries[i].path);
+    }
+    free (profile.entries);
+    profile.entries = NULL;
+    profile.count = profile.size = 0;
+    if (fclose (file) || rename (tmp, path)) {
+        fprintf (stderr, "Failed to write profile %s: %s\n", path,
+                 strerror (errno));
+        unlink (tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void*
+profile_readahead_thread (void *arg)
+{
+    FILE *file = arg;
+    unsigned long long physical, dev, ino;
+    long long size;
+    char *line = NULL, *path;
+    size_t line_size = 0;
+    struct stat st;
+    ssize_t len;
+    int fd, pos;
+
+    while ((len = getline (&line, &line_size, file)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (sscanf (line, "%llu %llu %llu %lld %n", &physical, &dev, &ino,
+                    &size, &pos) != 4)
+            continue;
+        path = line + pos;
+        if (profile_get_path (path))
+            continue;
+        fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        /* a file replaced since the profile was recorded is still read
+         * ahead, it'll be measured regardless
+         */
+        if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+            readahead (fd, 0, st.st_size);
+        close (fd);
+    }
+    free (line);
+    fclose (file);
+    return NULL;
+}
+
+int
+profile_readahead_start (const char *path)
+{
+    char magic[sizeof (PROFILE_MAGIC)];
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        /* no profile yet on the first boot */
+        if (errno == ENOENT)
+            return 0;
+        fprintf (stderr, "Failed to open profile %s: %s\n", path,
+                 strerror (errno));
+        return -1;
+    }
+    if (fgets (magic, sizeof (magic), file) == NULL ||
+        strncmp (magic, PROFILE_NAME, strlen (PROFILE_NAME)) != 0) {
+        fprintf (stderr, "%s is not a readahead profile.\n", path);
+        fclose (file);
+        return -1;
+    }
+    /* the profile only speeds things up, one in another format waits
+     * to be recorded again
+     */
+    if (strcmp (magic, PROFILE_MAGIC) != 0) {
+        fprintf (stderr, "Ignoring readahead profile %s in another "
+                 "format.\n", path);
+        fclose (file);
+        return 0;
+    }
+    if (pthread_create (&profile.thread, NULL, profile_readahead_thread,
+                        file)) {
+        fprintf (stderr, "Failed to start readahead thread.\n");
+        fclose (file);
+        return -1;
+    }
+    profile.thread_started = true;
+    return 0;
+}
+
+void
+profile_readahead_wait (void)
+{
+    if (profile.thread_started)
+        pthread_join (profile.thread, NULL);
+    profile.thread_started = false;
+}
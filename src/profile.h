@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*  Boot profile: the files a measurement run read, in the order they
+ *  sit on disk. Recording notes every file hashed through digest_file,
+ *  the readahead phase of a later run replays the profile with
+ *  readahead(2) in a background thread so hashing finds the data in the
+ *  page cache. The profile only changes how fast files are read, never
+ *  what is measured. It has a line per file with its first physical
+ *  block, device, inode, size and path, '\' and newlines in the path
+ *  escaped as in tree manifests.
+ */
+int
+profile_record_start (void);
+void
+profile_note_fd (int fd);
+int
+profile_record_save (const char *path);
+int
+profile_readahead_start (const char *path);
+void
+profile_readahead_wait (void);
+
+#endif /* PROFILE_H */
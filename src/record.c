@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record.h"
+
+#define READ_SIZE (1 << 20)
+
+struct record_reader {
+    int fd;
+    record_format_t format;
+    unsigned char *buf;
+    size_t size;
+    size_t start;       /* first unconsumed byte */
+    size_t end;         /* end of buffered data */
+    size_t scanned;     /* bytes after start known not to hold a delimiter */
+    bool eof;
+};
+
+int
+record_format_parse (const char *name, record_format_t *format)
+{
+    if (strcmp (name, "line") == 0)
+        *format = RECORD_LINE;
+    else if (strcmp (name, "nul") == 0)
+        *format = RECORD_NUL;
+    else if (strcmp (name, "length") == 0)
+        *format = RECORD_LENGTH;
+    else
+        return -1;
+    return 0;
+}
+
+record_reader_t*
+record_reader_new (int fd, record_format_t format)
+{
+    record_reader_t *reader;
+
+    reader = calloc (1, sizeof (record_reader_t));
+    if (reader == NULL) {
+        perror ("calloc of record_reader_t:\n");
+        return NULL;
+    }
+    reader->buf = malloc (READ_SIZE);
+    if (reader->buf == NULL) {
+        perror ("malloc of record buffer:\n");
+        free (reader);
+        return NULL;
+    }
+    reader->fd = fd;
+    reader->format = format;
+    reader->size = READ_SIZE;
+    return reader;
+}
+
+void
+record_reader_free (record_reader_t *reader)
+{
+    if (reader == NULL)
+        return;
+    free (reader->buf);
+    free (reader);
+}
+
+/*  Read more input, first moving the unconsumed bytes to the front and
+ *  growing the buffer when they fill it.
+ */
+static int
+record_fill (record_reader_t *reader)
+{
+    unsigned char *buf;
+    ssize_t ret;
+    size_t size;
+
+    if (reader->start) {
+        memmove (reader->buf, reader->buf + reader->start,
+                 reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end > RECORD_MAX + 4) {
+        fprintf (stderr, "Record longer than %d bytes.\n", RECORD_MAX);
+        return -1;
+    }
+    if (reader->end == reader->size) {
+        size = reader->size * 2;
+        buf = realloc (reader->buf, size);
+        if (buf == NULL) {
+            perror ("realloc of record buffer:\n");
+            return -1;
+        }
+        reader->buf = buf;
+        reader->size = size;
+    }
+    do {
+        ret = read (reader->fd, reader->buf + reader->end,
+                    reader->size - reader->end);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        perror ("read of records:\n");
+        return -1;
+    }
+    if (ret == 0)
+        reader->eof = true;
+    reader->end += ret;
+    return 0;
+}
+
+/*  Find the end of the record at start among the buffered bytes. Sets
+ *  *len to its data and *next to the offset of the record after it.
+ */
+static bool
+record_find (record_reader_t *reader, size_t *len, size_t *next)
+{
+    size_t avail = reader->end - reader->start;
+    const unsigned char *data = reader->buf + reader->start, *delim;
+    uint32_t length;
+
+    if (reader->format == RECORD_LENGTH) {
+        if (avail < 4)
+            return false;
+        length = (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 |
+                 data[3];
+        if (avail - 4 < length)
+            return false;
+        *len = length;
+        *next = reader->start + 4 + length;
+        return true;
+    }
+    delim = memchr (data + reader->scanned,
+                    reader->format == RECORD_LINE ? '\n' : '\0',
+                    avail - reader->scanned);
+    if (delim == NULL) {
+        reader->scanned = avail;
+        return false;
+    }
+    *len = delim - data;
+    *next = reader->start + *len + 1;
+    return true;
+}
+
+int
+record_next (record_reader_t *reader, bool block, const unsigned char **data,
+             size_t *len)
+{
+    size_t next;
+    uint32_t length;
+
+    while (!record_find (reader, len, &next)) {
+        if (reader->format == RECORD_LENGTH &&
+            reader->end - reader->start >= 4) {
+            length = (uint32_t)reader->buf[reader->start] << 24 |
+                     reader->buf[reader->start + 1] << 16 |
+                     reader->buf[reader->start + 2] << 8 |
+                     reader->buf[reader->start + 3];
+            if (length > RECORD_MAX) {
+                fprintf (stderr, "Record longer than %d bytes.\n",
+                         RECORD_MAX);
+                return RECORD_ERROR;
+            }
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end)
+                return RECORD_EOF;
+            if (reader->format == RECORD_LENGTH) {
+                fprintf (stderr, "Truncated record at end of input.\n");
+                return RECORD_ERROR;
+            }
+            /* an unterminated last record */
+            *len = reader->end - reader->start;
+            next = reader->end;
+            break;
+        }
+        if (!block)
+            return RECORD_AGAIN;
+        if (record_fill (reader))
+            return RECORD_ERROR;
+    }
+    /* the buffer grows by doubling, so a delimiter can turn up well
+     * past RECORD_MAX */
+    if (*len > RECORD_MAX) {
+        fprintf (stderr, "Record longer than %d bytes.\n", RECORD_MAX);
+        return RECORD_ERROR;
+    }
+    *data = reader->buf + reader->start + (reader->format == RECORD_LENGTH ?
+                                           4 : 0);
+    reader->start = next;
+    reader->scanned = 0;
+    return RECORD_OK;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RECORD_MAX (16 << 20)
+
+typedef enum record_format {
+    RECORD_LINE,        /* terminated by '\n' */
+    RECORD_NUL,         /* terminated by '\0' */
+    RECORD_LENGTH,      /* preceded by a 32 bit big-endian length */
+} record_format_t;
+
+enum {
+    RECORD_ERROR = -1,
+    RECORD_EOF = 0,
+    RECORD_OK = 1,
+    RECORD_AGAIN = 2,   /* no complete record buffered */
+};
+
+/*  Split what's read from a descriptor into records. A record's data
+ *  excludes its terminator or length, and a final line or NUL record
+ *  without a terminator still counts. Records may be up to RECORD_MAX
+ *  bytes, data returned by record_next stays valid until the next call.
+ */
+typedef struct record_reader record_reader_t;
+
+int
+record_format_parse (const char *name, record_format_t *format);
+record_reader_t*
+record_reader_new (int fd, record_format_t format);
+void
+record_reader_free (record_reader_t *reader);
+/*  The next record. Without block, RECORD_AGAIN is returned rather
+ *  than reading when no complete record is buffered, so callers can
+ *  act on what they have before possibly waiting for more input.
+ */
+int
+record_next (record_reader_t *reader, bool block, const unsigned char **data,
+             size_t *len);
+
+#endif /* RECORD_H */
@@ -0,0 +1,541 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+/* SHA_CTX is the only SHA1 state OpenSSL lets us save and restore */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <openssl/sha.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sweep.h"
+#include "util.h"
+
+#define CHUNK_SIZE (1 << 20)
+#define MIDSTATE_HEX (8 * 8 + SHA_CBLOCK * 2)
+
+typedef struct sweep_file {
+    char *path;
+    long priority;
+    bool done;
+    bool readable;
+    int64_t measured;       /* when last measured, 0 for never */
+    unsigned char digest[SWEEP_DIGEST_LEN];
+} sweep_file_t;
+
+/*  The midstate is only resumed for the same file, unchanged: device,
+ *  inode, size, mtime and ctime all as they were when it was cut off.
+ */
+typedef struct sweep_partial {
+    char *path;
+    uint64_t offset;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    SHA_CTX ctx;
+} sweep_partial_t;
+
+struct sweep {
+    char *state;
+    uint64_t number;
+    sweep_file_t *files;    /* sorted by path */
+    size_t count;
+    sweep_partial_t partial;    /* path is NULL without one */
+};
+
+static int
+path_cmp (const void *a, const void *b)
+{
+    return strcmp (((const sweep_file_t*)a)->path,
+                   ((const sweep_file_t*)b)->path);
+}
+
+static sweep_file_t*
+sweep_find (sweep_t *sweep, const char *path)
+{
+    sweep_file_t key = { .path = (char*)path };
+
+    return bsearch (&key, sweep->files, sweep->count, sizeof (sweep_file_t),
+                    path_cmp);
+}
+
+static void
+print_hex (FILE *file, const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        fprintf (file, "%02x", buf[i]);
+}
+
+static int
+sweep_load_list (sweep_t *sweep, const char *list)
+{
+    sweep_file_t *files;
+    char *line = NULL, *path;
+    size_t size = 0, len, i;
+    long priority;
+    FILE *file;
+    int ret = -1, offset;
+
+    file = fopen (list, "r");
+    if (file == NULL) {
+        fprintf (stderr, "Failed to open %s: %s\n", list, strerror (errno));
+        return -1;
+    }
+    while (getline (&line, &size, file) != -1) {
+        len = strcspn (line, "\n");
+        line[len] = '\0';
+        if (line[0] == '#' || len == 0)
+            continue;
+        if (sscanf (line, "%ld %n", &priority, &offset) != 1 ||
+            line[offset] == '\0') {
+            fprintf (stderr, "Malformed line in %s: %s\n", list, line);
+            goto list_out;
+        }
+        path = strdup (line + offset);
+        files = realloc (sweep->files,
+                         (sweep->count + 1) * sizeof (sweep_file_t));
+        if (path == NULL || files == NULL) {
+            perror ("allocation of sweep list:\n");
+            free (path);
+            if (files)
+                sweep->files = files;
+            goto list_out;
+        }
+        sweep->files = files;
+        sweep->files[sweep->count++] = (sweep_file_t) {
+            .path = path,
+            .priority = priority,
+        };
+    }
+    qsort (sweep->files, sweep->count, sizeof (sweep_file_t), path_cmp);
+    /* the same file twice would be measured twice */
+    for (i = 1; i < sweep->count; ++i) {
+        if (strcmp (sweep->files[i - 1].path, sweep->files[i].path) == 0) {
+            fprintf (stderr, "%s is listed twice in %s\n",
+                     sweep->files[i].path, list);
+            goto list_out;
+        }
+    }
+    ret = 0;
+list_out:
+    free (line);
+    fclose (file);
+    return ret;
+}
+
+static int
+parse_midstate (const char *hex, SHA_CTX *ctx)
+{
+    SHA_LONG words[8];
+    unsigned int i, word;
+
+    for (i = 0; i < 8; ++i) {
+        if (sscanf (hex + i * 8, "%8x", &word) != 1)
+            return -1;
+        words[i] = word;
+    }
+    ctx->h0 = words[0];
+    ctx->h1 = words[1];
+    ctx->h2 = words[2];
+    ctx->h3 = words[3];
+    ctx->h4 = words[4];
+    ctx->Nl = words[5];
+    ctx->Nh = words[6];
+    ctx->num = words[7];
+    if (ctx->num >= SHA_CBLOCK)
+        return -1;
+    return hex_parse (hex + 64, (unsigned char*)ctx->data, SHA_CBLOCK);
+}
+
+static void
+print_midstate (FILE *file, const SHA_CTX *ctx)
+{
+    fprintf (file, "%08x%08x%08x%08x%08x%08x%08x%08x",
+             (unsigned int)ctx->h0, (unsigned int)ctx->h1,
+             (unsigned int)ctx->h2, (unsigned int)ctx->h3,
+             (unsigned int)ctx->h4, (unsigned int)ctx->Nl,
+             (unsigned int)ctx->Nh, (unsigned int)ctx->num);
+    print_hex (file, (const unsigned char*)ctx->data, SHA_CBLOCK);
+}
+
+/*  Apply the checkpoint to the files of the list. Files no longer
+ *  listed are forgotten, new ones have never been measured. State
+ *  lines are:
+ *    sweep <number>
+ *    file <done> <measured> <sha1 or '-'> <path>
+ *    partial <offset> <dev> <ino> <size> <mtime ns> <ctime ns> <midstate>
+ *            <path>
+ */
+static int
+sweep_load_state (sweep_t *sweep)
+{
+    sweep_file_t *entry;
+    char *line = NULL, hex[SWEEP_DIGEST_LEN * 2 + 1];
+    char midstate[MIDSTATE_HEX + 1];
+    size_t size = 0;
+    int64_t measured;
+    FILE *file;
+    int done, offset;
+
+    file = fopen (sweep->state, "r");
+    if (file == NULL)
+        return errno == ENOENT ? 0 : -1;
+    while (getline (&line, &size, file) != -1) {
+        line[strcspn (line, "\n")] = '\0';
+        if (sscanf (line, "sweep %" SCNu64, &sweep->number) == 1)
+            continue;
+        if (sscanf (line, "file %d %" SCNd64 " %40s %n", &done, &measured,
+                    hex, &offset) == 3) {
+            entry = sweep_find (sweep, line + offset);
+            if (entry == NULL)
+                continue;
+            entry->measured = measured;
+            entry->readable = strcmp (hex, "-") != 0;
+            entry->done = done && (!entry->readable ||
+                                   (strlen (hex) == SWEEP_DIGEST_LEN * 2 &&
+                                    hex_parse (hex, entry->digest,
+                                               SWEEP_DIGEST_LEN) == 0));
+            continue;
+        }
+        if (sscanf (line, "partial %" SCNu64 " %" SCNu64 " %" SCNu64
+                    " %" SCNd64 " %" SCNd64 " %" SCNd64 " %192s %n",
+                    &sweep->partial.offset, &sweep->partial.dev,
+                    &sweep->partial.ino, &sweep->partial.size,
+                    &sweep->partial.mtime_ns, &sweep->partial.ctime_ns,
+                    midstate, &offset) == 7 &&
+            strlen (midstate) == MIDSTATE_HEX &&
+            parse_midstate (midstate, &sweep->partial.ctx) == 0 &&
+            sweep_find (sweep, line + offset)) {
+            free (sweep->partial.path);
+            sweep->partial.path = strdup (line + offset);
+            continue;
+        }
+        fprintf (stderr, "Ignoring malformed line in %s: %s\n", sweep->state,
+                 line);
+    }
+    free (line);
+    fclose (file);
+    return 0;
+}
+
+/*  Write the checkpoint to a temporary file and rename it into place so
+ *  a crash leaves the previous one.
+ */
+static int
+sweep_save (sweep_t *sweep)
+{
+    char *tmp;
+    size_t i;
+    FILE *file;
+    int fd;
+
+    if (asprintf (&tmp, "%s.XXXXXX", sweep->state) == -1) {
+        perror ("asprintf:\n");
+        return -1;
+    }
+    fd = mkstemp (tmp);
+    if (fd == -1 || (file = fdopen (fd, "w")) == NULL) {
+        fprintf (stderr, "Failed to write %s: %s\n", tmp, strerror (errno));
+        if (fd != -1) {
+            close (fd);
+            unlink (tmp);
+        }
+        free (tmp);
+        return -1;
+    }
+    fprintf (file, "sweep %" PRIu64 "\n", sweep->number);
+    for (i = 0; i < sweep->count; ++i) {
+        fprintf (file, "file %d %" PRId64 " ", sweep->files[i].done,
+                 sweep->files[i].measured);
+        if (sweep->files[i].measured && sweep->files[i].readable)
+            print_hex (file, sweep->files[i].digest, SWEEP_DIGEST_LEN);
+        else
+            fputc ('-', file);
+        fprintf (file, " %s\n", sweep->files[i].path);
+    }
+    if (sweep->partial.path) {
+        fprintf (file, "partial %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64
+                 " %" PRId64 " %" PRId64 " ", sweep->partial.offset,
+                 sweep->partial.dev, sweep->partial.ino, sweep->partial.size,
+                 sweep->partial.mtime_ns, sweep->partial.ctime_ns);
+        print_midstate (file, &sweep->partial.ctx);
+        fprintf (file, " %s\n", sweep->partial.path);
+    }
+    if (fflush (file) || fsync (fd) || fclose (file) ||
+        rename (tmp, sweep->state)) {
+        fprintf (stderr, "Failed to write %s: %s\n", sweep->state,
+                 strerror (errno));
+        unlink (tmp);
+        free (tmp);
+        return -1;
+    }
+    free (tmp);
+    return 0;
+}
+
+sweep_t*
+sweep_open (const char *list, const char *state)
+{
+    sweep_t *sweep;
+
+    sweep = calloc (1, sizeof (sweep_t));
+    if (sweep == NULL) {
+        perror ("calloc of sweep_t:\n");
+        return NULL;
+    }
+    sweep->state = strdup (state);
+    if (sweep->state == NULL) {
+        perror ("strdup:\n");
+        goto open_fail;
+    }
+    if (sweep_load_list (sweep, list))
+        goto open_fail;
+    if (sweep_load_state (sweep)) {
+        fprintf (stderr, "Failed to read %s: %s\n", state, strerror (errno));
+        goto open_fail;
+    }
+    return sweep;
+open_fail:
+    sweep_free (sweep);
+    return NULL;
+}
+
+void
+sweep_free (sweep_t *sweep)
+{
+    size_t i;
+
+    if (sweep == NULL)
+        return;
+    for (i = 0; i < sweep->count; ++i)
+        free (sweep->files[i].path);
+    free (sweep->files);
+    free (sweep->partial.path);
+    free (sweep->state);
+    free (sweep);
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*  By priority, then the files measured longest ago.
+ */
+static int
+order_cmp (const void *a, const void *b)
+{
+    const sweep_file_t *x = *(sweep_file_t *const *)a;
+    const sweep_file_t *y = *(sweep_file_t *const *)b;
+
+    if (x->priority != y->priority)
+        return x->priority > y->priority ? -1 : 1;
+    if (x->measured != y->measured)
+        return x->measured < y->measured ? -1 : 1;
+    return strcmp (x->path, y->path);
+}
+
+/*  Hash file, resuming the checkpointed midstate when it's for this
+ *  version of it. Returns 1 when the deadline cut it off, leaving its
+ *  midstate as the partial.
+ */
+static int
+sweep_hash (sweep_t *sweep, sweep_file_t *entry, unsigned char *buf,
+            uint64_t deadline, sweep_stats_t *stats)
+{
+    sweep_partial_t *partial = &sweep->partial;
+    struct stat sb;
+    SHA_CTX ctx;
+    uint64_t offset = 0;
+    int64_t mtime_ns, ctime_ns;
+    ssize_t len;
+    int fd;
+
+    fd = open (entry->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat (fd, &sb) == -1) {
+        fprintf (stderr, "Failed to read %s: %s\n", entry->path,
+                 strerror (errno));
+        if (fd != -1)
+            close (fd);
+        entry->readable = false;
+        return 0;
+    }
+    mtime_ns = (int64_t)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    ctime_ns = (int64_t)sb.st_ctim.tv_sec * 1000000000LL + sb.st_ctim.tv_nsec;
+    SHA1_Init (&ctx);
+    if (partial->path && strcmp (partial->path, entry->path) == 0 &&
+        partial->dev == sb.st_dev && partial->ino == sb.st_ino &&
+        partial->size == sb.st_size && partial->mtime_ns == mtime_ns &&
+        partial->ctime_ns == ctime_ns &&
+        lseek (fd, partial->offset, SEEK_SET) != -1) {
+        ctx = partial->ctx;
+        offset = partial->offset;
+    }
+    free (partial->path);
+    partial->path = NULL;
+    for (;;) {
+        if (now_ns () >= deadline) {
+            partial->path = strdup (entry->path);
+            if (partial->path == NULL) {
+                perror ("strdup:\n");
+                close (fd);
+                return -1;
+            }
+            partial->offset = offset;
+            partial->dev = sb.st_dev;
+            partial->ino = sb.st_ino;
+            partial->size = sb.st_size;
+            partial->mtime_ns = mtime_ns;
+            partial->ctime_ns = ctime_ns;
+            partial->ctx = ctx;
+            close (fd);
+            return 1;
+        }
+        len = read (fd, buf, CHUNK_SIZE);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1) {
+            fprintf (stderr, "Failed to read %s: %s\n", entry->path,
+                     strerror (errno));
+            close (fd);
+            entry->readable = false;
+            return 0;
+        }
+        if (len == 0)
+            break;
+        SHA1_Update (&ctx, buf, len);
+        offset += len;
+        stats->bytes += len;
+    }
+    close (fd);
+    SHA1_Final (entry->digest, &ctx);
+    entry->readable = true;
+    return 0;
+}
+
+static void
+sweep_finish (sweep_t *sweep, unsigned char *digest)
+{
+    SHA_CTX ctx;
+    char hex[SWEEP_DIGEST_LEN * 2 + 1];
+    size_t i, j;
+
+    SHA1_Init (&ctx);
+    for (i = 0; i < sweep->count; ++i) {
+        if (sweep->files[i].readable) {
+            for (j = 0; j < SWEEP_DIGEST_LEN; ++j)
+                sprintf (hex + j * 2, "%02x", sweep->files[i].digest[j]);
+            SHA1_Update (&ctx, hex, SWEEP_DIGEST_LEN * 2);
+        } else {
+            SHA1_Update (&ctx, "-", 1);
+        }
+        SHA1_Update (&ctx, " ", 1);
+        SHA1_Update (&ctx, sweep->files[i].path,
+                     strlen (sweep->files[i].path));
+        SHA1_Update (&ctx, "\n", 1);
+    }
+    SHA1_Final (digest, &ctx);
+}
+
+int
+sweep_run (sweep_t *sweep, uint64_t budget_ns, sweep_stats_t *stats)
+{
+    sweep_file_t **order = NULL, *first;
+    unsigned char *buf = NULL;
+    uint64_t deadline = now_ns ();
+    size_t i, n;
+    int ret = -1, status;
+
+    /* UINT64_MAX for no limit mustn't wrap around to the past */
+    deadline = budget_ns > UINT64_MAX - deadline ? UINT64_MAX :
+        deadline + budget_ns;
+    memset (stats, 0, sizeof (*stats));
+    stats->number = sweep->number;
+    stats->files = sweep->count;
+    order = calloc (sweep->count ? sweep->count : 1, sizeof (sweep_file_t*));
+    buf = malloc (CHUNK_SIZE);
+    if (order == NULL || buf == NULL) {
+        perror ("allocation for sweep:\n");
+        goto run_out;
+    }
+    for (i = 0, n = 0; i < sweep->count; ++i) {
+        if (!sweep->files[i].done)
+            order[n++] = &sweep->files[i];
+    }
+    qsort (order, n, sizeof (sweep_file_t*), order_cmp);
+    /* the file cut off last run goes first, to resume its midstate */
+    for (i = 0; sweep->partial.path && i < n; ++i) {
+        if (strcmp (order[i]->path, sweep->partial.path) == 0) {
+            first = order[i];
+            memmove (order + 1, order, i * sizeof (sweep_file_t*));
+            order[0] = first;
+            break;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        status = sweep_hash (sweep, order[i], buf, deadline, stats);
+        if (status == -1)
+            goto run_out;
+        if (status == 1)
+            break;
+        order[i]->done = true;
+        order[i]->measured = time (NULL);
+        ++stats->measured;
+    }
+    stats->remaining = n - stats->measured;
+    if (stats->remaining == 0) {
+        stats->complete = true;
+        sweep_finish (sweep, stats->digest);
+    }
+    ret = sweep_save (sweep);
+run_out:
+    free (order);
+    free (buf);
+    return ret;
+}
+
+int
+sweep_commit (sweep_t *sweep)
+{
+    size_t i;
+
+    ++sweep->number;
+    for (i = 0; i < sweep->count; ++i)
+        sweep->files[i].done = false;
+    free (sweep->partial.path);
+    sweep->partial.path = NULL;
+    return sweep_save (sweep);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SWEEP_DIGEST_LEN 20
+
+/*  A measurement of a list of files spread over as many runs as it
+ *  takes. The list has a line per file:
+ *    <priority> <path>
+ *  and each run hashes files, highest priority first and then those
+ *  measured longest ago, until its time budget runs out. The state
+ *  file checkpoints the sweep between runs: the files done so far with
+ *  their digests, when each file was last measured, and the SHA1
+ *  midstate of a file cut off by the budget, which the next run picks
+ *  up from where it stopped if the file's device, inode, size, mtime
+ *  and ctime haven't changed. The midstate is in host byte order,
+ *  state files don't move between architectures.
+ *  Once every file is done the sweep's digest is the SHA1 of the lines
+ *    <sha1 of contents or '-' if unreadable> <path>\n
+ *  in byte-wise path order. Only complete sweeps are meant to be
+ *  extended, so the PCR and event log see whole sweeps and nothing in
+ *  between. A complete sweep is extended before sweep_commit starts the
+ *  next one: a crash in between extends the same sweep again on the
+ *  next run, which the sweep number in the event log shows, where
+ *  committing first could lose a sweep without a trace.
+ */
+typedef struct sweep sweep_t;
+
+typedef struct sweep_stats {
+    uint64_t number;        /* of the sweep in progress */
+    size_t files;           /* in the list */
+    size_t measured;        /* files finished by this run */
+    size_t remaining;
+    uint64_t bytes;         /* hashed by this run */
+    bool complete;
+    unsigned char digest[SWEEP_DIGEST_LEN];     /* once complete */
+} sweep_stats_t;
+
+sweep_t*
+sweep_open (const char *list, const char *state);
+void
+sweep_free (sweep_t *sweep);
+/*  Measure until the sweep is complete or budget_ns has passed, then
+ *  checkpoint it to the state file.
+ */
+int
+sweep_run (sweep_t *sweep, uint64_t budget_ns, sweep_stats_t *stats);
+/*  Start the next sweep once a complete one has been recorded, keeping
+ *  when each file was last measured.
+ */
+int
+sweep_commit (sweep_t *sweep);
+
+#endif /* SWEEP_H */
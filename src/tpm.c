@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tss/tspi.h>
+#include <trousers/trousers.h>
+
+#include "tpm.h"
+
+struct tss_pool {
+    unsigned int size;
+    atomic_uint_fast64_t busy;
+    tss_conn_t conns[TSS_POOL_MAX];
+};
+
+tss_pool_t*
+tss_pool_new (unsigned int size)
+{
+    tss_pool_t *pool;
+
+    if (size == 0 || size > TSS_POOL_MAX) {
+        fprintf (stderr, "TSS context pool size must be 1-%d.\n",
+                 TSS_POOL_MAX);
+        return NULL;
+    }
+    pool = calloc (1, sizeof (tss_pool_t));
+    if (pool == NULL) {
+        perror ("calloc of TSS context pool:\n");
+        return NULL;
+    }
+    pool->size = size;
+    atomic_init (&pool->busy, 0);
+    return pool;
+}
+
+static void
+tss_conn_close (tss_conn_t *conn)
+{
+    TSS_RESULT result;
+
+    if (conn->context == 0)
+        return;
+    result = Tspi_Context_FreeMemory (conn->context, NULL);
+    if (result != TSS_SUCCESS)
+        fprintf (stderr, "Failed to FreeMemory: %s\n",
+                 Trspi_Error_String (result));
+    result = Tspi_Context_Close (conn->context);
+    if (result != TSS_SUCCESS)
+        fprintf (stderr, "Failed to close context: %s\n",
+                 Trspi_Error_String (result));
+    conn->context = 0;
+    conn->tpm = 0;
+    conn->connected = false;
+}
+
+static TSS_RESULT
+tss_conn_open (tss_conn_t *conn)
+{
+    TSS_UNICODE *host = NULL; /* no remote connections */
+    TSS_RESULT result;
+
+    result = Tspi_Context_Create (&conn->context);
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to create Tspi Context.\n");
+        conn->context = 0;
+        return result;
+    }
+    result = Tspi_Context_Connect (conn->context, host);
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to connect Tspi Context.\n");
+        goto open_fail;
+    }
+    result = Tspi_Context_GetTpmObject (conn->context, &conn->tpm);
+    if (result != TSS_SUCCESS) {
+        fprintf (stderr, "Failed to get TPM object.\n");
+        goto open_fail;
+    }
+    conn->connected = true;
+    return TSS_SUCCESS;
+open_fail:
+    tss_conn_close (conn);
+    return result;
+}
+
+static bool
+tss_conn_lost (TSS_RESULT result)
+{
+    switch (TSS_ERROR_CODE (result)) {
+        case TSS_E_COMM_FAILURE:
+        case TSS_E_NO_CONNECTION:
+        case TSS_E_CONNECTION_FAILED:
+        case TSS_E_CONNECTION_BROKEN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static unsigned int
+tss_pool_checkout (tss_pool_t *pool)
+{
+    uint_fast64_t busy, bit;
+    unsigned int i;
+
+    for (;;) {
+        busy = atomic_load (&pool->busy);
+        for (i = 0; i < pool->size; ++i) {
+            bit = (uint_fast64_t)1 << i;
+            if (busy & bit)
+                continue;
+            if (atomic_compare_exchange_weak (&pool->busy, &busy, busy | bit))
+                return i;
+            /* lost a race, busy holds the new bitmap: rescan */
+            i = (unsigned int)-1;
+        }
+        sched_yield ();
+    }
+}
+
+static void
+tss_pool_checkin (tss_pool_t *pool, unsigned int slot)
+{
+    atomic_fetch_and (&pool->busy, ~((uint_fast64_t)1 << slot));
+}
+
+TSS_RESULT
+tss_pool_run (tss_pool_t *pool, tss_op_t op, void *arg, bool retry)
+{
+    TSS_RESULT result, freed;
+    unsigned int slot, attempt;
+    tss_conn_t *conn;
+
+    slot = tss_pool_checkout (pool);
+    conn = &pool->conns[slot];
+    for (attempt = 0; attempt < (retry ? 2 : 1); ++attempt) {
+        if (!conn->connected) {
+            result = tss_conn_open (conn);
+            if (result != TSS_SUCCESS)
+                break;
+        }
+        result = op (conn, arg);
+        /* shortcut to free all memory bound to the context */
+        freed = Tspi_Context_FreeMemory (conn->context, NULL);
+        if (freed != TSS_SUCCESS)
+            fprintf (stderr, "Failed to FreeMemory: %s\n",
+                     Trspi_Error_String (freed));
+        if (!tss_conn_lost (result))
+            break;
+        tss_conn_close (conn);
+    }
+    tss_pool_checkin (pool, slot);
+    return result;
+}
+
+void
+tss_pool_free (tss_pool_t *pool)
+{
+    unsigned int i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i < pool->size; ++i)
+        tss_conn_close (&pool->conns[i]);
+    free (pool);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TPM_H
+#define TPM_H
+
+#include <stdbool.h>
+#include <tss/tspi.h>
+
+#define TSS_POOL_MAX 64
+
+/*  Trousers contexts can't be shared between threads, so a pool hands
+ *  each thread a context of its own for the length of one operation.
+ *  Contexts are created and connected the first time their slot is
+ *  used. Checkout is a compare-and-swap on a bitmap of busy slots,
+ *  threads only yield when every slot is busy.
+ */
+typedef struct tss_conn {
+    TSS_HCONTEXT context;
+    TSS_HTPM tpm;
+    bool connected;
+} tss_conn_t;
+
+typedef struct tss_pool tss_pool_t;
+
+typedef TSS_RESULT (*tss_op_t) (tss_conn_t *conn, void *arg);
+
+tss_pool_t*
+tss_pool_new (unsigned int size);
+void
+tss_pool_free (tss_pool_t *pool);
+/*  Run op on a pooled context. Memory the TSS allocated for op is
+ *  released with Tspi_Context_FreeMemory afterwards. A context that
+ *  lost its connection is closed and connected again on its next use,
+ *  op is only run a second time straight away if retry is set, which
+ *  is only safe for operations that can be repeated (reads, not
+ *  extends).
+ */
+TSS_RESULT
+tss_pool_run (tss_pool_t *pool, tss_op_t op, void *arg, bool retry);
+
+#endif /* TPM_H */
@@ -0,0 +1,875 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fcache.h"
+#include "filter.h"
+#include "hash.h"
+#include "pkgdb.h"
+#include "tree.h"
+
+#define ARENA_CHUNK_MIN 4096
+#define ARENA_CHUNK_MAX (1 << 20)
+#define SPILL_FANIN 8
+#define SPILL_MIN (64 * 1024)
+#define SPILL_BUF_SIZE 8192
+
+typedef struct tree_walk {
+    const tree_opts_t *opts;
+    tree_stats_t *stats;
+    EVP_MD_CTX *ctx;
+    char *path;
+    size_t path_len;
+    size_t path_size;
+    char *line;          /* a manifest record, path escaped */
+    size_t line_size;
+    size_t mem_used;
+    char *root;          /* absolute root for package lookups */
+    size_t root_len;
+    unsigned int md_len;
+    time_t start;
+    const EVP_MD *md;    /* of file contents */
+    fcache_t *cache;
+} tree_walk_t;
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
+
+/*  A sorted run of names spilled to a temp file. Each record is the
+ *  length of the prefix shared with the previous name, the length of
+ *  the remaining suffix and the suffix itself. Names are at most
+ *  NAME_MAX bytes so both lengths fit in a byte. Runs spilled from
+ *  memory are level 0, a run merged from SPILL_FANIN runs of a level is
+ *  one level up.
+ */
+typedef struct spill_run {
+    FILE *file;
+    char *buf;
+    unsigned int level;
+    char name[NAME_MAX + 1];
+} spill_run_t;
+
+/*  Entries of a single directory. Names live in arena chunks, the full
+ *  path prefix is only held once in tree_walk_t.path. Entries are
+ *  either all in memory or, once anything has been spilled, all in
+ *  runs that are merged through a heap. Runs are merged as soon as
+ *  SPILL_FANIN of them share a level, so a directory keeps fewer than
+ *  SPILL_FANIN runs open per level.
+ */
+typedef struct dir_entries {
+    arena_chunk_t *chunks;
+    size_t chunk_bytes;
+    char **names;
+    size_t count;
+    size_t size;
+    size_t next;
+    spill_run_t *runs;
+    size_t run_count;
+    size_t heap[SPILL_FANIN];
+    size_t heap_len;
+} dir_entries_t;
+
+static char
+tree_type (mode_t mode)
+{
+    switch (mode & S_IFMT) {
+        case S_IFREG:  return 'f';
+        case S_IFDIR:  return 'd';
+        case S_IFLNK:  return 'l';
+        case S_IFIFO:  return 'p';
+        case S_IFSOCK: return 's';
+        case S_IFCHR:  return 'c';
+        case S_IFBLK:  return 'b';
+        default:       return '?';
+    }
+}
+
+static int
+tree_update (tree_walk_t *walk, const void *data, size_t len)
+{
+    if (EVP_DigestUpdate (walk->ctx, data, len) == 0) {
+        ERR_print_errors_fp (stderr);
+        return -1;
+    }
+    if (walk->opts->manifest &&
+        fwrite (data, 1, len, walk->opts->manifest) != len) {
+        perror ("fwrite of manifest:\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+tree_mem (tree_walk_t *walk, ssize_t delta)
+{
+    walk->mem_used += delta;
+    if (walk->mem_used > walk->stats->mem_peak)
+        walk->stats->mem_peak = walk->mem_used;
+}
+
+static bool
+tree_mem_over (tree_walk_t *walk, size_t slack)
+{
+    return walk->opts->mem_limit &&
+        walk->mem_used > walk->opts->mem_limit - slack;
+}
+
+static int
+tree_record (tree_walk_t *walk, mode_t mode, const unsigned char *hash,
+             unsigned int hash_len)
+{
+    size_t i, size, len;
+    char *line;
+
+    size = 3 * EVP_MAX_MD_SIZE + 16 + 2 * walk->path_len;
+    if (size > walk->line_size) {
+        line = realloc (walk->line, size);
+        if (line == NULL) {
+            perror ("realloc of manifest line:\n");
+            return -1;
+        }
+        walk->line = line;
+        walk->line_size = size;
+    }
+    line = walk->line;
+    len = snprintf (line, size, "%c %04o ", tree_type (mode), mode & 07777);
+    if (hash) {
+        for (i = 0; i < hash_len; ++i)
+            len += snprintf (line + len, size - len, "%02x", hash[i]);
+    } else {
+        line[len++] = '-';
+    }
+    line[len++] = ' ';
+    for (i = 0; i < walk->path_len; ++i) {
+        if (walk->path[i] == '\\') {
+            line[len++] = '\\';
+            line[len++] = '\\';
+        } else if (walk->path[i] == '\n') {
+            line[len++] = '\\';
+            line[len++] = 'n';
+        } else {
+            line[len++] = walk->path[i];
+        }
+    }
+    line[len++] = '\n';
+    return tree_update (walk, line, len);
+}
+
+static int
+tree_path_push (tree_walk_t *walk, const char *name)
+{
+    size_t len = strlen (name);
+    char *path;
+
+    if (walk->path_len + len + 2 > walk->path_size) {
+        path = realloc (walk->path, (walk->path_len + len + 2) * 2);
+        if (path == NULL) {
+            perror ("realloc of tree path:\n");
+            return -1;
+        }
+        walk->path = path;
+        walk->path_size = (walk->path_len + len + 2) * 2;
+    }
+    walk->path[walk->path_len++] = '/';
+    memcpy (walk->path + walk->path_len, name, len + 1);
+    walk->path_len += len;
+    return 0;
+}
+
+static void
+tree_path_pop (tree_walk_t *walk)
+{
+    while (walk->path_len > 0 && walk->path[--walk->path_len] != '/')
+        ;
+    walk->path[walk->path_len] = '\0';
+}
+
+static int
+name_cmp (const void *a, const void *b)
+{
+    return strcmp (*(char* const*)a, *(char* const*)b);
+}
+
+static void
+entries_release (tree_walk_t *walk, dir_entries_t *ents)
+{
+    arena_chunk_t *chunk;
+
+    while (ents->chunks) {
+        chunk = ents->chunks;
+        ents->chunks = chunk->next;
+        free (chunk);
+    }
+    tree_mem (walk, -(ssize_t)ents->chunk_bytes);
+    tree_mem (walk, -(ssize_t)(ents->size * sizeof (char*)));
+    free (ents->names);
+    ents->chunk_bytes = 0;
+    ents->names = NULL;
+    ents->count = 0;
+    ents->size = 0;
+    ents->next = 0;
+}
+
+/*  The stdio buffer of a run is ours so it counts against the memory
+ *  limit like the names do.
+ */
+static void
+run_close (tree_walk_t *walk, spill_run_t *run)
+{
+    fclose (run->file);
+    free (run->buf);
+    tree_mem (walk, -SPILL_BUF_SIZE);
+    run->file = NULL;
+    run->buf = NULL;
+}
+
+static void
+entries_free (tree_walk_t *walk, dir_entries_t *ents)
+{
+    size_t i;
+
+    entries_release (walk, ents);
+    for (i = 0; i < ents->run_count; ++i)
+        run_close (walk, &ents->runs[i]);
+    free (ents->runs);
+}
+
+static int
+run_open (tree_walk_t *walk, spill_run_t *run, unsigned int level)
+{
+    const char *dir = getenv ("TMPDIR");
+    char path[PATH_MAX];
+    int fd;
+
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    snprintf (path, sizeof (path), "%s/pcr-extend.XXXXXX", dir);
+    run->buf = malloc (SPILL_BUF_SIZE);
+    if (run->buf == NULL) {
+        perror ("malloc of spill buffer:\n");
+        return -1;
+    }
+    fd = mkstemp (path);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to create spill file in %s: %s\n", dir,
+                 strerror (errno));
+        free (run->buf);
+        return -1;
+    }
+    unlink (path);
+    run->file = fdopen (fd, "w+");
+    if (run->file == NULL) {
+        perror ("fdopen:\n");
+        close (fd);
+        free (run->buf);
+        return -1;
+    }
+    setvbuf (run->file, run->buf, _IOFBF, SPILL_BUF_SIZE);
+    tree_mem (walk, SPILL_BUF_SIZE);
+    run->level = level;
+    return 0;
+}
+
+/*  Append name to a run, prefix compressed against prev.
+ */
+static int
+run_write (FILE *file, const char *prev, const char *name)
+{
+    size_t shared, len;
+
+    for (shared = 0; prev[shared] == name[shared] && prev[shared] != '\0';
+         ++shared)
+        ;
+    len = strlen (name + shared);
+    if (fputc (shared, file) == EOF || fputc (len, file) == EOF ||
+        fwrite (name + shared, 1, len, file) != len) {
+        perror ("write of spill run:\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*  Read the next name from a run, returns 1 at the end of the run.
+ */
+static int
+run_next (spill_run_t *run)
+{
+    int shared, len;
+
+    shared = fgetc (run->file);
+    if (shared == EOF)
+        return ferror (run->file) ? -1 : 1;
+    len = fgetc (run->file);
+    if (len == EOF || shared + len > NAME_MAX ||
+        fread (run->name + shared, 1, len, run->file) != (size_t)len) {
+        fprintf (stderr, "Corrupt spill run.\n");
+        return -1;
+    }
+    run->name[shared + len] = '\0';
+    return 0;
+}
+
+static bool
+heap_less (dir_entries_t *ents, size_t a, size_t b)
+{
+    return strcmp (ents->runs[ents->heap[a]].name,
+                   ents->runs[ents->heap[b]].name) < 0;
+}
+
+static void
+heap_down (dir_entries_t *ents, size_t i)
+{
+    size_t min, tmp;
+
+    for (;;) {
+        min = i;
+        if (2 * i + 1 < ents->heap_len && heap_less (ents, 2 * i + 1, min))
+            min = 2 * i + 1;
+        if (2 * i + 2 < ents->heap_len && heap_less (ents, 2 * i + 2, min))
+            min = 2 * i + 2;
+        if (min == i)
+            return;
+        tmp = ents->heap[i];
+        ents->heap[i] = ents->heap[min];
+        ents->heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*  Rewind the runs from first on, at most SPILL_FANIN of them, and heap
+ *  them by their first name.
+ */
+static int
+heap_init (dir_entries_t *ents, size_t first)
+{
+    size_t i;
+    int ret;
+
+    ents->heap_len = 0;
+    for (i = first; i < ents->run_count; ++i) {
+        if (fflush (ents->runs[i].file) || fseek (ents->runs[i].file, 0, SEEK_SET)) {
+            perror ("rewind of spill run:\n");
+            return -1;
+        }
+        ret = run_next (&ents->runs[i]);
+        if (ret == -1)
+            return -1;
+        if (ret == 0)
+            ents->heap[ents->heap_len++] = i;
+    }
+    for (i = ents->heap_len / 2; i-- > 0;)
+        heap_down (ents, i);
+    return 0;
+}
+
+/*  Copy the smallest name of the heap to buf and advance its run.
+ *  Returns 1 once the heap is empty.
+ */
+static int
+heap_pop (dir_entries_t *ents, char *buf)
+{
+    spill_run_t *run;
+    int ret;
+
+    if (ents->heap_len == 0)
+        return 1;
+    run = &ents->runs[ents->heap[0]];
+    strcpy (buf, run->name);
+    ret = run_next (run);
+    if (ret == -1)
+        return -1;
+    if (ret == 1)
+        ents->heap[0] = ents->heap[--ents->heap_len];
+    heap_down (ents, 0);
+    return 0;
+}
+
+/*  Merge the runs from first to the end into one, a level above the
+ *  highest of them.
+ */
+static int
+entries_merge (tree_walk_t *walk, dir_entries_t *ents, size_t first)
+{
+    char name[NAME_MAX + 1], prev[NAME_MAX + 1] = "";
+    spill_run_t merged;
+    unsigned int level = 0;
+    size_t i;
+    int ret;
+
+    for (i = first; i < ents->run_count; ++i) {
+        if (ents->runs[i].level >= level)
+            level = ents->runs[i].level + 1;
+    }
+    if (run_open (walk, &merged, level))
+        return -1;
+    if (heap_init (ents, first))
+        goto merge_fail;
+    while ((ret = heap_pop (ents, name)) == 0) {
+        if (run_write (merged.file, prev, name))
+            goto merge_fail;
+        strcpy (prev, name);
+    }
+    if (ret == -1)
+        goto merge_fail;
+    for (i = first; i < ents->run_count; ++i)
+        run_close (walk, &ents->runs[i]);
+    ents->runs[first] = merged;
+    ents->run_count = first + 1;
+    ++walk->stats->spill_merges;
+    return 0;
+merge_fail:
+    run_close (walk, &merged);
+    return -1;
+}
+
+/*  Sort the names held in memory and write them out as a new run, then
+ *  merge while the last SPILL_FANIN runs share a level.
+ */
+static int
+entries_spill (tree_walk_t *walk, dir_entries_t *ents)
+{
+    spill_run_t *runs;
+    const char *prev = "";
+    size_t i, first;
+    FILE *file;
+
+    runs = realloc (ents->runs, (ents->run_count + 1) * sizeof (spill_run_t));
+    if (runs == NULL) {
+        perror ("realloc of spill runs:\n");
+        return -1;
+    }
+    ents->runs = runs;
+    if (run_open (walk, &ents->runs[ents->run_count], 0))
+        return -1;
+    file = ents->runs[ents->run_count++].file;
+    qsort (ents->names, ents->count, sizeof (char*), name_cmp);
+    for (i = 0; i < ents->count; ++i) {
+        if (run_write (file, prev, ents->names[i]))
+            return -1;
+        prev = ents->names[i];
+    }
+    ++walk->stats->spill_runs;
+    entries_release (walk, ents);
+    while (ents->run_count >= SPILL_FANIN) {
+        first = ents->run_count - SPILL_FANIN;
+        if (ents->runs[first].level != ents->runs[ents->run_count - 1].level)
+            break;
+        if (entries_merge (walk, ents, first))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+entries_add (tree_walk_t *walk, dir_entries_t *ents, const char *name)
+{
+    arena_chunk_t *chunk;
+    size_t len = strlen (name) + 1, size;
+    char **names;
+
+    if (ents->chunks == NULL || ents->chunks->used + len > ents->chunks->size) {
+        size = ents->chunks ? ents->chunks->size * 2 : ARENA_CHUNK_MIN;
+        if (size > ARENA_CHUNK_MAX)
+            size = ARENA_CHUNK_MAX;
+        chunk = malloc (sizeof (arena_chunk_t) + size);
+        if (chunk == NULL) {
+            perror ("malloc of name arena:\n");
+            return -1;
+        }
+        chunk->next = ents->chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        ents->chunks = chunk;
+        ents->chunk_bytes += size;
+        tree_mem (walk, size);
+    }
+    if (ents->count == ents->size) {
+        size = ents->size ? ents->size * 2 : 64;
+        names = realloc (ents->names, size * sizeof (char*));
+        if (names == NULL) {
+            perror ("realloc of directory entries:\n");
+            return -1;
+        }
+        tree_mem (walk, (size - ents->size) * sizeof (char*));
+        ents->names = names;
+        ents->size = size;
+    }
+    chunk = ents->chunks;
+    ents->names[ents->count++] = memcpy (chunk->data + chunk->used, name, len);
+    chunk->used += len;
+    /* below SPILL_MIN a run would cost about as much as it saves */
+    if (ents->chunk_bytes >= SPILL_MIN && tree_mem_over (walk, 0))
+        return entries_spill (walk, ents);
+    return 0;
+}
+
+/*  Prepare the entries for iteration in name order. Large in-memory
+ *  batches are spilled too so they don't crowd out the subdirectories
+ *  walked while this one is being iterated. Runs are merged down to
+ *  SPILL_FANIN, the last of them merged as they are iterated.
+ */
+static int
+entries_sort (tree_walk_t *walk, dir_entries_t *ents)
+{
+    bool big = ents->chunk_bytes >= SPILL_MIN &&
+               tree_mem_over (walk, walk->opts->mem_limit / 2);
+
+    if (ents->count && (ents->run_count || big)) {
+        if (entries_spill (walk, ents))
+            return -1;
+    }
+    if (ents->run_count == 0) {
+        qsort (ents->names, ents->count, sizeof (char*), name_cmp);
+        return 0;
+    }
+    while (ents->run_count > SPILL_FANIN) {
+        if (entries_merge (walk, ents, ents->run_count - SPILL_FANIN))
+            return -1;
+    }
+    return heap_init (ents, 0);
+}
+
+/*  Returns the next name in order, NULL at the end. The name remains
+ *  valid until the following call. Errors are reported through err.
+ */
+static const char*
+entries_next (dir_entries_t *ents, char *buf, int *err)
+{
+    int ret;
+
+    if (ents->run_count == 0)
+        return ents->next < ents->count ? ents->names[ents->next++] : NULL;
+    ret = heap_pop (ents, buf);
+    if (ret == -1)
+        *err = -1;
+    return ret ? NULL : buf;
+}
+
+/*  Pick package digests to verify with an unpredictable sample so a
+ *  tampered file can't count on being skipped.
+ */
+static bool
+tree_sample (unsigned int percent)
+{
+    uint32_t value;
+
+    if (percent == 0)
+        return false;
+    if (percent >= 100 ||
+        RAND_bytes ((unsigned char*)&value, sizeof (value)) != 1)
+        return true;
+    return value % 100 < percent;
+}
+
+static const pkgdb_entry_t*
+tree_pkgdb_lookup (tree_walk_t *walk, struct stat *st)
+{
+    const pkgdb_entry_t *entry;
+    char path[PATH_MAX];
+
+    if (walk->opts->pkgdb == NULL)
+        return NULL;
+    if (walk->root_len + walk->path_len >= sizeof (path))
+        return NULL;
+    memcpy (path, walk->root, walk->root_len);
+    memcpy (path + walk->root_len, walk->path, walk->path_len + 1);
+    entry = pkgdb_lookup (walk->opts->pkgdb, path);
+    if (entry == NULL || entry->size != st->st_size ||
+        entry->mtime != st->st_mtime)
+        return NULL;
+    return entry;
+}
+
+static int
+tree_file (tree_walk_t *walk, int dir_fd, const char *name, struct stat *st)
+{
+    unsigned char cached[EVP_MAX_MD_SIZE];
+    const pkgdb_entry_t *pkg;
+    unsigned char *hash = NULL;
+    unsigned int hash_len = 0;
+    FILE *file = NULL;
+    size_t cache_mem;
+    int fd, ret = -1;
+
+    pkg = tree_pkgdb_lookup (walk, st);
+    if (pkg) {
+        if (!tree_sample (walk->opts->sample_percent)) {
+            ++walk->stats->pkg_reused;
+            return tree_record (walk, st->st_mode, pkg->digest,
+                                PKGDB_DIGEST_LEN);
+        }
+        ++walk->stats->pkg_checked;
+    } else if (walk->cache &&
+               fcache_lookup (walk->cache, st, walk->md, cached)) {
+        ++walk->stats->cache_hits;
+        return tree_record (walk, st->st_mode, cached, walk->md_len);
+    }
+    fd = openat (dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", walk->path,
+                 strerror (errno));
+        return -1;
+    }
+    file = fdopen (fd, "r");
+    if (file == NULL) {
+        perror ("fdopen:\n");
+        close (fd);
+        return -1;
+    }
+    hash = digest_file (file, walk->md, NULL, 0, &hash_len);
+    if (hash == NULL)
+        goto file_out;
+    if (pkg && (hash_len != PKGDB_DIGEST_LEN ||
+                memcmp (hash, pkg->digest, PKGDB_DIGEST_LEN) != 0)) {
+        fprintf (stderr, "%s doesn't match its package digest.\n",
+                 walk->path);
+        goto file_out;
+    }
+    if (walk->cache) {
+        cache_mem = fcache_memory (walk->cache);
+        if (fcache_add (walk->cache, st, walk->md, hash, walk->start))
+            goto file_out;
+        tree_mem (walk, fcache_memory (walk->cache) - cache_mem);
+    }
+    ret = tree_record (walk, st->st_mode, hash, hash_len);
+file_out:
+    fclose (file);
+    free (hash);
+    return ret;
+}
+
+static int
+tree_link (tree_walk_t *walk, int dir_fd, const char *name, struct stat *st)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len = 0;
+    char *target;
+    ssize_t len;
+    int ret = -1;
+
+    target = malloc (st->st_size + 1);
+    if (target == NULL) {
+        perror ("malloc of link target:\n");
+        return -1;
+    }
+    len = readlinkat (dir_fd, name, target, st->st_size + 1);
+    if (len == -1 || len > st->st_size) {
+        fprintf (stderr, "Failed to read link %s\n", walk->path);
+        goto link_out;
+    }
+    if (EVP_Digest (target, len, hash, &hash_len, walk->md, NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto link_out;
+    }
+    ret = tree_record (walk, st->st_mode, hash, hash_len);
+link_out:
+    free (target);
+    return ret;
+}
+
+/*  Walk the directory open on dir_fd. The descriptor is consumed.
+ */
+static int
+tree_dir (tree_walk_t *walk, int dir_fd)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    dir_entries_t ents = { 0 };
+    char buf[NAME_MAX + 1];
+    const char *name;
+    int fd, err = 0, ret = -1;
+
+    dir = fdopendir (dir_fd);
+    if (dir == NULL) {
+        perror ("fdopendir:\n");
+        close (dir_fd);
+        return -1;
+    }
+    errno = 0;
+    while ((entry = readdir (dir)) != NULL) {
+        if (strcmp (entry->d_name, ".") == 0 ||
+            strcmp (entry->d_name, "..") == 0)
+            continue;
+        if (entries_add (walk, &ents, entry->d_name))
+            goto dir_out;
+        errno = 0;
+    }
+    if (errno) {
+        perror ("readdir:\n");
+        goto dir_out;
+    }
+    if (entries_sort (walk, &ents))
+        goto dir_out;
+    while ((name = entries_next (&ents, buf, &err)) != NULL) {
+        if (fstatat (dirfd (dir), name, &st, AT_SYMLINK_NOFOLLOW)) {
+            perror ("fstatat:\n");
+            goto dir_out;
+        }
+        if (tree_path_push (walk, name))
+            goto dir_out;
+        if (filter_match (walk->opts->filter, walk->path, st.st_mode) ==
+            FILTER_EXCLUDE) {
+            tree_path_pop (walk);
+            continue;
+        }
+        ++walk->stats->entries;
+        switch (st.st_mode & S_IFMT) {
+            case S_IFREG:
+                if (tree_file (walk, dirfd (dir), name, &st))
+                    goto dir_out;
+                break;
+            case S_IFLNK:
+                if (tree_link (walk, dirfd (dir), name, &st))
+                    goto dir_out;
+                break;
+            case S_IFDIR:
+                if (tree_record (walk, st.st_mode, NULL, 0))
+                    goto dir_out;
+                fd = openat (dirfd (dir), name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == -1) {
+                    fprintf (stderr, "Failed to open %s: %s\n", walk->path,
+                             strerror (errno));
+                    goto dir_out;
+                }
+                if (tree_dir (walk, fd))
+                    goto dir_out;
+                break;
+            default:
+                if (tree_record (walk, st.st_mode, NULL, 0))
+                    goto dir_out;
+                break;
+        }
+        tree_path_pop (walk);
+    }
+    if (err)
+        goto dir_out;
+    ret = 0;
+dir_out:
+    entries_free (walk, &ents);
+    closedir (dir);
+    return ret;
+}
+
+unsigned char*
+sha1_tree (const char *root, const tree_opts_t *opts, tree_stats_t *stats,
+           unsigned int *hash_len)
+{
+    tree_walk_t walk = { .opts = opts, .stats = stats };
+    unsigned char *hash = NULL;
+    int fd;
+
+    fd = open (root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf (stderr, "Failed to open directory %s: %s\n", root,
+                 strerror (errno));
+        return NULL;
+    }
+    walk.path = calloc (1, 256);
+    if (walk.path == NULL) {
+        perror ("calloc of tree path:\n");
+        close (fd);
+        return NULL;
+    }
+    walk.path_size = 256;
+    if (opts->pkgdb) {
+        walk.root = realpath (root, NULL);
+        if (walk.root == NULL) {
+            fprintf (stderr, "Failed to resolve %s: %s\n", root,
+                     strerror (errno));
+            close (fd);
+            goto tree_fail;
+        }
+        /* the root directory itself contributes nothing to the path */
+        walk.root_len = strcmp (walk.root, "/") == 0 ? 0 : strlen (walk.root);
+    }
+    walk.ctx = EVP_MD_CTX_create ();
+    if (walk.ctx == NULL || EVP_DigestInit (walk.ctx, EVP_sha1 ()) == 0) {
+        ERR_print_errors_fp (stderr);
+        close (fd);
+        goto tree_fail;
+    }
+    walk.md = opts->pkgdb ? EVP_sha256 () : EVP_sha1 ();
+    walk.md_len = EVP_MD_size (walk.md);
+    walk.start = time (NULL);
+    memset (stats, 0, sizeof (tree_stats_t));
+    if (opts->cache) {
+        /* half the memory limit, the other half is for entries */
+        walk.cache = fcache_new (opts->mem_limit ?
+                                 fcache_entries_in (opts->mem_limit / 2) : 0);
+        if (walk.cache == NULL || fcache_load (walk.cache, opts->cache)) {
+            close (fd);
+            goto tree_fail;
+        }
+        tree_mem (&walk, fcache_memory (walk.cache));
+    }
+    if (tree_dir (&walk, fd))
+        goto tree_fail;
+    /* files no longer in the tree drop out of the cache */
+    if (opts->cache && fcache_save (walk.cache, opts->cache, true))
+        goto tree_fail;
+    if (opts->manifest && fflush (opts->manifest)) {
+        perror ("fflush of manifest:\n");
+        goto tree_fail;
+    }
+    hash = calloc (1, EVP_MAX_MD_SIZE);
+    if (hash == NULL) {
+        perror ("calloc of hash buffer:\n");
+        goto tree_fail;
+    }
+    if (EVP_DigestFinal (walk.ctx, hash, hash_len) == 0) {
+        ERR_print_errors_fp (stderr);
+        goto tree_fail;
+    }
+    EVP_MD_CTX_destroy (walk.ctx);
+    free (walk.path);
+    free (walk.line);
+    free (walk.root);
+    fcache_free (walk.cache);
+    return hash;
+tree_fail:
+    if (walk.ctx)
+        EVP_MD_CTX_destroy (walk.ctx);
+    free (walk.path);
+    free (walk.line);
+    free (walk.root);
+    fcache_free (walk.cache);
+    free (hash);
+    return NULL;
+}
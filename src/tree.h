@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdio.h>
+
+#include "filter.h"
+#include "pkgdb.h"
+
+typedef struct tree_opts {
+    const filter_t *filter;
+    size_t mem_limit;   /* bytes, 0 for no limit */
+    FILE *manifest;     /* manifest lines are copied here when set */
+    const pkgdb_t *pkgdb;         /* package digests to reuse, or NULL */
+    unsigned int sample_percent;  /* of reused digests to check anyway */
+    const char *cache;  /* file digest cache, or NULL */
+} tree_opts_t;
+
+typedef struct tree_stats {
+    size_t entries;
+    size_t spill_runs;
+    size_t spill_merges;
+    size_t mem_peak;    /* high-water mark of directory entry storage */
+    size_t pkg_reused;  /* files measured by their package digest */
+    size_t pkg_checked; /* package digests spot-checked by hashing */
+    size_t cache_hits;  /* files measured by their cached digest */
+} tree_stats_t;
+
+/*  Measure the directory tree rooted at root. Entries are visited depth
+ *  first in byte-wise name order and each one that passes the filter is
+ *  rendered as a manifest line:
+ *    <type> <mode> <sha1 of contents or link target, or '-'> <path>\n
+ *  with '\' and newlines in the path escaped. The returned SHA1 is the
+ *  hash of the manifest, so the same tree and rules always produce the
+ *  same value.
+ *  Memory use doesn't grow with the size of the tree: directory entries
+ *  are kept in per-directory arenas and, once opts->mem_limit is
+ *  exceeded, sorted and spilled to prefix-compressed runs in TMPDIR
+ *  which are merged back as the directory is walked. The stdio buffers
+ *  of open runs count against the limit. A directory holding less than
+ *  64KiB of names isn't spilled, so the limit can be overshot by that
+ *  much per directory being walked.
+ *  With opts->pkgdb files and link targets are hashed with SHA-256
+ *  instead, so every digest in the manifest has the same length, and
+ *  files whose size and mtime match the package manager's records take
+ *  the recorded digest without being read. A random sample of
+ *  opts->sample_percent of them is hashed anyway and the measurement
+ *  fails if any differs. Package paths are absolute so root is
+ *  resolved with realpath.
+ *  With opts->cache files whose device, inode, size, mtime and ctime
+ *  match an entry of the cache take its digest without being read, and
+ *  the cache is rewritten with the files of this walk. Files changed
+ *  in the second the walk started aren't cached. With a memory limit
+ *  the cache counts against it and keeps to half of it, dropping its
+ *  oldest entries beyond that. Every entry is still stat'ed: a
+ *  directory's mtime and ctime only change when its own entries do,
+ *  never for a file rewritten beneath it, so they can't vouch for a
+ *  subtree.
+ */
+unsigned char*
+sha1_tree (const char *root, const tree_opts_t *opts, tree_stats_t *stats,
+           unsigned int *hash_len);
+
+#endif /* TREE_H */
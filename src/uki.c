@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pe.h"
+#include "uki.h"
+
+/* sections worth a thread of their own */
+#define UKI_THREAD_MIN (1 << 20)
+
+/*  The order systemd-stub measures sections in.
+ */
+static const char *const uki_sections[] = {
+    ".linux", ".osrel", ".cmdline", ".initrd", ".ucode", ".splash", ".dtb",
+    ".uname", ".sbat", ".pcrpkey", ".profile", ".dtbauto", ".hwids",
+    ".efifw",
+};
+
+typedef struct uki_job {
+    const pe_image_t *image;
+    const pe_section_t *section;
+    const EVP_MD *const *mds;
+    size_t count;
+    unsigned char (*digest)[EVP_MAX_MD_SIZE];
+    pthread_t thread;
+    bool threaded;
+    int ret;
+} uki_job_t;
+
+static int
+uki_hash (const EVP_MD *const *mds, size_t count, const void *data,
+          size_t len, unsigned char digest[][EVP_MAX_MD_SIZE])
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (EVP_Digest (data, len, digest[i], NULL, mds[i], NULL) == 0) {
+            ERR_print_errors_fp (stderr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void*
+uki_hash_section (void *arg)
+{
+    static const unsigned char zeros[4096];
+    uki_job_t *job = arg;
+    const pe_section_t *section = job->section;
+    EVP_MD_CTX *ctx = NULL;
+    size_t i, raw, left;
+
+    job->ret = -1;
+    raw = section->raw_size < section->virtual_size ?
+          section->raw_size : section->virtual_size;
+    for (i = 0; i < job->count; ++i) {
+        ctx = EVP_MD_CTX_create ();
+        if (ctx == NULL || EVP_DigestInit (ctx, job->mds[i]) == 0 ||
+            EVP_DigestUpdate (ctx, job->image->map + section->offset,
+                              raw) == 0)
+            goto hash_fail;
+        for (left = section->virtual_size - raw; left;) {
+            size_t len = left < sizeof (zeros) ? left : sizeof (zeros);
+
+            if (EVP_DigestUpdate (ctx, zeros, len) == 0)
+                goto hash_fail;
+            left -= len;
+        }
+        if (EVP_DigestFinal (ctx, job->digest[i], NULL) == 0)
+            goto hash_fail;
+        EVP_MD_CTX_destroy (ctx);
+    }
+    job->ret = 0;
+    return NULL;
+hash_fail:
+    ERR_print_errors_fp (stderr);
+    if (ctx)
+        EVP_MD_CTX_destroy (ctx);
+    return NULL;
+}
+
+static const pe_section_t*
+uki_find (const pe_image_t *image, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < image->section_count; ++i) {
+        if (strcmp (image->sections[i].name, name) == 0)
+            return &image->sections[i];
+    }
+    return NULL;
+}
+
+/*  PCR extend: pcr = H(pcr || digest).
+ */
+static int
+uki_extend (const EVP_MD *md, unsigned char *pcr, unsigned int len,
+            const unsigned char *digest)
+{
+    unsigned char buf[EVP_MAX_MD_SIZE * 2];
+
+    memcpy (buf, pcr, len);
+    memcpy (buf + len, digest, len);
+    if (EVP_Digest (buf, len * 2, pcr, NULL, md, NULL) == 0) {
+        ERR_print_errors_fp (stderr);
+        return -1;
+    }
+    return 0;
+}
+
+int
+uki_predict (const char *path, const EVP_MD *const *mds, size_t count,
+             uki_prediction_t *prediction)
+{
+    uki_job_t jobs[UKI_SECTIONS_MAX] = { 0 };
+    unsigned char name_digest[PE_DIGESTS_MAX][EVP_MAX_MD_SIZE];
+    const pe_section_t *section;
+    pe_image_t *image;
+    size_t i, j, n = 0;
+    int ret = -1;
+
+    if (count > PE_DIGESTS_MAX)
+        return -1;
+    image = pe_open (path);
+    if (image == NULL)
+        return -1;
+    memset (prediction, 0, sizeof (*prediction));
+    for (i = 0; i < sizeof (uki_sections) / sizeof (uki_sections[0]); ++i) {
+        section = uki_find (image, uki_sections[i]);
+        if (section == NULL || section->virtual_size == 0)
+            continue;
+        prediction->sections[n].name = uki_sections[i];
+        jobs[n] = (uki_job_t) {
+            .image = image,
+            .section = section,
+            .mds = mds,
+            .count = count,
+            .digest = prediction->sections[n].digest,
+        };
+        if (section->virtual_size >= UKI_THREAD_MIN)
+            jobs[n].threaded = pthread_create (&jobs[n].thread, NULL,
+                                               uki_hash_section,
+                                               &jobs[n]) == 0;
+        if (!jobs[n].threaded)
+            uki_hash_section (&jobs[n]);
+        ++n;
+    }
+    prediction->section_count = n;
+    ret = 0;
+    for (i = 0; i < n; ++i) {
+        if (jobs[i].threaded)
+            pthread_join (jobs[i].thread, NULL);
+        if (jobs[i].ret)
+            ret = -1;
+    }
+    if (ret)
+        goto predict_out;
+    if (n == 0) {
+        fprintf (stderr, "%s has no sections systemd-stub measures.\n", path);
+        ret = -1;
+        goto predict_out;
+    }
+
+    /* replay the stub's extends in software, bank by bank */
+    for (j = 0; j < count; ++j)
+        prediction->pcr_len[j] = EVP_MD_size (mds[j]);
+    for (i = 0; i < n; ++i) {
+        if (uki_hash (mds, count, prediction->sections[i].name,
+                      strlen (prediction->sections[i].name) + 1, name_digest))
+            goto predict_fail;
+        for (j = 0; j < count; ++j) {
+            if (uki_extend (mds[j], prediction->pcr[j],
+                            prediction->pcr_len[j], name_digest[j]) ||
+                uki_extend (mds[j], prediction->pcr[j],
+                            prediction->pcr_len[j],
+                            prediction->sections[i].digest[j]))
+                goto predict_fail;
+        }
+    }
+    goto predict_out;
+predict_fail:
+    ret = -1;
+predict_out:
+    pe_close (image);
+    return ret;
+}
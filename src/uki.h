@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef UKI_H
+#define UKI_H
+
+#include <openssl/evp.h>
+#include <stddef.h>
+
+#include "pe.h"
+
+#define UKI_PCR 11
+#define UKI_SECTIONS_MAX 16
+
+typedef struct uki_section {
+    const char *name;
+    unsigned char digest[PE_DIGESTS_MAX][EVP_MAX_MD_SIZE];
+} uki_section_t;
+
+typedef struct uki_prediction {
+    uki_section_t sections[UKI_SECTIONS_MAX];   /* in measurement order */
+    size_t section_count;
+    unsigned char pcr[PE_DIGESTS_MAX][EVP_MAX_MD_SIZE];
+    unsigned int pcr_len[PE_DIGESTS_MAX];
+} uki_prediction_t;
+
+/*  Predict the value PCR 11 takes once systemd-stub boots the unified
+ *  kernel image at path, starting from zero, in one bank per md. The
+ *  stub walks its known sections in a fixed order (.pcrsig excepted)
+ *  and for each one present extends the digest of its name, NUL
+ *  included, then that of its contents as loaded: VirtualSize bytes,
+ *  zero filled past the raw data. Large sections are hashed on threads
+ *  of their own.
+ */
+int
+uki_predict (const char *path, const EVP_MD *const *mds, size_t count,
+             uki_prediction_t *prediction);
+
+#endif /* UKI_H */
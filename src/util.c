@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util.h"
+
+static int
+hex_value (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    return tolower ((unsigned char)c) - 'a' + 10;
+}
+
+int
+hex_parse (const char *hex, unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (!isxdigit ((unsigned char)hex[2 * i]) ||
+            !isxdigit ((unsigned char)hex[2 * i + 1]))
+            return -1;
+        buf[i] = hex_value (hex[2 * i]) << 4 | hex_value (hex[2 * i + 1]);
+    }
+    return 0;
+}
+
+int
+unix_listen (const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat sb;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        fprintf (stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy (addr.sun_path, path);
+    /* only a stale socket is replaced, never a file given by mistake */
+    if (lstat (path, &sb) == 0) {
+        if (!S_ISSOCK (sb.st_mode)) {
+            fprintf (stderr, "Failed to listen on %s: path exists\n", path);
+            return -1;
+        }
+        if (unlink (path) == -1) {
+            fprintf (stderr, "Failed to remove %s: %s\n", path,
+                     strerror (errno));
+            return -1;
+        }
+    }
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror ("socket:\n");
+        return -1;
+    }
+    if (bind (fd, (struct sockaddr*)&addr, sizeof (addr)) == -1 ||
+        listen (fd, SOMAXCONN) == -1) {
+        fprintf (stderr, "Failed to listen on %s: %s\n", path,
+                 strerror (errno));
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
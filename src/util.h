@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+
+/*  Decode the first len * 2 characters of hex into len bytes of buf.
+ *  Returns -1 if any of them isn't a hex digit, what follows isn't
+ *  looked at.
+ */
+int
+hex_parse (const char *hex, unsigned char *buf, size_t len);
+/*  Bind a Unix stream socket to path, replacing a socket left there but
+ *  nothing else, and listen on it. Returns the close-on-exec descriptor
+ *  or -1.
+ */
+int
+unix_listen (const char *path);
+
+#endif /* UTIL_H */
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dm-ioctl.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "verity.h"
+#include "util.h"
+
+#define DM_CONTROL "/dev/mapper/control"
+#define DM_BUF_SIZE 16384
+#define VERITY_LEVELS_MAX 63
+
+/*  Run a DM_TABLE_STATUS for device, growing the buffer until the
+ *  result fits. Returns the single verity target's parameters.
+ */
+static char*
+dm_status (int control, const char *device, bool table)
+{
+    struct dm_target_spec *spec;
+    struct dm_ioctl *io = NULL;
+    struct stat sb;
+    size_t size = DM_BUF_SIZE;
+    char *params = NULL;
+
+    for (;;) {
+        free (io);
+        io = calloc (1, size);
+        if (io == NULL) {
+            perror ("calloc of dm ioctl:\n");
+            return NULL;
+        }
+        io->version[0] = DM_VERSION_MAJOR;
+        io->data_size = size;
+        io->data_start = sizeof (struct dm_ioctl);
+        io->flags = table ? DM_STATUS_TABLE_FLAG : 0;
+        if (stat (device, &sb) == 0 && S_ISBLK (sb.st_mode)) {
+            io->dev = sb.st_rdev;
+        } else {
+            if (strlen (device) >= DM_NAME_LEN) {
+                fprintf (stderr, "Invalid dm name: %s\n", device);
+                goto status_out;
+            }
+            strcpy (io->name, device);
+        }
+        if (ioctl (control, DM_TABLE_STATUS, io) == -1) {
+            fprintf (stderr, "DM_TABLE_STATUS of %s failed: %s\n", device,
+                     strerror (errno));
+            goto status_out;
+        }
+        if (!(io->flags & DM_BUFFER_FULL_FLAG))
+            break;
+        size *= 2;
+    }
+    spec = (struct dm_target_spec*)((char*)io + io->data_start);
+    if (io->target_count != 1 || strcmp (spec->target_type, "verity")) {
+        fprintf (stderr, "%s isn't a single dm-verity target.\n", device);
+        goto status_out;
+    }
+    params = strdup ((char*)(spec + 1));
+    if (params == NULL)
+        perror ("strdup:\n");
+status_out:
+    free (io);
+    return params;
+}
+
+int
+verity_query (const char *device, verity_table_t *table)
+{
+    char *params = NULL, *status = NULL;
+    int control, ret = -1;
+
+    control = open (DM_CONTROL, O_RDWR | O_CLOEXEC);
+    if (control == -1) {
+        fprintf (stderr, "Failed to open %s: %s\n", DM_CONTROL,
+                 strerror (errno));
+        return -1;
+    }
+    params = dm_status (control, device, true);
+    if (params == NULL || verity_parse (params, table))
+        goto query_out;
+    /* the status of a verity target is 'V' or 'C' once corrupted */
+    status = dm_status (control, device, false);
+    if (status == NULL)
+        goto query_out;
+    table->corrupted = status[0] != 'V';
+    ret = 0;
+query_out:
+    free (status);
+    free (params);
+    close (control);
+    return ret;
+}
+
+int
+verity_parse (const char *params, verity_table_t *table)
+{
+    unsigned int data_major, data_minor, hash_major, hash_minor;
+    unsigned long long data_blocks, hash_start;
+    char *options, *token, *save;
+    size_t used = 0;
+    bool device_arg = false;
+    int consumed = 0;
+
+    memset (table, 0, sizeof (verity_table_t));
+    if (sscanf (params, "%u %u:%u %u:%u %u %u %llu %llu %31s %128s %512s%n",
+                &table->version, &data_major, &data_minor, &hash_major,
+                &hash_minor, &table->data_block_size,
+                &table->hash_block_size, &data_blocks, &hash_start,
+                table->algorithm, table->root, table->salt,
+                &consumed) != 12) {
+        fprintf (stderr, "Unexpected verity table: %s\n", params);
+        return -1;
+    }
+    table->data_dev = makedev (data_major, data_minor);
+    table->hash_dev = makedev (hash_major, hash_minor);
+    table->data_blocks = data_blocks;
+    table->hash_start = hash_start;
+    options = strdup (params + consumed);
+    if (options == NULL) {
+        perror ("strdup:\n");
+        return -1;
+    }
+    /* device numbers of optional arguments change between boots */
+    for (token = strtok_r (options, " ", &save); token;
+         token = strtok_r (NULL, " ", &save)) {
+        used += snprintf (table->options + used,
+                          sizeof (table->options) - used, "%s%s",
+                          used ? " " : "", device_arg ? "-" : token);
+        if (used >= sizeof (table->options)) {
+            fprintf (stderr, "Verity options too long: %s\n", params);
+            free (options);
+            return -1;
+        }
+        device_arg = strcmp (token, "use_fec_from_device") == 0;
+    }
+    free (options);
+    return 0;
+}
+
+char*
+verity_record (const verity_table_t *table)
+{
+    char *record = NULL;
+
+    if (asprintf (&record, "dm-verity:%u %u %u %llu %llu %s %s %s%s%s",
+                  table->version, table->data_block_size,
+                  table->hash_block_size,
+                  (unsigned long long)table->data_blocks,
+                  (unsigned long long)table->hash_start, table->algorithm,
+                  table->root, table->salt, table->options[0] ? " " : "",
+                  table->options) == -1) {
+        perror ("asprintf:\n");
+        return NULL;
+    }
+    return record;
+}
+
+static int
+hex_decode (const char *hex, unsigned char *buf, size_t size, size_t *len)
+{
+    *len = strlen (hex) / 2;
+    if (strlen (hex) % 2 || *len > size)
+        return -1;
+    return hex_parse (hex, buf, *len);
+}
+
+static int
+pread_full (int fd, unsigned char *buf, size_t len, uint64_t offset)
+{
+    ssize_t got;
+    size_t done = 0;
+
+    while (done < len) {
+        got = pread (fd, buf + done, len - done, offset + done);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        done += got;
+    }
+    return 0;
+}
+
+static int
+verity_hash (const verity_table_t *table, const EVP_MD *md,
+             const unsigned char *salt, size_t salt_len,
+             const unsigned char *data, size_t len, unsigned char *out)
+{
+    EVP_MD_CTX *ctx;
+    int ok;
+
+    ctx = EVP_MD_CTX_create ();
+    if (ctx == NULL)
+        return -1;
+    /* format 0 (Chrome OS) appends the salt, format 1 prepends it */
+    ok = EVP_DigestInit (ctx, md) &&
+        (table->version == 0 || EVP_DigestUpdate (ctx, salt, salt_len)) &&
+        EVP_DigestUpdate (ctx, data, len) &&
+        (table->version != 0 || EVP_DigestUpdate (ctx, salt, salt_len)) &&
+        EVP_DigestFinal (ctx, out, NULL);
+    EVP_MD_CTX_destroy (ctx);
+    return ok ? 0 : -1;
+}
+
+static unsigned int
+log2_floor (uint64_t value)
+{
+    unsigned int bits = 0;
+
+    while (value >>= 1)
+        ++bits;
+    return bits;
+}
+
+int
+verity_sample (const verity_table_t *table, int data_fd, int hash_fd,
+               unsigned int samples)
+{
+    unsigned char salt[VERITY_SALT_MAX], root[EVP_MAX_MD_SIZE];
+    unsigned char want[EVP_MAX_MD_SIZE];
+    unsigned char *data = NULL, *hash = NULL;
+    uint64_t level_block[VERITY_LEVELS_MAX], position, block, blocks;
+    unsigned int bits, block_bits, levels, digest_size, i;
+    size_t salt_len = 0, root_len = 0, offset;
+    const EVP_MD *md;
+    int level, ret = -1;
+
+    md = EVP_get_digestbyname (table->algorithm);
+    if (md == NULL) {
+        fprintf (stderr, "Unknown verity algorithm %s\n", table->algorithm);
+        return -1;
+    }
+    digest_size = EVP_MD_size (md);
+    if ((strcmp (table->salt, "-") &&
+         hex_decode (table->salt, salt, sizeof (salt), &salt_len)) ||
+        hex_decode (table->root, root, sizeof (root), &root_len) ||
+        root_len != digest_size) {
+        fprintf (stderr, "Invalid verity root hash or salt.\n");
+        return -1;
+    }
+    block_bits = log2_floor (table->hash_block_size);
+    if (table->data_blocks == 0 ||
+        table->hash_block_size != 1U << block_bits ||
+        table->hash_block_size < digest_size) {
+        fprintf (stderr, "Unsupported verity geometry.\n");
+        return -1;
+    }
+    /* the tree layout dm-verity uses: top level first on the device */
+    bits = log2_floor (table->hash_block_size / digest_size);
+    for (levels = 0; bits * levels < 64 &&
+         (table->data_blocks - 1) >> (bits * levels); ++levels)
+        ;
+    if (levels > VERITY_LEVELS_MAX) {
+        fprintf (stderr, "Unsupported verity geometry.\n");
+        return -1;
+    }
+    position = table->hash_start;
+    for (level = levels - 1; level >= 0; --level) {
+        level_block[level] = position;
+        blocks = (level + 1) * bits >= 64 ? 1 :
+            (table->data_blocks + (1ULL << ((level + 1) * bits)) - 1) >>
+            ((level + 1) * bits);
+        position += blocks;
+    }
+    data = malloc (table->data_block_size);
+    hash = malloc (table->hash_block_size);
+    if (data == NULL || hash == NULL) {
+        perror ("malloc of verity blocks:\n");
+        goto sample_out;
+    }
+    for (i = 0; i < samples; ++i) {
+        if (RAND_bytes ((unsigned char*)&block, sizeof (block)) != 1) {
+            ERR_print_errors_fp (stderr);
+            goto sample_out;
+        }
+        block %= table->data_blocks;
+        if (pread_full (data_fd, data, table->data_block_size,
+                        block * table->data_block_size)) {
+            fprintf (stderr, "Failed to read data block %llu\n",
+                     (unsigned long long)block);
+            goto sample_out;
+        }
+        if (verity_hash (table, md, salt, salt_len, data,
+                         table->data_block_size, want))
+            goto sample_out;
+        for (level = 0; level < (int)levels; ++level) {
+            position = block >> (level * bits);
+            offset = position & ((1U << bits) - 1);
+            offset = table->version ? offset << (block_bits - bits) :
+                offset * digest_size;
+            if (pread_full (hash_fd, hash, table->hash_block_size,
+                            (level_block[level] + (position >> bits)) *
+                            table->hash_block_size)) {
+                fprintf (stderr, "Failed to read hash block of data block "
+                         "%llu\n", (unsigned long long)block);
+                goto sample_out;
+            }
+            if (CRYPTO_memcmp (hash + offset, want, digest_size)) {
+                fprintf (stderr, "Data block %llu doesn't match the hash "
+                         "tree at level %d\n", (unsigned long long)block,
+                         level);
+                goto sample_out;
+            }
+            if (verity_hash (table, md, salt, salt_len, hash,
+                             table->hash_block_size, want))
+                goto sample_out;
+        }
+        if (CRYPTO_memcmp (want, root, digest_size)) {
+            fprintf (stderr, "Hash tree of data block %llu doesn't match "
+                     "the root hash\n", (unsigned long long)block);
+            goto sample_out;
+        }
+    }
+    ret = 0;
+sample_out:
+    free (data);
+    free (hash);
+    return ret;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef VERITY_H
+#define VERITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define VERITY_SALT_MAX 256
+
+/*  The parameters of an active dm-verity target:
+ *    <version> <data dev> <hash dev> <data block size> <hash block size>
+ *    <data blocks> <hash start> <algorithm> <root hash> <salt> [options]
+ */
+typedef struct verity_table {
+    unsigned int version;
+    dev_t data_dev;
+    dev_t hash_dev;
+    unsigned int data_block_size;
+    unsigned int hash_block_size;
+    uint64_t data_blocks;
+    uint64_t hash_start;   /* in hash blocks */
+    char algorithm[32];
+    char root[129];
+    char salt[VERITY_SALT_MAX * 2 + 1];   /* hex, '-' for none */
+    char options[512];     /* device arguments replaced with '-' */
+    bool corrupted;        /* the target has seen a bad block */
+} verity_table_t;
+
+/*  Query the device mapper for the verity table of device, a dm block
+ *  device node or the name of a mapping.
+ */
+int
+verity_query (const char *device, verity_table_t *table);
+int
+verity_parse (const char *params, verity_table_t *table);
+/*  The canonical record of table, everything but the device numbers:
+ *    dm-verity:<version> <data block size> <hash block size>
+ *    <data blocks> <hash start> <algorithm> <root hash> <salt> [options]
+ *  Returned in a malloc'd string.
+ */
+char*
+verity_record (const verity_table_t *table);
+/*  Check samples random data blocks against the hash tree, from the
+ *  data block up to the root hash.
+ */
+int
+verity_sample (const verity_table_t *table, int data_fd, int hash_fd,
+               unsigned int samples);
+
+#endif /* VERITY_H */
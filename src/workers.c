@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "workers.h"
+
+typedef struct worker_thread {
+    worker_fn_t fn;
+    void *arg;
+} worker_thread_t;
+
+typedef struct phase_thread {
+    phase_fn_t fn;
+    void *arg;
+    unsigned int index;
+} phase_thread_t;
+
+static void*
+worker_start (void *arg)
+{
+    worker_thread_t *thread = arg;
+
+    thread->fn (thread->arg);
+    return NULL;
+}
+
+int
+workers_run (worker_fn_t fn, void *arg, unsigned int threads)
+{
+    worker_thread_t thread = { .fn = fn, .arg = arg };
+    pthread_t *ids;
+    unsigned int started, i;
+
+    ids = calloc (threads ? threads : 1, sizeof (pthread_t));
+    if (ids == NULL) {
+        perror ("calloc of threads:\n");
+        return -1;
+    }
+    for (started = 0; started + 1 < threads; ++started) {
+        if (pthread_create (&ids[started], NULL, worker_start, &thread)) {
+            perror ("pthread_create:\n");
+            break;
+        }
+    }
+    /* the calling thread is the last worker, so one always runs */
+    fn (arg);
+    for (i = 0; i < started; ++i)
+        pthread_join (ids[i], NULL);
+    free (ids);
+    return 0;
+}
+
+static void*
+phase_start (void *arg)
+{
+    phase_thread_t *thread = arg;
+
+    thread->fn (thread->arg, thread->index);
+    return NULL;
+}
+
+int
+phase_run (phase_fn_t fn, void *arg, unsigned int threads)
+{
+    pthread_t *ids;
+    phase_thread_t *args;
+    unsigned int i;
+    int ret = 0;
+
+    ids = calloc (threads, sizeof (pthread_t));
+    args = calloc (threads, sizeof (phase_thread_t));
+    if (ids == NULL || args == NULL) {
+        perror ("calloc of threads:\n");
+        free (ids);
+        free (args);
+        return -1;
+    }
+    for (i = 0; i < threads; ++i) {
+        args[i] = (phase_thread_t){ .fn = fn, .arg = arg, .index = i };
+        if (i > 0 && pthread_create (&ids[i], NULL, phase_start, &args[i])) {
+            perror ("pthread_create:\n");
+            ret = -1;
+            break;
+        }
+    }
+    /* every index must run, so a missing thread fails the phase */
+    if (ret == 0)
+        fn (arg, 0);
+    while (--i > 0)
+        pthread_join (ids[i], NULL);
+    free (ids);
+    free (args);
+    return ret;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*  Run fn on up to threads threads sharing arg, the calling thread
+ *  being the last of them so at least one always runs. fn is expected
+ *  to take work from arg until there is none left, so threads that
+ *  can't be started only slow things down. Returns -1 without running
+ *  fn if the threads can't be allocated.
+ */
+typedef void (*worker_fn_t) (void *arg);
+
+int
+workers_run (worker_fn_t fn, void *arg, unsigned int threads);
+
+/*  Run fn once for each index below threads, each on its own thread,
+ *  for work split up front into a share per index. Every index must
+ *  run, so a thread that can't be started fails the phase.
+ */
+typedef void (*phase_fn_t) (void *arg, unsigned int index);
+
+int
+phase_run (phase_fn_t fn, void *arg, unsigned int threads);
+
+#endif /* WORKERS_H */
@@ -0,0 +1,43 @@
+# Git checkout measurement against 'git write-tree' on the same index.
+. "$TESTDIR/lib.sh"
+need git
+
+export HOME="$T" GIT_CONFIG_NOSYSTEM=1
+repo="$T/repo"
+git init -q "$repo" || fail "git init failed"
+cd "$repo" || fail "no $repo"
+mkdir -p bin doc/deep
+printf 'a\n' > a
+printf '#!/bin/sh\n' > bin/run
+chmod 0755 bin/run
+ln -s a link
+printf 'deep\n' > doc/deep/file
+git add -A
+
+# write-tree puts the index into the object store, kat only reads it
+tree () {
+    "$KAT" git "$repo" | sed -n 's/^tree //p'
+}
+
+got=$(tree)
+expect "known tree" "$got" 9543ff2476e7b395fb939c3d3b080306a2da251a
+expect "clean checkout" "$got" "$(git write-tree)"
+
+# a modified file is hashed from the working tree
+printf 'changed\n' > doc/deep/file
+got=$(tree)
+git add -u
+expect "modified file" "$got" "$(git write-tree)"
+
+# intent-to-add entries aren't part of the tree
+printf 'later\n' > later
+git add -N later
+expect "intent to add" "$(tree)" "$(git write-tree)"
+
+git update-index --index-version 4
+expect "index version 4" "$(tree)" "$(git write-tree)"
+
+# the shared index of a split index isn't read, so it must be refused
+git update-index --split-index
+"$KAT" git "$repo" >/dev/null 2>&1 && fail "split index was measured"
+exit 0
@@ -0,0 +1,47 @@
+# Golden digest databases from pcr-golden-build: every digest listed is
+# found, no other is, and damaged files are refused.
+. "$TESTDIR/lib.sh"
+need python3
+
+python3 - "$T" <<'END' || fail "writing the lists failed"
+import hashlib
+import sys
+
+members = [hashlib.sha1(b'member %d' % i).hexdigest() for i in range(50000)]
+with open(sys.argv[1] + '/list', 'w') as f:
+    f.write('# golden digests\n\n')
+    for i, digest in enumerate(members):
+        f.write('%s%s  /usr/lib/file%d\n' % ('sha1:' if i % 3 else '',
+                                            digest, i))
+    # duplicates are dropped
+    f.write('\n'.join(members[:1000]) + '\n')
+with open(sys.argv[1] + '/members', 'w') as f:
+    f.write('\n'.join(members) + '\n')
+with open(sys.argv[1] + '/others', 'w') as f:
+    f.write('\n'.join(hashlib.sha1(b'other %d' % i).hexdigest()
+                      for i in range(50000)) + '\n')
+END
+
+"$GOLDEN_BUILD" -j 4 -o "$T/db" "$T/list" > /dev/null ||
+    fail "pcr-golden-build failed"
+expect "members" "$("$KAT" golden "$T/db" "$T/members")" \
+    "found 50000 missing 0"
+expect "others" "$("$KAT" golden "$T/db" "$T/others")" \
+    "found 0 missing 50000"
+
+# a bucket count whose pilots wrap the layout around to the file's size
+python3 - "$T/wrapped" <<'END' || fail "writing the database failed"
+import struct
+import sys
+
+buckets = (1 << 62) - 2
+header = struct.pack('=8sIIIIQQQ16x', b'PCRGOLD', 1, 0x01020304, 20, 0, 1,
+                     buckets, 0)
+tables = struct.pack('=QQQQ', 0, 1, 0, buckets)
+open(sys.argv[1], 'wb').write(header + tables + bytes(12))
+END
+"$KAT" golden "$T/wrapped" "$T/members" > /dev/null 2>&1
+expect "wrapped database" $? 1
+head -c 4000 "$T/db" > "$T/short"
+"$KAT" golden "$T/short" "$T/members" > /dev/null 2>&1
+expect "truncated database" $? 1
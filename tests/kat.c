@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*  Known-answer test driver: runs one measurement of the library code
+ *  on a fixture and prints the result for the test scripts to compare.
+ *    kat digest FILE             SHA1 of FILE through digest_file
+ *    kat tree DIR [MEM_LIMIT]    tree digest, manifest on stdout
+ *    kat git WORKTREE            git tree id of the working tree
+ *    kat golden DB LIST          how many digests of LIST, one hex
+ *                                digest per line, DB holds
+ *    kat oci LAYOUT [CACHE]      verified manifests and blob counts
+ *    kat pe FILE                 SHA1 and SHA256 Authenticode digests
+ *    kat record FORMAT FILE      length and SHA1 of each record of FILE,
+ *                                or stdin for '-', and "again" where
+ *                                the reader ran out of buffered input
+ *    kat sweep LIST STATE BUDGET one run of a sweep given BUDGET us, or
+ *                                no limit for 0: its digest once
+ *                                complete, else how far it got
+ *    kat uki FILE                SHA1 and SHA256 PCR 11 predictions
+ *    kat verity TABLE DATA HASH SAMPLES
+ *                                record of a verity table, then samples
+ *                                data blocks against its hash tree
+ */
+
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "git.h"
+#include "golden.h"
+#include "hash.h"
+#include "oci.h"
+#include "pe.h"
+#include "record.h"
+#include "sweep.h"
+#include "tree.h"
+#include "uki.h"
+#include "util.h"
+#include "verity.h"
+
+static void
+print_hex (const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        printf ("%02x", buf[i]);
+}
+
+static int
+kat_digest (int argc, char *argv[])
+{
+    unsigned char *hash;
+    unsigned int hash_len;
+    FILE *file;
+
+    if (argc < 1)
+        return -1;
+    file = fopen (argv[0], "r");
+    if (file == NULL) {
+        perror ("fopen:\n");
+        return -1;
+    }
+    hash = digest_file (file, EVP_sha1 (), NULL, 0, &hash_len);
+    fclose (file);
+    if (hash == NULL)
+        return -1;
+    print_hex (hash, hash_len);
+    printf ("\n");
+    free (hash);
+    return 0;
+}
+
+static int
+kat_tree (int argc, char *argv[])
+{
+    tree_opts_t opts = { .manifest = stdout };
+    tree_stats_t stats = { 0 };
+    unsigned char *hash;
+    unsigned int hash_len;
+
+    if (argc < 1)
+        return -1;
+    if (argc > 1)
+        opts.mem_limit = strtoul (argv[1], NULL, 0);
+    hash = sha1_tree (argv[0], &opts, &stats, &hash_len);
+    if (hash == NULL)
+        return -1;
+    printf ("digest ");
+    print_hex (hash, hash_len);
+    printf ("\nspill runs %zu\n", stats.spill_runs);
+    free (hash);
+    return 0;
+}
+
+static int
+kat_git (int argc, char *argv[])
+{
+    git_stats_t stats = { 0 };
+    unsigned char *hash;
+    unsigned int hash_len;
+
+    if (argc < 1)
+        return -1;
+    hash = sha1_git_tree (argv[0], &stats, &hash_len);
+    if (hash == NULL)
+        return -1;
+    printf ("tree ");
+    print_hex (hash, hash_len);
+    printf ("\nhashed %zu\n", stats.hashed);
+    free (hash);
+    return 0;
+}
+
+static int
+kat_golden (int argc, char *argv[])
+{
+    unsigned char digest[GOLDEN_DIGEST_MAX];
+    size_t found = 0, missing = 0;
+    golden_t *golden;
+    char line[256];
+    FILE *list;
+
+    if (argc < 2)
+        return -1;
+    golden = golden_open (argv[0]);
+    if (golden == NULL)
+        return -1;
+    list = fopen (argv[1], "r");
+    if (list == NULL) {
+        perror ("fopen:\n");
+        golden_close (golden);
+        return -1;
+    }
+    while (fgets (line, sizeof (line), list)) {
+        if (hex_parse (line, digest, golden_digest_len (golden)))
+            continue;
+        if (golden_contains (golden, digest))
+            ++found;
+        else
+            ++missing;
+    }
+    fclose (list);
+    golden_close (golden);
+    printf ("found %zu missing %zu\n", found, missing);
+    return 0;
+}
+
+static int
+kat_oci (int argc, char *argv[])
+{
+    oci_opts_t opts = { .jobs = 2 };
+    oci_image_t image;
+    size_t i, j;
+
+    if (argc < 1)
+        return -1;
+    if (argc > 1)
+        opts.cache = argv[1];
+    if (oci_measure (argv[0], &opts, &image))
+        return -1;
+    for (i = 0; i < image.count; ++i) {
+        printf ("manifest %s\n", image.manifests[i].digest);
+        printf ("config %s\n", image.manifests[i].config);
+        for (j = 0; j < image.manifests[i].layer_count; ++j)
+            printf ("layer %s\n", image.manifests[i].layers[j]);
+    }
+    printf ("blobs %zu read %zu cached %zu\n", image.blobs, image.verified,
+            image.cached);
+    oci_image_free (&image);
+    return 0;
+}
+
+static int
+kat_pe (int argc, char *argv[])
+{
+    const EVP_MD *mds[] = { EVP_sha1 (), EVP_sha256 () };
+    unsigned char digests[2][EVP_MAX_MD_SIZE];
+    unsigned int lens[2];
+    pe_image_t *image;
+    int ret;
+
+    if (argc < 1)
+        return -1;
+    image = pe_open (argv[0]);
+    if (image == NULL)
+        return -1;
+    ret = pe_digest (image, mds, 2, digests, lens);
+    pe_close (image);
+    if (ret)
+        return -1;
+    print_hex (digests[0], lens[0]);
+    printf (" ");
+    print_hex (digests[1], lens[1]);
+    printf ("\n");
+    return 0;
+}
+
+static int
+kat_record (int argc, char *argv[])
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    record_format_t format;
+    record_reader_t *reader;
+    const unsigned char *data;
+    size_t len;
+    int fd, status, ret = -1;
+
+    if (argc < 2 || record_format_parse (argv[0], &format))
+        return -1;
+    fd = strcmp (argv[1], "-") ? open (argv[1], O_RDONLY) : 0;
+    if (fd == -1) {
+        perror ("open:\n");
+        return -1;
+    }
+    reader = record_reader_new (fd, format);
+    if (reader == NULL)
+        goto record_out;
+    /* as pcr-extend --stream reads them */
+    for (;;) {
+        status = record_next (reader, false, &data, &len);
+        if (status == RECORD_AGAIN) {
+            printf ("again\n");
+            status = record_next (reader, true, &data, &len);
+        }
+        if (status == RECORD_ERROR)
+            goto record_out;
+        if (status == RECORD_EOF)
+            break;
+        if (EVP_Digest (data, len, digest, &digest_len, EVP_sha1 (),
+                        NULL) == 0)
+            goto record_out;
+        printf ("%zu ", len);
+        print_hex (digest, digest_len);
+        printf ("\n");
+    }
+    printf ("eof\n");
+    ret = 0;
+record_out:
+    record_reader_free (reader);
+    if (fd != 0)
+        close (fd);
+    return ret;
+}
+
+static int
+kat_sweep (int argc, char *argv[])
+{
+    sweep_stats_t stats;
+    sweep_t *sweep;
+    uint64_t budget_ns;
+    int ret;
+
+    if (argc < 3)
+        return -1;
+    budget_ns = strtoull (argv[2], NULL, 10) * 1000;
+    sweep = sweep_open (argv[0], argv[1]);
+    if (sweep == NULL)
+        return -1;
+    ret = sweep_run (sweep, budget_ns ? budget_ns : UINT64_MAX, &stats);
+    if (ret == 0 && stats.complete) {
+        printf ("complete ");
+        print_hex (stats.digest, SWEEP_DIGEST_LEN);
+        printf ("\n");
+    } else if (ret == 0) {
+        printf ("measured %zu remaining %zu bytes %llu\n", stats.measured,
+                stats.remaining, (unsigned long long)stats.bytes);
+    }
+    sweep_free (sweep);
+    return ret;
+}
+
+static int
+kat_uki (int argc, char *argv[])
+{
+    const EVP_MD *mds[] = { EVP_sha1 (), EVP_sha256 () };
+    uki_prediction_t prediction;
+
+    if (argc < 1 || uki_predict (argv[0], mds, 2, &prediction))
+        return -1;
+    print_hex (prediction.pcr[0], prediction.pcr_len[0]);
+    printf (" ");
+    print_hex (prediction.pcr[1], prediction.pcr_len[1]);
+    printf ("\n");
+    return 0;
+}
+
+static int
+kat_verity (int argc, char *argv[])
+{
+    verity_table_t table;
+    char *record;
+    int data_fd = -1, hash_fd = -1, ret = -1;
+
+    if (argc < 4 || verity_parse (argv[0], &table))
+        return -1;
+    record = verity_record (&table);
+    if (record == NULL)
+        return -1;
+    printf ("%s\n", record);
+    free (record);
+    data_fd = open (argv[1], O_RDONLY | O_CLOEXEC);
+    hash_fd = open (argv[2], O_RDONLY | O_CLOEXEC);
+    if (data_fd == -1 || hash_fd == -1) {
+        perror ("open:\n");
+        goto verity_out;
+    }
+    ret = verity_sample (&table, data_fd, hash_fd, atoi (argv[3]));
+verity_out:
+    if (data_fd != -1)
+        close (data_fd);
+    if (hash_fd != -1)
+        close (hash_fd);
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        int (*run) (int argc, char *argv[]);
+    } cmds[] = {
+        { "digest", kat_digest },
+        { "tree", kat_tree },
+        { "git", kat_git },
+        { "golden", kat_golden },
+        { "oci", kat_oci },
+        { "pe", kat_pe },
+        { "record", kat_record },
+        { "sweep", kat_sweep },
+        { "uki", kat_uki },
+        { "verity", kat_verity },
+    };
+    size_t i;
+
+    if (argc < 2) {
+        fprintf (stderr, "usage: %s COMMAND ARGS...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < sizeof (cmds) / sizeof (cmds[0]); ++i) {
+        if (strcmp (argv[1], cmds[i].name) == 0)
+            return cmds[i].run (argc - 2, argv + 2) ? EXIT_FAILURE :
+                EXIT_SUCCESS;
+    }
+    fprintf (stderr, "Unknown command %s\n", argv[1]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,24 @@
+# Sourced by the tests: a scratch directory and the ways out of a test.
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+
+skip () {
+    echo "  $*, skipped"
+    exit 77
+}
+
+fail () {
+    echo "  $*"
+    exit 1
+}
+
+need () {
+    for tool in "$@"; do
+        command -v "$tool" >/dev/null 2>&1 || skip "$tool not found"
+    done
+}
+
+# expect WHAT GOT EXPECTED
+expect () {
+    [ "$2" = "$3" ] || fail "$1: got $2, expected $3"
+}
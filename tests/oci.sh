@@ -0,0 +1,77 @@
+# OCI image layout verification. The layout is written here with its
+# digests from sha256sum, so what kat reports is checked against an
+# independent hash.
+. "$TESTDIR/lib.sh"
+need sha256sum
+
+layout="$T/layout"
+mkdir -p "$layout/blobs/sha256"
+printf '{"imageLayoutVersion":"1.0.0"}' > "$layout/oci-layout"
+
+# blob FILE: store FILE as a blob and set $digest and $size
+blob () {
+    digest=sha256:$(sha256sum < "$1" | cut -d' ' -f1)
+    size=$(wc -c < "$1" | tr -d ' ')
+    mv "$1" "$layout/blobs/sha256/${digest#sha256:}"
+}
+
+printf 'first layer' > "$T/l1"
+blob "$T/l1"; l1=$digest; l1_size=$size
+printf 'layer shared by both images' > "$T/l2"
+blob "$T/l2"; l2=$digest; l2_size=$size
+printf '{"architecture":"amd64","os":"linux"}' > "$T/c"
+blob "$T/c"; c=$digest; c_size=$size
+
+# desc DIGEST SIZE
+desc () {
+    printf '{"digest":"%s","size":%s}' "$1" "$2"
+}
+
+printf '{"schemaVersion":2,"config":%s,"layers":[%s,%s]}' \
+    "$(desc $c $c_size)" "$(desc $l1 $l1_size)" "$(desc $l2 $l2_size)" \
+    > "$T/m1"
+blob "$T/m1"; m1=$digest; m1_size=$size
+printf '{"schemaVersion":2,"config":%s,"layers":[%s]}' \
+    "$(desc $c $c_size)" "$(desc $l2 $l2_size)" > "$T/m2"
+blob "$T/m2"; m2=$digest; m2_size=$size
+# a nested index naming the first image again
+printf '{"schemaVersion":2,"manifests":[%s,%s]}' \
+    "$(desc $m2 $m2_size)" "$(desc $m1 $m1_size)" > "$T/i"
+blob "$T/i"; i=$digest; i_size=$size
+printf '{"schemaVersion":2,"manifests":[%s,%s]}' \
+    "$(desc $m1 $m1_size)" "$(desc $i $i_size)" > "$layout/index.json"
+
+cat > "$T/expected" <<END
+manifest $m1
+config $c
+layer $l1
+layer $l2
+manifest $m2
+config $c
+layer $l2
+manifest $m1
+config $c
+layer $l1
+layer $l2
+blobs 3 read 3 cached 0
+END
+"$KAT" oci "$layout" > "$T/got" || fail "kat oci failed"
+cmp -s "$T/got" "$T/expected" ||
+    fail "unexpected result: $(diff "$T/got" "$T/expected" | head -5)"
+
+# blobs changed in the second a run starts aren't cached, so wait
+sleep 2
+"$KAT" oci "$layout" "$T/cache" > /dev/null || fail "kat oci failed"
+expect "cached run" "$("$KAT" oci "$layout" "$T/cache" | tail -n 1)" \
+    "blobs 3 read 0 cached 3"
+
+# an index naming its manifests twice is refused, not read either way
+cp -r "$layout" "$T/dup"
+printf '{"schemaVersion":2,"manifests":[%s],"manifests":[%s]}' \
+    "$(desc $m1 $m1_size)" "$(desc $m2 $m2_size)" > "$T/dup/index.json"
+"$KAT" oci "$T/dup" > /dev/null 2>&1 && fail "duplicate key accepted"
+
+# a layer that doesn't match its digest fails the measurement
+printf 'tampered layer' > "$layout/blobs/sha256/${l1#sha256:}"
+"$KAT" oci "$layout" > /dev/null 2>&1 && fail "tampered layer verified"
+exit 0
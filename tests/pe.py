@@ -0,0 +1,167 @@
+# Reference PE/COFF images, Authenticode digests and unified kernel
+# image PCR 11 values, written from the Authenticode specification and
+# systemd-stub's documentation without reusing src/pe.c or src/uki.c.
+#   pe.py make OUT [uki|stub]
+#                          write a deterministic PE32+ image, with the
+#                          sections of a unified kernel image for 'uki'
+#                          and without trailing data for 'stub'
+#   pe.py digest FILE      print its SHA1 and SHA256 Authenticode digests
+#   pe.py pcr11 FILE       print the SHA1 and SHA256 PCR 11 values
+#                          systemd-stub extends for a unified kernel image
+#   pe.py pcr11 NAME=FILE...
+#                          the same for a UKI with those sections loaded
+import hashlib
+import struct
+import sys
+
+FILE_ALIGN = 0x200
+OPT_SIZE = 240          # PE32+ optional header with 16 data directories
+
+
+def fill(tag, size):
+    out = b''
+    while len(out) < size:
+        out += hashlib.sha256(b'%s %d' % (tag, len(out))).digest()
+    return out[:size]
+
+
+def make(path, sections, trailer=b'', cert=b''):
+    """sections: (name, data, virtual size) in section table order.
+    trailer follows the sections and cert is the certificate table."""
+    headers = 0x40 + 4 + 20 + OPT_SIZE + 40 * len(sections)
+    headers = (headers + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1)
+    body = b''
+    placed = {}
+    # lay the sections out in reverse table order so the file order
+    # differs from the table order
+    for name, data, vsize in reversed(sections):
+        if not data:
+            placed[name] = (0, 0)
+            continue
+        raw = (len(data) + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1)
+        placed[name] = (headers + len(body), raw)
+        body += data + bytes(raw - len(data))
+    out = bytearray(headers)
+    out[0:2] = b'MZ'
+    struct.pack_into('<I', out, 0x3c, 0x40)
+    out[0x40:0x44] = b'PE\0\0'
+    struct.pack_into('<HHIIIHH', out, 0x44, 0x8664, len(sections), 0, 0, 0,
+                     OPT_SIZE, 0x22)
+    opt = 0x58
+    struct.pack_into('<H', out, opt, 0x20b)
+    rvas = []
+    rva = 0x1000
+    for name, data, vsize in sections:
+        rvas.append(rva)
+        rva += (vsize + 0xfff) & ~0xfff
+    struct.pack_into('<II', out, opt + 32, 0x1000, FILE_ALIGN)
+    struct.pack_into('<I', out, opt + 56, rva)              # SizeOfImage
+    struct.pack_into('<I', out, opt + 60, headers)          # SizeOfHeaders
+    struct.pack_into('<I', out, opt + 64, 0x12345678)       # CheckSum
+    struct.pack_into('<H', out, opt + 68, 10)    # EFI application
+    struct.pack_into('<I', out, opt + 108, 16)   # NumberOfRvaAndSizes
+    image = bytes(out) + body + trailer
+    if cert:
+        struct.pack_into('<II', out, opt + 112 + 4 * 8, len(image),
+                         len(cert))
+    for i, (name, data, vsize) in enumerate(sections):
+        offset, raw = placed[name]
+        struct.pack_into('<8sIIII', out, opt + OPT_SIZE + i * 40,
+                         name.encode(), vsize, rvas[i], raw, offset)
+    with open(path, 'wb') as f:
+        f.write(bytes(out) + body + trailer + cert)
+
+
+def authenticode(path):
+    d = open(path, 'rb').read()
+    pe, = struct.unpack_from('<I', d, 0x3c)
+    count, opt_size = struct.unpack_from('<H12xH', d, pe + 6)
+    opt = pe + 24
+    magic, = struct.unpack_from('<H', d, opt)
+    checksum = opt + 64
+    cert_dir = opt + (128 if magic == 0x10b else 144)
+    headers, = struct.unpack_from('<I', d, opt + 60)
+    cert_offset, cert_size = struct.unpack_from('<II', d, cert_dir)
+    parts = [d[:checksum], d[checksum + 4:cert_dir], d[cert_dir + 8:headers]]
+    sections = []
+    for i in range(count):
+        raw, offset = struct.unpack_from('<II', d, opt + opt_size + i * 40 + 16)
+        if raw:
+            sections.append((offset, raw))
+    hashed = headers
+    for offset, raw in sorted(sections):
+        parts.append(d[offset:offset + raw])
+        hashed += raw
+    parts.append(d[hashed:len(d) - cert_size])
+    return [hashlib.new(md, b''.join(parts)).hexdigest()
+            for md in ('sha1', 'sha256')]
+
+
+# the sections systemd-stub measures, in the order it measures them
+UKI_ORDER = ['.linux', '.osrel', '.cmdline', '.initrd', '.ucode', '.splash',
+             '.dtb', '.uname', '.sbat', '.pcrpkey', '.profile', '.dtbauto',
+             '.hwids', '.efifw']
+
+UKI_SECTIONS = [
+    ('.text', fill(b'text', 0x300), 0x300),
+    ('.osrel', b'ID=test\n', 8),
+    ('.cmdline', b'root=/dev/sda ro', 16),
+    # loaded larger than its raw data, so zero filled
+    ('.initrd', fill(b'initrd', 5000), 9000),
+    ('.pcrsig', b'{}', 2),
+    ('.linux', fill(b'linux', 200000), 200000),
+]
+
+PE_SECTIONS = [
+    ('.text', fill(b'text', 0x600), 0x600),
+    ('.data', fill(b'data', 0x180), 0x200),
+    ('.bss', b'', 0x1000),
+    ('.reloc', fill(b'reloc', 0x20), 0x20),
+]
+
+
+def loaded_sections(path):
+    d = open(path, 'rb').read()
+    pe, = struct.unpack_from('<I', d, 0x3c)
+    count, opt_size = struct.unpack_from('<H12xH', d, pe + 6)
+    sections = {}
+    for i in range(count):
+        name, vsize, _, raw, offset = struct.unpack_from(
+            '<8sIIII', d, pe + 24 + opt_size + i * 40)
+        data = d[offset:offset + min(raw, vsize)]
+        sections[name.rstrip(b'\0').decode()] = data + bytes(vsize - len(data))
+    return sections
+
+
+def pcr11(sections):
+    values = []
+    for md in ('sha1', 'sha256'):
+        pcr = bytes(hashlib.new(md).digest_size)
+        for name in UKI_ORDER:
+            if name not in sections:
+                continue
+            for measured in (name.encode() + b'\0', sections[name]):
+                pcr = hashlib.new(md, pcr + hashlib.new(md, measured).digest())
+                pcr = pcr.digest()
+        values.append(pcr.hex())
+    return values
+
+
+if sys.argv[1] == 'make':
+    if sys.argv[3:] == ['uki']:
+        make(sys.argv[2], UKI_SECTIONS)
+    elif sys.argv[3:] == ['stub']:
+        make(sys.argv[2], PE_SECTIONS)
+    else:
+        make(sys.argv[2], PE_SECTIONS, fill(b'trailer', 100),
+             fill(b'cert', 0x80))
+elif sys.argv[1] == 'digest':
+    print(*authenticode(sys.argv[2]))
+elif sys.argv[1] == 'pcr11' and '=' in sys.argv[2]:
+    sections = {}
+    for arg in sys.argv[2:]:
+        name, path = arg.split('=', 1)
+        sections[name] = open(path, 'rb').read()
+    print(*pcr11(sections))
+elif sys.argv[1] == 'pcr11':
+    print(*pcr11(loaded_sections(sys.argv[2])))
@@ -0,0 +1,35 @@
+# Authenticode digests of a PE32+ image from pe.py: its sections are
+# out of file order in the section table, one has no raw data, and the
+# image has data after the sections and a certificate table.
+. "$TESTDIR/lib.sh"
+need python3
+
+python3 "$TESTDIR/pe.py" make "$T/image.efi" || fail "pe.py failed"
+sha1=018060790eb77fd2a202b75243aec41ba11879f6
+sha256=1b9210e56050058a52d3c134c72dce886658eb5e3cdd34a5602b7b7422c65a75
+expected="$sha1 $sha256"
+expect "reference digests" "$(python3 "$TESTDIR/pe.py" digest "$T/image.efi")" \
+    "$expected"
+expect "digests" "$("$KAT" pe "$T/image.efi")" "$expected"
+
+if command -v pesign >/dev/null 2>&1; then
+    expect "pesign digest" \
+        "$(pesign -h -i "$T/image.efi" | awk '{ print $2 }')" \
+        $sha256
+else
+    echo "  pesign not found, checked against pe.py only"
+fi
+
+# neither the checksum nor the certificate table is covered
+printf 'zzzz' | dd of="$T/image.efi" bs=1 seek=$((0x58 + 64)) conv=notrunc \
+    2>/dev/null
+size=$(wc -c < "$T/image.efi")
+printf 'zzzz' | dd of="$T/image.efi" bs=1 seek=$((size - 4)) conv=notrunc \
+    2>/dev/null
+expect "checksum and certificate changed" "$("$KAT" pe "$T/image.efi")" \
+    "$expected"
+
+# a truncated image is refused rather than read past its end
+head -c 2000 "$T/image.efi" > "$T/short.efi"
+"$KAT" pe "$T/short.efi" > /dev/null 2>&1 && fail "truncated image measured"
+exit 0
@@ -0,0 +1,14 @@
+# Hashing a file on a slow FUSE mount, simulated by slowread.c: the
+# digest must match sha1sum and the preads must overlap.
+. "$TESTDIR/lib.sh"
+need sha1sum
+
+head -c 8388608 /dev/urandom > "$T/file"
+expected=$(sha1sum < "$T/file" | cut -d' ' -f1)
+expect "local digest" "$("$KAT" digest "$T/file")" $expected
+SLOWREAD_US=2000 "$KAT_SLOWREAD" digest "$T/file" > "$T/got" 2> "$T/report" ||
+    fail "kat-slowread failed"
+expect "prefetched digest" "$(cat "$T/got")" $expected
+most=$(sed -n 's/.*at most \([0-9]*\) in flight/\1/p' "$T/report")
+[ "$most" -gt 1 ] || fail "preads didn't overlap: $(cat "$T/report")"
+echo "  $(cat "$T/report")"
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015 Philip Tricca <flihp@twobit.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*  Linked into kat-slowread to make every file look like it's on a
+ *  FUSE mount with a slow round trip: fstatfs reports FUSE and each
+ *  pread sleeps SLOWREAD_US microseconds first. The most preads seen
+ *  in flight at once is printed on exit, so a test can tell whether
+ *  the reads overlapped.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FUSE_SUPER_MAGIC 0x65735546
+
+static atomic_int in_flight;
+static atomic_int max_in_flight;
+static atomic_int reads;
+
+ssize_t
+pread (int fd, void *buf, size_t count, off_t offset)
+{
+    static ssize_t (*real) (int, void*, size_t, off_t);
+    const char *delay = getenv ("SLOWREAD_US");
+    ssize_t ret;
+    int now, max;
+
+    if (real == NULL)
+        real = dlsym (RTLD_NEXT, "pread");
+    now = atomic_fetch_add (&in_flight, 1) + 1;
+    max = atomic_load (&max_in_flight);
+    while (now > max &&
+           !atomic_compare_exchange_weak (&max_in_flight, &max, now))
+        ;
+    atomic_fetch_add (&reads, 1);
+    if (delay)
+        usleep (atoi (delay));
+    ret = real (fd, buf, count, offset);
+    atomic_fetch_sub (&in_flight, 1);
+    return ret;
+}
+
+int
+fstatfs (int fd, struct statfs *buf)
+{
+    static int (*real) (int, struct statfs*);
+    int ret;
+
+    if (real == NULL)
+        real = dlsym (RTLD_NEXT, "fstatfs");
+    ret = real (fd, buf);
+    if (ret == 0)
+        buf->f_type = FUSE_SUPER_MAGIC;
+    return ret;
+}
+
+static void __attribute__ ((destructor))
+slowread_report (void)
+{
+    fprintf (stderr, "slowread: %d reads, at most %d in flight\n",
+             atomic_load (&reads), atomic_load (&max_in_flight));
+}
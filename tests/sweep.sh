@@ -0,0 +1,46 @@
+# Sweeps cut off by their budget and resumed run after run, midstates
+# and all, come to the digest of an uninterrupted sweep.
+. "$TESTDIR/lib.sh"
+need sha1sum
+
+mkdir "$T/files"
+for i in 1 2 3; do
+    head -c $((i * 3 * 1048576 + 12345)) /dev/urandom > "$T/files/big$i"
+done
+echo small > "$T/files/small"
+: > "$T/files/empty"
+printf '%s\n' "10 $T/files/big2" "0 $T/files/big1" "0 $T/files/small" \
+    "5 $T/files/big3" "0 $T/files/empty" "0 $T/files/missing" > "$T/list"
+
+# the digest of '<sha1> <path>' lines in path order, '-' if unreadable
+for path in $(sed 's/^[0-9]* //' "$T/list" | LC_ALL=C sort); do
+    if [ -r "$path" ]; then
+        echo "$(sha1sum < "$path" | cut -d' ' -f1) $path"
+    else
+        echo "- $path"
+    fi
+done > "$T/lines"
+expected="complete $(sha1sum < "$T/lines" | cut -d' ' -f1)"
+
+got=$("$KAT" sweep "$T/list" "$T/whole" 0 2> /dev/null) ||
+    fail "uninterrupted sweep failed"
+expect "uninterrupted sweep" "$got" "$expected"
+
+# a millisecond at a time, more if a run got nowhere
+budget=1000
+runs=0
+resumed=no
+while :; do
+    runs=$((runs + 1))
+    [ $runs -le 1000 ] || fail "sweep still incomplete after 1000 runs"
+    got=$("$KAT" sweep "$T/list" "$T/state" $budget 2> /dev/null) ||
+        fail "sweep run $runs failed"
+    case "$got" in
+        complete*) break ;;
+        *" bytes 0") budget=$((budget * 2)) ;;
+    esac
+    grep -q '^partial [1-9]' "$T/state" && resumed=yes
+done
+[ $runs -gt 1 ] || fail "the budget never cut the sweep off"
+expect "resumed midstate" $resumed yes
+expect "sweep in $runs runs" "$got" "$expected"
@@ -0,0 +1,42 @@
+# Reference manifest for a directory tree, written from the format in
+# src/tree.h without reusing any of its code:
+#   <type> <mode> <sha1 of contents or link target, or '-'> <path>\n
+# depth first in byte-wise name order, '\' and newlines in the path
+# escaped. Prints the manifest, then "digest <sha1 of the manifest>".
+import hashlib
+import os
+import stat
+import sys
+
+TYPES = {stat.S_IFREG: 'f', stat.S_IFDIR: 'd', stat.S_IFLNK: 'l',
+         stat.S_IFIFO: 'p', stat.S_IFSOCK: 's', stat.S_IFCHR: 'c',
+         stat.S_IFBLK: 'b'}
+
+
+def walk(root, rel, out):
+    for name in sorted(os.listdir(os.path.join(root, rel) or b'.')):
+        path = os.path.join(rel, name)
+        full = os.path.join(root, path)
+        st = os.lstat(full)
+        kind = stat.S_IFMT(st.st_mode)
+        if kind == stat.S_IFREG:
+            with open(full, 'rb') as f:
+                digest = hashlib.sha1(f.read()).hexdigest()
+        elif kind == stat.S_IFLNK:
+            digest = hashlib.sha1(os.readlink(full)).hexdigest()
+        else:
+            digest = '-'
+        escaped = (b'/' + path).replace(b'\\', b'\\\\').replace(b'\n', b'\\n')
+        out.append(b'%c %04o %s %s\n' % (ord(TYPES.get(kind, '?')),
+                                         stat.S_IMODE(st.st_mode),
+                                         digest.encode(), escaped))
+        if kind == stat.S_IFDIR:
+            walk(root, path, out)
+
+
+lines = []
+walk(os.fsencode(sys.argv[1]), b'', lines)
+manifest = b''.join(lines)
+sys.stdout.buffer.write(manifest)
+sys.stdout.buffer.write(b'digest %s\n' %
+                        hashlib.sha1(manifest).hexdigest().encode())
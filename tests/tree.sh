@@ -0,0 +1,53 @@
+# Directory tree measurement: a fixed tree with a known digest, then a
+# larger one against the Python reference in tree.py.
+. "$TESTDIR/lib.sh"
+
+mkdir -p "$T/known/d"
+printf 'hello\n' > "$T/known/d/h"
+printf 'x' > "$T/known/a\\b"
+ln -s d/h "$T/known/l"
+chmod 0644 "$T/known/d/h" "$T/known/a\\b"
+chmod 0755 "$T/known/d"
+expect "known tree" "$("$KAT" tree "$T/known" | sed -n 's/^digest //p')" \
+    19dda031bec248cf47c50282ef45aaa9c8799fd2
+
+need python3
+mkdir -p "$T/root/sub/deeper" "$T/root/empty"
+printf 'a' > "$T/root/a"
+printf 'back' > "$T/root/back\\slash"
+printf 'new' > "$T/root/new
+line"
+printf '' > "$T/root/sub/zero"
+printf 'deep' > "$T/root/sub/deeper/file"
+chmod 0600 "$T/root/sub/zero"
+chmod 0711 "$T/root/sub/deeper"
+ln -s ../a "$T/root/sub/link"
+mkfifo "$T/root/fifo"
+i=0
+while [ $i -lt 200 ]; do
+    printf '%d' $i > "$T/root/sub/f$i"
+    i=$((i + 1))
+done
+
+python3 "$TESTDIR/tree.py" "$T/root" > "$T/expected" ||
+    fail "tree.py failed"
+"$KAT" tree "$T/root" | grep -v '^spill runs' > "$T/got" ||
+    fail "kat tree failed"
+cmp -s "$T/got" "$T/expected" ||
+    fail "manifest differs from tree.py:
+$(diff "$T/got" "$T/expected" | head -5)"
+
+# enough names in one directory to spill them under a small memory limit
+mkdir "$T/root/many"
+i=0
+while [ $i -lt 2000 ]; do
+    : > "$T/root/many/a-name-long-enough-to-fill-the-entry-arenas-$i"
+    i=$((i + 1))
+done
+python3 "$TESTDIR/tree.py" "$T/root" > "$T/expected" ||
+    fail "tree.py failed"
+"$KAT" tree "$T/root" 65536 > "$T/got" || fail "kat tree failed"
+runs=$(sed -n 's/^spill runs //p' "$T/got")
+[ "$runs" -gt 0 ] || fail "a 64K memory limit didn't spill"
+grep -v '^spill runs' "$T/got" | cmp -s - "$T/expected" ||
+    fail "spilled manifest differs from tree.py"
@@ -0,0 +1,33 @@
+# PCR 11 predictions for unified kernel images. One image comes from
+# pe.py with sections out of measurement order, a .pcrsig section that
+# isn't measured and a section loaded larger than its raw data. Where
+# objcopy is installed a second one is put together the way UKIs are
+# with binutils, adding the sections to a stub.
+. "$TESTDIR/lib.sh"
+need python3
+
+python3 "$TESTDIR/pe.py" make "$T/uki.efi" uki || fail "pe.py failed"
+sha1=f6d8c75390a52ca15e756619d6bf311452d70ba9
+sha256=16e9fa1e8bb5d1c43977694ee5595854c23ef13e58a8da61ebb93be1449d01f7
+expect "reference PCR 11" "$(python3 "$TESTDIR/pe.py" pcr11 "$T/uki.efi")" \
+    "$sha1 $sha256"
+expect "PCR 11" "$("$KAT" uki "$T/uki.efi")" "$sha1 $sha256"
+
+command -v objcopy >/dev/null 2>&1 || skip "objcopy not found"
+python3 "$TESTDIR/pe.py" make "$T/stub.efi" stub || fail "pe.py failed"
+printf 'ID=objcopy\n' > "$T/osrel"
+printf 'quiet' > "$T/cmdline"
+head -c 300000 /dev/urandom > "$T/linux"
+head -c 70000 /dev/urandom > "$T/initrd"
+objcopy \
+    --add-section .osrel="$T/osrel" --change-section-vma .osrel=0x20000 \
+    --add-section .cmdline="$T/cmdline" \
+    --change-section-vma .cmdline=0x30000 \
+    --add-section .initrd="$T/initrd" --change-section-vma .initrd=0x40000 \
+    --add-section .linux="$T/linux" --change-section-vma .linux=0x100000 \
+    "$T/stub.efi" "$T/objcopy.efi" || fail "objcopy failed"
+expected=$(python3 "$TESTDIR/pe.py" pcr11 .osrel="$T/osrel" \
+    .cmdline="$T/cmdline" .initrd="$T/initrd" .linux="$T/linux") ||
+    fail "pe.py failed"
+got=$("$KAT" uki "$T/objcopy.efi") || fail "kat uki failed"
+expect "objcopy image PCR 11" "$got" "$expected"
@@ -0,0 +1,35 @@
+# Reference dm-verity hash tree (format 1, as veritysetup writes it with
+# --no-superblock), written from the kernel's documentation without
+# reusing src/verity.c. Writes BLOCKS deterministic 4K data blocks to
+# DATA and their hash tree to HASH, top level first, and prints the
+# root hash.
+import hashlib
+import sys
+
+BLOCK = 4096
+SALT = bytes.fromhex('aabbcc')
+
+
+def digest(block):
+    return hashlib.sha256(SALT + block).digest()
+
+
+data_path, hash_path, count = sys.argv[1], sys.argv[2], int(sys.argv[3])
+blocks = [hashlib.sha256(b'block %d' % i).digest() * (BLOCK // 32)
+          for i in range(count)]
+with open(data_path, 'wb') as f:
+    f.write(b''.join(blocks))
+
+levels = []
+hashes = [digest(b) for b in blocks]
+while len(hashes) > 1:
+    level = []
+    for i in range(0, len(hashes), BLOCK // 32):
+        block = b''.join(hashes[i:i + BLOCK // 32])
+        level.append(block + bytes(BLOCK - len(block)))
+    levels.append(level)
+    hashes = [digest(b) for b in level]
+with open(hash_path, 'wb') as f:
+    for level in reversed(levels):
+        f.write(b''.join(level))
+print(hashes[0].hex())